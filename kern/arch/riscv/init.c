@@ -3,9 +3,11 @@
 #include <smp.h>
 #include <arch/init.h>
 #include <arch/console.h>
+#include <topology.h>
 
 void arch_init()
 {		
 	smp_boot();
+	topology_init();
 	proc_init();
 }
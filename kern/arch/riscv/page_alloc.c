@@ -48,13 +48,12 @@ void page_alloc_init(struct multiboot_info *mbi)
 	for (uintptr_t page = 0; page < first_free_page; page++)
 		page_setref(&pages[page], 1);
 	
-	// append other pages to the free lists
+	colored_page_free_list = lists;
+
+	// hand the other pages to the buddy allocator, which fills the free lists
 	for (uintptr_t page = first_free_page; page < first_invalid_page; page++)
 	{
 		page_setref(&pages[page], 0);
-		LIST_INSERT_HEAD(&lists[page & (num_colors-1)], &pages[page], pg_link);
+		buddy_free_page(&pages[page]);
 	}
-	nr_free_pages = first_invalid_page - first_free_page;
-
-	colored_page_free_list = lists;
 }
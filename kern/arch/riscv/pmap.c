@@ -92,6 +92,17 @@ int get_va_perms(pde_t *pgdir, const void *SNT va)
 	return pte == NULL ? 0 : (*pte & (PTE_PERM | PTE_E));
 }
 
+/* User jumbo mappings aren't supported here, so callers use little pages */
+int pgdir_map_jumbo(pde_t *pgdir, void *va, struct page *page, int perm)
+{
+	return -ENOMEM;
+}
+
+int pgdir_split_jumbo(pde_t *pgdir, void *va)
+{
+	return 0;
+}
+
 void
 page_check(void)
 {
@@ -106,6 +106,7 @@
 #define PTE_SW   0x100 // Supervisor Read permission
 #define PTE_SR   0x200 // Supervisor Write permission
 #define PTE_PERM (PTE_SR | PTE_SW | PTE_SX | PTE_UR | PTE_UW | PTE_UX)
+#define PTE_COW  0x400 // Software: copy on write (below the PPN)
 #define PTE_PPN_SHIFT 13
 
 // commly used access modes
@@ -146,6 +147,9 @@
 #define PAGE_PRESENT(pte) ((pte) & PTE_P)
 #define PAGE_UNMAPPED(pte) ((pte) == 0)
 #define PAGE_PAGED_OUT(pte) (!PAGE_PRESENT(pte) && !PAGE_UNMAPPED(pte))
+/* We don't map user memory with jumbos (yet) */
+#define PAGE_JUMBO(pte) 0
+#define JPGSIZE PTSIZE
 #define NOVPT
 
 #ifndef __ASSEMBLER__
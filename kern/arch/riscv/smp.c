@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <atomic.h>
 #include <pmap.h>
+#include <topology.h>
 
 volatile uint32_t num_cpus_booted = 0;
 
@@ -19,6 +20,16 @@ smp_boot(void)
 	printd("%d cores reporting!\n", num_cpus);
 }
 
+/* We don't know anything about the topology, so every core is on its own */
+void arch_topology_init(void)
+{
+	for (int i = 0; i < num_cpus; i++) {
+		cpu_topology[i].socket = 0;
+		cpu_topology[i].llc = i;
+		cpu_topology[i].phys_core = i;
+	}
+}
+
 void
 smp_init(void)
 {
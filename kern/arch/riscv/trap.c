@@ -238,6 +238,11 @@ handle_fault_store(struct hw_trapframe *state)
 {
 	if(in_kernel(state))
 	{
+		/* The kernel can write to a user page that is CoW, like a ucq after a
+		 * fork.  We might be in an IRQ or holding the mm_lock. */
+		if (state->badvaddr < ULIM && current &&
+		    !kernel_cow_fault(current, state->badvaddr))
+			return;
 		print_trapframe(state);
 		panic("Store Page Fault in the Kernel at %p!", state->badvaddr);
 	}
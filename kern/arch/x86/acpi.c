@@ -0,0 +1,204 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Minimal ACPI table parsing.  We find the RSDP, walk the RSDT (or XSDT) for
+ * the SRAT, and tell the page allocator which memory is on which NUMA node.
+ * Proximity domains are renumbered into dense node ids.
+ *
+ * This runs before page_alloc_init(), so it can't allocate memory.  It reads
+ * the tables through the KERNBASE mapping, so tables above max_paddr (which
+ * can happen on 32 bit) are ignored, and we'll have one node. */
+
+#include <arch/acpi.h>
+#include <arch/arch.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Proximity domain of each node, in the order we found them */
+static uint32_t node_domains[MAX_NUMA_NODES];
+static int nr_node_domains;
+/* Node of each APIC id.  x2APIC ids past this are lumped in with node 0. */
+#define ACPI_MAX_APIC_ID 256
+static uint8_t apic_nodes[ACPI_MAX_APIC_ID];
+
+/* Returns the KVA of [pa, pa + len), or 0 if we can't get to it yet */
+static void *acpi_kaddr(uint64_t pa, size_t len)
+{
+	if (pa + len > max_paddr)
+		return 0;
+	return KADDR(pa);
+}
+
+static bool acpi_checksum_ok(void *addr, size_t len)
+{
+	uint8_t sum = 0;
+	for (int i = 0; i < len; i++)
+		sum += ((uint8_t*)addr)[i];
+	return sum == 0;
+}
+
+static struct acpi_rsdp *rsdp_search(uintptr_t base, uintptr_t bound)
+{
+	struct acpi_rsdp *rsdp;
+
+	/* The RSDP is on a 16 byte boundary */
+	for (uintptr_t pa = base; pa + sizeof(struct acpi_rsdp) <= bound;
+	     pa += 16) {
+		rsdp = KADDR(pa);
+		if (memcmp(rsdp->signature, ACPI_RSDP_SIG, 8))
+			continue;
+		if (acpi_checksum_ok(rsdp, 20))
+			return rsdp;
+	}
+	return 0;
+}
+
+static struct acpi_rsdp *rsdp_find(void)
+{
+	struct acpi_rsdp *rsdp = 0;
+	uintptr_t ebda_base = *(uint16_t*)KADDR(ACPI_EBDA_POINTER) << 4;
+
+	if (ebda_base)
+		rsdp = rsdp_search(ebda_base, ebda_base + ACPI_EBDA_SIZE);
+	if (!rsdp)
+		rsdp = rsdp_search(ACPI_BIOS_ROM_BASE, ACPI_BIOS_ROM_BOUND);
+	return rsdp;
+}
+
+/* Returns the table at pa if it is there, complete, and has signature sig */
+static struct acpi_sdt_hdr *sdt_map(uint64_t pa, const char *sig)
+{
+	struct acpi_sdt_hdr *hdr = acpi_kaddr(pa, sizeof(struct acpi_sdt_hdr));
+
+	if (!hdr || memcmp(hdr->signature, sig, 4))
+		return 0;
+	if (!acpi_kaddr(pa, hdr->length) || !acpi_checksum_ok(hdr, hdr->length))
+		return 0;
+	return hdr;
+}
+
+/* Finds the table with signature sig in the XSDT, or the RSDT if there is no
+ * XSDT. */
+static struct acpi_sdt_hdr *acpi_find_table(const char *sig)
+{
+	struct acpi_rsdp *rsdp = rsdp_find();
+	struct acpi_sdt_hdr *sdt, *table;
+	size_t nr_entries;
+
+	if (!rsdp)
+		return 0;
+	if ((rsdp->revision >= 2) && rsdp->xsdt_addr &&
+	    acpi_checksum_ok(rsdp, rsdp->length) &&
+	    (sdt = sdt_map(rsdp->xsdt_addr, "XSDT"))) {
+		nr_entries = (sdt->length - sizeof(*sdt)) / sizeof(uint64_t);
+		for (int i = 0; i < nr_entries; i++) {
+			/* XSDT entries are only 4 byte aligned */
+			uint64_t pa;
+			memcpy(&pa, (void*)(sdt + 1) + i * sizeof(uint64_t), sizeof(pa));
+			if ((table = sdt_map(pa, sig)))
+				return table;
+		}
+		return 0;
+	}
+	sdt = sdt_map(rsdp->rsdt_addr, "RSDT");
+	if (!sdt)
+		return 0;
+	nr_entries = (sdt->length - sizeof(*sdt)) / sizeof(uint32_t);
+	for (int i = 0; i < nr_entries; i++) {
+		if ((table = sdt_map(((uint32_t*)(sdt + 1))[i], sig)))
+			return table;
+	}
+	return 0;
+}
+
+/* Returns the node for a proximity domain, making a new one if needed */
+static int domain_to_node(uint32_t domain)
+{
+	for (int i = 0; i < nr_node_domains; i++) {
+		if (node_domains[i] == domain)
+			return i;
+	}
+	if (nr_node_domains == MAX_NUMA_NODES) {
+		warn("Too many NUMA domains, putting domain %d on node 0", domain);
+		return 0;
+	}
+	node_domains[nr_node_domains] = domain;
+	return nr_node_domains++;
+}
+
+static void srat_set_apic_node(uint32_t apic_id, uint32_t domain)
+{
+	int node = domain_to_node(domain);
+
+	if (apic_id < ACPI_MAX_APIC_ID)
+		apic_nodes[apic_id] = node;
+}
+
+/* Finds the SRAT, and tells the page allocator about the nodes' memory.  Call
+ * this before freeing any memory to the allocator. */
+void acpi_srat_parse(void)
+{
+	struct acpi_srat *srat = (struct acpi_srat*)acpi_find_table(ACPI_SRAT_SIG);
+	struct acpi_srat_lapic *lapic;
+	struct acpi_srat_mem *mem;
+	struct acpi_srat_x2apic *x2apic;
+	void *entry, *end;
+
+	if (!srat) {
+		printk("No ACPI SRAT, assuming one NUMA node\n");
+		return;
+	}
+	end = (void*)srat + srat->hdr.length;
+	for (entry = srat + 1; entry + 2 <= end; entry += ((uint8_t*)entry)[1]) {
+		/* A zero length entry would loop forever */
+		if (!((uint8_t*)entry)[1])
+			break;
+		switch (((uint8_t*)entry)[0]) {
+			case ACPI_SRAT_LAPIC:
+				lapic = entry;
+				if (!(lapic->flags & ACPI_SRAT_ENABLED))
+					break;
+				srat_set_apic_node(lapic->apic_id, lapic->proximity_lo |
+				                   lapic->proximity_hi[0] << 8 |
+				                   lapic->proximity_hi[1] << 16 |
+				                   lapic->proximity_hi[2] << 24);
+				break;
+			case ACPI_SRAT_MEM:
+				mem = entry;
+				if (!(mem->flags & ACPI_SRAT_ENABLED) || !mem->len)
+					break;
+				/* We don't track memory we can't map */
+				if (mem->base >= max_paddr)
+					break;
+				numa_add_mem_range(mem->base,
+				                   MIN(mem->len, max_paddr - mem->base),
+				                   domain_to_node(mem->proximity));
+				break;
+			case ACPI_SRAT_X2APIC:
+				x2apic = entry;
+				if (!(x2apic->flags & ACPI_SRAT_ENABLED))
+					break;
+				srat_set_apic_node(x2apic->x2apic_id, x2apic->proximity);
+				break;
+		}
+	}
+	printk("ACPI SRAT: %d NUMA nodes\n", nr_numa_nodes);
+}
+
+/* Tells the page allocator which node each core is on.  Call this once the
+ * cores are booted and have their os core ids. */
+void acpi_srat_init_cores(void)
+{
+	int node;
+
+	for (int i = 0; i < num_cpus; i++) {
+		node = apic_nodes[get_hw_coreid(i)];
+		/* A node with cores but no memory has nothing to be local to */
+		if (node >= nr_numa_nodes)
+			node = 0;
+		numa_set_core_node(i, node);
+	}
+}
@@ -0,0 +1,101 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Minimal ACPI table parsing.  For now, we only look at the SRAT (System
+ * Resource Affinity Table), to find out which memory and cores are on which
+ * NUMA node. */
+
+#ifndef ROS_KERN_ACPI_H
+#define ROS_KERN_ACPI_H
+
+#include <ros/common.h>
+
+/* Where to look for the RSDP: the first KB of the EBDA, or the BIOS ROM */
+#define ACPI_EBDA_POINTER		0x040e
+#define ACPI_EBDA_SIZE			1024
+#define ACPI_BIOS_ROM_BASE		0xe0000
+#define ACPI_BIOS_ROM_BOUND		0x100000
+
+#define ACPI_RSDP_SIG			"RSD PTR "
+#define ACPI_SRAT_SIG			"SRAT"
+
+/* Root System Description Pointer.  The fields from length on are only there
+ * for revision 2 and up, which have the XSDT. */
+struct acpi_rsdp {
+	char						signature[8];
+	uint8_t						checksum;
+	char						oem_id[6];
+	uint8_t						revision;
+	uint32_t					rsdt_addr;
+	uint32_t					length;
+	uint64_t					xsdt_addr;
+	uint8_t						ext_checksum;
+	uint8_t						reserved[3];
+} __attribute__((packed));
+
+/* Header of every system description table, including the RSDT and XSDT, whose
+ * bodies are arrays of (32 and 64 bit) table addresses. */
+struct acpi_sdt_hdr {
+	char						signature[4];
+	uint32_t					length;
+	uint8_t						revision;
+	uint8_t						checksum;
+	char						oem_id[6];
+	char						oem_table_id[8];
+	uint32_t					oem_revision;
+	uint32_t					creator_id;
+	uint32_t					creator_revision;
+} __attribute__((packed));
+
+/* The SRAT is followed by variable length entries, each starting with its type
+ * and length. */
+struct acpi_srat {
+	struct acpi_sdt_hdr			hdr;
+	uint32_t					table_revision;
+	uint64_t					reserved;
+} __attribute__((packed));
+
+#define ACPI_SRAT_LAPIC			0
+#define ACPI_SRAT_MEM			1
+#define ACPI_SRAT_X2APIC		2
+
+#define ACPI_SRAT_ENABLED		0x1
+
+struct acpi_srat_lapic {
+	uint8_t						type;
+	uint8_t						length;
+	uint8_t						proximity_lo;
+	uint8_t						apic_id;
+	uint32_t					flags;
+	uint8_t						sapic_eid;
+	uint8_t						proximity_hi[3];
+	uint32_t					clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_mem {
+	uint8_t						type;
+	uint8_t						length;
+	uint32_t					proximity;
+	uint16_t					reserved1;
+	uint64_t					base;
+	uint64_t					len;
+	uint32_t					reserved2;
+	uint32_t					flags;
+	uint64_t					reserved3;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic {
+	uint8_t						type;
+	uint8_t						length;
+	uint16_t					reserved1;
+	uint32_t					proximity;
+	uint32_t					x2apic_id;
+	uint32_t					flags;
+	uint32_t					clock_domain;
+	uint32_t					reserved2;
+} __attribute__((packed));
+
+void acpi_srat_parse(void);
+void acpi_srat_init_cores(void);
+
+#endif /* ROS_KERN_ACPI_H */
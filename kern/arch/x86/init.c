@@ -9,11 +9,13 @@
 #include <arch/mptables.h>
 #include <arch/pci.h>
 #include <arch/ioapic.h>
+#include <arch/acpi.h>
 #include <arch/console.h>
 #include <arch/perfmon.h>
 #include <arch/init.h>
 #include <console.h>
 #include <monitor.h>
+#include <topology.h>
 
 struct ancillary_state x86_default_fpu;
 
@@ -93,6 +95,8 @@ void arch_init()
 	#else
 		smp_boot();
 	#endif
+	acpi_srat_init_cores();
+	topology_init();
 	proc_init();
 
 	/* EXPERIMENTAL NETWORK FUNCTIONALITY
@@ -15,6 +15,7 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <multiboot.h>
+#include <arch/acpi.h>
 
 spinlock_t colored_page_free_list_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 
@@ -22,25 +23,24 @@ page_list_t LCKD(&colored_page_free_list_lock) * CT(llc_cache->num_colors) RO
   colored_page_free_list = NULL;
 
 static void page_alloc_bootstrap() {
-	// Allocate space for the array required to manage the free lists
-	size_t list_size = llc_cache->num_colors*sizeof(page_list_t);
+	// Allocate space for the array required to manage the free lists, with a
+	// set of colors for each NUMA node
+	size_t nr_lists = llc_cache->num_colors * nr_numa_nodes;
+	size_t list_size = nr_lists * sizeof(page_list_t);
 	page_list_t LCKD(&colored_page_free_list_lock)*tmp =
 	    (page_list_t*)boot_alloc(list_size,PGSIZE);
 	colored_page_free_list = SINIT(tmp);
-	for (int i = 0; i < llc_cache->num_colors; i++)
+	for (int i = 0; i < nr_lists; i++)
 		LIST_INIT(&colored_page_free_list[i]);
 }
 
-/* Can do whatever here.  For now, our page allocator just works with colors,
- * not NUMA zones or anything. */
+/* Can do whatever here.  The buddy allocator sorts the page onto its node's
+ * lists. */
 static void track_free_page(struct page *page)
 {
-	LIST_INSERT_HEAD(&colored_page_free_list[get_page_color(page2ppn(page),
-	                                                        llc_cache)],
-	                 page, pg_link);
-	nr_free_pages++;
 	/* Page was previous marked as busy, need to set it free explicitly */
 	page_setref(page, 0);
+	buddy_free_page(page);
 }
 
 static struct page *pa64_to_page(uint64_t paddr)
@@ -214,6 +214,8 @@ static void account_for_pages(physaddr_t boot_freemem_paddr)
 /* Initialize the memory free lists.  After this, do not use boot_alloc. */
 void page_alloc_init(struct multiboot_info *mbi)
 {
+	/* Need to know the NUMA nodes before we set up and fill the free lists */
+	acpi_srat_parse();
 	page_alloc_bootstrap();
 	/* First, we need to initialize the pages array such that all memory is busy
 	 * by default.
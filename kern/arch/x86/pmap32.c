@@ -485,11 +485,23 @@ int get_va_perms(pde_t *pgdir, const void *SNT va)
 	return the_pte & the_pde & (PTE_U | PTE_W | PTE_P);
 }
 
+/* User jumbo mappings aren't supported here, so callers use little pages */
+int pgdir_map_jumbo(pde_t *pgdir, void *va, struct page *page, int perm)
+{
+	return -ENOMEM;
+}
+
+int pgdir_split_jumbo(pde_t *pgdir, void *va)
+{
+	return 0;
+}
+
 void
 page_check(void)
 {
 	page_t *pp, *pp0, *pp1, *pp2;
 	page_list_t fl[1024];
+	page_list_t bfl[MAX_NUMA_NODES][BUDDY_MAX_ORDER + 1];
 	pte_t *ptep;
 
 	// should be able to allocate three pages
@@ -503,10 +515,17 @@ page_check(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	for(int i=0; i<llc_cache->num_colors; i++) {
+	assert(llc_cache->num_colors * nr_numa_nodes <= 1024);
+	for(int i=0; i<llc_cache->num_colors * nr_numa_nodes; i++) {
 		fl[i] = colored_page_free_list[i];
 		LIST_INIT(&colored_page_free_list[i]);
 	}
+	for (int n = 0; n < nr_numa_nodes; n++) {
+		for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+			bfl[n][i] = buddy_free_lists[n][i];
+			LIST_INIT(&buddy_free_lists[n][i]);
+		}
+	}
 
 	// should be no free memory
 	assert(kpage_alloc(&pp) == -ENOMEM);
@@ -622,8 +641,11 @@ page_check(void)
 	}
 
 	// give free list back
-	for(int i=0; i<llc_cache->num_colors; i++)
+	for(int i=0; i<llc_cache->num_colors * nr_numa_nodes; i++)
 		colored_page_free_list[i] = fl[i];
+	for (int n = 0; n < nr_numa_nodes; n++)
+		for (int i = 0; i <= BUDDY_MAX_ORDER; i++)
+			buddy_free_lists[n][i] = bfl[n][i];
 
 	// free the pages we took
 	page_decref(pp0);
@@ -386,6 +386,49 @@ int get_va_perms(pde_t *pgdir, const void *va)
 	return pml_perm_walk(pgdir, va, PML4_SHIFT);
 }
 
+/* Maps the JPGSIZE worth of pages starting at page as a jumbo at va, which
+ * must be JPGSIZE aligned.  The PTE takes over the caller's refs, one per
+ * little page, like a regular PTE does.  Fails with -EEXIST if there is
+ * anything already at va, including an empty page table; callers can fall back
+ * to little pages. */
+int pgdir_map_jumbo(pde_t *pgdir, void *va, struct page *page, int perm)
+{
+	pte_t *pte;
+
+	assert(!JPGOFF(va));
+	pte = pml_walk(pgdir, (uintptr_t)va, PG_WALK_CREATE | PML2_SHIFT);
+	if (!pte)
+		return -ENOMEM;
+	if (!PAGE_UNMAPPED(*pte))
+		return -EEXIST;
+	*pte = PTE_ADDR(page2pa(page)) | PTE_P | PTE_PS | perm;
+	return 0;
+}
+
+/* Breaks up the jumbo mapping va is in (if any) into a page table of little
+ * PTEs, with the same translation and perms.  The refs on the pages move to the
+ * little PTEs.  Since the translation doesn't change, the caller only needs to
+ * flush the TLB when it changes the new PTEs. */
+int pgdir_split_jumbo(pde_t *pgdir, void *va)
+{
+	pte_t *pte, *pt;
+	physaddr_t pa;
+	int flags;
+
+	pte = pml_walk(pgdir, (uintptr_t)va, PML2_SHIFT);
+	if (!pte || !PAGE_JUMBO(*pte))
+		return 0;
+	pt = kpage_zalloc_addr();
+	if (!pt)
+		return -ENOMEM;
+	pa = PTE_ADDR(*pte);
+	flags = PGOFF(*pte) & ~(PTE_PS | PTE_JPAT);
+	for (int i = 0; i < NPTENTRIES; i++)
+		pt[i] = (pa + i * PGSIZE) | flags;
+	*pte = PADDR(pt) | PTE_P | PTE_U | PTE_W;
+	return 0;
+}
+
 #define check_sym_va(sym, addr)                                                \
 ({                                                                             \
 	if ((sym) != (addr))                                                       \
@@ -465,8 +508,8 @@ void x86_cleanup_bootmem(void)
 }
 
 /* Walks len bytes from start, executing 'callback' on every PTE, passing it a
- * specific VA and whatever arg is passed in.  Note, this cannot handle jumbo
- * pages.
+ * specific VA and whatever arg is passed in.  Jumbo PTEs are passed along too,
+ * with the VA of the start of the jumbo, so callbacks need to check PAGE_JUMBO.
  *
  * This is just a clumsy wrapper around the more powerful pml_for_each, which
  * can handle jumbo and intermediate pages. */
@@ -483,8 +526,8 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	{
 		struct tramp_package *tp = (struct tramp_package*)data;
 		assert(tp->cb);
-		/* memwalk CBs don't know how to handle intermediates or jumbos */
-		if (shift != PML1_SHIFT)
+		/* memwalk CBs don't know how to handle intermediates */
+		if ((shift != PML1_SHIFT) && !(*pte & PTE_PS))
 			return 0;
 		return tp->cb(tp->p, pte, (void*)kva, tp->cb_arg);
 	}
@@ -198,6 +198,7 @@ typedef unsigned long pde_t;
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
+#define PTE_COW		0x200	// Software: copy on write
 
 // Only flags in PTE_USER may be used in system calls.
 #define PTE_USER	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
@@ -215,6 +216,8 @@ typedef unsigned long pde_t;
 #define PAGE_PRESENT(pte) ((pte) & PTE_P)
 #define PAGE_UNMAPPED(pte) ((pte) == 0)
 #define PAGE_PAGED_OUT(pte) (!PAGE_PRESENT(pte) && !PAGE_UNMAPPED(pte))
+/* For a PTE from a walk of user memory, which never uses PAT on little pages */
+#define PAGE_JUMBO(pte) (PAGE_PRESENT(pte) && ((pte) & PTE_PS))
 
 /* **************************************** */
 /* Segmentation */
@@ -272,6 +272,7 @@ typedef unsigned long pde_t;
 #define PTE_PS			0x080	/* Page Size */
 #define PTE_PAT			0x080	/* Page attribute table */
 #define PTE_G			0x100	/* Global Page */
+#define PTE_COW			0x200	/* Software: copy on write (available bit) */
 #define PTE_JPAT		0x800	/* Jumbo PAT */
 
 /* Permissions fields and common access modes.  These should be read as 'just
@@ -294,6 +295,8 @@ typedef unsigned long pde_t;
 #define PAGE_PRESENT(pte) ((pte) & PTE_P)
 #define PAGE_UNMAPPED(pte) ((pte) == 0)
 #define PAGE_PAGED_OUT(pte) (!PAGE_PRESENT(pte) && !PAGE_UNMAPPED(pte))
+/* For a PTE from a walk of user memory, which never uses PAT on little pages */
+#define PAGE_JUMBO(pte) (PAGE_PRESENT(pte) && ((pte) & PTE_PS))
 
 
 /* **************************************** */
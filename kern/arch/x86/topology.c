@@ -0,0 +1,108 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * x86 CPU topology, from CPUID.  An APIC id is made of bit fields: the SMT
+ * thread in the low bits, then the core, then the package.  CPUID tells us how
+ * wide the fields are, and which APIC ids share the last level cache.  The
+ * field widths are the same on every core, so we can do this all from one core
+ * with the APIC ids we found at boot. */
+
+#include <topology.h>
+#include <arch/x86.h>
+#include <arch/arch.h>
+#include <smp.h>
+#include <stdio.h>
+
+/* Returns the number of bits needed for ids 0..count-1 */
+static int id_bits(uint32_t count)
+{
+	int bits = 0;
+	while ((1U << bits) < count)
+		bits++;
+	return bits;
+}
+
+static uint32_t cpuid_max_leaf(void)
+{
+	uint32_t eax;
+	cpuid(0, 0, &eax, 0, 0, 0);
+	return eax;
+}
+
+/* Sets the shifts that get us from an APIC id to its physical core and
+ * package, from the extended topology leaf if we have it. */
+static void apic_id_shifts(int *smt_shift, int *pkg_shift)
+{
+	uint32_t eax, ebx, ecx, edx;
+	int nr_logical, nr_cores = 1;
+
+	if (cpuid_max_leaf() >= 0xb) {
+		cpuid(0xb, 0, &eax, &ebx, &ecx, 0);
+		/* ebx is 0 if the leaf isn't really supported */
+		if (ebx) {
+			*smt_shift = eax & 0x1f;
+			*pkg_shift = *smt_shift;
+			/* The level after SMT is the core level, whose shift gets us
+			 * to the package. */
+			cpuid(0xb, 1, &eax, &ebx, &ecx, 0);
+			if (ebx && (((ecx >> 8) & 0xff) == 2))
+				*pkg_shift = eax & 0x1f;
+			return;
+		}
+	}
+	cpuid(1, 0, 0, &ebx, 0, &edx);
+	/* No HTT means one logical processor per package */
+	if (!(edx & (1 << 28))) {
+		*smt_shift = 0;
+		*pkg_shift = 0;
+		return;
+	}
+	nr_logical = (ebx >> 16) & 0xff;
+	if (cpuid_max_leaf() >= 4) {
+		cpuid(4, 0, &eax, 0, 0, 0);
+		nr_cores = (eax >> 26) + 1;
+	}
+	*pkg_shift = id_bits(nr_logical);
+	*smt_shift = id_bits(nr_logical / nr_cores);
+}
+
+/* Returns the shift that gets us from an APIC id to its last level cache, or
+ * -1 if CPUID doesn't tell us. */
+static int apic_id_llc_shift(void)
+{
+	uint32_t eax;
+	int level, llc_level = 0, llc_shift = -1;
+
+	if (cpuid_max_leaf() < 4)
+		return -1;
+	for (int i = 0; ; i++) {
+		cpuid(4, i, &eax, 0, 0, 0);
+		/* cache type 0 means there are no more caches */
+		if (!(eax & 0x1f))
+			break;
+		level = (eax >> 5) & 0x7;
+		if (level > llc_level) {
+			llc_level = level;
+			llc_shift = id_bits(((eax >> 14) & 0xfff) + 1);
+		}
+	}
+	return llc_shift;
+}
+
+void arch_topology_init(void)
+{
+	int smt_shift, pkg_shift, llc_shift;
+	uint32_t apic_id;
+
+	apic_id_shifts(&smt_shift, &pkg_shift);
+	llc_shift = apic_id_llc_shift();
+	/* Without LLC info, assume one LLC per package */
+	if (llc_shift < 0)
+		llc_shift = pkg_shift;
+	for (int i = 0; i < num_cpus; i++) {
+		apic_id = get_hw_coreid(i);
+		cpu_topology[i].socket = apic_id >> pkg_shift;
+		cpu_topology[i].llc = apic_id >> llc_shift;
+		cpu_topology[i].phys_core = apic_id >> smt_shift;
+	}
+}
@@ -123,6 +123,12 @@ void page_fault_handler(struct hw_trapframe *hw_tf)
 
 	/* TODO - handle kernel page faults */
 	if ((hw_tf->tf_cs & 3) == 0) {
+		/* The kernel can write to a user page that is CoW, like a ucq after a
+		 * fork.  We might be in an IRQ or holding the mm_lock. */
+		if ((hw_tf->tf_err & PF_ERROR_PRESENT) &&
+		    (hw_tf->tf_err & PF_ERROR_WRITE) && (fault_va < ULIM) && current &&
+		    !kernel_cow_fault(current, fault_va))
+			return;
 		print_trapframe(hw_tf);
 		backtrace_kframe(hw_tf);
 		panic("Page Fault in the Kernel at 0x%08x!", fault_va);
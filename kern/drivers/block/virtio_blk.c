@@ -0,0 +1,465 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * virtio-blk driver, for legacy virtio PCI devices (like QEMU's).  It sits
+ * under the block layer's request queue: b_submit() turns a request (and
+ * whatever got merged with it) into virtio requests, one per run of contiguous
+ * sectors, with a descriptor per physically contiguous chunk of buffer.
+ *
+ * Completions come in on the device's IRQ.  If the device lets us, we ask for
+ * an interrupt only after half of what's in flight is done, and we reap
+ * whatever is finished every time we submit, so a busy disk takes fewer
+ * interrupts. */
+
+#ifdef __SHARC__
+#pragma nosharc
+#endif
+
+#include <arch/x86.h>
+#include <arch/pci.h>
+#include <arch/apic.h>
+#include <arch/ioapic.h>
+#include <trap.h>
+#include <kmalloc.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "virtio_blk.h"
+
+static struct virtio_blk *vblks[VBLK_MAX_DEVS];
+static int nr_vblks;
+
+/* Same as Linux's vring_need_event(): whether moving idx from old to new_idx
+ * passed event_idx. */
+static bool vring_need_event(uint16_t event_idx, uint16_t new_idx,
+                             uint16_t old)
+{
+	return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
+static size_t vring_size(unsigned int num)
+{
+	return ROUNDUP(sizeof(struct vring_desc) * num + sizeof(uint16_t) *
+	               (3 + num), VIRTIO_PCI_QUEUE_ALIGN) +
+	       ROUNDUP(sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * num,
+	               VIRTIO_PCI_QUEUE_ALIGN);
+}
+
+static void vblk_free_chain(struct virtio_blk *vblk, uint16_t head)
+{
+	uint16_t i = head;
+
+	while (vblk->desc[i].flags & VRING_DESC_F_NEXT) {
+		i = vblk->desc[i].next;
+		vblk->nr_free++;
+	}
+	vblk->nr_free++;
+	vblk->desc[i].next = vblk->free_head;
+	vblk->free_head = head;
+}
+
+/* Takes a descriptor off the free list and fills it in.  Check nr_free
+ * first. */
+static uint16_t vblk_add_desc(struct virtio_blk *vblk, void *buf, size_t len,
+                              uint16_t flags)
+{
+	uint16_t i = vblk->free_head;
+
+	assert(vblk->nr_free);
+	vblk->free_head = vblk->desc[i].next;
+	vblk->nr_free--;
+	vblk->desc[i].addr = PADDR(buf);
+	vblk->desc[i].len = len;
+	vblk->desc[i].flags = flags;
+	return i;
+}
+
+/* Walks the BHs of a dispatch's request and everything merged with it,
+ * calling func on each run of contiguous sectors (first BH index in the
+ * request, and how many BHs).  Runs don't cross requests. */
+static void vblk_for_each_run(struct block_request *breq,
+                              void func(struct block_request *, int, int))
+{
+	struct buffer_head *prev;
+	int end;
+
+	for (; breq; breq = breq->merge_next) {
+		for (int i = 0; i < breq->nr_bhs; i = end) {
+			for (end = i + 1; end < breq->nr_bhs; end++) {
+				prev = breq->bhs[end - 1];
+				if (breq->bhs[end]->bh_sector !=
+				    prev->bh_sector + prev->bh_nr_sector)
+					break;
+			}
+			func(breq, i, end - i);
+		}
+	}
+}
+
+/* Whether b follows a in physical memory, so they can share a descriptor */
+static bool bh_phys_contig(struct buffer_head *a, struct buffer_head *b)
+{
+	return PADDR(a->bh_buffer) + (a->bh_nr_sector << SECTOR_SZ_LOG) ==
+	       PADDR(b->bh_buffer);
+}
+
+/* Counts the descriptors a dispatch will need */
+static unsigned int vblk_count_descs(struct block_request *breq)
+{
+	unsigned int nr_descs = 0;
+
+	void __count_run(struct block_request *breq, int first, int nr)
+	{
+		/* header and status */
+		nr_descs += 2;
+		for (int i = first; i < first + nr; i++) {
+			if ((i == first) ||
+			    !bh_phys_contig(breq->bhs[i - 1], breq->bhs[i]))
+				nr_descs++;
+		}
+	}
+	vblk_for_each_run(breq, __count_run);
+	return nr_descs;
+}
+
+/* Puts a dispatch's virtio requests in the avail ring.  Hold the lock, and make
+ * sure there are enough free descriptors. */
+static void vblk_queue_dispatch(struct virtio_blk *vblk,
+                                struct vblk_dispatch *disp)
+{
+	uint16_t avail_idx = vblk->avail->idx;
+	uint16_t old_idx = avail_idx;
+	uint16_t data_flags = disp->breq->flags & BREQ_READ ? VRING_DESC_F_WRITE
+	                                                     : 0;
+
+	void __queue_run(struct block_request *breq, int first, int nr)
+	{
+		struct vblk_req *req;
+		uint16_t head, prev, i;
+
+		/* The header's descriptor is the one the device hands back */
+		head = vblk->free_head;
+		req = &vblk->reqs[head];
+		req->hdr.type = breq->flags & BREQ_READ ? VIRTIO_BLK_T_IN
+		                                        : VIRTIO_BLK_T_OUT;
+		req->hdr.ioprio = 0;
+		req->hdr.sector = breq->bhs[first]->bh_sector;
+		req->status = 0xff;
+		req->disp = disp;
+		prev = vblk_add_desc(vblk, &req->hdr, sizeof(req->hdr),
+		                     VRING_DESC_F_NEXT);
+		assert(prev == head);
+		for (int j = first; j < first + nr; j++) {
+			if ((j != first) &&
+			    bh_phys_contig(breq->bhs[j - 1], breq->bhs[j])) {
+				vblk->desc[prev].len += breq->bhs[j]->bh_nr_sector
+				                        << SECTOR_SZ_LOG;
+				continue;
+			}
+			i = vblk_add_desc(vblk, breq->bhs[j]->bh_buffer,
+			                  breq->bhs[j]->bh_nr_sector << SECTOR_SZ_LOG,
+			                  data_flags | VRING_DESC_F_NEXT);
+			vblk->desc[prev].next = i;
+			prev = i;
+		}
+		i = vblk_add_desc(vblk, &req->status, 1, VRING_DESC_F_WRITE);
+		vblk->desc[prev].next = i;
+		vblk->avail->ring[avail_idx % vblk->num] = head;
+		avail_idx++;
+		disp->nr_pending++;
+		vblk->nr_outstanding++;
+	}
+	vblk_for_each_run(disp->breq, __queue_run);
+	/* The device can't see the ring entries til it sees the new idx */
+	wmb_f();
+	vblk->avail->idx = avail_idx;
+	mb_f();
+	if (vblk->event_idx ? vring_need_event(*vblk->avail_event, avail_idx,
+	                                        old_idx)
+	                    : !(vblk->used->flags & VRING_USED_F_NO_NOTIFY)) {
+		vblk->nr_notifies++;
+		outw(vblk->iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+	}
+}
+
+/* Moves backlogged dispatches into the ring, in order, while they fit */
+static void vblk_run_backlog(struct virtio_blk *vblk)
+{
+	struct vblk_dispatch *disp;
+
+	while ((disp = STAILQ_FIRST(&vblk->backlog))) {
+		if (disp->nr_descs > vblk->nr_free)
+			return;
+		STAILQ_REMOVE_HEAD(&vblk->backlog, link);
+		vblk_queue_dispatch(vblk, disp);
+	}
+}
+
+/* Takes finished virtio requests off the used ring, and puts the dispatches
+ * they finished on done.  Hold the lock. */
+static void vblk_reap(struct virtio_blk *vblk,
+                      struct vblk_dispatch_stailq *done)
+{
+	struct vring_used_elem *elem;
+	struct vblk_req *req;
+
+	while (vblk->last_used != ACCESS_ONCE(vblk->used->idx)) {
+		rmb_f();
+		elem = &vblk->used->ring[vblk->last_used % vblk->num];
+		req = &vblk->reqs[elem->id];
+		if (req->status != VIRTIO_BLK_S_OK)
+			req->disp->error = TRUE;
+		vblk_free_chain(vblk, elem->id);
+		vblk->last_used++;
+		vblk->nr_outstanding--;
+		if (!--req->disp->nr_pending)
+			STAILQ_INSERT_TAIL(done, req->disp, link);
+	}
+	vblk_run_backlog(vblk);
+}
+
+/* Tells the device when we next want an interrupt: once half of what's in
+ * flight is done.  Returns TRUE if more finished while we were deciding, in
+ * which case reap again. */
+static bool vblk_arm_irq(struct virtio_blk *vblk)
+{
+	unsigned int batch = MAX(vblk->nr_outstanding >> VBLK_COALESCE_SHIFT, 1);
+
+	if (vblk->event_idx)
+		*vblk->used_event = vblk->last_used + batch - 1;
+	mb_f();
+	return vblk->last_used != ACCESS_ONCE(vblk->used->idx);
+}
+
+/* Completes dispatches outside of the lock, since the block layer might want
+ * to give us more. */
+static void vblk_complete(struct vblk_dispatch_stailq *done)
+{
+	struct vblk_dispatch *disp;
+	struct block_request *breq;
+
+	while ((disp = STAILQ_FIRST(done))) {
+		STAILQ_REMOVE_HEAD(done, link);
+		breq = disp->breq;
+		if (disp->error)
+			breq->flags |= BREQ_ERROR;
+		kfree(disp);
+		bdev_complete_request(breq);
+	}
+}
+
+static void vblk_submit(struct block_device *bdev, struct block_request *breq)
+{
+	struct virtio_blk *vblk = (struct virtio_blk*)bdev;
+	struct vblk_dispatch_stailq done = STAILQ_HEAD_INITIALIZER(done);
+	struct vblk_dispatch *disp = kmalloc(sizeof(struct vblk_dispatch), 0);
+
+	if (!disp) {
+		breq->flags |= BREQ_ERROR;
+		bdev_complete_request(breq);
+		return;
+	}
+	disp->breq = breq;
+	disp->nr_pending = 0;
+	disp->error = FALSE;
+	disp->nr_descs = vblk_count_descs(breq);
+	/* Requests with nothing to do, or that we can't do, finish right away */
+	if (disp->nr_descs > vblk->num) {
+		warn("Block request too big for %s's ring", bdev->b_name);
+		disp->error = TRUE;
+	} else if (disp->nr_descs && (breq->flags & BREQ_WRITE) &&
+	           vblk->read_only) {
+		disp->error = TRUE;
+	}
+	if (!disp->nr_descs || disp->error) {
+		STAILQ_INSERT_TAIL(&done, disp, link);
+		vblk_complete(&done);
+		return;
+	}
+	spin_lock_irqsave(&vblk->lock);
+	/* Poll for anything that finished, so we don't need the IRQ for it */
+	if (vblk->last_used != ACCESS_ONCE(vblk->used->idx))
+		vblk->nr_polled++;
+	vblk_reap(vblk, &done);
+	STAILQ_INSERT_TAIL(&vblk->backlog, disp, link);
+	vblk_run_backlog(vblk);
+	while (vblk_arm_irq(vblk))
+		vblk_reap(vblk, &done);
+	spin_unlock_irqsave(&vblk->lock);
+	vblk_complete(&done);
+}
+
+static void vblk_irq_handler(struct hw_trapframe *hw_tf, void *data)
+{
+	struct vblk_dispatch_stailq done = STAILQ_HEAD_INITIALIZER(done);
+	struct virtio_blk *vblk;
+
+	/* Devices could share the IRQ line, so check all of them */
+	for (int i = 0; i < nr_vblks; i++) {
+		vblk = vblks[i];
+		if (vblk->irq != (uintptr_t)data)
+			continue;
+		/* Reading the ISR acks it */
+		if (!(inb(vblk->iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE))
+			continue;
+		spin_lock_irqsave(&vblk->lock);
+		vblk->nr_irqs++;
+		do {
+			vblk_reap(vblk, &done);
+		} while (vblk_arm_irq(vblk));
+		spin_unlock_irqsave(&vblk->lock);
+		vblk_complete(&done);
+	}
+}
+
+static void vblk_print_stats(struct block_device *bdev)
+{
+	struct virtio_blk *vblk = (struct virtio_blk*)bdev;
+
+	printk("\tvirtio: %llu irqs, %llu notifies, %llu polled, ring %u/%u free\n",
+	       vblk->nr_irqs, vblk->nr_notifies, vblk->nr_polled, vblk->nr_free,
+	       vblk->num);
+}
+
+/* Sets up virtqueue 0, which is the only one virtio-blk has.  Returns 0 on
+ * success. */
+static int vblk_setup_ring(struct virtio_blk *vblk)
+{
+	void *ring;
+	size_t ring_order, reqs_order;
+
+	outw(vblk->iobase + VIRTIO_PCI_QUEUE_SEL, 0);
+	vblk->num = inw(vblk->iobase + VIRTIO_PCI_QUEUE_NUM);
+	if (!vblk->num || (vblk->num & (vblk->num - 1)))
+		return -1;
+	/* The ring has to be physically contiguous */
+	ring_order = LOG2_UP(ROUNDUP(vring_size(vblk->num), PGSIZE) / PGSIZE);
+	ring = get_cont_pages(ring_order, 0);
+	if (!ring)
+		return -1;
+	reqs_order = LOG2_UP(ROUNDUP(sizeof(struct vblk_req) * vblk->num, PGSIZE) /
+	                     PGSIZE);
+	vblk->reqs = get_cont_pages(reqs_order, 0);
+	if (!vblk->reqs) {
+		free_cont_pages(ring, ring_order);
+		return -1;
+	}
+	memset(ring, 0, vring_size(vblk->num));
+	vblk->desc = ring;
+	vblk->avail = ring + sizeof(struct vring_desc) * vblk->num;
+	vblk->used_event = &vblk->avail->ring[vblk->num];
+	vblk->used = ring + ROUNDUP(sizeof(struct vring_desc) * vblk->num +
+	                            sizeof(uint16_t) * (3 + vblk->num),
+	                            VIRTIO_PCI_QUEUE_ALIGN);
+	vblk->avail_event = (uint16_t*)&vblk->used->ring[vblk->num];
+	for (int i = 0; i < vblk->num - 1; i++)
+		vblk->desc[i].next = i + 1;
+	vblk->free_head = 0;
+	vblk->nr_free = vblk->num;
+	vblk->last_used = 0;
+	vblk->nr_outstanding = 0;
+	STAILQ_INIT(&vblk->backlog);
+	outl(vblk->iobase + VIRTIO_PCI_QUEUE_PFN,
+	     PADDR(ring) >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+	return 0;
+}
+
+static void vblk_route_irq(uint8_t irq)
+{
+	extern handler_t interrupt_handlers[];
+
+	register_interrupt_handler(interrupt_handlers, KERNEL_IRQ_OFFSET + irq,
+	                           vblk_irq_handler, (void*)(uintptr_t)irq);
+#ifdef CONFIG_ENABLE_MPTABLES
+	ioapic_route_irq(irq, 0);
+#else
+	pic_unmask_irq(irq);
+	unmask_lapic_lvt(LAPIC_LVT_LINT0);
+#endif /* CONFIG_ENABLE_MPTABLES */
+}
+
+static void vblk_attach(struct pci_device *pcidev)
+{
+	struct virtio_blk *vblk;
+	struct block_device *bdev;
+	uint32_t bar = pci_getbar(pcidev, 0);
+	uint32_t features;
+	char path[] = "/dev/vda";
+	bool irq_routed = FALSE;
+
+	if (nr_vblks == VBLK_MAX_DEVS) {
+		printk("[virtio-blk] Too many devices, skipping %02x:%02x.%x\n",
+		       pcidev->bus, pcidev->dev, pcidev->func);
+		return;
+	}
+	if (!pci_is_iobar(bar)) {
+		printk("[virtio-blk] BAR0 isn't IO space, not a legacy device\n");
+		return;
+	}
+	vblk = kzmalloc(sizeof(struct virtio_blk), 0);
+	assert(vblk);
+	vblk->iobase = pci_getiobar32(bar);
+	vblk->irq = pcidev->irqline;
+	spinlock_init_irqsave(&vblk->lock);
+	/* Let it do IO and DMA */
+	pcidev_write32(pcidev, PCI_STAT_CMD_REG,
+	               pcidev_read32(pcidev, PCI_STAT_CMD_REG) | PCI_CMD_IO_SPC |
+	               PCI_CMD_BUS_MAS);
+	/* Reset, then tell it we know what it is */
+	outb(vblk->iobase + VIRTIO_PCI_STATUS, 0);
+	outb(vblk->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+	outb(vblk->iobase + VIRTIO_PCI_STATUS,
+	     VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	features = inl(vblk->iobase + VIRTIO_PCI_HOST_FEATURES);
+	vblk->event_idx = features & (1 << VIRTIO_RING_F_EVENT_IDX) ? TRUE : FALSE;
+	vblk->read_only = features & (1 << VIRTIO_BLK_F_RO) ? TRUE : FALSE;
+	outl(vblk->iobase + VIRTIO_PCI_GUEST_FEATURES,
+	     features & ((1 << VIRTIO_RING_F_EVENT_IDX) | (1 << VIRTIO_BLK_F_RO)));
+	if (vblk_setup_ring(vblk)) {
+		printk("[virtio-blk] Couldn't set up the virtqueue\n");
+		outb(vblk->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+		kfree(vblk);
+		return;
+	}
+	bdev = &vblk->bdev;
+	bdev->b_id = nr_vblks;
+	bdev->b_sector_sz = SECTOR_SZ;
+	/* The low 32 bits come first */
+	bdev->b_nr_sector = inl(vblk->iobase + VIRTIO_BLK_CFG_CAPACITY);
+	bdev->b_nr_sector |= (uint64_t)inl(vblk->iobase + VIRTIO_BLK_CFG_CAPACITY
+	                                   + 4) << 32;
+	kref_init(&bdev->b_kref, fake_release, 1);
+	path[7] += nr_vblks;
+	strncpy(bdev->b_name, path + 5, BDEV_INLINE_NAME);
+	bdev->b_submit = vblk_submit;
+	bdev->b_print_stats = vblk_print_stats;
+	bdev->b_max_in_flight = VBLK_MAX_IN_FLIGHT;
+	for (int i = 0; i < nr_vblks; i++)
+		irq_routed |= vblks[i]->irq == vblk->irq;
+	vblks[nr_vblks++] = vblk;
+	if (!irq_routed)
+		vblk_route_irq(vblk->irq);
+	outb(vblk->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK |
+	     VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	bdev_register(bdev);
+	bdev_make_device(bdev, path);
+	printk("[virtio-blk] %s: %lu sectors, IRQ %d, ring %u%s%s\n", path,
+	       bdev->b_nr_sector, vblk->irq, vblk->num,
+	       vblk->event_idx ? ", event idx" : "",
+	       vblk->read_only ? ", read only" : "");
+}
+
+/* Finds and sets up every virtio-blk device on the PCI bus */
+void virtio_blk_init(void)
+{
+	struct pci_device *pcidev;
+
+	STAILQ_FOREACH(pcidev, &pci_devices, all_dev) {
+		if ((pcidev->ven_id != VIRTIO_VENDOR_ID) ||
+		    (pcidev->dev_id != VIRTIO_BLK_DEV_ID))
+			continue;
+		vblk_attach(pcidev);
+	}
+}
@@ -0,0 +1,137 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Legacy (0.9.5) virtio PCI and virtio-blk definitions. */
+
+#ifndef ROS_KERN_VIRTIO_BLK_H
+#define ROS_KERN_VIRTIO_BLK_H
+
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <blockdev.h>
+
+#define VIRTIO_VENDOR_ID			0x1af4
+#define VIRTIO_BLK_DEV_ID			0x1001
+
+/* Legacy virtio PCI registers, offsets into BAR0 (IO space) */
+#define VIRTIO_PCI_HOST_FEATURES	0x00	/* 32 bit */
+#define VIRTIO_PCI_GUEST_FEATURES	0x04	/* 32 bit */
+#define VIRTIO_PCI_QUEUE_PFN		0x08	/* 32 bit */
+#define VIRTIO_PCI_QUEUE_NUM		0x0c	/* 16 bit */
+#define VIRTIO_PCI_QUEUE_SEL		0x0e	/* 16 bit */
+#define VIRTIO_PCI_QUEUE_NOTIFY		0x10	/* 16 bit */
+#define VIRTIO_PCI_STATUS			0x12	/* 8 bit */
+#define VIRTIO_PCI_ISR				0x13	/* 8 bit, reading acks */
+#define VIRTIO_PCI_CONFIG			0x14	/* device config, without MSI-X */
+
+#define VIRTIO_PCI_QUEUE_ALIGN		4096
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT	12
+
+#define VIRTIO_STATUS_ACK			0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+#define VIRTIO_ISR_QUEUE			0x01
+
+/* Feature bits */
+#define VIRTIO_BLK_F_RO				5
+#define VIRTIO_RING_F_EVENT_IDX		29
+
+/* virtio-blk config space: capacity is in 512 byte sectors */
+#define VIRTIO_BLK_CFG_CAPACITY		(VIRTIO_PCI_CONFIG + 0x00)	/* 64 bit */
+
+/* Virtqueues.  The avail ring is followed by used_event, and the used ring by
+ * avail_event, which only mean something with VIRTIO_RING_F_EVENT_IDX. */
+struct vring_desc {
+	uint64_t					addr;
+	uint32_t					len;
+	uint16_t					flags;
+	uint16_t					next;
+};
+#define VRING_DESC_F_NEXT			1
+#define VRING_DESC_F_WRITE			2		/* the device writes it */
+
+struct vring_avail {
+	uint16_t					flags;
+	uint16_t					idx;
+	uint16_t					ring[];
+};
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+
+struct vring_used_elem {
+	uint32_t					id;
+	uint32_t					len;
+};
+
+struct vring_used {
+	uint16_t					flags;
+	uint16_t					idx;
+	struct vring_used_elem		ring[];
+};
+#define VRING_USED_F_NO_NOTIFY		1
+
+/* Requests are a header, the data, and a status byte, each in their own
+ * descriptors */
+#define VIRTIO_BLK_T_IN				0
+#define VIRTIO_BLK_T_OUT			1
+#define VIRTIO_BLK_S_OK				0
+
+struct virtio_blk_outhdr {
+	uint32_t					type;
+	uint32_t					ioprio;
+	uint64_t					sector;
+};
+
+/* The driver's state.  A block_request from the queue turns into a dispatch,
+ * which is one virtio request per run of contiguous sectors.  Each virtio
+ * request's header and status live in reqs[], indexed by its first
+ * descriptor.  Dispatches that don't fit in the ring wait on the backlog. */
+struct vblk_dispatch {
+	struct block_request		*breq;
+	unsigned int				nr_pending;		/* virtio requests */
+	unsigned int				nr_descs;		/* how many it needs */
+	bool						error;
+	STAILQ_ENTRY(vblk_dispatch)	link;
+};
+STAILQ_HEAD(vblk_dispatch_stailq, vblk_dispatch);
+
+/* Power of two sized, so none of them cross a page */
+struct vblk_req {
+	struct virtio_blk_outhdr	hdr;
+	uint8_t						status;
+	struct vblk_dispatch		*disp;
+} __attribute__((aligned(32)));
+
+/* Completions it takes to get an interrupt, as a fraction of what is in
+ * flight, when the device lets us pick (VIRTIO_RING_F_EVENT_IDX). */
+#define VBLK_COALESCE_SHIFT			1
+#define VBLK_MAX_IN_FLIGHT			32
+#define VBLK_MAX_DEVS				4
+
+struct virtio_blk {
+	struct block_device			bdev;
+	spinlock_t					lock;
+	uint32_t					iobase;
+	uint8_t						irq;
+	bool						event_idx;
+	bool						read_only;
+	unsigned int				num;			/* ring size */
+	struct vring_desc			*desc;
+	struct vring_avail			*avail;
+	struct vring_used			*used;
+	uint16_t					*used_event;
+	uint16_t					*avail_event;
+	uint16_t					free_head;
+	unsigned int				nr_free;
+	uint16_t					last_used;
+	unsigned int				nr_outstanding;	/* virtio requests */
+	struct vblk_req				*reqs;
+	struct vblk_dispatch_stailq	backlog;
+	/* Stats */
+	uint64_t					nr_irqs;
+	uint64_t					nr_notifies;
+	uint64_t					nr_polled;		/* reaped outside the IRQ */
+};
+
+#endif /* ROS_KERN_VIRTIO_BLK_H */
@@ -8,8 +8,10 @@
  * (picture running the ksched then).  The other style is to block/sleep on the
  * awaiter after the alarm is set.
  *
- * Like with most systems, you won't wake up til after the time you specify (for
- * now).  This might change, esp if we tweak things to coalesce alarms.
+ * Like with most systems, you won't wake up til after the time you specify.
+ * Alarms are coalesced into ticks of 2^TCHAIN_TICK_SHIFT TSC cycles (a couple
+ * usec), and go off at the end of their tick, so you might wake up to a tick
+ * late.
  *
  * If you're using a global alarm timer_chain, you'll probably need to grab a
  * lock.  The only current user is pcpu tchains, though the code ought be able
@@ -59,18 +61,34 @@ struct alarm_waiter {
 	struct semaphore			sem;			/* kthread will sleep on this */
 	void						*data;
 	TAILQ_ENTRY(alarm_waiter)	next;
+	struct awaiters_tailq		*list;			/* 0 when not armed */
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
+TAILQ_HEAD(awaiters_tailq, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
+/* Timer chains are hierarchical timing wheels.  Level 0 has a slot for each of
+ * the next 64 ticks, level 1 a slot for each of the next 64 blocks of 64 ticks,
+ * and so on.  Alarms too far out for the top level wait on the overflow list.
+ * As time passes, the slots of the higher levels are cascaded down into the
+ * lower ones.  Each level has a bitmap of its non-empty slots, so we can skip
+ * over empty time without walking it. */
+#define TCHAIN_TICK_SHIFT		12		/* TSC cycles per tick, log2 */
+#define TCHAIN_LEVEL_SHIFT		6
+#define TCHAIN_NR_SLOTS			(1 << TCHAIN_LEVEL_SHIFT)
+#define TCHAIN_SLOT_MASK		(TCHAIN_NR_SLOTS - 1)
+#define TCHAIN_NR_LEVELS		5
+
 /* One of these per alarm source, such as a per-core timer.  Based on the
  * source, you may need a lock (such as for a global timer).  set_interrupt() is
  * a method for setting the interrupt source. */
 struct timer_chain {
-	struct awaiters_tailq		waiters;
-	uint64_t					earliest_time;
-	uint64_t					latest_time;
+	struct awaiters_tailq		slots[TCHAIN_NR_LEVELS][TCHAIN_NR_SLOTS];
+	uint64_t					occupied[TCHAIN_NR_LEVELS];	/* slot bitmaps */
+	struct awaiters_tailq		overflow;
+	uint64_t					base;			/* tick we've processed up to */
+	unsigned long				nr_waiters;
+	uint64_t					earliest_time;	/* when the interrupt is set */
 	void (*set_interrupt) (uint64_t time, struct timer_chain *);
 };
 
@@ -84,7 +102,7 @@ void init_awaiter(struct alarm_waiter *waiter,
 void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
-/* Arms/disarms the alarm */
+/* Arms/disarms the alarm.  Unsetting an alarm that isn't set is a noop. */
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 void unset_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 /* Blocks on the alarm waiter */
@@ -14,9 +14,18 @@
 #include <syscall.h>
 #include <error.h>
 
-extern struct proc_list arsc_proc_list;
-extern spinlock_t arsc_proc_lock;
+/* Empty passes over the rings before a server starts sleeping between passes,
+ * and the bounds on how long it sleeps. */
+#define ARSC_POLL_ROUNDS		1000
+#define ARSC_MIN_SLEEP_USEC		10
+#define ARSC_MAX_SLEEP_USEC		1000
 
+/* The option only exists with CONFIG_ARSC_SERVER, but we're always built */
+#ifndef CONFIG_ARSC_SERVER_CORES
+#define CONFIG_ARSC_SERVER_CORES	1
+#endif
+
+int arsc_init(void);
 syscall_sring_t* sys_init_arsc(struct proc* p);
 intreg_t syscall_async(struct proc* p, syscall_req_t *syscall);
 void arsc_server(uint32_t srcid, long a0, long a1, long a2);
@@ -12,6 +12,7 @@
 #include <slab.h>
 #include <pagemap.h>
 #include <kthread.h>
+#include <sys/queue.h>
 
 /* All block IO is done assuming a certain size sector, which is the smallest
  * possible unit of transfer between the kernel and the block layer.  This can
@@ -21,8 +22,49 @@
 #define SECTOR_SZ_LOG 9
 #define SECTOR_SZ (1 << SECTOR_SZ_LOG)
 
+struct block_request;
+struct block_device;
+TAILQ_HEAD(breq_tailq, block_request);
+TAILQ_HEAD(bdev_tailq, block_device);
+
+/* Requests wait in a per-device queue until the driver has room for them.
+ * While they wait, requests for neighboring sectors are merged into one
+ * dispatch, and the elevator picks the next one in sector order (C-SCAN),
+ * unless the oldest has waited past its deadline.  Plugging a queue holds
+ * everything back, so a batch of submissions gets merged before any of it
+ * goes out.  A plug belongs to the kernel context that made it, and only holds
+ * the queue while that context runs: it could sleep on its own IO. */
+#define BLK_READ_DEADLINE_USEC		50000
+#define BLK_WRITE_DEADLINE_USEC		500000
+#define BLK_MAX_MERGE_SECTORS		256
+#define BLK_NR_LAT_BUCKETS			16		/* log2 usec */
+
+struct block_queue {
+	spinlock_t					lock;			/* irqsave, drivers complete */
+	struct breq_tailq			sorted;			/* by sector, for the elevator */
+	struct breq_tailq			fifo;			/* by age, for deadlines */
+	unsigned long				next_sector;	/* where the elevator is */
+	unsigned int				nr_plugs;
+	unsigned int				nr_queued;
+	unsigned int				nr_in_flight;
+	bool						kick_pending;	/* a run_queue kmsg is coming */
+	/* Stats */
+	uint64_t					nr_submits;
+	uint64_t					nr_merges;
+	uint64_t					nr_dispatches;
+	uint64_t					nr_expired;		/* dispatched for deadlines */
+	unsigned int				max_depth;		/* queued + in flight */
+	uint64_t					lat_hist[BLK_NR_LAT_BUCKETS];
+};
+
 /* Every block device is represented by one of these, with custom methods, as
- * applicable for the type of device.  Subject to massive changes. */
+ * applicable for the type of device.  Subject to massive changes.
+ *
+ * Drivers set b_submit and b_max_in_flight, then bdev_register() the device.
+ * b_submit() gets a request (and any merged with it), and must eventually call
+ * bdev_complete_request() on it, usually from its interrupt handler.  It must
+ * not block.  b_print_stats() is optional.  Drivers that go away call
+ * bdev_unregister() before freeing the device. */
 #define BDEV_INLINE_NAME 10
 struct block_device {
 	int							b_id;
@@ -32,10 +74,12 @@ struct block_device {
 	struct page_map				b_pm;
 	void						*b_data;			/* dev-specific use */
 	char						b_name[BDEV_INLINE_NAME];
-	// TODO: list or something of buffer heads (?)
-	// list of outstanding requests
-	// io scheduler
-	// callbacks for completion
+	void						(*b_submit)(struct block_device *bdev,
+							                struct block_request *breq);
+	void						(*b_print_stats)(struct block_device *bdev);
+	unsigned int				b_max_in_flight;
+	struct block_queue			b_queue;
+	TAILQ_ENTRY(block_device)	b_link;				/* all registered bdevs */
 };
 
 /* So far, only NEEDS_ZEROED is used */
@@ -73,9 +117,13 @@ void bdev_put_buffer(struct buffer_head *bh);
  *
  * bhs normally points to the inline version (enough for a page).  kmalloc
  * another array of BH pointers if you want more.  The BHs do not need to be
- * linked or otherwise associated with a page mapping. */
+ * linked or otherwise associated with a page mapping.
+ *
+ * The rest is filled in by bdev_submit_request().  A request whose BHs are
+ * one contiguous run of sectors can be merged with others in the queue.  The
+ * request at the head of a merged group is the one the driver sees, and it
+ * describes the whole group; walk merge_next for the rest. */
 #define NR_INLINE_BH (PGSIZE >> SECTOR_SZ_LOG)
-struct block_request;
 struct block_request {
 	unsigned int				flags;
 	void						(*callback)(struct block_request *breq);
@@ -84,18 +132,42 @@ struct block_request {
 	struct buffer_head			**bhs;				/* BHs describing the IOs */
 	unsigned int				nr_bhs;
 	struct buffer_head			*local_bhs[NR_INLINE_BH];
+	/* Block layer use */
+	struct block_device			*bdev;
+	unsigned long				first_sector;
+	unsigned long				nr_sector;			/* of the group, if head */
+	uint64_t					submit_time;
+	uint64_t					deadline;
+	struct block_request		*merge_next;
+	struct block_request		*merge_tail;		/* head only */
+	TAILQ_ENTRY(block_request)	sort_link;
+	TAILQ_ENTRY(block_request)	fifo_link;
 };
 struct kmem_cache *breq_kcache;	/* for the block requests */
 
 /* Block request flags */
 #define BREQ_READ 			0x001
 #define BREQ_WRITE 			0x002
+#define BREQ_ERROR			0x004				/* set by the driver */
+#define BREQ_CONTIG			0x008				/* BHs are one run of sectors */
 
 void block_init(void);
+void bdev_register(struct block_device *bdev);
+void bdev_unregister(struct block_device *bdev);
+void bdev_make_device(struct block_device *bdev, char *path);
 struct block_device *get_bdev(char *path);
 void free_bhs(struct page *page);
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq);
+void bdev_complete_request(struct block_request *breq);
+void bdev_plug(struct block_device *bdev);
+void bdev_unplug(struct block_device *bdev);
+void bdev_plug_suspend(void);
+void bdev_plug_resume(void);
+struct block_device *pm_backing_bdev(struct page_map *pm);
 void generic_breq_done(struct block_request *breq);
 void sleep_on_breq(struct block_request *breq);
+int bdev_writepages(struct block_device *bdev, struct page **pages,
+                    unsigned int nr, bool dirty_only);
+void print_bdev_stats(void);
 
 #endif /* ROS_KERN_BLOCKDEV_H */
@@ -0,0 +1,61 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Concurrent hash table.  Same keys, values, and hash/eq functions as
+ * hashtable.h, but it does its own locking, so callers don't need a big lock
+ * around it.
+ *
+ * Buckets are locked by stripes: a hash's stripe is its low bits, and tables
+ * are always a power of two, at least CHT_NR_STRIPES buckets long.  That way
+ * every bucket (in the old or new table) belongs to exactly one stripe.
+ *
+ * Growing is incremental.  When the load gets too high, we switch to a table
+ * twice as big, and each later insert or remove moves a few buckets from the
+ * old table over, until the old one is empty.  Lookups check whichever table
+ * their bucket is in at the moment. */
+
+#ifndef ROS_KERN_CHASHTABLE_H
+#define ROS_KERN_CHASHTABLE_H
+
+#include <ros/common.h>
+#include <atomic.h>
+#include <hashtable.h>
+
+#define CHT_NR_STRIPES		64	/* power of two */
+#define CHT_MAX_LOAD		2	/* average entries per bucket before growing */
+#define CHT_REHASH_STEP		8	/* buckets moved per insert/remove */
+
+struct cht_table {
+	size_t						nr_buckets;		/* power of two */
+	hash_entry_t				**buckets;
+};
+
+struct chashtable {
+	spinlock_t					stripes[CHT_NR_STRIPES];
+	struct cht_table			*cur;
+	struct cht_table			*old;			/* non-zero while growing */
+	size_t						rehash_idx;		/* next old bucket to move */
+	atomic_t					rehashing;		/* someone is moving buckets */
+	atomic_t					nr_entries;
+	size_t						(*hashfn)(void *k);
+	ssize_t						(*eqfn)(void *k1, void *k2);
+};
+
+struct chashtable *create_chashtable(size_t minsize, size_t (*hashfn)(void*),
+                                     ssize_t (*eqfn)(void*, void*));
+void chashtable_destroy(struct chashtable *h);
+int chashtable_insert(struct chashtable *h, void *k, void *v);
+void *chashtable_search(struct chashtable *h, void *k);
+void *chashtable_search_get(struct chashtable *h, void *k,
+                            bool (*get)(void *v));
+void *chashtable_remove(struct chashtable *h, void *k);
+void *chashtable_remove_if(struct chashtable *h, void *k,
+                           bool (*pred)(void *v));
+void chash_for_each(struct chashtable *h, void func(void*));
+
+static inline size_t chashtable_count(struct chashtable *h)
+{
+	return atomic_read(&h->nr_entries);
+}
+
+#endif /* ROS_KERN_CHASHTABLE_H */
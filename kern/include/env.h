@@ -65,6 +65,7 @@ struct proc {
 	physaddr_t env_cr3;			// Physical address of page dir
 	spinlock_t mm_lock;		/* Protects page tables and VMRs (mem mgmt) */
 	struct vmr_tailq vm_regions;
+	struct vm_region *vmr_root;	/* AVL tree of the vm_regions */
 
 	// Per process info and data pages
  	procinfo_t *SAFE procinfo;       // KVA of per-process shared info table (RO)
@@ -10,34 +10,30 @@
 
 #include <ros/common.h>
 
-#define NUM_KMALLOC_CACHES 13
+/* kmalloc's size classes.  Small sizes step by KMALLOC_ALIGNMENT, up to
+ * KMALLOC_SMALL_MAX.  After that, there are KMALLOC_STEPS_PER_POW2 classes
+ * between powers of two (steps of 25%), up to KMALLOC_LARGEST.  Anything larger
+ * gets its own block of pages.  Buffers have no header; kfree() finds their
+ * cache (or size) from their struct page. */
 #define KMALLOC_ALIGNMENT 16
-#define KMALLOC_SMALLEST 32
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
-#define KMALLOC_OFFSET ROUNDUP(sizeof(struct kmalloc_tag), KMALLOC_ALIGNMENT)
+#define KMALLOC_SMALL_MAX 128
+#define KMALLOC_NR_SMALL (KMALLOC_SMALL_MAX / KMALLOC_ALIGNMENT)
+#define KMALLOC_STEPS_PER_POW2 4
+#define KMALLOC_LARGEST (128 * 1024)
+/* 8 small classes, then 4 classes for each power of two from 2^8 to 2^17 */
+#define NUM_KMALLOC_CACHES (KMALLOC_NR_SMALL + 10 * KMALLOC_STEPS_PER_POW2)
 
 void kmalloc_init(void);
 void* (DALLOC(size) kmalloc)(size_t size, int flags);
 void* (DALLOC(size) kzmalloc)(size_t size, int flags);
 void* (DALLOC(size) krealloc)(void* buf, size_t size, int flags);
 void  (DFREE(addr) kfree)(void *addr);
+void  (DFREE(addr) kfree_sized)(void *addr, size_t size);
+size_t ksize(void *addr);
 
 /* Flags */
-#define KMALLOC_TAG_CACHE 1
-#define KMALLOC_TAG_PAGES 2
 /* Not implemented yet. Block until it is available. */
 #define KMALLOC_WAIT	4
 
-#define KMALLOC_CANARY 0xdeadbabe
-
-struct kmalloc_tag {
-	int flags;
-	uint32_t canary;
-	union {
-		struct kmem_cache *my_cache WHEN(flags == KMALLOC_TAG_CACHE);
-		size_t num_pages WHEN(flags == KMALLOC_TAG_PAGES);
-	};
-};
-
 #endif //ROS_KERN_KMALLOC_H
 
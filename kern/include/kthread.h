@@ -15,6 +15,7 @@
 #include <atomic.h>
 
 struct proc;
+struct block_device;
 struct kthread;
 struct semaphore;
 struct semaphore_entry;
@@ -30,10 +31,30 @@ struct kthread {
 	uintptr_t					stacktop;
 	struct proc					*proc;
 	struct syscall				*sysc;
+	struct block_device			*plugged_bdev;	/* see bdev_plug() */
+	unsigned int				plug_depth;
 	TAILQ_ENTRY(kthread)		link;
 	/* ID, other shit, etc */
 };
 
+/* Each core keeps a pool of kthreads, each with its own stack, for blocking
+ * and restarting, so sem_down() doesn't need the allocators in steady state.
+ * When a core runs out, it refills to KTHREAD_POOL_LOW in one go.  Cores that
+ * restart more kthreads than they block free down to KTHREAD_POOL_HIGH.  Only
+ * touch a pool from its core, with irqs disabled. */
+#define KTHREAD_POOL_LOW			4
+#define KTHREAD_POOL_HIGH			16
+
+struct kthread_pool {
+	struct kthread_tailq		kthreads;
+	unsigned int				nr_kthreads;
+	/* Stats */
+	uint64_t					nr_blocks;		/* sem_downs that slept */
+	uint64_t					nr_restarts;
+	uint64_t					nr_misses;		/* found the pool empty */
+	uint64_t					nr_frees;		/* freed for being over HIGH */
+};
+
 /* Semaphore for kthreads to sleep on.  0 or less means you need to sleep */
 struct semaphore {
 	struct kthread_tailq		waiters;
@@ -57,6 +78,8 @@ struct semaphore_entry {
 };
 
 void kthread_init(void);
+void kthread_pool_init(struct kthread_pool *pool);
+void print_kthread_stats(void);
 void restart_kthread(struct kthread *kthread);
 void kthread_runnable(struct kthread *kthread);
 void kthread_yield(void);
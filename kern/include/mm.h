@@ -29,9 +29,19 @@ struct mm {
  * don't refcnt these.  Either they are in the TAILQ/tree, or they should be
  * freed.  There should be no other references floating around.  We still need
  * to sort out how we share memory and how we'll do private memory with these
- * VMRs. */
+ * VMRs.
+ *
+ * VMRs are on both a sorted TAILQ (for walking neighbors) and an AVL tree keyed
+ * on vm_base (for lookups).  Each tree node also tracks the free VA after it
+ * (up to the next VMR) and the largest such gap in its subtree, so we can find
+ * room for a new VMR without walking the list. */
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
+	struct vm_region			*vm_left;
+	struct vm_region			*vm_right;
+	int							vm_height;
+	size_t						vm_gap;		/* free VA after this vmr */
+	size_t						vm_max_gap;	/* largest vm_gap in subtree */
 	struct proc					*vm_proc;	/* owning process, for now */
 	//struct mm 					*vm_mm;		/* owning address space */
 	uintptr_t					vm_base;
@@ -61,6 +71,7 @@ void isolate_vmrs(struct proc *p, uintptr_t va, size_t len);
 void destroy_vmrs(struct proc *p);
 int duplicate_vmrs(struct proc *p, struct proc *new_p);
 void print_vmrs(struct proc *p);
+unsigned long nr_pages(unsigned long nr_bytes);
 
 /* mmap() related functions.  These manipulate VMRs and change the hardware page
  * tables.  Any requests below the LOWEST_VA will silently be upped.  This may
@@ -73,6 +84,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
 int munmap(struct proc *p, uintptr_t addr, size_t len);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
+int kernel_cow_fault(struct proc *p, uintptr_t va);
 
 /* These assume the mm_lock is held already */
 void *__do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
@@ -81,6 +93,29 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len);
 int __handle_page_fault(struct proc* p, uintptr_t va, int prot);
 
+/* Collects the user VAs whose PTEs an mm operation changed, so we can shoot
+ * them down once, after all of the PTEs are changed.  We track the one range
+ * that covers them all; __tlbshootdown() decides how to flush it. */
+struct tlb_batch {
+	uintptr_t					start;
+	uintptr_t					end;
+};
+
+static inline void tlb_batch_init(struct tlb_batch *batch)
+{
+	batch->start = (uintptr_t)-1;
+	batch->end = 0;
+}
+
+static inline void tlb_batch_add(struct tlb_batch *batch, uintptr_t va,
+                                 size_t len)
+{
+	batch->start = MIN(batch->start, va);
+	batch->end = MAX(batch->end, va + len);
+}
+
+void tlb_batch_flush(struct proc *p, struct tlb_batch *batch);
+
 /* Kernel Dynamic Memory Mappings */
 /* These two are just about reserving VA space */
 uintptr_t get_vmap_segment(unsigned long num_pages);
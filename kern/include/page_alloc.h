@@ -32,6 +32,18 @@ typedef LIST_ENTRY(page) page_list_entry_t;
 #define PG_UPTODATE		0x002	/* page map, filled with file data */
 #define PG_DIRTY		0x004	/* page map, data is dirty */
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
+/* Page allocator state, only meaningful while the page is free */
+#define PG_BUDDY		0x010	/* head of a free block of 2^pg_order pages */
+/* Kernel heap state, only meaningful while the page is allocated */
+#define PG_SLAB			0x020	/* backs a slab, pg_private is its kmem_cache */
+#define PG_KMALLOC		0x040	/* head of a kmalloc'd block of 2^pg_order pgs */
+
+/* Largest block the buddy allocator tracks: 2^10 pages (4MB) */
+#define BUDDY_MAX_ORDER	10
+
+/* NUMA nodes, each with its own free lists */
+#define MAX_NUMA_NODES		8
+#define MAX_NUMA_MEM_RANGES	32
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -42,21 +54,38 @@ struct page {
 	LIST_ENTRY(page)			pg_link;	/* membership in various lists */
 	struct kref					pg_kref;
 	unsigned int				pg_flags;
+	unsigned int				pg_order;	/* if PG_BUDDY or PG_KMALLOC */
 	struct page_map				*pg_mapping;
 	unsigned long				pg_index;
 	void						*pg_private;	/* type depends on page usage */
 	struct semaphore 			pg_sem;		/* for blocking on IO */
+	TAILQ_ENTRY(page)			pg_lru;		/* page cache LRU, see reclaim.c */
+	uint8_t						pg_lru_list;	/* which one, under the LRU lock */
+	uint8_t						pg_refs;	/* page cache hits since last scan */
 };
+TAILQ_HEAD(page_tailq, page);
 
 /******** Externally visible global variables ************/
 extern uint8_t* global_cache_colors_map;
 extern spinlock_t colored_page_free_list_lock;
+/* num_colors lists for each NUMA node, node 0's first */
 extern page_list_t LCKD(&colored_page_free_list_lock) * RO CT(llc_num_colors)
     colored_page_free_list;
+/* Free blocks of 2^order pages, for order >= 1, per node.  Single free pages
+ * (order 0) are on the colored_page_free_list. */
+extern page_list_t LCKD(&colored_page_free_list_lock)
+    buddy_free_lists[MAX_NUMA_NODES][BUDDY_MAX_ORDER + 1];
+extern int nr_numa_nodes;
 
 /*************** Functional Interface *******************/
 void page_alloc_init(struct multiboot_info *mbi);
 void colored_page_alloc_init(void);
+void buddy_free_page(struct page *page);
+void numa_add_mem_range(physaddr_t base, physaddr_t len, int node);
+void numa_set_core_node(uint32_t coreid, int node);
+int core2node(uint32_t coreid);
+int ppn2node(size_t ppn);
+void print_numa_info(void);
 
 error_t upage_alloc(struct proc* p, page_t *SAFE *page, int zero);
 error_t kpage_alloc(page_t *SAFE *page);
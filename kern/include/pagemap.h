@@ -12,12 +12,15 @@
 
 #include <radix.h>
 #include <atomic.h>
+#include <kref.h>
+#include <sys/queue.h>
 
 /* Need to be careful, due to some ghetto circular references */
 struct page;
 struct inode;
 struct block_device;
 struct page_map_operations;
+struct page_lru;
 
 /* Every object that has pages, like an inode or the swap (or even direct block
  * devices) has a page_map, tracking which of its pages are currently in memory.
@@ -28,21 +31,37 @@ struct page_map {
 		struct block_device			*pm_bdev;	/* bdev of the owner, if any */
 	};
 	struct radix_tree			pm_tree;		/* tracks present pages */
-	spinlock_t					pm_tree_lock;	/* spinlock => we can't block */
+	spinlock_t					pm_tree_lock;	/* irqsave, IO completions use it */
 	unsigned long				pm_num_pages;	/* how many pages are present */
 	struct page_map_operations	*pm_op;
 	unsigned int				pm_flags;
+	struct page_lru				*pm_lru;		/* see reclaim.h */
+	/* Writeback, see writeback.c.  The host's kref, if set, is held while we
+	 * are on the dirty list. */
+	struct kref					*pm_host_kref;
+	uint64_t					pm_dirtied_at;	/* TSC, when we got on the list */
+	int							pm_wb_error;	/* until fsync reports it */
+	TAILQ_ENTRY(page_map)		pm_dirty_link;
 	/*... and private lists, backing block dev info, other mappings, etc. */
 };
+TAILQ_HEAD(page_map_tailq, page_map);
+
+/* pm_flags */
+#define PM_DIRTY_LISTED			0x001	/* on the dirty list, writeback.c */
+
+/* Tags in pm_tree.  Pages are tagged dirty until writeback starts on them, and
+ * tagged writeback until the write finishes. */
+#define PM_TAG_DIRTY			0
+#define PM_TAG_WRITEBACK		1
 
 /* Operations performed on a page_map.  These are usually FS specific, which
  * get assigned when the inode is created.
  * Will fill these in as they are created/needed/used. */
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
-/*	readpages: read a list of pages
-	writepage: write from a page to its backing store
-	writepages: write a list of pages
+	int (*readpages) (struct page_map *, struct page **, unsigned int);
+	int (*writepages) (struct page_map *, struct page **, unsigned int);
+/*	writepage: write from a page to its backing store
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
@@ -53,11 +72,40 @@ struct page_map_operations {
 	direct_io: bypass the page cache */
 };
 
+/* readpages() is optional, and is how we read ahead.  It gets pages that are
+ * already in the page map and locked, plus a reference to each, and it starts
+ * reading them in without waiting.  As each page finishes, it must be marked
+ * PG_UPTODATE (unless the IO failed), unlocked, and decref'd.  If it returns
+ * an error, it did none of that, and the caller cleans up.
+ *
+ * writepages() is optional too, and pms without it are never written back.  It
+ * gets pages that are contiguous, locked, and tagged writeback, plus a ref to
+ * each, and starts writing them without waiting.  As each page finishes, call
+ * pm_end_page_writeback().  If it returns an error, it did none of that. */
+
+/* Readahead state, one per open file.  Sequential reads get a window of pages
+ * read in ahead of them, which doubles every time the reader gets to the mark,
+ * up to RA_MAX_PAGES.  Any other access collapses the window. */
+#define RA_MIN_PAGES			4
+#define RA_MAX_PAGES			32
+
+struct file_ra_state {
+	unsigned long				start;			/* first page of the last window */
+	unsigned long				size;			/* 0 when we aren't streaming */
+	unsigned long				mark;			/* starts the next window */
+	unsigned long				prev_idx;		/* last page read */
+};
+
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 struct page *pm_find_page(struct page_map *pm, unsigned long index);
 int pm_insert_page(struct page_map *pm, unsigned long index, struct page *page);
 int pm_remove_page(struct page_map *pm, struct page *page);
+void pm_destroy(struct page_map *pm);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
+void file_ra_state_init(struct file_ra_state *ra);
+void pm_readahead(struct page_map *pm, struct file_ra_state *ra,
+                  unsigned long index, unsigned long nr_pages);
+void print_pm_stats(void);
 
 #endif /* ROS_KERN_PAGEMAP_H */
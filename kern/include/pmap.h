@@ -80,7 +80,7 @@ void *boot_zalloc(size_t amt, size_t align);
 
 void page_check(void);
 int	 page_insert(pde_t *pgdir, struct page *page, void *SNT va, int perm);
-void page_remove(pde_t *COUNT(NPDENTRIES) pgdir, void *SNT va);
+int	 page_remove(pde_t *COUNT(NPDENTRIES) pgdir, void *SNT va);
 page_t*COUNT(1) page_lookup(pde_t SSOMELOCK*COUNT(NPDENTRIES) pgdir, void *SNT va, pte_t **pte_store);
 error_t	pagetable_remove(pde_t *COUNT(NPDENTRIES) pgdir, void *SNT va);
 void	page_decref(page_t *COUNT(1) pp);
@@ -90,9 +90,13 @@ void tlb_flush_global(void);
 bool regions_collide_unsafe(uintptr_t start1, uintptr_t end1, 
                             uintptr_t start2, uintptr_t end2);
 
+void jumbo_decref(pte_t pte);
+
 /* Arch specific implementations for these */
 pte_t *pgdir_walk(pde_t *COUNT(NPDENTRIES) pgdir, const void *SNT va, int create);
 int get_va_perms(pde_t *COUNT(NPDENTRIES) pgdir, const void *SNT va);
+int pgdir_map_jumbo(pde_t *pgdir, void *va, struct page *page, int perm);
+int pgdir_split_jumbo(pde_t *pgdir, void *va);
 
 static inline page_t *SAFE ppn2page(size_t ppn)
 {
@@ -143,4 +147,27 @@ static inline ppn_t kva2ppn(void* addr)
 	return page2ppn(kva2page(addr));
 }
 
+/* The kernel can break CoW on a user PTE without the mm_lock (see
+ * kernel_cow_fault()), so anyone changing a present user PTE, even with the
+ * mm_lock, uses these. */
+static inline bool pte_cas(pte_t *pte, pte_t old_pte, pte_t new_pte)
+{
+	return atomic_cas((atomic_t*)pte, old_pte, new_pte);
+}
+
+static inline pte_t pte_swap(pte_t *pte, pte_t new_pte)
+{
+	return atomic_swap((atomic_t*)pte, new_pte);
+}
+
+/* Returns the KVA of the little page va is in, given the PTE from a walk for
+ * va.  This works for jumbo PTEs too, unlike PTE_ADDR. */
+static inline void *pte2kva(pte_t pte, const void *va)
+{
+	if (PAGE_JUMBO(pte))
+		return KADDR(PTE_ADDR(pte) +
+		             ROUNDDOWN((uintptr_t)va & (JPGSIZE - 1), PGSIZE));
+	return KADDR(PTE_ADDR(pte));
+}
+
 #endif /* !ROS_KERN_PMAP_H */
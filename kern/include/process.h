@@ -52,9 +52,9 @@
 
 #include <env.h>
 
-/* Can use a htable iterator to iterate through all active procs */
-extern struct hashtable *pid_hash;
-extern spinlock_t pid_hash_lock;
+/* Protects the pid table.  Use pid_for_each() to walk all active procs. */
+extern spinlock_t pid_table_lock;
+void pid_for_each(void (*func)(struct proc *p));
 
 /* Initialization */
 void proc_init(void);
@@ -127,7 +127,10 @@ struct proc *switch_to(struct proc *new_p);
 void switch_back(struct proc *new_p, struct proc *old_proc);
 void abandon_core(void);
 void clear_owning_proc(uint32_t coreid);
+/* Shootdowns of more pages than this flush the whole TLB */
+#define TLB_SHOOTDOWN_MAX_INVLPG 32
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end);
+void print_tlb_stats(void);
 
 /* Kernel message handlers for process management */
 void __startcore(uint32_t srcid, long a0, long a1, long a2);
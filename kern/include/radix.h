@@ -12,20 +12,23 @@
  * There are some utility functions, probably unimplemented til we need them,
  * that will make the tree have enough memory for future calls.
  *
- * You can also store a tag along with the void* for a given item, and do
- * lookups based on those tags.  Or you will be able to, once it is
- * implemented. */
+ * You can also store tags along with the void* for a given item, and do
+ * lookups based on those tags.  A node has a bitmap per tag: in a leaf, the bit
+ * says the item is tagged, and in an interior node, it says something under
+ * that child is tagged.  That way, lookups skip untagged parts of the tree. */
 
 #ifndef ROS_KERN_RADIX_H
 #define ROS_KERN_RADIX_H
 
 #define LOG_RNODE_SLOTS 6
-#define NR_RNODE_SLOTS (1 << LOG_RNODE_SLOTS)
+#define NR_RNODE_SLOTS (1 << LOG_RNODE_SLOTS)	/* at most 64, for the tags */
+#define RADIX_NR_TAGS 2
 
 #include <ros/common.h>
 
 struct radix_node {
 	void						*items[NR_RNODE_SLOTS];
+	uint64_t					tags[RADIX_NR_TAGS];
 	unsigned int				num_items;
 	bool						leaf;
 	struct radix_node			*parent;
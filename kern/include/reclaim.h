@@ -0,0 +1,80 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Page cache reclaim.  Page cache pages are on an active or an inactive LRU
+ * list.  New pages start out inactive, and pages that get hit again while they
+ * are inactive move to the active list, so one pass over a big file can't push
+ * out the pages people keep using.  Reclaim evicts from the head of the
+ * inactive list, and refills it from the active list to keep the two about the
+ * same size.
+ *
+ * A pm's pages are on its pm_lru, which is the system's page_lru unless the pm
+ * has its own (like the tests do).
+ *
+ * We also remember a few thousand recently evicted pages.  Loading one of them
+ * again is a refault: the inactive list was too short to hold it, so the page
+ * goes straight to the active list.
+ *
+ * When the page allocator runs low, it wakes up the reclaimer, which frees
+ * pages until we are back above the high watermark. */
+
+#ifndef ROS_KERN_RECLAIM_H
+#define ROS_KERN_RECLAIM_H
+
+#include <ros/common.h>
+#include <pagemap.h>
+#include <page_alloc.h>
+
+/* pg_lru_list */
+#define PG_LRU_NONE				0
+#define PG_LRU_INACTIVE			1
+#define PG_LRU_ACTIVE			2
+
+#define RECLAIM_BATCH			32			/* pages freed per lock hold */
+#define RECLAIM_NR_SHADOWS		4096		/* evicted pages we remember */
+#define RECLAIM_BACKOFF_USEC	100000		/* when there's nothing to evict */
+/* Watermarks, in fractions of RAM */
+#define RECLAIM_LOW_SHIFT		6
+#define RECLAIM_HIGH_SHIFT		5
+
+/* Under the LRU's lock */
+struct reclaim_stats {
+	uint64_t					nr_scanned;
+	uint64_t					nr_evicted;
+	uint64_t					nr_refaults;
+	uint64_t					nr_activated;
+	uint64_t					nr_deactivated;
+	uint64_t					nr_rotated;		/* dirty, waiting on writeback */
+};
+
+struct page_lru {
+	struct page_tailq			inactive;
+	struct page_tailq			active;
+	unsigned long				nr_inactive;
+	unsigned long				nr_active;
+	spinlock_t					lock;			/* irqsave */
+	struct reclaim_stats		stats;
+	/* Keys of recently evicted pages, 0 for none.  Racy, like any hint. */
+	unsigned long				shadows[RECLAIM_NR_SHADOWS];
+};
+
+extern struct page_lru page_lru;
+extern size_t reclaim_low_pages;
+
+void reclaim_init(void);
+void page_lru_init(struct page_lru *lru);
+void pm_lru_add(struct page_map *pm, struct page *page);
+void pm_lru_del(struct page_map *pm, struct page *page);
+unsigned long page_lru_shrink(struct page_lru *lru, unsigned long nr_to_free);
+unsigned long pm_shrink(unsigned long nr_to_free);
+void reclaim_wakeup(void);
+void print_reclaim_stats(void);
+
+/* Notes a hit on a page cache page.  This is racy, but it is only a hint. */
+static inline void pm_mark_accessed(struct page *page)
+{
+	if (page->pg_refs < 2)
+		page->pg_refs++;
+}
+
+#endif /* ROS_KERN_RECLAIM_H */
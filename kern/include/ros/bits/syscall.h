@@ -84,6 +84,8 @@
 #define SYS_mkdir				118
 #define SYS_rmdir				119
 #define SYS_pipe				120
+#define SYS_fsync				121
+#define SYS_fdatasync			122
 
 /* Misc syscalls */
 #define SYS_gettimeofday		140
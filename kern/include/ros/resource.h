@@ -17,6 +17,15 @@
 #define RES_APPLE_PIES		 2
 #define MAX_NUM_RESOURCES    3
 
+/* Not a resource: sys_provision() of this sets how the ksched places the
+ * target's cores, and the value is one of the CORE_PLACE_ policies. */
+#define PROV_CORE_PLACEMENT	0x100
+
+/* Core placement policies */
+#define CORE_PLACE_PACK		0	/* share sockets and LLCs, avoid SMT siblings */
+#define CORE_PLACE_PACK_SMT	1	/* same, but use SMT siblings first */
+#define CORE_PLACE_SPREAD	2	/* use different LLCs and sockets */
+
 /* Flags */
 #define REQ_ASYNC			0x01 // Sync by default (?)
 #define REQ_SOFT			0x02 // just making something up
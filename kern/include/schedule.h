@@ -23,6 +23,7 @@ struct sched_pcore {
 	TAILQ_ENTRY(sched_pcore)	alloc_next;			/* on an alloc list (idle)*/
 	struct proc					*prov_proc;			/* who this is prov to */
 	struct proc					*alloc_proc;		/* who this is alloc to */
+	bool						idle;				/* in an idle pool */
 };
 TAILQ_HEAD(sched_pcore_tailq, sched_pcore);
 
@@ -32,6 +33,7 @@ struct sched_proc_data {
 	struct proc_list 			*cur_list;			/* which tailq we're on */
 	struct sched_pcore_tailq	prov_alloc_me;		/* prov cores alloced us */
 	struct sched_pcore_tailq	prov_not_alloc_me;	/* maybe alloc to others */
+	int							core_placement;		/* CORE_PLACE_ policy */
 	/* count of lists? */
 	/* other accounting info */
 };
@@ -87,6 +89,7 @@ uint32_t max_vcores(struct proc *p);
  * this from generic kernel code, since it might not be present in all kernel
  * schedulers. */
 int provision_core(struct proc *p, uint32_t pcoreid);
+int sched_set_core_placement(struct proc *p, int policy);
 
 /************** Debugging **************/
 void sched_diag(void);
@@ -12,7 +12,9 @@
  *
  * For large objects, the kmem_slabs point to bufctls, which have the address
  * of their large buffers.  These slabs can consist of more than one contiguous
- * page.
+ * page.  Allocated buffers are found from their address with a per-cache hash
+ * table of bufctls, so the buffers themselves are packed and aligned, with no
+ * bookkeeping in them.
  *
  * For small objects, the slabs do not use the bufctls.  Instead, they point to
  * the next free object in the slab.  The free objects themselves hold the
@@ -24,6 +26,14 @@
  * overwrite things, so we need to add an extra 4-8 bytes per object for the
  * pointer, and then pass over that data when we return the actual object's
  * address.  This also might fuck with alignment.
+ *
+ * In front of the slab layer sits a magazine layer, based on the 2001 Bonwick
+ * and Adams paper (Magazines and Vmem).  Each core has two magazines (loaded and
+ * prev) of constructed objects per cache, and the common alloc/free path only
+ * touches those, with irqs disabled instead of a lock.  When both of a core's
+ * magazines are empty (or full), it trades with the cache's depot, which has a
+ * lock.  Only when the depot can't help do we go to the slab layer and its
+ * cache_lock.
  */
 
 #ifndef ROS_KERN_SLAB_H
@@ -67,6 +77,47 @@ struct kmem_slab {
 };
 TAILQ_HEAD(kmem_slab_list, kmem_slab);
 
+/* Large-object caches track their allocated bufctls in a hash table, keyed by
+ * buffer address.  It starts at a page worth of buckets, and doubles when the
+ * average chain length goes over KMC_HASH_MAX_LOAD. */
+#define KMC_HASH_INIT_SZ (PGSIZE / sizeof(struct kmem_bufctl_list))
+#define KMC_HASH_MAX_LOAD 2
+
+/* Magazines are arrays of object pointers ('rounds').  We size them so a
+ * magazine is two cache lines. */
+#define KMC_MAG_SZ 14
+
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine) link;
+	size_t nr_rounds;
+	void *rounds[KMC_MAG_SZ];
+};
+SLIST_HEAD(kmem_mag_list, kmem_magazine);
+
+/* Per-core front end of a cache.  Only touched by its core, with irqs off.  The
+ * stats are kept here so we don't share cache lines. */
+struct kmem_pcpu_cache {
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *prev;
+	unsigned long nr_allocs;
+	unsigned long nr_mag_hits;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* Magazines that aren't loaded on a core sit in the depot, either full or
+ * empty.  Partially full magazines are never in the depot. */
+struct kmem_depot {
+	spinlock_t lock;
+	struct kmem_mag_list full_mags;
+	struct kmem_mag_list empty_mags;
+	size_t nr_full;
+	size_t nr_empty;
+	unsigned long nr_refills;
+};
+
+/* Cache flags */
+#define KMC_NOMAG 0x001		/* no magazine layer, always use the slabs */
+#define KMC_TYPESAFE 0x002	/* never give the memory back to the system */
+
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
@@ -81,6 +132,15 @@ struct kmem_cache {
 	void (*ctor)(void *, size_t);
 	void (*dtor)(void *, size_t);
 	unsigned long nr_cur_alloc;
+	unsigned long nr_slab_grows;
+	/* buf -> bufctl hash, for large-object caches.  Allocated on first grow */
+	struct kmem_bufctl_list *alloc_hash;
+	size_t nr_hash_buckets;
+	size_t nr_hash_items;
+	unsigned int hash_shift;
+	/* Magazine layer.  pcpu_caches is 0 until kmem_cache_init_pcpu() */
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depot;
 };
 
 /* List of all kmem_caches, sorted in order of size */
@@ -98,6 +158,7 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
+void kmem_cache_init_pcpu(void);
 void kmem_cache_reap(struct kmem_cache *cp);
 
 /* Debug */
@@ -38,10 +38,13 @@ struct per_cpu_info {
 	uint32_t __ctx_depth;		/* don't access directly.  see trap.h. */
 	int __lock_checking_enabled;/* == 1, enables spinlock depth checking */
 	struct syscall *cur_sysc;	/* ptr is into cur_proc's address space */
-	struct kthread *spare;		/* useful when restarting */
+	struct kthread_pool kthread_pool;	/* stacks for blocking/restarting */
 	struct timer_chain tchain;	/* for the per-core alarm */
 	unsigned int lock_depth;
 	struct trace_ring traces;
+	/* This context's block device plug, see bdev_plug() */
+	struct block_device *plugged_bdev;
+	unsigned int plug_depth;
 
 #ifdef __SHARC__
 	// held spin-locks. this will have to go elsewhere if multiple kernel
@@ -55,10 +58,22 @@ struct per_cpu_info {
 	segdesc_t *gdt;
 #endif
 	/* KMSGs */
+	struct kmsg_bcq *immed_amsg_ring;
+	struct kmsg_bcq *routine_amsg_ring;
 	spinlock_t immed_amsg_lock;
 	struct kernel_msg_list NTPTV(a0t) NTPTV(a1t) NTPTV(a2t) immed_amsgs;
 	spinlock_t routine_amsg_lock;
 	struct kernel_msg_list NTPTV(a0t) NTPTV(a1t) NTPTV(a2t) routine_amsgs;
+	/* TLB shootdown stats */
+	uint64_t nr_tlb_ipis;			/* shootdowns this core sent */
+	uint64_t nr_tlb_invlpgs;		/* pages this core flushed one at a time */
+	uint64_t nr_tlb_flushes;		/* full flushes this core did for them */
+	/* Page cache stats */
+	uint64_t nr_pm_hits;			/* loads that found the page up to date */
+	uint64_t nr_pm_waits;			/* found it, but waited for its IO */
+	uint64_t nr_pm_misses;			/* read it in synchronously */
+	uint64_t nr_ra_windows;			/* readahead windows started */
+	uint64_t nr_ra_pages;			/* pages read ahead */
 }__attribute__((aligned(ARCH_CL_SIZE)));
 
 /* Allows the kernel to figure out what process is running on this core.  Can be
@@ -28,12 +28,21 @@ void test_kernel_messages(void);
 void test_slab(void);
 void test_kmalloc(void);
 void test_hashtable(void);
+void test_chashtable(void);
 void test_bcq(void);
 void test_ucq(void);
 void test_vm_regions(void);
 void test_radix_tree(void);
 void test_random_fs(void);
 void test_kthreads(void);
+void test_page_alloc_scaling(void);
+void test_kmsg_latency(void);
+void test_pid2proc(void);
+void test_alarm_wheel(void);
+void test_block_queue(void);
+void test_readahead(void);
+void test_writeback(void);
+void test_reclaim(void);
 
 void test_hello_world_handler(struct hw_trapframe *hw_tf, void *data);
 void test_print_info_handler(struct hw_trapframe *hw_tf, void *data);
@@ -0,0 +1,38 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * CPU topology: which socket, last level cache, and physical core each of our
+ * cores is on.  The arch fills in raw ids (anything unique will do), and we
+ * renumber them into dense ids, so callers can use them as array indexes. */
+
+#ifndef ROS_KERN_TOPOLOGY_H
+#define ROS_KERN_TOPOLOGY_H
+
+#include <ros/common.h>
+#include <arch/arch.h>
+
+struct core_topology {
+	int							socket;
+	int							llc;		/* last level cache */
+	int							phys_core;	/* SMT siblings share this */
+};
+
+extern struct core_topology cpu_topology[MAX_NUM_CPUS];
+extern int nr_sockets, nr_llcs, nr_phys_cores;
+
+void topology_init(void);
+/* Arch-specific: fills in cpu_topology with raw ids for each core */
+void arch_topology_init(void);
+void print_topology(void);
+
+static inline bool cores_share_llc(uint32_t a, uint32_t b)
+{
+	return cpu_topology[a].llc == cpu_topology[b].llc;
+}
+
+static inline bool cores_are_siblings(uint32_t a, uint32_t b)
+{
+	return cpu_topology[a].phys_core == cpu_topology[b].phys_core;
+}
+
+#endif /* ROS_KERN_TOPOLOGY_H */
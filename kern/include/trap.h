@@ -7,6 +7,7 @@
 #include <arch/arch.h>
 #include <arch/mmu.h>
 #include <sys/queue.h>
+#include <ros/bcq_struct.h>
 #include <arch/trap.h>
 
 // func ptr for interrupt service routines
@@ -84,12 +85,22 @@ struct kernel_message
 STAILQ_HEAD(kernel_msg_list, kernel_message);
 typedef struct kernel_message kernel_message_t;
 
+/* Each core has a ring for each type of message, which senders copy their
+ * messages into without locking or allocating.  If a ring fills up, senders
+ * fall back to the locked kernel_msg_list.  Must be a power of two. */
+#define KMSG_RING_SZ			64
+DEFINE_BCQ_TYPES(kmsg, struct kernel_message, KMSG_RING_SZ);
+
 void kernel_msg_init(void);
+struct kmsg_bcq *kmsg_ring_alloc(void);
 uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
                              long arg2, int type);
+int send_kernel_message_multi(uint8_t *cores, amr_t pc, long arg0, long arg1,
+                              long arg2, int type);
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data);
 void process_routine_kmsg(void);
 void print_kmsgs(uint32_t coreid);
+bool has_immed_kmsgs(uint32_t coreid);
 
 /* Kernel context depths.  IRQ depth is how many nested IRQ stacks/contexts we
  * are working on.  Kernel trap depth is how many nested kernel traps (not
@@ -16,6 +16,8 @@ static inline bool is_user_rwaddr(void *addr, size_t len);
 /* Can they use the area in the manner of perm? */
 void *user_mem_check(struct proc *p, const void *DANGEROUS va, size_t len,
                      size_t align, int perm);
+/* Copies CoW pages, so the kernel can write the area directly */
+int user_mem_break_cow(struct proc *p, const void *DANGEROUS va, size_t len);
 /* Kills them if they can't use the area in the manner of perm */
 void *user_mem_assert(struct proc *p, const void *DANGEROUS va, size_t len, 
                       size_t align, int perm);
@@ -20,7 +20,7 @@
 #include <kref.h>
 #include <time.h>
 #include <radix.h>
-#include <hashtable.h>
+#include <chashtable.h>
 #include <pagemap.h>
 #include <blockdev.h>
 
@@ -126,10 +126,9 @@ struct super_block {
 	struct file_tailq			s_files;		/* assigned files */
 	struct dentry_tailq			s_lru_d;		/* unused dentries (in dcache)*/
 	spinlock_t					s_lru_lock;
-	struct hashtable			*s_dcache;		/* dentry cache */
-	spinlock_t					s_dcache_lock;
-	struct hashtable			*s_icache;		/* inode cache */
-	spinlock_t					s_icache_lock;
+	struct chashtable			*s_dcache;		/* dentry cache */
+	spinlock_t					s_prune_lock;	/* dcache_prune() vs put */
+	struct chashtable			*s_icache;		/* inode cache */
 	struct block_device			*s_bdev;
 	TAILQ_ENTRY(super_block)	s_instances;	/* list of sbs of this fs type*/
 	char						s_name[32];
@@ -280,6 +279,7 @@ struct file {
 	spinlock_t					f_ep_lock;
 	void						*f_privdata;	/* tty/socket driver hook */
 	struct page_map				*f_mapping;		/* page cache mapping */
+	struct file_ra_state		f_ra;			/* readahead */
 
 	/* Ghetto appserver support */
 	int fd; // all it contains is an appserver fd (for pid 0, aka kernel)
@@ -0,0 +1,38 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Writeback of dirty page cache pages.  Dirty pages are tagged in their pm's
+ * radix tree, and pms with dirty pages sit on a dirty list, oldest first.
+ * Flusher kthreads wake up periodically (or when there is too much dirty
+ * memory) and write back pms whose pages have been dirty for too long, in
+ * clusters of contiguous pages.  Writers that get too far ahead of the
+ * flushers wait for them. */
+
+#ifndef ROS_KERN_WRITEBACK_H
+#define ROS_KERN_WRITEBACK_H
+
+#include <ros/common.h>
+#include <pagemap.h>
+#include <arch/mmu.h>
+
+#define WB_NR_FLUSHERS			2
+#define WB_PERIOD_USEC			1000000		/* flushers wake up this often */
+#define WB_EXPIRE_USEC			5000000		/* max time a pm stays dirty */
+#define WB_MAX_CLUSTER			32			/* pages per writepages() */
+/* Percent of RAM that can be dirty before the flushers write back everything,
+ * and before writers have to wait */
+#define WB_BACKGROUND_RATIO		10
+#define WB_DIRTY_RATIO			20
+
+void writeback_init(void);
+void pm_dirty_page(struct page_map *pm, struct page *page);
+void pm_dirty_mapped_page(struct page *page, pte_t pte_val);
+int pm_writeback(struct page_map *pm, bool wait);
+int pm_wait_writeback(struct page_map *pm);
+void pm_end_page_writeback(struct page *page, bool error);
+void writeback_wake_throttled(void);
+void writeback_wakeup(void);
+void writeback_throttle(void);
+void print_writeback_stats(void);
+
+#endif /* ROS_KERN_WRITEBACK_H */
@@ -4,14 +4,15 @@
  *
  * Alarms.  This includes various ways to sleep for a while or defer work on a
  * specific timer.  These can be per-core, global or whatever.  Like with most
- * systems, you won't wake up til after the time you specify. (for now, this
- * might change).
+ * systems, you won't wake up til after the time you specify.
+ *
+ * Timer chains are hierarchical timing wheels (see alarm.h), so setting and
+ * unsetting are O(1), and an interrupt handles every alarm in the ticks that
+ * passed.  Alarms in the same tick are coalesced into one interrupt.
  *
  * TODO:
  * 	- have a kernel sense of time, instead of just the TSC or whatever timer the
- * 	chain uses...
- * 	- coalesce or otherwise deal with alarms that are close to cut down on
- * 	interrupt overhead. */
+ * 	chain uses... */
 
 #include <ros/common.h>
 #include <sys/queue.h>
@@ -20,28 +21,175 @@
 #include <stdio.h>
 #include <smp.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
-static void reset_tchain_times(struct timer_chain *tchain)
+/* Ticks are how the wheel measures time: TSC >> TCHAIN_TICK_SHIFT */
+static uint64_t time2tick(uint64_t time)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
-	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+	return time >> TCHAIN_TICK_SHIFT;
+}
+
+static uint64_t tick2time(uint64_t tick)
+{
+	return tick << TCHAIN_TICK_SHIFT;
+}
+
+/* Number of ticks covered by one slot at level */
+static uint64_t level_span(int level)
+{
+	return 1ULL << (level * TCHAIN_LEVEL_SHIFT);
+}
+
+/* Puts waiter in the slot for its tick, relative to tchain->base.  Waiters
+ * whose tick has passed go in the current tick's slot. */
+static void tchain_insert(struct timer_chain *tchain,
+                          struct alarm_waiter *waiter)
+{
+	uint64_t tick = MAX(time2tick(waiter->wake_up_time), tchain->base);
+	uint64_t delta = tick - tchain->base;
+	struct awaiters_tailq *list = &tchain->overflow;
+	int idx;
+
+	for (int i = 0; i < TCHAIN_NR_LEVELS; i++) {
+		if (delta < level_span(i + 1)) {
+			idx = (tick >> (i * TCHAIN_LEVEL_SHIFT)) & TCHAIN_SLOT_MASK;
+			list = &tchain->slots[i][idx];
+			tchain->occupied[i] |= 1ULL << idx;
+			break;
+		}
+	}
+	TAILQ_INSERT_TAIL(list, waiter, next);
+	waiter->list = list;
+}
+
+/* Takes waiter off whatever list it is on, keeping the bitmaps in sync.  It
+ * could be on one of our slots, the overflow list, or trigger_tchain()'s list
+ * of waiters about to go off. */
+static void tchain_remove(struct timer_chain *tchain,
+                          struct alarm_waiter *waiter)
+{
+	struct awaiters_tailq *list = waiter->list;
+	size_t slot_nr = list - &tchain->slots[0][0];
+
+	TAILQ_REMOVE(list, waiter, next);
+	waiter->list = 0;
+	if ((slot_nr < TCHAIN_NR_LEVELS * TCHAIN_NR_SLOTS) && TAILQ_EMPTY(list))
+		tchain->occupied[slot_nr / TCHAIN_NR_SLOTS] &=
+		        ~(1ULL << (slot_nr % TCHAIN_NR_SLOTS));
+}
+
+/* Moves everyone on list back into the wheel, relative to the current base */
+static void tchain_reinsert(struct timer_chain *tchain,
+                            struct awaiters_tailq *list)
+{
+	struct awaiters_tailq temp = TAILQ_HEAD_INITIALIZER(temp);
+	struct alarm_waiter *i;
+
+	TAILQ_CONCAT(&temp, list, next);
+	while ((i = TAILQ_FIRST(&temp))) {
+		TAILQ_REMOVE(&temp, i, next);
+		tchain_insert(tchain, i);
+	}
+}
+
+/* Moves base up to new_base, which must not skip over any work, and cascades
+ * the higher slots whose time has come.  Lower levels go first. */
+static void tchain_advance(struct timer_chain *tchain, uint64_t new_base)
+{
+	int idx;
+
+	tchain->base = new_base;
+	for (int i = 1; i < TCHAIN_NR_LEVELS; i++) {
+		if (new_base & (level_span(i) - 1))
+			return;
+		idx = (new_base >> (i * TCHAIN_LEVEL_SHIFT)) & TCHAIN_SLOT_MASK;
+		if (!(tchain->occupied[i] & (1ULL << idx)))
+			continue;
+		tchain->occupied[i] &= ~(1ULL << idx);
+		tchain_reinsert(tchain, &tchain->slots[i][idx]);
+	}
+	if (!(new_base & (level_span(TCHAIN_NR_LEVELS) - 1)))
+		tchain_reinsert(tchain, &tchain->overflow);
+}
+
+/* Returns the first slot at or after idx, going around the wheel, given the
+ * bitmap of occupied slots.  Returns how far that is from idx. */
+static int next_slot_dist(uint64_t occupied, int idx)
+{
+	uint64_t rotated;
+
+	assert(occupied);
+	rotated = (occupied >> idx) | (idx ? occupied << (TCHAIN_NR_SLOTS - idx)
+	                                   : 0);
+	return __builtin_ctzll(rotated);
+}
+
+/* Returns the next tick after base that level needs work done at, or 0 if it
+ * has nothing.  For level 0, that's a slot's tick, which goes off once the tick
+ * is over.  For the other levels, it's when the next slot gets cascaded.
+ * TCHAIN_NR_LEVELS is the overflow list, which gets a look every time the top
+ * level wraps around. */
+static uint64_t tchain_level_next(struct timer_chain *tchain, int level)
+{
+	int shift = level * TCHAIN_LEVEL_SHIFT;
+	uint64_t boundary = ((tchain->base >> shift) + 1) << shift;
+	int idx;
+
+	if (level == TCHAIN_NR_LEVELS)
+		return TAILQ_EMPTY(&tchain->overflow) ? 0 : boundary;
+	if (!tchain->occupied[level])
+		return 0;
+	idx = (boundary >> shift) & TCHAIN_SLOT_MASK;
+	return boundary + next_slot_dist(tchain->occupied[level], idx) *
+	                  level_span(level);
+}
+
+/* The earliest tick after base that needs work, or 0 if there is none */
+static uint64_t tchain_next_tick(struct timer_chain *tchain)
+{
+	uint64_t next = 0, cand;
+
+	for (int i = 0; i <= TCHAIN_NR_LEVELS; i++) {
+		cand = tchain_level_next(tchain, i);
+		if (cand && (!next || cand < next))
+			next = cand;
 	}
+	return next;
+}
+
+/* When the interrupt needs to go off: the end of the current tick if its slot
+ * has waiters, o/w the end of the next level 0 slot's tick or the start of the
+ * next cascade, whichever is sooner.  0 for never. */
+static uint64_t tchain_interrupt_time(struct timer_chain *tchain)
+{
+	uint64_t next, cand;
+
+	if (!tchain->nr_waiters)
+		return 0;
+	if (tchain->occupied[0] & (1ULL << (tchain->base & TCHAIN_SLOT_MASK)))
+		return tick2time(tchain->base + 1);
+	next = tchain_level_next(tchain, 0);
+	next = next ? tick2time(next + 1) : 0;
+	for (int i = 1; i <= TCHAIN_NR_LEVELS; i++) {
+		cand = tick2time(tchain_level_next(tchain, i));
+		if (cand && (!next || cand < next))
+			next = cand;
+	}
+	return next;
 }
 
 /* One time set up of a tchain, currently called in per_cpu_init() */
 void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt) (uint64_t, struct timer_chain *))
 {
-	TAILQ_INIT(&tchain->waiters);
+	for (int i = 0; i < TCHAIN_NR_LEVELS; i++) {
+		for (int j = 0; j < TCHAIN_NR_SLOTS; j++)
+			TAILQ_INIT(&tchain->slots[i][j]);
+		tchain->occupied[i] = 0;
+	}
+	TAILQ_INIT(&tchain->overflow);
+	tchain->base = time2tick(read_tsc());
+	tchain->nr_waiters = 0;
+	tchain->earliest_time = ALARM_POISON_TIME;
 	tchain->set_interrupt = set_interrupt;
-	reset_tchain_times(tchain);
 }
 
 /* Initializes a new awaiter.  Pass 0 for the function if you want it to be a
@@ -51,6 +199,7 @@ void init_awaiter(struct alarm_waiter *waiter,
 {
 	waiter->wake_up_time = ALARM_POISON_TIME;
 	waiter->func = func;
+	waiter->list = 0;
 	if (!func)
 		sem_init_irqsave(&waiter->sem, 0);
 }
@@ -88,17 +237,18 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
  * heavy lifting is in the timer-source specific function pointer. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
+	uint64_t time = tchain_interrupt_time(tchain);
+
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!time) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
+		tchain->earliest_time = ALARM_POISON_TIME;
 		tchain->set_interrupt(0, tchain);
 	} else {
-		/* Make sure it is on and set to the earliest time */
-		assert(tchain->earliest_time != ALARM_POISON_TIME);
-		/* TODO: check for times in the past or very close to now */
-		printd("Turning alarm on for %llu\n", tchain->earliest_time);
-		tchain->set_interrupt(tchain->earliest_time, tchain);
+		printd("Turning alarm on for %llu\n", time);
+		tchain->earliest_time = time;
+		tchain->set_interrupt(time, tchain);
 	}
 }
 
@@ -114,111 +264,86 @@ static void wake_awaiter(struct alarm_waiter *waiter)
 }
 
 /* This is called when an interrupt triggers a tchain, and needs to wake up
- * everyone whose time is up. */
+ * everyone whose time is up.  Every tick that has fully passed goes off as a
+ * batch.  We move base past a tick before running its waiters, so handlers
+ * that rearm land in the right slots. */
 void trigger_tchain(struct timer_chain *tchain)
 {
-	struct alarm_waiter *i, *temp;
-	uint64_t now = read_tsc();
-	bool changed_list = FALSE;
+	struct awaiters_tailq expired = TAILQ_HEAD_INITIALIZER(expired);
+	struct alarm_waiter *i;
+	uint64_t now_tick = time2tick(read_tsc());
+	uint64_t next;
+	int idx;
+
 	assert(!irq_is_enabled());
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
-		       i, i->wake_up_time, now);
-		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
-			changed_list = TRUE;
-			TAILQ_REMOVE(&tchain->waiters, i, next);
+	while (tchain->base < now_tick) {
+		idx = tchain->base & TCHAIN_SLOT_MASK;
+		if (tchain->occupied[0] & (1ULL << idx)) {
+			tchain->occupied[0] &= ~(1ULL << idx);
+			TAILQ_CONCAT(&expired, &tchain->slots[0][idx], next);
+		}
+		/* Skip the empty ticks, but don't go past now */
+		next = tchain_next_tick(tchain);
+		tchain_advance(tchain, next ? MIN(next, now_tick) : now_tick);
+		/* unset_alarm() needs to know these are on expired */
+		TAILQ_FOREACH(i, &expired, next)
+			i->list = &expired;
+		while ((i = TAILQ_FIRST(&expired))) {
+			printd("Waking %p, due at %llu\n", i, i->wake_up_time);
+			TAILQ_REMOVE(&expired, i, next);
+			i->list = 0;
+			tchain->nr_waiters--;
 			/* Don't touch the waiter after waking it, since it could be in use
 			 * on another core (and the waiter can be clobbered as the kthread
 			 * unwinds its stack).  Or it could be kfreed */
 			wake_awaiter(i);
-		} else {
-			break;
 		}
 	}
-	if (changed_list) {
-		reset_tchain_times(tchain);
-	}
 	/* Need to reset the interrupt no matter what */
 	reset_tchain_interrupt(tchain);
 }
 
 /* Sets the alarm.  If it is a kthread-style alarm (func == 0), sleep on it
  * later.  Hold the lock, if applicable.  If this is a per-core tchain, the
- * interrupt-disabling ought to suffice. */
+ * interrupt-disabling ought to suffice.  Setting an armed alarm moves it. */
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
 	int8_t irq_state = 0;
+	uint64_t time;
 
 	/* This will fail if you don't set a time */
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	disable_irqsave(&irq_state);
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		goto reset_out;
+	if (waiter->list) {
+		tchain_remove(tchain, waiter);
+		tchain->nr_waiters--;
 	}
-	/* If not, either we're first, last, or in the middle.  Reset the interrupt
-	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt later */
-		goto reset_out;
-	}
-	/* If there is a tie for last, the newer one will really go last.  We need
-	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		goto no_reset_out;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale well
-	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
-	 * will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			goto no_reset_out;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
-reset_out:
-	reset_tchain_interrupt(tchain);
-no_reset_out:
+	/* An empty wheel can skip ahead, so we don't cascade through idle time */
+	if (!tchain->nr_waiters)
+		tchain->base = MAX(tchain->base, time2tick(read_tsc()));
+	tchain_insert(tchain, waiter);
+	tchain->nr_waiters++;
+	/* Only touch the interrupt if we need it to go off sooner.  It's the end of
+	 * our tick, or sooner if we have to cascade first. */
+	time = tick2time(MAX(time2tick(waiter->wake_up_time), tchain->base) + 1);
+	if ((tchain->earliest_time == ALARM_POISON_TIME) ||
+	    (time < tchain->earliest_time))
+		reset_tchain_interrupt(tchain);
 	enable_irqsave(&irq_state);
-	/* TODO: could put some debug stuff here */
 }
 
-/* Removes waiter from the tchain before it goes off. 
- * TODO: handle waiters that already went off. */
+/* Removes waiter from the tchain before it goes off.  If it already went off
+ * (or was never set), this does nothing.  We don't bother turning off the
+ * interrupt; if it was for us, it'll go off and find nothing to do. */
 void unset_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
 	int8_t irq_state = 0;
 
 	disable_irqsave(&irq_state);
-	warn("Code currently assumes the alarm waiter hasn't triggered yet!");
-	/* Need to make sure earliest and latest are set, in case we're mucking with
-	 * the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-		reset_int = TRUE;		/* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
+	if (waiter->list) {
+		tchain_remove(tchain, waiter);
+		tchain->nr_waiters--;
 	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
-	if (reset_int)
-		reset_tchain_interrupt(tchain);
 	enable_irqsave(&irq_state);
 }
 
@@ -275,20 +400,31 @@ void set_pcpu_alarm_interrupt(uint64_t time, struct timer_chain *tchain)
 
 /* Debug helpers */
 
-/* Disable irqs before calling this, or otherwise protect yourself. */
-void print_chain(struct timer_chain *tchain)
+static void print_awaiters(struct awaiters_tailq *list, char *where)
 {
 	struct alarm_waiter *i;
-	printk("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
-	       tchain->earliest_time,
-	       tchain->latest_time);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
+
+	TAILQ_FOREACH(i, list, next) {
 		struct kthread *kthread = TAILQ_FIRST(&i->sem.waiters);
-		printk("\tWaiter %p, time: %llu, kthread: %p (%p)\n", i,
+		printk("\t%s: waiter %p, time: %llu, kthread: %p (%p)\n", where, i,
 		       i->wake_up_time, kthread, (kthread ? kthread->proc : 0));
+	}
+}
 
+/* Disable irqs before calling this, or otherwise protect yourself. */
+void print_chain(struct timer_chain *tchain)
+{
+	char where[16];
+
+	printk("Chain %p has %lu waiters, base tick: %llu, interrupt at: %llu\n",
+	       tchain, tchain->nr_waiters, tchain->base, tchain->earliest_time);
+	for (int i = 0; i < TCHAIN_NR_LEVELS; i++) {
+		for (int j = 0; j < TCHAIN_NR_SLOTS; j++) {
+			snprintf(where, sizeof(where), "L%d/%02d", i, j);
+			print_awaiters(&tchain->slots[i][j], where);
+		}
 	}
+	print_awaiters(&tchain->overflow, "overflow");
 }
 
 /* Prints all chains, rather verbosely */
@@ -20,11 +20,21 @@
 #include <smp.h>
 #include <arsc_server.h>
 #include <kref.h>
+#include <alarm.h>
 
 
 
-struct proc_list arsc_proc_list = TAILQ_HEAD_INITIALIZER(arsc_proc_list);
-spinlock_t arsc_proc_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+/* Each server core has its own list of procs.  A proc stays with the server
+ * it was given in sys_init_arsc(), so its ring is only touched by one core. */
+struct arsc_server {
+	spinlock_t lock;
+	struct proc_list procs;
+	int nr_procs;
+	uint32_t pcoreid;
+};
+
+static struct arsc_server arsc_servers[CONFIG_ARSC_SERVER_CORES];
+static int nr_arsc_servers;
 
 intreg_t inline syscall_async(struct proc *p, syscall_req_t *call)
 {
@@ -33,8 +43,34 @@ intreg_t inline syscall_async(struct proc *p, syscall_req_t *call)
 	               sc->arg2, sc->arg3, sc->arg4, sc->arg5);
 }
 
+/* Called by the ksched once it picked the server cores, before it starts them.
+ * Returns how many servers we want. */
+int arsc_init(void)
+{
+	nr_arsc_servers = CONFIG_ARSC_SERVER_CORES;
+	for (int i = 0; i < nr_arsc_servers; i++) {
+		spinlock_init_irqsave(&arsc_servers[i].lock);
+		TAILQ_INIT(&arsc_servers[i].procs);
+		arsc_servers[i].nr_procs = 0;
+	}
+	return nr_arsc_servers;
+}
+
+/* Picks the server with the fewest procs.  Racy, but it's just a hint. */
+static struct arsc_server *arsc_pick_server(void)
+{
+	struct arsc_server *srv = &arsc_servers[0];
+
+	for (int i = 1; i < nr_arsc_servers; i++) {
+		if (arsc_servers[i].nr_procs < srv->nr_procs)
+			srv = &arsc_servers[i];
+	}
+	return srv;
+}
+
 syscall_sring_t* sys_init_arsc(struct proc *p)
 {
+	struct arsc_server *srv;
 	kref_get(&p->p_kref, 1);		/* we're storing an external ref here */
 	syscall_sring_t* sring;
 	void * va;
@@ -54,32 +90,91 @@ syscall_sring_t* sys_init_arsc(struct proc *p)
 	               sring,
 	               SYSCALLRINGSIZE);
 
-	spin_lock_irqsave(&arsc_proc_lock);
-	TAILQ_INSERT_TAIL(&arsc_proc_list, p, proc_arsc_link);
-	spin_unlock_irqsave(&arsc_proc_lock);
+	srv = arsc_pick_server();
+	spin_lock_irqsave(&srv->lock);
+	TAILQ_INSERT_TAIL(&srv->procs, p, proc_arsc_link);
+	srv->nr_procs++;
+	spin_unlock_irqsave(&srv->lock);
 	return (syscall_sring_t*)va;
 }
 
+/* Sleeps the server for usec.  The core halts in smp_idle() in the meantime. */
+static void arsc_sleep(uint64_t usec)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	struct alarm_waiter a_waiter;
+
+	init_awaiter(&a_waiter, 0);
+	set_awaiter_rel(&a_waiter, usec);
+	set_alarm(tchain, &a_waiter);
+	sleep_on_awaiter(&a_waiter);
+}
+
+/* Makes one pass over srv's procs, returning how many syscalls we ran. */
+static size_t arsc_server_pass(struct arsc_server *srv)
+{
+	struct proc *p;
+	size_t count = 0;
+	int nr_procs = srv->nr_procs;
+
+	for (int i = 0; i < nr_procs; i++) {
+		/* We can't hold the lock while we run syscalls (they can block), so we
+		 * rotate the first proc to the back and hold a ref while we work. */
+		spin_lock_irqsave(&srv->lock);
+		p = TAILQ_FIRST(&srv->procs);
+		if (!p) {
+			spin_unlock_irqsave(&srv->lock);
+			break;
+		}
+		TAILQ_REMOVE(&srv->procs, p, proc_arsc_link);
+		TAILQ_INSERT_TAIL(&srv->procs, p, proc_arsc_link);
+		proc_incref(p, 1);
+		spin_unlock_irqsave(&srv->lock);
+		/* Probably want to try to process a dying process's syscalls.  If
+		 * not, just move it to an else case */
+		count += process_generic_syscalls(p, MAX_ASRC_BATCH);
+		if (p->state == PROC_DYING) {
+			spin_lock_irqsave(&srv->lock);
+			TAILQ_REMOVE(&srv->procs, p, proc_arsc_link);
+			srv->nr_procs--;
+			spin_unlock_irqsave(&srv->lock);
+			proc_decref(p);	/* the list's ref, from sys_init_arsc */
+		}
+		proc_decref(p);
+	}
+	return count;
+}
+
+/* Server loop, run as a routine kmsg on a dedicated core, with a0 as the index
+ * of the server.  We poll while there is work.  Once the rings have been empty
+ * for ARSC_POLL_ROUNDS passes, we sleep between passes, doubling the sleep up
+ * to ARSC_MAX_SLEEP_USEC, and go back to polling as soon as we find work.
+ *
+ * Completions go out through the normal syscall path, so a process that wants
+ * an event instead of spinning on SC_DONE sets SC_UEVENT and an ev_q (say, a
+ * UCQ) in the syscall before it posts it. */
 void arsc_server(uint32_t srcid, long a0, long a1, long a2)
 {
-	struct proc *p = NULL;
-	TAILQ_INIT(&arsc_proc_list);
+	struct arsc_server *srv = &arsc_servers[a0];
+	unsigned int empty_rounds = 0;
+	uint64_t sleep_usec = ARSC_MIN_SLEEP_USEC;
+
+	srv->pcoreid = core_id();
+	/* RKMs run with IRQs off; we need them for syscalls and our alarms */
+	enable_irq();
 	while (1) {
-		while (TAILQ_EMPTY(&arsc_proc_list))
+		if (arsc_server_pass(srv)) {
+			empty_rounds = 0;
+			sleep_usec = ARSC_MIN_SLEEP_USEC;
+			continue;
+		}
+		if (empty_rounds < ARSC_POLL_ROUNDS) {
+			empty_rounds++;
 			cpu_relax();
-		
-		TAILQ_FOREACH(p, &arsc_proc_list, proc_arsc_link) {
-			/* Probably want to try to process a dying process's syscalls.  If
-			 * not, just move it to an else case */
-			process_generic_syscalls (p, MAX_ASRC_BATCH); 
-			if (p->state == PROC_DYING) {
-				TAILQ_REMOVE(&arsc_proc_list, p, proc_arsc_link);
-				proc_decref(p);
-				/* Need to break out, so the TAILQ_FOREACH doesn't flip out.
-				 * It's not fair, but we're not dealing with that yet anyway */
-				break;
-			}
+			continue;
 		}
+		arsc_sleep(sleep_usec);
+		sleep_usec = MIN(sleep_usec * 2, ARSC_MAX_SLEEP_USEC);
 	}
 }
 
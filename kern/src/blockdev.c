@@ -10,6 +10,7 @@
 #include <slab.h>
 #include <page_alloc.h>
 #include <pmap.h>
+#include <writeback.h>
 /* These two are needed for the fake interrupt */
 #include <alarm.h>
 #include <smp.h>
@@ -18,6 +19,15 @@ struct file_operations block_f_op;
 struct page_map_operations block_pm_op;
 struct kmem_cache *breq_kcache;
 
+static struct bdev_tailq bdev_list = TAILQ_HEAD_INITIALIZER(bdev_list);
+static spinlock_t bdev_list_lock = SPINLOCK_INITIALIZER;
+
+/* The RAM disk fakes an interrupt with an alarm, so it might as well act like a
+ * device with a few requests in flight. */
+#define RAMDISK_MAX_IN_FLIGHT 4
+static void ramdisk_submit(struct block_device *bdev,
+                           struct block_request *breq);
+
 void block_init(void)
 {
 	breq_kcache = kmem_cache_create("block_reqs", sizeof(struct block_request),
@@ -36,18 +46,19 @@ void block_init(void)
 	ram_bd->b_sector_sz = 512;
 	ram_bd->b_nr_sector = (unsigned long)_binary_mnt_ext2fs_img_size / 512;
 	kref_init(&ram_bd->b_kref, fake_release, 1);
-	pm_init(&ram_bd->b_pm, &block_pm_op, ram_bd);
 	ram_bd->b_data = _binary_mnt_ext2fs_img_start;
 	strncpy(ram_bd->b_name, "RAMDISK", BDEV_INLINE_NAME);
 	ram_bd->b_name[BDEV_INLINE_NAME - 1] = '\0';
+	ram_bd->b_submit = ramdisk_submit;
+	ram_bd->b_max_in_flight = RAMDISK_MAX_IN_FLIGHT;
+	bdev_register(ram_bd);
 	/* Connect it to the file system */
-	struct file *ram_bf = make_device("/dev/ramdisk", S_IRUSR | S_IWUSR,
-	                                  __S_IFBLK, &block_f_op);
-	/* make sure the inode tracks the right pm (not it's internal one) */
-	ram_bf->f_dentry->d_inode->i_mapping = &ram_bd->b_pm;
-	ram_bf->f_dentry->d_inode->i_bdev = ram_bd;	/* this holds the bd kref */
-	kref_put(&ram_bf->f_kref);
+	bdev_make_device(ram_bd, "/dev/ramdisk");
 	#endif /* CONFIG_EXT2FS */
+	#ifdef CONFIG_VIRTIO_BLK
+	extern void virtio_blk_init(void);
+	virtio_blk_init();
+	#endif /* CONFIG_VIRTIO_BLK */
 }
 
 /* Generic helper, returns a kref'd reference out of principle. */
@@ -80,53 +91,355 @@ void free_bhs(struct page *page)
 	page->pg_private = 0;		/* catch bugs */
 }
 
-/* This ultimately will handle the actual request processing, all the way down
- * to the driver, and will deal with blocking.  For now, we just fulfill the
- * request right away (RAM based block devs). */
+/* Sets up bdev's page map and request queue, and makes it visible to
+ * print_bdev_stats().  Set the driver's fields first. */
+void bdev_register(struct block_device *bdev)
+{
+	struct block_queue *q = &bdev->b_queue;
+
+	assert(bdev->b_submit && bdev->b_max_in_flight);
+	pm_init(&bdev->b_pm, &block_pm_op, bdev);
+	bdev->b_pm.pm_host_kref = &bdev->b_kref;
+	memset(q, 0, sizeof(struct block_queue));
+	spinlock_init_irqsave(&q->lock);
+	TAILQ_INIT(&q->sorted);
+	TAILQ_INIT(&q->fifo);
+	spin_lock(&bdev_list_lock);
+	TAILQ_INSERT_TAIL(&bdev_list, bdev, b_link);
+	spin_unlock(&bdev_list_lock);
+}
+
+/* Undoes bdev_register(), after which the driver can free bdev.  The caller
+ * must have stopped submitting, and everything it submitted must be done. */
+void bdev_unregister(struct block_device *bdev)
+{
+	struct block_queue *q = &bdev->b_queue;
+
+	spin_lock(&bdev_list_lock);
+	TAILQ_REMOVE(&bdev_list, bdev, b_link);
+	spin_unlock(&bdev_list_lock);
+	assert(!q->nr_queued && !q->nr_in_flight && !q->nr_plugs);
+	/* A completion could have sent a kmsg to restart the queue.  It has
+	 * nothing to do, but it still has a pointer to bdev.  It clears the flag
+	 * with the lock held, so once we get the lock, it's done. */
+	while (ACCESS_ONCE(q->kick_pending))
+		kthread_yield();
+	spin_lock_irqsave(&q->lock);
+	spin_unlock_irqsave(&q->lock);
+	pm_destroy(&bdev->b_pm);
+}
+
+/* Makes a device file at path for bdev.  The file's inode holds bdev's kref. */
+void bdev_make_device(struct block_device *bdev, char *path)
+{
+	struct file *bdev_f = make_device(path, S_IRUSR | S_IWUSR, __S_IFBLK,
+	                                  &block_f_op);
+	/* make sure the inode tracks the right pm (not it's internal one) */
+	bdev_f->f_dentry->d_inode->i_mapping = &bdev->b_pm;
+	bdev_f->f_dentry->d_inode->i_bdev = bdev;
+	kref_put(&bdev_f->f_kref);
+}
+
+/* Tries to add breq to a queued request for the neighboring sectors.  Hold the
+ * queue lock. */
+static bool bdev_try_merge(struct block_queue *q, struct block_request *breq)
+{
+	struct block_request *i;
+
+	if (!(breq->flags & BREQ_CONTIG))
+		return FALSE;
+	TAILQ_FOREACH(i, &q->sorted, sort_link) {
+		if (!(i->flags & BREQ_CONTIG) ||
+		    ((i->flags ^ breq->flags) & (BREQ_READ | BREQ_WRITE)) ||
+		    (i->nr_sector + breq->nr_sector > BLK_MAX_MERGE_SECTORS))
+			continue;
+		if (i->first_sector + i->nr_sector == breq->first_sector) {
+			i->merge_tail->merge_next = breq;
+			i->merge_tail = breq;
+			i->nr_sector += breq->nr_sector;
+			return TRUE;
+		}
+		if (breq->first_sector + breq->nr_sector == i->first_sector) {
+			/* breq becomes the head of the group, and takes i's place in the
+			 * queue (and its deadline, which is sooner) */
+			breq->merge_next = i;
+			breq->merge_tail = i->merge_tail;
+			breq->nr_sector += i->nr_sector;
+			breq->deadline = i->deadline;
+			TAILQ_INSERT_BEFORE(i, breq, sort_link);
+			TAILQ_REMOVE(&q->sorted, i, sort_link);
+			TAILQ_INSERT_BEFORE(i, breq, fifo_link);
+			TAILQ_REMOVE(&q->fifo, i, fifo_link);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Puts breq in the queue in sector order.  Hold the queue lock. */
+static void bdev_enqueue(struct block_queue *q, struct block_request *breq)
+{
+	struct block_request *i;
+
+	TAILQ_FOREACH(i, &q->sorted, sort_link) {
+		if (i->first_sector > breq->first_sector)
+			break;
+	}
+	if (i)
+		TAILQ_INSERT_BEFORE(i, breq, sort_link);
+	else
+		TAILQ_INSERT_TAIL(&q->sorted, breq, sort_link);
+	TAILQ_INSERT_TAIL(&q->fifo, breq, fifo_link);
+	q->nr_queued++;
+	q->max_depth = MAX(q->max_depth, q->nr_queued + q->nr_in_flight);
+}
+
+/* Picks the next request to dispatch: the oldest if it is past its deadline,
+ * o/w the next one at or after the elevator, wrapping around to the lowest
+ * sector.  Hold the queue lock. */
+static struct block_request *bdev_elevator_next(struct block_queue *q)
+{
+	struct block_request *breq = TAILQ_FIRST(&q->fifo);
+
+	if (!breq)
+		return 0;
+	if (read_tsc() > breq->deadline) {
+		q->nr_expired++;
+		return breq;
+	}
+	TAILQ_FOREACH(breq, &q->sorted, sort_link) {
+		if (breq->first_sector >= q->next_sector)
+			return breq;
+	}
+	return TAILQ_FIRST(&q->sorted);
+}
+
+/* Hands requests to the driver until it is full, the queue is empty, or
+ * someone plugged it.  We don't hold the lock while the driver works. */
+static void bdev_run_queue(struct block_device *bdev)
+{
+	struct block_queue *q = &bdev->b_queue;
+	struct block_request *breq;
+
+	spin_lock_irqsave(&q->lock);
+	q->kick_pending = FALSE;
+	while (!q->nr_plugs && (q->nr_in_flight < bdev->b_max_in_flight)) {
+		breq = bdev_elevator_next(q);
+		if (!breq)
+			break;
+		TAILQ_REMOVE(&q->sorted, breq, sort_link);
+		TAILQ_REMOVE(&q->fifo, breq, fifo_link);
+		q->nr_queued--;
+		q->nr_in_flight++;
+		q->nr_dispatches++;
+		q->next_sector = breq->first_sector + breq->nr_sector;
+		spin_unlock_irqsave(&q->lock);
+		bdev->b_submit(bdev, breq);
+		spin_lock_irqsave(&q->lock);
+	}
+	spin_unlock_irqsave(&q->lock);
+}
+
+static void __bdev_run_queue(uint32_t srcid, long a0, long a1, long a2)
+{
+	bdev_run_queue((struct block_device*)a0);
+}
+
+/* Queues a request for bdev, to be dispatched when the device has room.  When
+ * it is done, breq->callback runs, possibly from interrupt context.  Returns
+ * -1 if the request is beyond the end of the device. */
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
 {
-	void *src, *dst;
-	unsigned long first_sector;
-	unsigned int nr_sector;
+	struct block_queue *q = &bdev->b_queue;
+	struct buffer_head *bh;
+	bool contig = breq->nr_bhs;
 
+	breq->bdev = bdev;
+	breq->first_sector = breq->nr_bhs ? breq->bhs[0]->bh_sector : 0;
+	breq->nr_sector = 0;
+	breq->flags &= ~(BREQ_ERROR | BREQ_CONTIG);
+	if (!(breq->flags & (BREQ_READ | BREQ_WRITE)))
+		panic("Need a request type!\n");
 	for (int i = 0; i < breq->nr_bhs; i++) {
-		first_sector = breq->bhs[i]->bh_sector;
-		nr_sector = breq->bhs[i]->bh_nr_sector;
+		bh = breq->bhs[i];
 		/* Sectors are indexed starting with 0, for now. */
-		if (first_sector + nr_sector > bdev->b_nr_sector) {
+		if (bh->bh_sector + bh->bh_nr_sector > bdev->b_nr_sector) {
 			warn("Exceeding the num sectors!");
 			return -1;
 		}
-		if (breq->flags & BREQ_READ) {
-			dst = breq->bhs[i]->bh_buffer;
-			src = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-		} else if (breq->flags & BREQ_WRITE) {
-			dst = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-			src = breq->bhs[i]->bh_buffer;
-		} else {
-			panic("Need a request type!\n");
-		}
-		memcpy(dst, src, nr_sector << SECTOR_SZ_LOG);
+		if (bh->bh_sector != breq->first_sector + breq->nr_sector)
+			contig = FALSE;
+		breq->nr_sector += bh->bh_nr_sector;
 	}
-	/* Faking the device interrupt with an alarm */
-	void breq_handler(struct alarm_waiter *waiter)
-	{
-		/* In the future, we'll need to figure out which breq this was in
-		 * response to */
-		struct block_request *breq = (struct block_request*)waiter->data;
+	/* Only contiguous requests can merge.  The elevator just uses the first
+	 * sector for the others. */
+	if (contig)
+		breq->flags |= BREQ_CONTIG;
+	breq->submit_time = read_tsc();
+	breq->deadline = breq->submit_time +
+	                 usec2tsc(breq->flags & BREQ_WRITE ? BLK_WRITE_DEADLINE_USEC
+	                                                   : BLK_READ_DEADLINE_USEC);
+	breq->merge_next = 0;
+	breq->merge_tail = breq;
+	spin_lock_irqsave(&q->lock);
+	q->nr_submits++;
+	if (bdev_try_merge(q, breq))
+		q->nr_merges++;
+	else
+		bdev_enqueue(q, breq);
+	spin_unlock_irqsave(&q->lock);
+	bdev_run_queue(bdev);
+	return 0;
+}
+
+/* Drivers call this when they finish a request they got from b_submit(),
+ * usually from IRQ context.  We run the callbacks for everything merged into
+ * it, and get the queue going again. */
+void bdev_complete_request(struct block_request *breq)
+{
+	struct block_device *bdev = breq->bdev;
+	struct block_queue *q = &bdev->b_queue;
+	struct block_request *next;
+	uint64_t now = read_tsc();
+	bool kick = FALSE;
+	int bucket;
+
+	spin_lock_irqsave(&q->lock);
+	q->nr_in_flight--;
+	for (struct block_request *i = breq; i; i = i->merge_next) {
+		bucket = LOG2_UP(tsc2usec(now - i->submit_time) + 1);
+		q->lat_hist[MIN(bucket, BLK_NR_LAT_BUCKETS - 1)]++;
+	}
+	/* Restarting the queue would call the driver, so we do it from a routine
+	 * kmsg instead of in the driver's IRQ handler. */
+	if (q->nr_queued && !q->nr_plugs && !q->kick_pending) {
+		q->kick_pending = TRUE;
+		kick = TRUE;
+	}
+	spin_unlock_irqsave(&q->lock);
+	if (kick)
+		send_kernel_message(core_id(), __bdev_run_queue, (long)bdev, 0, 0,
+		                    KMSG_ROUTINE);
+	/* Once we run a breq's callback, it could be freed.  The driver only marks
+	 * the head with errors, but they apply to everything merged into it. */
+	for (struct block_request *head = breq; breq; breq = next) {
+		next = breq->merge_next;
+		breq->flags |= head->flags & BREQ_ERROR;
 		if (breq->callback)
 			breq->callback(breq);
-		kfree(waiter);
 	}
+}
+
+static void __bdev_plug(struct block_device *bdev)
+{
+	spin_lock_irqsave(&bdev->b_queue.lock);
+	bdev->b_queue.nr_plugs++;
+	spin_unlock_irqsave(&bdev->b_queue.lock);
+}
+
+static void __bdev_unplug(struct block_device *bdev)
+{
+	spin_lock_irqsave(&bdev->b_queue.lock);
+	assert(bdev->b_queue.nr_plugs);
+	bdev->b_queue.nr_plugs--;
+	spin_unlock_irqsave(&bdev->b_queue.lock);
+	bdev_run_queue(bdev);
+}
+
+/* Holds back bdev's queue, so the requests the current kernel context submits
+ * til bdev_unplug() can be merged and sorted before any go out.  Plugs nest,
+ * but only the outermost one holds a queue, so a context plugs at most one
+ * device.  If the context sleeps, sem_down() lets the queue go til it runs
+ * again, so it's fine to block while plugged. */
+void bdev_plug(struct block_device *bdev)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	if (pcpui->plug_depth++)
+		return;
+	pcpui->plugged_bdev = bdev;
+	__bdev_plug(bdev);
+}
+
+void bdev_unplug(struct block_device *bdev)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	assert(pcpui->plug_depth);
+	if (--pcpui->plug_depth)
+		return;
+	assert(pcpui->plugged_bdev == bdev);
+	pcpui->plugged_bdev = 0;
+	__bdev_unplug(bdev);
+}
+
+/* sem_down() calls these around a sleep, which is when the context's plug lets
+ * go of its queue.  It still owns the plug, and moves it with the kthread. */
+void bdev_plug_suspend(void)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	if (pcpui->plugged_bdev)
+		__bdev_unplug(pcpui->plugged_bdev);
+}
+
+void bdev_plug_resume(void)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	if (pcpui->plugged_bdev)
+		__bdev_plug(pcpui->plugged_bdev);
+}
+
+/* Returns the block device that pm's pages are read from and written to, if
+ * any, for callers that want to plug it. */
+struct block_device *pm_backing_bdev(struct page_map *pm)
+{
+	if (pm->pm_op == &block_pm_op)
+		return pm->pm_bdev;
+	if (pm->pm_host && pm->pm_host->i_sb)
+		return pm->pm_host->i_sb->s_bdev;
+	return 0;
+}
+
+/* Faking the device interrupt with an alarm */
+static void ramdisk_irq_handler(struct alarm_waiter *waiter)
+{
+	struct block_request *breq = (struct block_request*)waiter->data;
+
+	kfree(waiter);
+	bdev_complete_request(breq);
+}
+
+/* RAM disk driver: does the IO right away, and completes it a bit later. */
+static void ramdisk_submit(struct block_device *bdev,
+                           struct block_request *breq)
+{
 	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
-	struct alarm_waiter *waiter = kmalloc(sizeof(struct alarm_waiter), 0);
-	init_awaiter(waiter, breq_handler);
+	struct alarm_waiter *waiter;
+	struct buffer_head *bh;
+	void *src, *dst;
+
+	for (struct block_request *i = breq; i; i = i->merge_next) {
+		for (int j = 0; j < i->nr_bhs; j++) {
+			bh = i->bhs[j];
+			if (i->flags & BREQ_READ) {
+				dst = bh->bh_buffer;
+				src = bdev->b_data + (bh->bh_sector << SECTOR_SZ_LOG);
+			} else {
+				dst = bdev->b_data + (bh->bh_sector << SECTOR_SZ_LOG);
+				src = bh->bh_buffer;
+			}
+			memcpy(dst, src, bh->bh_nr_sector << SECTOR_SZ_LOG);
+		}
+	}
+	waiter = kmalloc(sizeof(struct alarm_waiter), 0);
+	init_awaiter(waiter, ramdisk_irq_handler);
 	/* Stitch things up, so we know how to find things later */
 	waiter->data = breq;
 	/* Set for 5ms. */
 	set_awaiter_rel(waiter, 5000);
 	set_alarm(tchain, waiter);
-	return 0;
 }
 
 /* Helper method, unblocks someone blocked on sleep_on_breq(). */
@@ -160,6 +473,87 @@ int block_readpage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
+/* Completes a request from bdev_writepages(), usually from IRQ context.  Like
+ * with reads, a page's BHs are next to each other in the request. */
+static void bdev_writepages_done(struct block_request *breq)
+{
+	struct page *page;
+
+	for (int i = 0; i < breq->nr_bhs; i++) {
+		page = breq->bhs[i]->bh_page;
+		if ((i + 1 < breq->nr_bhs) && (breq->bhs[i + 1]->bh_page == page))
+			continue;
+		pm_end_page_writeback(page, breq->flags & BREQ_ERROR);
+	}
+	if (breq->bhs != breq->local_bhs)
+		kfree(breq->bhs);
+	kmem_cache_free(breq_kcache, breq);
+	writeback_wake_throttled();
+}
+
+/* Starts writing pages to bdev as one block request, for a writepages() op,
+ * and returns without waiting.  With dirty_only, we only write the BHs marked
+ * dirty, which is what block device pages want, since the rest of the page
+ * might never have been read in.  Pages with nothing to write are done right
+ * away. */
+int bdev_writepages(struct block_device *bdev, struct page **pages,
+                    unsigned int nr, bool dirty_only)
+{
+	struct block_request *breq;
+	struct buffer_head *bh;
+	unsigned int nr_bhs = 0;
+
+	for (int i = 0; i < nr; i++) {
+		for (bh = (struct buffer_head*)pages[i]->pg_private; bh;
+		     bh = bh->bh_next)
+			if (!dirty_only || (bh->bh_flags & BH_DIRTY))
+				nr_bhs++;
+	}
+	breq = kmem_cache_alloc(breq_kcache, 0);
+	if (!breq)
+		return -ENOMEM;
+	breq->bhs = breq->local_bhs;
+	if (nr_bhs > NR_INLINE_BH) {
+		breq->bhs = kmalloc(nr_bhs * sizeof(struct buffer_head*), 0);
+		if (!breq->bhs) {
+			kmem_cache_free(breq_kcache, breq);
+			return -ENOMEM;
+		}
+	}
+	breq->flags = BREQ_WRITE;
+	breq->callback = bdev_writepages_done;
+	breq->data = 0;
+	breq->nr_bhs = 0;
+	for (int i = 0; i < nr; i++) {
+		nr_bhs = breq->nr_bhs;
+		for (bh = (struct buffer_head*)pages[i]->pg_private; bh;
+		     bh = bh->bh_next) {
+			if (dirty_only && !(bh->bh_flags & BH_DIRTY))
+				continue;
+			/* If it gets dirtied again, the page gets tagged again too */
+			bh->bh_flags &= ~BH_DIRTY;
+			breq->bhs[breq->nr_bhs++] = bh;
+		}
+		if (breq->nr_bhs == nr_bhs)
+			pm_end_page_writeback(pages[i], FALSE);
+	}
+	if (!breq->nr_bhs) {
+		bdev_writepages_done(breq);
+		return 0;
+	}
+	if (bdev_submit_request(bdev, breq)) {
+		breq->flags |= BREQ_ERROR;
+		bdev_writepages_done(breq);
+	}
+	return 0;
+}
+
+/* Writes back the dirty buffers in pages, see bdev_writepages() */
+int block_writepages(struct page_map *pm, struct page **pages, unsigned int nr)
+{
+	return bdev_writepages(pm->pm_bdev, pages, nr, TRUE);
+}
+
 /* Returns a BH pointing to the buffer where blk_num from bdev is located (given
  * blocks of size blk_sz).  This uses the page cache for the page allocations
  * and evictions, but only caches blocks that are requested.  Check the docs for
@@ -260,15 +654,15 @@ found:
 	return bh;
 }
 
-/* Will dirty the block/BH/page for the given block/buffer.  Will have to be
- * careful with the page reclaimer - if someone holds a reference, they can
- * still dirty it. */
+/* Will dirty the block/BH/page for the given block/buffer, so the flushers
+ * write it back.  Will have to be careful with the page reclaimer - if someone
+ * holds a reference, they can still dirty it. */
 void bdev_dirty_buffer(struct buffer_head *bh)
 {
 	struct page *page = bh->bh_page;
 	/* TODO: race on flag modification */
 	bh->bh_flags |= BH_DIRTY;
-	page->pg_flags |= PG_DIRTY;
+	pm_dirty_page(page->pg_mapping, page);
 }
 
 /* Decrefs the buffer from bdev_get_buffer().  Call this when you no longer
@@ -279,9 +673,40 @@ void bdev_put_buffer(struct buffer_head *bh)
 	page_decref(bh->bh_page);
 }
 
+/* Prints the request queue stats of every block device */
+void print_bdev_stats(void)
+{
+	struct block_device *bdev;
+	struct block_queue *q;
+
+	spin_lock(&bdev_list_lock);
+	TAILQ_FOREACH(bdev, &bdev_list, b_link) {
+		q = &bdev->b_queue;
+		printk("%s: %llu submits, %llu merges, %llu dispatches (%llu expired)\n",
+		       bdev->b_name, q->nr_submits, q->nr_merges, q->nr_dispatches,
+		       q->nr_expired);
+		printk("\tqueued: %u, in flight: %u, max depth: %u, plugs: %u\n",
+		       q->nr_queued, q->nr_in_flight, q->max_depth, q->nr_plugs);
+		printk("\tlatency (usec): ");
+		for (int i = 0; i < BLK_NR_LAT_BUCKETS - 1; i++) {
+			if (q->lat_hist[i])
+				printk("<%lu: %llu ", 1UL << i, q->lat_hist[i]);
+		}
+		if (q->lat_hist[BLK_NR_LAT_BUCKETS - 1])
+			printk(">=%lu: %llu", 1UL << (BLK_NR_LAT_BUCKETS - 2),
+			       q->lat_hist[BLK_NR_LAT_BUCKETS - 1]);
+		printk("\n");
+		if (bdev->b_print_stats)
+			bdev->b_print_stats(bdev);
+	}
+	spin_unlock(&bdev_list_lock);
+}
+
 /* Block device page map ops: */
 struct page_map_operations block_pm_op = {
 	block_readpage,
+	0,	/* readpages */
+	block_writepages,
 };
 
 /* Block device file ops: for now, we don't let you do much of anything */
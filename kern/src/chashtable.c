@@ -0,0 +1,316 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Concurrent hash table, see chashtable.h.
+ *
+ * Lock ordering: the 'rehashing' flag, then the stripes in order.  Only the
+ * core holding 'rehashing' starts or finishes a resize or moves buckets.
+ * Starting and finishing a resize also takes every stripe, so anyone holding a
+ * stripe can trust cur and old. */
+
+#include <ros/common.h>
+#include <ros/errno.h>
+#include <chashtable.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <assert.h>
+#include <stdio.h>
+
+extern struct kmem_cache *hentry_cache;
+
+/* Same mixing as hashtable.c's hash(), to cope with poor hash functions.  We
+ * use the low bits for both the stripe and the bucket. */
+static size_t cht_hash(struct chashtable *h, void *k)
+{
+	size_t i = h->hashfn(k);
+	i += ~(i << 9);
+	i ^=  ((i >> 14) | (i << 18));
+	i +=  (i << 4);
+	i ^=  ((i >> 10) | (i << 22));
+	return i;
+}
+
+static spinlock_t *cht_stripe(struct chashtable *h, size_t hash)
+{
+	return &h->stripes[hash & (CHT_NR_STRIPES - 1)];
+}
+
+static void cht_lock_all(struct chashtable *h)
+{
+	for (int i = 0; i < CHT_NR_STRIPES; i++)
+		spin_lock(&h->stripes[i]);
+}
+
+static void cht_unlock_all(struct chashtable *h)
+{
+	for (int i = CHT_NR_STRIPES - 1; i >= 0; i--)
+		spin_unlock(&h->stripes[i]);
+}
+
+static struct cht_table *cht_table_alloc(size_t nr_buckets)
+{
+	struct cht_table *t = kmalloc(sizeof(struct cht_table), 0);
+
+	if (!t)
+		return 0;
+	t->buckets = kzmalloc(nr_buckets * sizeof(hash_entry_t*), 0);
+	if (!t->buckets) {
+		kfree(t);
+		return 0;
+	}
+	t->nr_buckets = nr_buckets;
+	return t;
+}
+
+static void cht_table_free(struct cht_table *t)
+{
+	kfree(t->buckets);
+	kfree(t);
+}
+
+/* Returns the bucket for hash.  Hold hash's stripe.  An old bucket below
+ * rehash_idx has been moved, and only a mover holding our stripe can move
+ * rehash_idx past our bucket, so the answer can't change while we're locked. */
+static hash_entry_t **cht_bucket(struct chashtable *h, size_t hash)
+{
+	struct cht_table *old = h->old;
+	size_t idx;
+
+	if (old) {
+		idx = hash & (old->nr_buckets - 1);
+		if (idx >= ACCESS_ONCE(h->rehash_idx))
+			return &old->buckets[idx];
+	}
+	return &h->cur->buckets[hash & (h->cur->nr_buckets - 1)];
+}
+
+/* Moves up to CHT_REHASH_STEP buckets from the old table to the new one, and
+ * finishes the resize once the old one is empty.  If someone else is already
+ * moving buckets, we let them. */
+static void cht_rehash_step(struct chashtable *h)
+{
+	struct cht_table *old;
+	hash_entry_t *e, *next, **new_b;
+	spinlock_t *stripe;
+	size_t idx;
+
+	if (!ACCESS_ONCE(h->old))
+		return;
+	if (!atomic_cas(&h->rehashing, 0, 1))
+		return;
+	old = h->old;
+	if (!old)
+		goto out;
+	for (int i = 0; i < CHT_REHASH_STEP; i++) {
+		idx = h->rehash_idx;
+		if (idx == old->nr_buckets)
+			break;
+		/* the new buckets for old idx are in the same stripe as idx */
+		stripe = &h->stripes[idx & (CHT_NR_STRIPES - 1)];
+		spin_lock(stripe);
+		for (e = old->buckets[idx]; e; e = next) {
+			next = e->next;
+			new_b = &h->cur->buckets[e->h & (h->cur->nr_buckets - 1)];
+			e->next = *new_b;
+			*new_b = e;
+		}
+		old->buckets[idx] = 0;
+		h->rehash_idx = idx + 1;
+		spin_unlock(stripe);
+	}
+	if (h->rehash_idx == old->nr_buckets) {
+		cht_lock_all(h);
+		h->old = 0;
+		cht_unlock_all(h);
+		cht_table_free(old);
+	}
+out:
+	atomic_set(&h->rehashing, 0);
+}
+
+/* Switches to a table twice as big if we're over the load limit.  The buckets
+ * move over later, in cht_rehash_step(). */
+static void cht_maybe_grow(struct chashtable *h)
+{
+	struct cht_table *new;
+
+	if (ACCESS_ONCE(h->old))
+		return;
+	if (atomic_read(&h->nr_entries) <= h->cur->nr_buckets * CHT_MAX_LOAD)
+		return;
+	if (!atomic_cas(&h->rehashing, 0, 1))
+		return;
+	/* someone could have grown it before we got the flag */
+	if (h->old ||
+	    (atomic_read(&h->nr_entries) <= h->cur->nr_buckets * CHT_MAX_LOAD))
+		goto out;
+	/* If this fails, we'll try again on a later insert */
+	new = cht_table_alloc(h->cur->nr_buckets * 2);
+	if (!new)
+		goto out;
+	cht_lock_all(h);
+	h->old = h->cur;
+	h->cur = new;
+	h->rehash_idx = 0;
+	cht_unlock_all(h);
+out:
+	atomic_set(&h->rehashing, 0);
+}
+
+struct chashtable *create_chashtable(size_t minsize, size_t (*hashfn)(void*),
+                                     ssize_t (*eqfn)(void*, void*))
+{
+	struct chashtable *h = kmalloc(sizeof(struct chashtable), 0);
+	size_t nr_buckets = CHT_NR_STRIPES;
+
+	if (!h)
+		return 0;
+	while (nr_buckets < minsize)
+		nr_buckets <<= 1;
+	h->cur = cht_table_alloc(nr_buckets);
+	if (!h->cur) {
+		kfree(h);
+		return 0;
+	}
+	for (int i = 0; i < CHT_NR_STRIPES; i++)
+		spinlock_init(&h->stripes[i]);
+	h->old = 0;
+	h->rehash_idx = 0;
+	atomic_init(&h->rehashing, 0);
+	atomic_init(&h->nr_entries, 0);
+	h->hashfn = hashfn;
+	h->eqfn = eqfn;
+	return h;
+}
+
+/* Frees the table and its entries, but not the keys or values.  No one else can
+ * be using it. */
+void chashtable_destroy(struct chashtable *h)
+{
+	hash_entry_t *e, *next;
+	struct cht_table *tables[2] = {h->cur, h->old};
+
+	for (int t = 0; t < 2; t++) {
+		if (!tables[t])
+			continue;
+		for (size_t i = 0; i < tables[t]->nr_buckets; i++) {
+			for (e = tables[t]->buckets[i]; e; e = next) {
+				next = e->next;
+				kmem_cache_free(hentry_cache, e);
+			}
+		}
+		cht_table_free(tables[t]);
+	}
+	kfree(h);
+}
+
+/* Adds k -> v.  Like hashtable_insert(), this doesn't check for an existing k.
+ * Returns 0 on success, -ENOMEM otherwise. */
+int chashtable_insert(struct chashtable *h, void *k, void *v)
+{
+	hash_entry_t *e = kmem_cache_alloc(hentry_cache, 0);
+	hash_entry_t **b;
+	spinlock_t *stripe;
+
+	if (!e)
+		return -ENOMEM;
+	e->k = k;
+	e->v = v;
+	e->h = cht_hash(h, k);
+	stripe = cht_stripe(h, e->h);
+	spin_lock(stripe);
+	b = cht_bucket(h, e->h);
+	e->next = *b;
+	*b = e;
+	spin_unlock(stripe);
+	atomic_inc(&h->nr_entries);
+	cht_maybe_grow(h);
+	cht_rehash_step(h);
+	return 0;
+}
+
+/* Finds the value for k.  If get is set, it is called on the value while the
+ * bucket is still locked, and we only return the value if get returns TRUE.
+ * Use it to take a ref on something that could be removed and freed right
+ * after we unlock. */
+void *chashtable_search_get(struct chashtable *h, void *k,
+                            bool (*get)(void *v))
+{
+	size_t hash = cht_hash(h, k);
+	spinlock_t *stripe = cht_stripe(h, hash);
+	hash_entry_t *e;
+	void *v = 0;
+
+	spin_lock(stripe);
+	for (e = *cht_bucket(h, hash); e; e = e->next) {
+		if ((e->h == hash) && h->eqfn(k, e->k)) {
+			if (!get || get(e->v))
+				v = e->v;
+			break;
+		}
+	}
+	spin_unlock(stripe);
+	return v;
+}
+
+void *chashtable_search(struct chashtable *h, void *k)
+{
+	return chashtable_search_get(h, k, 0);
+}
+
+/* Removes k and returns its value, or 0 if it isn't there.  If pred is set, we
+ * only remove k if pred returns TRUE on its value, which is checked while the
+ * bucket is locked. */
+void *chashtable_remove_if(struct chashtable *h, void *k,
+                           bool (*pred)(void *v))
+{
+	size_t hash = cht_hash(h, k);
+	spinlock_t *stripe = cht_stripe(h, hash);
+	hash_entry_t *e, **pe;
+	void *v = 0;
+
+	spin_lock(stripe);
+	for (pe = cht_bucket(h, hash); (e = *pe); pe = &e->next) {
+		if ((e->h == hash) && h->eqfn(k, e->k)) {
+			if (pred && !pred(e->v))
+				break;
+			*pe = e->next;
+			v = e->v;
+			break;
+		}
+	}
+	spin_unlock(stripe);
+	if (!v)
+		return 0;
+	kmem_cache_free(hentry_cache, e);
+	atomic_dec(&h->nr_entries);
+	cht_rehash_step(h);
+	return v;
+}
+
+void *chashtable_remove(struct chashtable *h, void *k)
+{
+	return chashtable_remove_if(h, k, 0);
+}
+
+/* Runs func on every value, one stripe at a time.  func runs with the stripe
+ * locked, so it can't block or touch the table. */
+void chash_for_each(struct chashtable *h, void func(void*))
+{
+	struct cht_table *tables[2];
+	hash_entry_t *e;
+
+	for (int s = 0; s < CHT_NR_STRIPES; s++) {
+		spin_lock(&h->stripes[s]);
+		tables[0] = h->old;
+		tables[1] = h->cur;
+		for (int t = 0; t < 2; t++) {
+			if (!tables[t])
+				continue;
+			for (size_t i = s; i < tables[t]->nr_buckets; i += CHT_NR_STRIPES)
+				for (e = tables[t]->buckets[i]; e; e = e->next)
+					func(e->v);
+		}
+		spin_unlock(&h->stripes[s]);
+	}
+}
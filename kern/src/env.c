@@ -21,6 +21,7 @@
 #include <schedule.h>
 #include <kmalloc.h>
 #include <mm.h>
+#include <writeback.h>
 
 #include <ros/syscall.h>
 #include <error.h>
@@ -137,9 +138,13 @@ void env_user_mem_free(env_t* e, void* start, size_t len)
 	assert((uintptr_t)start + len <= UVPT); //since this keeps fucking happening
 	int user_page_free(env_t* e, pte_t* pte, void* va, void* arg)
 	{
-		if(PAGE_PRESENT(*pte))
+		if (PAGE_JUMBO(*pte)) {
+			jumbo_decref(*pte);
+			*pte = 0;
+		} else if(PAGE_PRESENT(*pte))
 		{
 			page_t* page = ppn2page(PTE2PPN(*pte));
+			pm_dirty_mapped_page(page, *pte);
 			*pte = 0;
 			page_decref(page);
 		} else {
@@ -15,6 +15,7 @@
 #include <error.h>
 #include <pmap.h>
 #include <bitmask.h>
+#include <writeback.h>
 
 /* These structs are declared again and initialized farther down */
 struct page_map_operations ext2_pm_op;
@@ -693,6 +694,42 @@ int ext2_mappage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
+/* Adds the BHs of page that need to be read in to breq, and zeroes the rest.
+ * If we wanted to ensure no data is leaked after a crash, we'd write a 0 block
+ * too. */
+static void ext2_pack_page_bhs(struct page_map *pm, struct page *page,
+                               struct block_request *breq)
+{
+	struct buffer_head *bh = (struct buffer_head*)page->pg_private;
+
+	assert(bh);
+	for (; bh; bh = bh->bh_next) {
+		if (!(bh->bh_flags & BH_NEEDS_ZEROED)) {
+			breq->bhs[breq->nr_bhs++] = bh;
+		} else {
+			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
+			bh->bh_flags |= BH_DIRTY;
+			pm_dirty_page(pm, page);
+		}
+	}
+}
+
+/* Finishes a page whose blocks were read in: zero out whatever is beyond the
+ * EOF and mark it up to date.  We could do this by figuring out where the BHs
+ * end and zeroing from there, but I'd rather zero from where the file ends
+ * (which could be in the middle of an FS block */
+static void ext2_finish_readpage(struct page_map *pm, struct page *page)
+{
+	uintptr_t eof_off;
+	eof_off = (pm->pm_host->i_size - page->pg_index * PGSIZE);
+	eof_off = MIN(eof_off, PGSIZE) % PGSIZE;
+	/* at this point, eof_off is the offset into the page of the EOF, or 0 */
+	if (eof_off)
+		memset(eof_off + page2kva(page), 0, PGSIZE - eof_off);
+	/* Now the page is up to date */
+	page->pg_flags |= PG_UPTODATE;
+}
+
 /* Fills page with its contents from its backing store file.  Note that we do
  * the zero padding here, instead of higher in the VFS.  Might change in the
  * future.  TODO: make this a block FS generic call. */
@@ -700,9 +737,7 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 {
 	int retval;
 	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
-	struct buffer_head *bh;
 	struct block_request *breq;
-	void *eobh;
 
 	assert(page->pg_flags & PG_BUFFER);
 	retval = ext2_mappage(pm, page);
@@ -719,41 +754,107 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 	breq->bhs = breq->local_bhs;
 	breq->nr_bhs = 0;
 	/* Pack the BH pointers in the block request */
-	bh = (struct buffer_head*)page->pg_private;
-	assert(bh);
-	/* Either read the block in, or zero the buffer.  If we wanted to ensure no
-	 * data is leaked after a crash, we'd write a 0 block too. */
-	for (int i = 0; bh; bh = bh->bh_next) {
-		if (!(bh->bh_flags & BH_NEEDS_ZEROED)) {
-			breq->bhs[i] = bh;
-			breq->nr_bhs++;
-			i++;
-		} else {
-			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
-			bh->bh_flags |= BH_DIRTY;
-			bh->bh_page->pg_flags |= PG_DIRTY;
-		}
-	}
+	ext2_pack_page_bhs(pm, page, breq);
 	retval = bdev_submit_request(bdev, breq);
 	assert(!retval);
 	sleep_on_breq(breq);
 	kmem_cache_free(breq_kcache, breq);
-	/* zero out whatever is beyond the EOF.  we could do this by figuring out
-	 * where the BHs end and zeroing from there, but I'd rather zero from where
-	 * the file ends (which could be in the middle of an FS block */
-	uintptr_t eof_off;
-	eof_off = (pm->pm_host->i_size - page->pg_index * PGSIZE);
-	eof_off = MIN(eof_off, PGSIZE) % PGSIZE;
-	/* at this point, eof_off is the offset into the page of the EOF, or 0 */
-	if (eof_off)
-		memset(eof_off + page2kva(page), 0, PGSIZE - eof_off);
-	/* Now the page is up to date */
-	page->pg_flags |= PG_UPTODATE;
+	ext2_finish_readpage(pm, page);
 	/* Useful debugging.  Put one higher up if the page is not getting mapped */
 	//print_pageinfo(page);
 	return 0;
 }
 
+/* Completes a request from ext2_readpages(), usually from IRQ context.  A
+ * page's BHs are next to each other in the request, so we're done with a page
+ * at its last BH.  If the IO failed, we unmap the pages and leave them not up
+ * to date, and whoever loads them will try again with ext2_readpage(). */
+static void ext2_readpages_done(struct block_request *breq)
+{
+	struct page_map *pm = (struct page_map*)breq->data;
+	struct page *page;
+
+	for (int i = 0; i < breq->nr_bhs; i++) {
+		page = breq->bhs[i]->bh_page;
+		if ((i + 1 < breq->nr_bhs) && (breq->bhs[i + 1]->bh_page == page))
+			continue;
+		if (breq->flags & BREQ_ERROR)
+			free_bhs(page);
+		else
+			ext2_finish_readpage(pm, page);
+		unlock_page(page);
+		page_decref(page);
+	}
+	if (breq->bhs != breq->local_bhs)
+		kfree(breq->bhs);
+	kmem_cache_free(breq_kcache, breq);
+}
+
+/* Starts reading in pages (for readahead), as one block request, and returns
+ * without waiting for it.  Pages that are all holes are done right away. */
+int ext2_readpages(struct page_map *pm, struct page **pages, unsigned int nr)
+{
+	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
+	unsigned int blk_per_pg = PGSIZE / pm->pm_host->i_sb->s_blocksize;
+	struct block_request *breq;
+	unsigned int nr_bhs;
+	int retval = 0;
+
+	breq = kmem_cache_alloc(breq_kcache, 0);
+	if (!breq)
+		return -ENOMEM;
+	breq->bhs = breq->local_bhs;
+	if (nr * blk_per_pg > NR_INLINE_BH) {
+		breq->bhs = kmalloc(nr * blk_per_pg * sizeof(struct buffer_head*), 0);
+		if (!breq->bhs) {
+			kmem_cache_free(breq_kcache, breq);
+			return -ENOMEM;
+		}
+	}
+	for (int i = 0; i < nr; i++) {
+		assert(pages[i]->pg_flags & PG_BUFFER);
+		retval = ext2_mappage(pm, pages[i]);
+		if (retval) {
+			/* free_bhs() can handle having a halfway aborted mappage() */
+			for (int j = 0; j <= i; j++)
+				free_bhs(pages[j]);
+			if (breq->bhs != breq->local_bhs)
+				kfree(breq->bhs);
+			kmem_cache_free(breq_kcache, breq);
+			return retval;
+		}
+	}
+	breq->flags = BREQ_READ;
+	breq->callback = ext2_readpages_done;
+	breq->data = pm;
+	breq->nr_bhs = 0;
+	for (int i = 0; i < nr; i++) {
+		nr_bhs = breq->nr_bhs;
+		ext2_pack_page_bhs(pm, pages[i], breq);
+		if (breq->nr_bhs == nr_bhs) {
+			ext2_finish_readpage(pm, pages[i]);
+			unlock_page(pages[i]);
+			page_decref(pages[i]);
+		}
+	}
+	if (!breq->nr_bhs) {
+		ext2_readpages_done(breq);
+		return 0;
+	}
+	if (bdev_submit_request(bdev, breq)) {
+		breq->flags |= BREQ_ERROR;
+		ext2_readpages_done(breq);
+	}
+	return 0;
+}
+
+/* Starts writing back dirty pages, for the flushers and fsync.  The pages were
+ * read or written, so all of their blocks are mapped already. */
+int ext2_writepages(struct page_map *pm, struct page **pages, unsigned int nr)
+{
+	return bdev_writepages(pm->pm_host->i_sb->s_bdev, pages, nr, FALSE);
+}
+
 /* Super Operations */
 
 /* Creates and initializes a new inode.  FS specific, yet inode-generic fields
@@ -1403,10 +1504,22 @@ int ext2_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
-/* Flushes the file's dirty contents to disc */
+/* Flushes the file's dirty contents to disc, and waits for them.  The block
+ * maps and bitmaps that say where the data went are in the bdev's page cache,
+ * so we write those too.  Without datasync, we'd also write the inode, once
+ * ext2_write_inode() does something. */
 int ext2_fsync(struct file *file, struct dentry *dentry, int datasync)
 {
-	return -1;
+	int error;
+
+	error = pm_writeback(file->f_mapping, TRUE);
+	if (!error)
+		error = pm_writeback(&dentry->d_inode->i_sb->s_bdev->b_pm, TRUE);
+	if (error) {
+		set_errno(-error);
+		return -1;
+	}
+	return 0;
 }
 
 /* Traditionally, sleeps until there is file activity.  We probably won't
@@ -1448,6 +1561,8 @@ int ext2_check_flags(int flags)
 /* Redeclaration and initialization of the FS ops structures */
 struct page_map_operations ext2_pm_op = {
 	ext2_readpage,
+	ext2_readpages,
+	ext2_writepages,
 };
 
 struct super_operations ext2_s_op = {
@@ -40,6 +40,8 @@
 #include <vfs.h>
 #include <devfs.h>
 #include <blockdev.h>
+#include <writeback.h>
+#include <reclaim.h>
 #include <ext2fs.h>
 #include <kthread.h>
 #include <net.h>
@@ -84,7 +86,10 @@ void kernel_init(multiboot_info_t *mboot_info)
 	train_timing();
 	kb_buf_init(&cons_buf);
 	arch_init();
+	kmem_cache_init_pcpu();			/* needs num_cpus, from arch_init */
 	block_init();
+	writeback_init();
+	reclaim_init();
 	enable_irq();
 	socket_init();
 #ifdef CONFIG_EXT2FS
@@ -25,59 +25,102 @@
 
 #define kmallocdebug(args...)  //printk(args)
 
-//List of physical pages used by kmalloc
-static spinlock_t pages_list_lock = SPINLOCK_INITIALIZER;
-static page_list_t LCKD(&pages_list_lock)pages_list;
+/* Sizes up to this are mapped to their class with a table lookup */
+#define KMALLOC_LOOKUP_MAX 4096
 
 struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
+static uint8_t kmalloc_lookup[KMALLOC_LOOKUP_MAX / KMALLOC_ALIGNMENT];
+
+/* Returns the object size of the idx'th kmalloc cache */
+static size_t kmalloc_class_size(int idx)
+{
+	int order, step;
+
+	if (idx < KMALLOC_NR_SMALL)
+		return (idx + 1) * KMALLOC_ALIGNMENT;
+	/* Each power of two, 2^order, is reached in KMALLOC_STEPS_PER_POW2 steps
+	 * from 2^(order - 1) */
+	idx -= KMALLOC_NR_SMALL;
+	order = LOG2_UP(KMALLOC_SMALL_MAX) + 1 + idx / KMALLOC_STEPS_PER_POW2;
+	step = idx % KMALLOC_STEPS_PER_POW2 + 1;
+	return (1UL << (order - 1)) +
+	       step * ((1UL << (order - 1)) / KMALLOC_STEPS_PER_POW2);
+}
+
+/* Returns the index of the smallest kmalloc cache that holds size bytes.  size
+ * must be <= KMALLOC_LARGEST. */
+static int kmalloc_cache_idx(size_t size)
+{
+	int order;
+
+	if (!size)
+		return 0;
+	if (size <= KMALLOC_LOOKUP_MAX)
+		return kmalloc_lookup[(size - 1) / KMALLOC_ALIGNMENT];
+	/* size is in (2^(order - 1), 2^order] */
+	order = LOG2_UP(size);
+	return KMALLOC_NR_SMALL +
+	       (order - LOG2_UP(KMALLOC_SMALL_MAX) - 1) * KMALLOC_STEPS_PER_POW2 +
+	       (size - 1 - (1UL << (order - 1))) /
+	       ((1UL << (order - 1)) / KMALLOC_STEPS_PER_POW2);
+}
+
 void kmalloc_init(void)
 {
-	// i want to know if we ever make the tag bigger (should be below 16 bytes)
-	static_assert(sizeof(struct kmalloc_tag) <= KMALLOC_ALIGNMENT);
+	int idx = 0;
+
+	static_assert(KMALLOC_LOOKUP_MAX <= KMALLOC_LARGEST);
+	assert(kmalloc_class_size(NUM_KMALLOC_CACHES - 1) == KMALLOC_LARGEST);
 	// build caches of common sizes
-	size_t ksize = KMALLOC_SMALLEST;
-	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
-		kmalloc_caches[i] = kmem_cache_create("kmalloc_cache", ksize,
+	for (int i = 0; i < NUM_KMALLOC_CACHES; i++)
+		kmalloc_caches[i] = kmem_cache_create("kmalloc_cache",
+		                                      kmalloc_class_size(i),
 		                                      KMALLOC_ALIGNMENT, 0, 0, 0);
-		ksize <<= 1;
+	for (int i = 0; i < KMALLOC_LOOKUP_MAX / KMALLOC_ALIGNMENT; i++) {
+		while (kmalloc_class_size(idx) < (i + 1) * KMALLOC_ALIGNMENT)
+			idx++;
+		kmalloc_lookup[i] = idx;
 	}
+	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		assert(kmalloc_cache_idx(kmalloc_class_size(i)) == i);
+		/* the largest class has nothing above it */
+		if (i < NUM_KMALLOC_CACHES - 1)
+			assert(kmalloc_cache_idx(kmalloc_class_size(i) + 1) == i + 1);
+	}
+}
+
+/* Allocations too big for the caches get their own block of pages.  The head
+ * page remembers the block's order for kfree(). */
+static void *kmalloc_pages(size_t size, int flags)
+{
+	size_t order = LOG2_UP(ROUNDUP(size, PGSIZE) / PGSIZE);
+	void *buf = get_cont_pages(order, flags);
+	struct page *page;
+
+	if (!buf)
+		panic("Kmalloc failed!  Handle me!");
+	page = kva2page(buf);
+	page->pg_flags |= PG_KMALLOC;
+	page->pg_order = order;
+	return buf;
+}
+
+static void kfree_pages(void *addr, size_t order)
+{
+	kva2page(addr)->pg_flags &= ~PG_KMALLOC;
+	free_cont_pages(addr, order);
 }
 
 void *kmalloc(size_t size, int flags) 
 {
-	// reserve space for bookkeeping and preserve alignment
-	size_t ksize = size + KMALLOC_OFFSET;
 	void *buf;
-	int cache_id;
-	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
-	// if we don't have a cache to handle it, alloc cont pages
-	if (cache_id >= NUM_KMALLOC_CACHES) {
-		size_t num_pgs = ROUNDUP(size + sizeof(struct kmalloc_tag), PGSIZE) /
-		                           PGSIZE;
-		buf = get_cont_pages(LOG2_UP(num_pgs), flags);
-		if (!buf)
-			panic("Kmalloc failed!  Handle me!");
-		// fill in the kmalloc tag
-		struct kmalloc_tag *tag = buf;
-		tag->flags = KMALLOC_TAG_PAGES;
-		tag->num_pages = num_pgs;
-		tag->canary = KMALLOC_CANARY;
-		return buf + KMALLOC_OFFSET;
-	}
-	// else, alloc from the appropriate cache
-	buf = kmem_cache_alloc(kmalloc_caches[cache_id], flags);
+
+	if (size > KMALLOC_LARGEST)
+		return kmalloc_pages(size, flags);
+	buf = kmem_cache_alloc(kmalloc_caches[kmalloc_cache_idx(size)], flags);
 	if (!buf)
 		panic("Kmalloc failed!  Handle me!");
-	// store a pointer to the buffers kmem_cache in it's bookkeeping space
-	struct kmalloc_tag *tag = buf;
-	tag->flags = KMALLOC_TAG_CACHE;
-	tag->my_cache = kmalloc_caches[cache_id];
-	tag->canary = KMALLOC_CANARY;
-	return buf + KMALLOC_OFFSET;
+	return buf;
 }
 
 void *kzmalloc(size_t size, int flags) 
@@ -89,25 +132,58 @@ void *kzmalloc(size_t size, int flags)
 	return v;
 }
 
+/* Returns the usable size of the kmalloc'd buffer at addr, which is at least as
+ * big as was asked for. */
+size_t ksize(void *addr)
+{
+	struct page *page = kva2page(addr);
+
+	if (page->pg_flags & PG_SLAB)
+		return ((struct kmem_cache*)page->pg_private)->obj_size;
+	assert(page->pg_flags & PG_KMALLOC);
+	return (1UL << page->pg_order) * PGSIZE;
+}
+
 void *krealloc(void* buf, size_t size, int flags) {
-	struct kmalloc_tag *tag = (struct kmalloc_tag*)(buf - KMALLOC_OFFSET);
-	if (tag->my_cache->obj_size >= size)
+	size_t old_size;
+	void *new_buf;
+
+	if (!buf)
+		return kmalloc(size, flags);
+	old_size = ksize(buf);
+	if (old_size >= size)
 		return buf;
+	new_buf = kmalloc(size, flags);
+	if (!new_buf)
+		return 0;
+	memcpy(new_buf, buf, old_size);
 	kfree(buf);
-	return kmalloc(size, flags);
+	return new_buf;
 }
 
 void kfree(void *addr)
 {
+	struct page *page;
+
 	if(addr == NULL)
 		return;
-	struct kmalloc_tag *tag = (struct kmalloc_tag*)(addr - KMALLOC_OFFSET);
-	assert(tag->canary == KMALLOC_CANARY);
-	if (tag->flags & KMALLOC_TAG_CACHE)
-		kmem_cache_free(tag->my_cache, addr - KMALLOC_OFFSET);
-	else if (tag->flags & KMALLOC_TAG_PAGES) {
-		free_cont_pages(addr - KMALLOC_OFFSET, LOG2_UP(tag->num_pages));
-	} else 
+	page = kva2page(addr);
+	if (page->pg_flags & PG_SLAB)
+		kmem_cache_free((struct kmem_cache*)page->pg_private, addr);
+	else if (page->pg_flags & PG_KMALLOC)
+		kfree_pages(addr, page->pg_order);
+	else 
 		panic("[Italian Accent]: Che Cazzo! BO! Flag in kmalloc!!!");
 }
 
+/* Frees addr, which was kmalloc'd with size bytes.  Callers that know the size
+ * can use this to skip looking up addr's struct page. */
+void kfree_sized(void *addr, size_t size)
+{
+	if (addr == NULL)
+		return;
+	if (size > KMALLOC_LARGEST)
+		kfree_pages(addr, LOG2_UP(ROUNDUP(size, PGSIZE) / PGSIZE));
+	else
+		kmem_cache_free(kmalloc_caches[kmalloc_cache_idx(size)], addr);
+}
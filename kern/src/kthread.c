@@ -11,6 +11,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <schedule.h>
+#include <blockdev.h>
 
 struct kmem_cache *kthread_kcache;
 
@@ -20,6 +21,115 @@ void kthread_init(void)
 	                                   __alignof__(struct kthread), 0, 0, 0);
 }
 
+/* Allocates a kthread and a stack for it, which it holds a page ref on.
+ * Returns 0 if we're out of memory. */
+static struct kthread *kthread_alloc(void)
+{
+	struct kthread *kthread;
+	struct page *page;
+
+	kthread = kmem_cache_alloc(kthread_kcache, 0);
+	if (!kthread)
+		return 0;
+	if (kpage_alloc(&page)) {
+		kmem_cache_free(kthread_kcache, kthread);
+		return 0;
+	}
+#ifdef CONFIG_KTHREAD_POISON
+	/* TODO: KTHR-STACK don't poison like this */
+	*(uintptr_t*)page2kva(page) = 0;
+#endif /* CONFIG_KTHREAD_POISON */
+	kthread->stacktop = (uintptr_t)page2kva(page) + PGSIZE;
+	return kthread;
+}
+
+static void kthread_free(struct kthread *kthread)
+{
+	/* assumes the stack is a page, and that stacktop is somewhere in
+	 * (pg_bottom, pg_bottom + PGSIZE].  Normally, it ought to be pg_bottom
+	 * + PGSIZE (on x86).  kva2page can take any kva, not just a page
+	 * aligned addr. */
+	page_decref(kva2page((void*)kthread->stacktop - 1));
+	kmem_cache_free(kthread_kcache, kthread);
+}
+
+/* Pools are LIFO, so we reuse the stacks that are still in the cache */
+static void kthread_pool_put(struct kthread_pool *pool, struct kthread *kthread)
+{
+	TAILQ_INSERT_HEAD(&pool->kthreads, kthread, link);
+	pool->nr_kthreads++;
+}
+
+/* Tops the pool up to nr kthreads, or as close as memory allows */
+static void kthread_pool_fill(struct kthread_pool *pool, unsigned int nr)
+{
+	struct kthread *kthread;
+
+	while (pool->nr_kthreads < nr) {
+		kthread = kthread_alloc();
+		if (!kthread)
+			return;
+		TAILQ_INSERT_TAIL(&pool->kthreads, kthread, link);
+		pool->nr_kthreads++;
+	}
+}
+
+/* Frees the coldest kthreads until the pool has at most nr */
+static void kthread_pool_trim(struct kthread_pool *pool, unsigned int nr)
+{
+	struct kthread *kthread;
+
+	while (pool->nr_kthreads > nr) {
+		kthread = TAILQ_LAST(&pool->kthreads, kthread_tailq);
+		TAILQ_REMOVE(&pool->kthreads, kthread, link);
+		pool->nr_kthreads--;
+		pool->nr_frees++;
+		kthread_free(kthread);
+	}
+}
+
+/* Gets a kthread and stack to switch to, refilling the pool if it is empty */
+static struct kthread *kthread_pool_get(struct kthread_pool *pool)
+{
+	struct kthread *kthread;
+
+	if (!pool->nr_kthreads) {
+		pool->nr_misses++;
+		kthread_pool_fill(pool, KTHREAD_POOL_LOW);
+	}
+	kthread = TAILQ_FIRST(&pool->kthreads);
+	assert(kthread);
+	TAILQ_REMOVE(&pool->kthreads, kthread, link);
+	pool->nr_kthreads--;
+	return kthread;
+}
+
+/* Called by each core in smp_percpu_init(), so the pool is ready before the
+ * core's first block. */
+void kthread_pool_init(struct kthread_pool *pool)
+{
+	TAILQ_INIT(&pool->kthreads);
+	pool->nr_kthreads = 0;
+	pool->nr_blocks = 0;
+	pool->nr_restarts = 0;
+	pool->nr_misses = 0;
+	pool->nr_frees = 0;
+	kthread_pool_fill(pool, KTHREAD_POOL_LOW);
+}
+
+void print_kthread_stats(void)
+{
+	struct kthread_pool *pool;
+
+	printk("Core     Blocks   Restarts  Pool misses  Pool frees  Pooled\n");
+	for (int i = 0; i < num_cpus; i++) {
+		pool = &per_cpu_info[i].kthread_pool;
+		printk("%4d %10llu %10llu %12llu %11llu %7u\n", i, pool->nr_blocks,
+		       pool->nr_restarts, pool->nr_misses, pool->nr_frees,
+		       pool->nr_kthreads);
+	}
+}
+
 /* Starts kthread on the calling core.  This does not return, and will handle
  * the details of cleaning up whatever is currently running (freeing its stack,
  * etc).  Pairs with sem_down(). */
@@ -30,17 +140,12 @@ void restart_kthread(struct kthread *kthread)
 	/* Avoid messy complications.  The kthread will enable_irqsave() when it
 	 * comes back up. */
 	disable_irq();
-	/* Free any spare, since we need ours to become the spare (since we can't
-	 * free our current kthread *before* popping it, nor can we free the current
-	 * stack until we pop to the kthread's stack). */
-	if (pcpui->spare) {
-		/* assumes the stack is a page, and that stacktop is somewhere in
-		 * (pg_bottom, pg_bottom + PGSIZE].  Normally, it ought to be pg_bottom
-		 * + PGSIZE (on x86).  kva2page can take any kva, not just a page
-		 * aligned addr. */
-		page_decref(kva2page((void*)pcpui->spare->stacktop - 1));
-		kmem_cache_free(kthread_kcache, pcpui->spare);
-	}
+	pcpui->kthread_pool.nr_restarts++;
+	/* Make room in the pool for our kthread, which will hold the stack we're on
+	 * (we can't free our current kthread *before* popping it, nor can we free
+	 * the current stack until we pop to the kthread's stack).  Everything
+	 * already in the pool is free to go. */
+	kthread_pool_trim(&pcpui->kthread_pool, KTHREAD_POOL_HIGH - 1);
 	current_stacktop = get_stack_top();
 	/* When a kthread runs, its stack is the default kernel stack */
 	set_stack_top(kthread->stacktop);
@@ -55,9 +160,10 @@ void restart_kthread(struct kthread *kthread)
 	assert(!*kth_stack_poison);
 	*kth_stack_poison = 0xdeadbeef;
 #endif /* CONFIG_KTHREAD_POISON */
-	/* Set the spare stuff (current kthread, current (not kthread) stacktop) */
-	pcpui->spare = kthread;
+	/* Pool the current kthread with the current (not kthread) stacktop.  No one
+	 * will take it til we're off this stack, since irqs are disabled. */
 	kthread->stacktop = current_stacktop;
+	kthread_pool_put(&pcpui->kthread_pool, kthread);
 	/* Only change current if we need to (the kthread was in process context) */
 	if (kthread->proc) {
 		/* Load our page tables before potentially decreffing cur_proc */
@@ -72,6 +178,11 @@ void restart_kthread(struct kthread *kthread)
 	/* Tell the core which syscall we are running (if any) */
 	assert(!pcpui->cur_sysc);	/* catch bugs, prev user should clear */
 	pcpui->cur_sysc = kthread->sysc;
+	/* and give it back its plug */
+	assert(!pcpui->plug_depth);
+	pcpui->plugged_bdev = kthread->plugged_bdev;
+	pcpui->plug_depth = kthread->plug_depth;
+	bdev_plug_resume();
 	/* Finally, restart our thread */
 	pop_kernel_ctx(&kthread->context);
 }
@@ -170,7 +281,6 @@ void sem_down(struct semaphore *sem)
 {
 	volatile bool blocking = TRUE;	/* signal to short circuit when restarting*/
 	struct kthread *kthread;
-	struct page *page;				/* assumption here that stacks are PGSIZE */
 	register uintptr_t new_stacktop;
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 
@@ -186,27 +296,15 @@ void sem_down(struct semaphore *sem)
 		goto block_return_path;
 	}
 	spin_unlock(&sem->lock);
-	/* We're probably going to sleep, so get ready.  We'll check again later. */
-	/* Try to get the spare first.  If there is one, we'll use it (o/w, we'll
-	 * get a fresh kthread.  Why we need this is more clear when we try to
-	 * restart kthreads.  Having them also ought to cut down on contention.
-	 * Note we do this with interrupts disabled (which protects us from
-	 * concurrent modifications). */
-	if (pcpui->spare) {
-		kthread = pcpui->spare;
-		/* we're using the spare, so we use the page the spare held */
-		new_stacktop = kthread->stacktop;
-		pcpui->spare = 0;
-	} else {
-		kthread = kmem_cache_alloc(kthread_kcache, 0);
-		assert(kthread);
-		assert(!kpage_alloc(&page));	/* decref'd when the kthread is freed */
-#ifdef CONFIG_KTHREAD_POISON
-		/* TODO: KTHR-STACK don't poison like this */
-		*(uintptr_t*)page2kva(page) = 0;
-#endif /* CONFIG_KTHREAD_POISON */
-		new_stacktop = (uintptr_t)page2kva(page) + PGSIZE;
-	}
+	/* We're probably going to sleep, so get ready.  We'll check again later.
+	 * Our plugged IO could be what we're waiting for, so let it go. */
+	bdev_plug_suspend();
+	/* Get a kthread from the pool.  Our context goes in the kthread, and the
+	 * core moves on to the stack the kthread held.  Note we do this with
+	 * interrupts disabled (which protects the pool from concurrent
+	 * modifications). */
+	kthread = kthread_pool_get(&pcpui->kthread_pool);
+	new_stacktop = kthread->stacktop;
 	/* This is the stacktop we are currently on and wish to save */
 	kthread->stacktop = get_stack_top();
 	/* Set the core's new default stack */
@@ -230,6 +328,11 @@ void sem_down(struct semaphore *sem)
 	/* kthread tracks the syscall it is working on, which implies errno */
 	kthread->sysc = pcpui->cur_sysc;
 	pcpui->cur_sysc = 0;				/* this core no longer works on sysc */
+	/* and the plug, if any */
+	kthread->plugged_bdev = pcpui->plugged_bdev;
+	kthread->plug_depth = pcpui->plug_depth;
+	pcpui->plugged_bdev = 0;
+	pcpui->plug_depth = 0;
 	if (kthread->proc)
 		proc_incref(kthread->proc, 1);
 	/* Save the context, toggle blocking for the reactivation */
@@ -243,6 +346,7 @@ void sem_down(struct semaphore *sem)
 	spin_lock(&sem->lock);
 	if (sem->nr_signals-- <= 0) {
 		TAILQ_INSERT_TAIL(&sem->waiters, kthread, link);
+		pcpui->kthread_pool.nr_blocks++;
 		/* At this point, we know we'll sleep and change stacks later.  Once we
 		 * unlock, we could have the kthread restarted (possibly on another
 		 * core), so we need to disable irqs until we are on our new stack.
@@ -271,11 +375,13 @@ unwind_sleep_prep:
 	if (kthread->proc)
 		proc_decref(kthread->proc);
 	set_stack_top(kthread->stacktop);
-	/* Save the allocs as the spare */
-	assert(!pcpui->spare);
-	pcpui->spare = kthread;
-	/* save the "freshly alloc'd" stack/page, not the one we came in on */
+	pcpui->plugged_bdev = kthread->plugged_bdev;
+	pcpui->plug_depth = kthread->plug_depth;
+	bdev_plug_resume();
+	/* Give the kthread back, with the stack we got from the pool, not the one
+	 * we came in on */
 	kthread->stacktop = new_stacktop;
+	kthread_pool_put(&pcpui->kthread_pool, kthread);
 #ifdef CONFIG_KTHREAD_POISON
 	/* TODO: KTHR-STACK don't unpoison like this */
 	/* switch back to old stack in use, new one not */
@@ -23,6 +23,7 @@
 #include <slab.h>
 #include <kmalloc.h>
 #include <vfs.h>
+#include <writeback.h>
 #include <smp.h>
 
 struct kmem_cache *vmr_kcache;
@@ -33,16 +34,208 @@ void vmr_init(void)
 	                               __alignof__(struct dentry), 0, 0, 0);
 }
 
+/* VMR tree helpers.  The tree is an AVL tree, keyed on vm_base, and augmented
+ * with the largest gap in each subtree.  The keys never change once a VMR is in
+ * the tree (splitting and merging change vm_end), so whenever a VMR's gap
+ * changes, we can find it from the root and fix up the path. */
+static int vmr_height(struct vm_region *vmr)
+{
+	return vmr ? vmr->vm_height : 0;
+}
+
+static size_t vmr_max_gap(struct vm_region *vmr)
+{
+	return vmr ? vmr->vm_max_gap : 0;
+}
+
+/* Recomputes vmr's height and max gap from its children */
+static void vmr_update(struct vm_region *vmr)
+{
+	vmr->vm_height = MAX(vmr_height(vmr->vm_left),
+	                     vmr_height(vmr->vm_right)) + 1;
+	vmr->vm_max_gap = MAX(vmr->vm_gap, MAX(vmr_max_gap(vmr->vm_left),
+	                                       vmr_max_gap(vmr->vm_right)));
+}
+
+static struct vm_region *vmr_rotate_right(struct vm_region *vmr)
+{
+	struct vm_region *left = vmr->vm_left;
+
+	vmr->vm_left = left->vm_right;
+	left->vm_right = vmr;
+	vmr_update(vmr);
+	vmr_update(left);
+	return left;
+}
+
+static struct vm_region *vmr_rotate_left(struct vm_region *vmr)
+{
+	struct vm_region *right = vmr->vm_right;
+
+	vmr->vm_right = right->vm_left;
+	right->vm_left = vmr;
+	vmr_update(vmr);
+	vmr_update(right);
+	return right;
+}
+
+/* Rebalances the subtree rooted at vmr, whose children are balanced, and
+ * returns the new root of the subtree. */
+static struct vm_region *vmr_balance(struct vm_region *vmr)
+{
+	int balance = vmr_height(vmr->vm_left) - vmr_height(vmr->vm_right);
+
+	if (balance > 1) {
+		if (vmr_height(vmr->vm_left->vm_left) <
+		    vmr_height(vmr->vm_left->vm_right))
+			vmr->vm_left = vmr_rotate_left(vmr->vm_left);
+		return vmr_rotate_right(vmr);
+	}
+	if (balance < -1) {
+		if (vmr_height(vmr->vm_right->vm_right) <
+		    vmr_height(vmr->vm_right->vm_left))
+			vmr->vm_right = vmr_rotate_right(vmr->vm_right);
+		return vmr_rotate_left(vmr);
+	}
+	vmr_update(vmr);
+	return vmr;
+}
+
+static struct vm_region *__vmr_tree_insert(struct vm_region *root,
+                                           struct vm_region *vmr)
+{
+	if (!root)
+		return vmr;
+	if (vmr->vm_base < root->vm_base)
+		root->vm_left = __vmr_tree_insert(root->vm_left, vmr);
+	else
+		root->vm_right = __vmr_tree_insert(root->vm_right, vmr);
+	return vmr_balance(root);
+}
+
+/* Removes the lowest VMR from the subtree, returning it in *min */
+static struct vm_region *__vmr_tree_remove_min(struct vm_region *root,
+                                               struct vm_region **min)
+{
+	if (!root->vm_left) {
+		*min = root;
+		return root->vm_right;
+	}
+	root->vm_left = __vmr_tree_remove_min(root->vm_left, min);
+	return vmr_balance(root);
+}
+
+static struct vm_region *__vmr_tree_remove(struct vm_region *root,
+                                           struct vm_region *vmr)
+{
+	struct vm_region *succ;
+
+	assert(root);
+	if (root == vmr) {
+		if (!vmr->vm_left)
+			return vmr->vm_right;
+		if (!vmr->vm_right)
+			return vmr->vm_left;
+		vmr->vm_right = __vmr_tree_remove_min(vmr->vm_right, &succ);
+		succ->vm_left = vmr->vm_left;
+		succ->vm_right = vmr->vm_right;
+		return vmr_balance(succ);
+	}
+	if (vmr->vm_base < root->vm_base)
+		root->vm_left = __vmr_tree_remove(root->vm_left, vmr);
+	else
+		root->vm_right = __vmr_tree_remove(root->vm_right, vmr);
+	return vmr_balance(root);
+}
+
+/* Recomputes the max gaps on the path from root down to vmr */
+static void __vmr_tree_fixup(struct vm_region *root, struct vm_region *vmr)
+{
+	assert(root);
+	if (vmr->vm_base < root->vm_base)
+		__vmr_tree_fixup(root->vm_left, vmr);
+	else if (vmr->vm_base > root->vm_base)
+		__vmr_tree_fixup(root->vm_right, vmr);
+	vmr_update(root);
+}
+
+/* Helper: recomputes the free VA after vmr, up to the next one, and updates the
+ * tree.  Call this whenever vmr or its successor changes. */
+static void vmr_gap_changed(struct vm_region *vmr)
+{
+	struct vm_region *next = TAILQ_NEXT(vmr, vm_link);
+
+	vmr->vm_gap = (next ? next->vm_base : UMAPTOP) - vmr->vm_end;
+	__vmr_tree_fixup(vmr->vm_proc->vmr_root, vmr);
+}
+
+/* Helper: adds a VMR, with its proc, base, and end set, to its proc's list and
+ * tree. */
+static void vmr_insert(struct vm_region *vmr)
+{
+	struct proc *p = vmr->vm_proc;
+	struct vm_region *next, *prev;
+
+	next = find_first_vmr(p, vmr->vm_base);
+	if (next)
+		TAILQ_INSERT_BEFORE(next, vmr, vm_link);
+	else
+		TAILQ_INSERT_TAIL(&p->vm_regions, vmr, vm_link);
+	vmr->vm_left = 0;
+	vmr->vm_right = 0;
+	vmr->vm_gap = (next ? next->vm_base : UMAPTOP) - vmr->vm_end;
+	vmr_update(vmr);
+	p->vmr_root = __vmr_tree_insert(p->vmr_root, vmr);
+	prev = TAILQ_PREV(vmr, vmr_tailq, vm_link);
+	if (prev)
+		vmr_gap_changed(prev);
+}
+
+/* Helper: takes vmr off its proc's list and tree */
+static void vmr_remove(struct vm_region *vmr)
+{
+	struct proc *p = vmr->vm_proc;
+	struct vm_region *prev = TAILQ_PREV(vmr, vmr_tailq, vm_link);
+
+	TAILQ_REMOVE(&p->vm_regions, vmr, vm_link);
+	p->vmr_root = __vmr_tree_remove(p->vmr_root, vmr);
+	if (prev)
+		vmr_gap_changed(prev);
+}
+
+/* Finds the lowest VMR in the subtree with a gap after it that can hold len
+ * bytes at or above va.  Subtrees without a big enough gap are skipped, as are
+ * the left subtrees of VMRs below va, so this is O(log n). */
+static struct vm_region *__vmr_find_gap(struct vm_region *root, uintptr_t va,
+                                        size_t len)
+{
+	struct vm_region *ret;
+	uintptr_t gap_end;
+
+	if (!root || root->vm_max_gap < len)
+		return 0;
+	/* Gaps in the left subtree end by root->vm_base */
+	if (root->vm_base > va) {
+		ret = __vmr_find_gap(root->vm_left, va, len);
+		if (ret)
+			return ret;
+	}
+	gap_end = root->vm_end + root->vm_gap;
+	if ((gap_end > va) && (gap_end - MAX(root->vm_end, va) >= len))
+		return root;
+	return __vmr_find_gap(root->vm_right, va, len);
+}
+
 /* For now, the caller will set the prot, flags, file, and offset.  In the
  * future, we may put those in here, to do clever things with merging vm_regions
  * that are the same.
  *
- * TODO: take a look at solari's vmem alloc.  And consider keeping these in a
- * tree of some sort for easier lookups. */
+ * We'll put it at va if it fits, o/w at the lowest spot above va that fits.
+ * TODO: take a look at solari's vmem alloc. */
 struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 {
-	struct vm_region *vmr = 0, *vm_i, *vm_next;
-	uintptr_t gap_end;
+	struct vm_region *vmr, *vm_i;
+	uintptr_t base;
 
 	assert(!PGOFF(va));
 	assert(!PGOFF(len));
@@ -51,44 +244,24 @@ struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 	vm_i = TAILQ_FIRST(&p->vm_regions);
 	/* This works for now, but if all we have is BRK_END ones, we'll start
 	 * growing backwards (TODO) */
-	if (!vm_i || (va + len < vm_i->vm_base)) {
-		vmr = kmem_cache_alloc(vmr_kcache, 0);
-		if (!vmr)
-			panic("EOM!");
-		memset(vmr, 0, sizeof(struct vm_region));
-		vmr->vm_base = va;
-		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
+	if (!vm_i || (va + len <= vm_i->vm_base)) {
+		base = va;
 	} else {
-		TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
-			vm_next = TAILQ_NEXT(vm_i, vm_link);
-			gap_end = vm_next ? vm_next->vm_base : UMAPTOP;
-			/* skip til we get past the 'hint' va */
-			if (va >= gap_end)
-				continue;
-			/* Find a gap that is big enough */
-			if (gap_end - vm_i->vm_end >= len) {
-				vmr = kmem_cache_alloc(vmr_kcache, 0);
-				if (!vmr)
-					panic("EOM!");
-				memset(vmr, 0, sizeof(struct vm_region));
-				/* if we can put it at va, let's do that.  o/w, put it so it
-				 * fits */
-				if ((gap_end >= va + len) && (va >= vm_i->vm_end))
-					vmr->vm_base = va;
-				else
-					vmr->vm_base = vm_i->vm_end;
-				TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr, vm_link);
-				break;
-			}
+		vm_i = __vmr_find_gap(p->vmr_root, va, len);
+		if (!vm_i) {
+			warn("Not making a VMR, wanted %p, + %p = %p", va, len, va + len);
+			return 0;
 		}
+		base = MAX(vm_i->vm_end, va);
 	}
-	/* Finalize the creation, if we got one */
-	if (vmr) {
-		vmr->vm_proc = p;
-		vmr->vm_end = vmr->vm_base + len;
-	}
+	vmr = kmem_cache_alloc(vmr_kcache, 0);
 	if (!vmr)
-		warn("Not making a VMR, wanted %p, + %p = %p", va, len, va + len);
+		panic("EOM!");
+	memset(vmr, 0, sizeof(struct vm_region));
+	vmr->vm_proc = p;
+	vmr->vm_base = base;
+	vmr->vm_end = base + len;
+	vmr_insert(vmr);
 	return vmr;
 }
 
@@ -103,8 +276,6 @@ struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 	if ((old_vmr->vm_base >= va) || (old_vmr->vm_end <= va))
 		return 0;
 	new_vmr = kmem_cache_alloc(vmr_kcache, 0);
-	TAILQ_INSERT_AFTER(&old_vmr->vm_proc->vm_regions, old_vmr, new_vmr,
-	                   vm_link);
 	new_vmr->vm_proc = old_vmr->vm_proc;
 	new_vmr->vm_base = va;
 	new_vmr->vm_end = old_vmr->vm_end;
@@ -120,6 +291,8 @@ struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 		new_vmr->vm_file = 0;
 		new_vmr->vm_foff = 0;
 	}
+	/* This also fixes old_vmr's gap, which is now 0 */
+	vmr_insert(new_vmr);
 	return new_vmr;
 }
 
@@ -137,6 +310,7 @@ int merge_vmr(struct vm_region *first, struct vm_region *second)
 	                         first->vm_end - first->vm_base))
 		return -1;
 	first->vm_end = second->vm_end;
+	/* Removing second fixes up first's gap */
 	destroy_vmr(second);
 	return 0;
 }
@@ -170,6 +344,7 @@ int grow_vmr(struct vm_region *vmr, uintptr_t va)
 	if (va <= vmr->vm_end)
 		return -1;
 	vmr->vm_end = va;
+	vmr_gap_changed(vmr);
 	return 0;
 }
 
@@ -181,6 +356,7 @@ int shrink_vmr(struct vm_region *vmr, uintptr_t va)
 	if ((va < vmr->vm_base) || (va > vmr->vm_end))
 		return -1;
 	vmr->vm_end = va;
+	vmr_gap_changed(vmr);
 	return 0;
 }
 
@@ -190,7 +366,7 @@ void destroy_vmr(struct vm_region *vmr)
 {
 	if (vmr->vm_file)
 		kref_put(&vmr->vm_file->f_kref);
-	TAILQ_REMOVE(&vmr->vm_proc->vm_regions, vmr, vm_link);
+	vmr_remove(vmr);
 	kmem_cache_free(vmr_kcache, vmr);
 }
 
@@ -198,10 +374,14 @@ void destroy_vmr(struct vm_region *vmr)
  * if there is none. */
 struct vm_region *find_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
+	struct vm_region *vmr = p->vmr_root;
+
+	while (vmr) {
+		if (va < vmr->vm_base)
+			vmr = vmr->vm_left;
+		else if (va >= vmr->vm_end)
+			vmr = vmr->vm_right;
+		else
 			return vmr;
 	}
 	return 0;
@@ -211,15 +391,18 @@ struct vm_region *find_vmr(struct proc *p, uintptr_t va)
  * none. */
 struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-		if (vmr->vm_base > va)
-			return vmr;
+	struct vm_region *vmr = p->vmr_root, *ret = 0;
+
+	/* VMRs don't overlap, so they are sorted by vm_end too */
+	while (vmr) {
+		if (vmr->vm_end > va) {
+			ret = vmr;
+			vmr = vmr->vm_left;
+		} else {
+			vmr = vmr->vm_right;
+		}
 	}
-	return 0;
+	return ret;
 }
 
 /* Makes sure that no VMRs cross either the start or end of the given region
@@ -239,13 +422,59 @@ void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 void destroy_vmrs(struct proc *p)
 {
 	struct vm_region *vm_i;
-	TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link)
+	while ((vm_i = TAILQ_FIRST(&p->vm_regions)))
 		destroy_vmr(vm_i);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure. */
+/* Order of the contiguous allocation backing a jumbo page */
+#define JPG_ORDER (LOG2_UP(JPGSIZE / PGSIZE))
+/* Size of the window of cached file pages mapped on a read fault */
+#define FAULT_AROUND_PAGES 16
+
+static int __vmr_fault(struct proc *p, struct vm_region *vmr, uintptr_t va,
+                       int prot);
+#ifdef CONFIG_FAULT_AROUND
+static void fault_around(struct proc *p, struct vm_region *vmr, uintptr_t va);
+#endif
+
+/* Helper: tries to map a zeroed jumbo page at va, which must be JPGSIZE
+ * aligned.  Returns the jumbo's KVA, or 0 if we're out of contiguous memory or
+ * something is already mapped at va, in which case the caller should use little
+ * pages.  Jumbos ignore the proc's cache colors, since they cover all of them. */
+static void *map_jumbo(struct proc *p, uintptr_t va, int pte_prot)
+{
+	void *kva = get_cont_pages(JPG_ORDER, 0);
+
+	if (!kva)
+		return 0;
+	/* Zero before the PTE is visible to the proc's other cores */
+	memset(kva, 0, JPGSIZE);
+	if (pgdir_map_jumbo(p->env_pgdir, (void*)va, kva2page(kva), pte_prot)) {
+		free_cont_pages(kva, JPG_ORDER);
+		return 0;
+	}
+	return kva;
+}
+
+/* Helper: makes sure no jumbo mapping crosses either end of [va, va + len),
+ * splitting any that do.  Callers can then treat any jumbos they find in the
+ * region as all or nothing. */
+static int isolate_jumbos(struct proc *p, uintptr_t va, size_t len)
+{
+	if ((va % JPGSIZE) && pgdir_split_jumbo(p->env_pgdir, (void*)va))
+		return -ENOMEM;
+	if (((va + len) % JPGSIZE) &&
+	    pgdir_split_jumbo(p->env_pgdir, (void*)(va + len)))
+		return -ENOMEM;
+	return 0;
+}
+
+/* Helper: makes new_p share p's present pages in [va_start, va_end), copy on
+ * write.  Both PTEs lose write access and get PTE_COW, and the page gets a ref
+ * for new_p's PTE.  The first write from either side faults and gets its own
+ * copy (see __cow_page()).  Jumbos get split first, since CoW is per little
+ * page and kernel_cow_fault() can't split them.  The caller needs to flush p's
+ * TLB.  0 on success, -ERROR on failure. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
@@ -259,19 +488,35 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		     va_end);
 		return -EINVAL;
 	}
+	for (uintptr_t va = ROUNDDOWN(va_start, JPGSIZE); va < va_end;
+	     va += JPGSIZE) {
+		if (pgdir_split_jumbo(p->env_pgdir, (void*)va))
+			return -ENOMEM;
+	}
 	int copy_page(struct proc *p, pte_t *pte, void *va, void *arg) {
 		struct proc *new_p = (struct proc*)arg;
 		struct page *pp;
+		pte_t *new_pte, old_pte, cow_pte;
 		if (PAGE_PRESENT(*pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
+			new_pte = pgdir_walk(new_p->env_pgdir, va, 1);
+			if (!new_pte)
 				return -ENOMEM;
-			if (page_insert(new_p->env_pgdir, pp, va, *pte & PTE_PERM)) {
+			/* If the page is already CoW, the kernel could copy it out from
+			 * under us and drop the last ref.  So get our ref first, and only
+			 * keep it if the PTE still has that page. */
+			do {
+				old_pte = ACCESS_ONCE(*pte);
+				pp = ppn2page(PTE2PPN(old_pte));
+				if (!kref_get_not_zero(&pp->pg_kref, 1))
+					continue;
+				cow_pte = old_pte | PTE_COW;
+				if ((old_pte & PTE_PERM) == PTE_USER_RW)
+					cow_pte = (cow_pte & ~PTE_PERM) | PTE_USER_RO;
+				if (pte_cas(pte, old_pte, cow_pte))
+					break;
 				page_decref(pp);
-				return -ENOMEM;
-			}
-			memcpy(page2kva(pp), ppn2kva(PTE2PPN(*pte)), PGSIZE);
-			page_decref(pp);
+			} while (1);
+			*new_pte = cow_pte;
 		} else if (PAGE_PAGED_OUT(*pte)) {
 			/* TODO: (SWAP) will need to either make a copy or CoW/refcnt the
 			 * backend store.  For now, this PTE will be the same as the
@@ -284,41 +529,11 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 	}
 	return env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
 	                         new_p);
-	/* here's how to do it without the env_user_mem_walk */
-#if 0
-	pte_t *old_pte;
-	struct page *pp;
-	/* For each page, check the old PTE and copy present pages over */
-	for (uintptr_t va_i = va_start; va_i < va_end; va_i += PGSIZE) {
-		old_pte = pgdir_walk(p->env_pgdir, (void*)va_i, 0);
-		if (!old_pte)
-			continue;
-		if (PAGE_PRESENT(*old_pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
-				return -ENOMEM;
-			if (page_insert(new_p->env_pgdir, pp, (void*)va_i,
-			                *old_pte & PTE_PERM)) {
-				page_decref(pp);
-				return -ENOMEM;
-			}
-			pagecopy(page2kva(pp), ppn2kva(PTE2PPN(*old_pte)));
-			page_decref(pp);
-		} else if (PAGE_PAGED_OUT(*old_pte)) {
-			/* TODO: (SWAP) will need to either make a copy or CoW/refcnt the
-			 * backend store.  For now, this PTE will be the same as the
-			 * original PTE */
-			panic("Swapping not supported!");
-		} else {
-			panic("Weird PTE %p in %s!", *old_pte, __FUNCTION__);
-		}
-	}
-	return 0;
-#endif
 }
 
 /* This will make new_p have the same VMRs as p, and it will make sure all
- * physical pages are copied over, with the exception of MAP_SHARED files.
+ * physical pages are shared copy-on-write, with the exception of MAP_SHARED
+ * files (which are shared for real).
  * This is used by fork().
  *
  * Note that if you are working on a VMR that is a file, you'll want to be
@@ -340,15 +555,18 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 			kref_get(&vm_i->vm_file->f_kref, 1);
 		vmr->vm_file = vm_i->vm_file;
 		vmr->vm_foff = vm_i->vm_foff;
+		/* Insert first, so new_p's teardown cleans up after a failure */
+		vmr_insert(vmr);
 		if (!vmr->vm_file || vmr->vm_flags & MAP_PRIVATE) {
 			assert(!(vmr->vm_flags & MAP_SHARED));
-			/* Copy over the memory from one VMR to the other */
+			/* Share the memory from one VMR with the other, CoW */
 			if ((ret = copy_pages(p, new_p, vmr->vm_base, vmr->vm_end)))
-				return ret;
+				break;
 		}
-		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
 	}
-	return 0;
+	/* copy_pages() write-protected p's pages, even if it failed partway */
+	proc_tlbshootdown(p, 0, UMAPTOP);
+	return ret;
 }
 
 void print_vmrs(struct proc *p)
@@ -481,8 +699,7 @@ void *__do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
                 struct file *file, size_t offset)
 {
 	len = ROUNDUP(len, PGSIZE);
-	int num_pages = len / PGSIZE;
-	int retval;
+	int retval, pte_prot;
 
 	struct vm_region *vmr, *vmr_temp;
 
@@ -545,15 +762,25 @@ void *__do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	 * length and not any merged regions, which is why we set addr above and use
 	 * it here.
 	 *
+	 * Anonymous memory gets jumbo pages for any aligned JPGSIZE chunks, if we
+	 * can get the contiguous memory, and little pages otherwise.
+	 *
 	 * If HPF errors out, we'll warn and fail for now.  This could be due to
 	 * some userspace error, but also occurs when we run out of memory.  If we
 	 * are out of memory, the kernel can't really handle it. */
+	pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	if (flags & MAP_POPULATE && vmr->vm_prot != PROT_NONE)
-		for (int i = 0; i < num_pages; i++) {
-			retval = __handle_page_fault(p, addr + i * PGSIZE, vmr->vm_prot);
+		for (uintptr_t va = addr; va < addr + len; va += PGSIZE) {
+			if (!file && !(va % JPGSIZE) && (va + JPGSIZE <= addr + len) &&
+			    map_jumbo(p, va, pte_prot)) {
+				va += JPGSIZE - PGSIZE;
+				continue;
+			}
+			retval = __vmr_fault(p, vmr, va, vmr->vm_prot);
 			if (retval) {
 				warn("do_mmap() failing (%d) on addr %p with prot 0x%x",
-				     retval, addr + i * PGSIZE,  vmr->vm_prot);
+				     retval, va,  vmr->vm_prot);
 				destroy_vmr(vmr);
 				set_errno(-retval);
 				if (retval == -ENOMEM) {
@@ -586,20 +813,33 @@ int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	return ret;
 }
 
+/* Shoots down everything batched so far, and resets the batch */
+void tlb_batch_flush(struct proc *p, struct tlb_batch *batch)
+{
+	if (batch->start < batch->end)
+		proc_tlbshootdown(p, batch->start, batch->end);
+	tlb_batch_init(batch);
+}
+
 /* This does not care if the region is not mapped.  POSIX says you should return
  * ENOMEM if any part of it is unmapped.  Can do this later if we care, based on
  * the VMRs, not the actual page residency. */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 {
 	struct vm_region *vmr, *next_vmr;
-	pte_t *pte;
-	bool shootdown_needed = FALSE;
+	pte_t *pte, old_pte, new_pte;
+	struct tlb_batch batch;
 	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
+	if (isolate_jumbos(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	/* TODO: this is aggressively splitting, when we might not need to if the
 	 * prots are the same as the previous.  Plus, there are three excessive
 	 * scans.  Finally, we might be able to merge when we are done. */
 	isolate_vmrs(p, addr, len);
+	tlb_batch_init(&batch);
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
 		if (vmr->vm_prot == prot)
@@ -612,15 +852,27 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		for (uintptr_t va = vmr->vm_base; va < vmr->vm_end; va += PGSIZE) { 
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (pte && PAGE_PRESENT(*pte)) {
-				*pte = (*pte & ~PTE_PERM) | pte_prot;
-				shootdown_needed = TRUE;
+				/* CoW pages stay read-only until the write fault */
+				do {
+					old_pte = ACCESS_ONCE(*pte);
+					if ((old_pte & PTE_COW) && (pte_prot == PTE_USER_RW))
+						new_pte = (old_pte & ~PTE_PERM) | PTE_USER_RO;
+					else
+						new_pte = (old_pte & ~PTE_PERM) | pte_prot;
+				} while (!pte_cas(pte, old_pte, new_pte));
+				/* isolate_jumbos() made sure jumbos are entirely in range */
+				if (PAGE_JUMBO(*pte)) {
+					tlb_batch_add(&batch, va, JPGSIZE);
+					va += JPGSIZE - PGSIZE;
+				} else {
+					tlb_batch_add(&batch, va, PGSIZE);
+				}
 			}
 		}
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		vmr = next_vmr;
 	}
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_batch_flush(p, &batch);
 	return 0;
 }
 
@@ -648,24 +900,39 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	struct vm_region *vmr, *next_vmr;
 	pte_t *pte;
-	bool shootdown_needed = FALSE;
+	struct tlb_batch batch;
 
+	/* Break up any jumbos on the ends before we touch anything, so a failure
+	 * leaves the region as it was. */
+	if (isolate_jumbos(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	/* TODO: this will be a bit slow, since we end up doing three linear
 	 * searches (two in isolate, one in find_first). */
 	isolate_vmrs(p, addr, len);
+	tlb_batch_init(&batch);
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
 		for (uintptr_t va = vmr->vm_base; va < vmr->vm_end; va += PGSIZE) { 
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (!pte)
 				continue;
-			if (PAGE_PRESENT(*pte)) {
+			if (PAGE_JUMBO(*pte)) {
+				/* Entirely in range, thanks to isolate_jumbos().  Same TLB race
+				 * as below. */
+				jumbo_decref(*pte);
+				*pte = 0;
+				tlb_batch_add(&batch, va, JPGSIZE);
+				va += JPGSIZE - PGSIZE;
+			} else if (PAGE_PRESENT(*pte)) {
 				/* TODO: (TLB) race here, where the page can be given out before
 				 * the shootdown happened.  Need to put it on a temp list. */
-				page_t *page = ppn2page(PTE2PPN(*pte));
-				*pte = 0;
+				pte_t old_pte = pte_swap(pte, 0);
+				page_t *page = ppn2page(PTE2PPN(old_pte));
+				pm_dirty_mapped_page(page, old_pte);
 				page_decref(page);
-				shootdown_needed = TRUE;
+				tlb_batch_add(&batch, va, PGSIZE);
 			} else if (PAGE_PAGED_OUT(*pte)) {
 				/* TODO: (SWAP) mark free in the swapfile or whatever.  For now,
 				 * PAGED_OUT is also being used to mean "hasn't been mapped
@@ -679,11 +946,90 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 		destroy_vmr(vmr);
 		vmr = next_vmr;
 	}
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_batch_flush(p, &batch);
 	return 0;
 }
 
+/* Helper: gives p its own writable copy of the CoW page at va, whose PTE is
+ * pte.  Returns 0 once the PTE is writable, even if someone else got there
+ * first.
+ *
+ * This works without the mm_lock, for kernel_cow_fault(), so the PTE only
+ * changes with a CAS.  If no one else has the page anymore, we just take it
+ * over, but only with the lock held (can_take): otherwise, a fork could be
+ * sharing the page with a new child, in which case the PTE wouldn't change and
+ * our CAS would succeed anyway.  Copies are always safe. */
+static int __cow_page(struct proc *p, uintptr_t va, pte_t *pte, bool can_take)
+{
+	pte_t old_pte = ACCESS_ONCE(*pte);
+	struct page *old_page, *new_page;
+	DECL_BITMASK(targets, MAX_NUM_CPUS);
+
+	/* Someone else already broke it, or unmapped it */
+	if (!PAGE_PRESENT(old_pte) || !(old_pte & PTE_COW))
+		return 0;
+	old_page = ppn2page(PTE2PPN(old_pte));
+	if (can_take && (kref_refcnt(&old_page->pg_kref) == 1)) {
+		/* Other cores might have the RO translation cached, which is fine.
+		 * They'll just take a spurious fault. */
+		pte_cas(pte, old_pte, (old_pte & ~(PTE_PERM | PTE_COW)) | PTE_USER_RW);
+		return 0;
+	}
+	if (upage_alloc(p, &new_page, FALSE))
+		return -ENOMEM;
+	/* No one can write the old page, since everyone has it read-only */
+	memcpy(page2kva(new_page), page2kva(old_page), PGSIZE);
+	if (!pte_cas(pte, old_pte,
+	             PTE(page2ppn(new_page),
+	                 (PGOFF(old_pte) & ~(PTE_PERM | PTE_COW)) | PTE_USER_RW))) {
+		page_decref(new_page);
+		return 0;
+	}
+	/* No one can keep using the old page.  We might be in the kernel, writing
+	 * to p's memory, so flush locally too.  Only an MCP can have it in other
+	 * cores' TLBs.  Without the mm_lock, we might be in an IRQ, so we can't
+	 * grab the proc_lock to see which cores those are. */
+	tlb_invalidate(p->env_pgdir, (void*)va);
+	if (p->state == PROC_RUNNING_M) {
+		if (can_take) {
+			proc_tlbshootdown(p, va, va + PGSIZE);
+		} else {
+			CLR_BITMASK(targets, MAX_NUM_CPUS);
+			for (int i = 0; i < num_cpus; i++) {
+				if (i != core_id())
+					SET_BITMASK_BIT(targets, i);
+			}
+			send_kernel_message_multi(targets, __tlbshootdown, va,
+			                          va + PGSIZE, 0, KMSG_IMMEDIATE);
+		}
+	}
+	page_decref(old_page);
+	return 0;
+}
+
+/* Handles a kernel write fault on p's CoW page at va.  The kernel writes to
+ * user memory without the mm_lock, like ucqs and syscall structs, and sometimes
+ * from IRQs or while holding the mm_lock, so we can't take it here.  Returns 0
+ * if the kernel can retry the write. */
+int kernel_cow_fault(struct proc *p, uintptr_t va)
+{
+	pte_t *pte;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	/* Doesn't allocate, and user page tables don't go away til p does */
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	if (!pte || !PAGE_PRESENT(*pte))
+		return -EFAULT;
+	/* Someone broke the CoW, and our TLB is stale */
+	if ((*pte & PTE_PERM) == PTE_USER_RW) {
+		tlb_invalidate(p->env_pgdir, (void*)va);
+		return 0;
+	}
+	if (!(*pte & PTE_COW))
+		return -EFAULT;
+	return __cow_page(p, va, pte, FALSE);
+}
+
 int handle_page_fault(struct proc* p, uintptr_t va, int prot)
 {
 	va = ROUNDDOWN(va,PGSIZE);
@@ -708,8 +1054,6 @@ int handle_page_fault(struct proc* p, uintptr_t va, int prot)
 int __handle_page_fault(struct proc *p, uintptr_t va, int prot)
 {
 	struct vm_region *vmr;
-	struct page *a_page;
-	unsigned int f_idx;	/* index of the missing page in the file */
 	int retval;
 
 	/* Check the vmr's protection */
@@ -718,11 +1062,34 @@ int __handle_page_fault(struct proc *p, uintptr_t va, int prot)
 		return -EFAULT;
 	if (!(vmr->vm_prot & prot))			/* wrong prots for this vmr */
 		return -EPERM;
+	retval = __vmr_fault(p, vmr, va, prot);
+#ifdef CONFIG_FAULT_AROUND
+	/* Reads of a file are usually followed by reads of its neighbors */
+	if (!retval && vmr->vm_file && !(prot & PROT_WRITE))
+		fault_around(p, vmr, va);
+#endif
+	return retval;
+}
+
+/* Faults in va, which is in vmr, for an access of prot.  Callers have already
+ * checked prot against the vmr.  Returns 0 on success, or an appropriate -error
+ * code.  Assumes you hold the mm_lock. */
+static int __vmr_fault(struct proc *p, struct vm_region *vmr, uintptr_t va,
+                       int prot)
+{
+	struct page *a_page;
+	unsigned int f_idx;	/* index of the missing page in the file */
+	int retval;
+
 	/* find offending PTE (prob don't read this in).  This might alloc an
 	 * intermediate page table page. */
 	pte_t *pte = pgdir_walk(p->env_pgdir, (void*)va, 1);
 	if (!pte)
 		return -ENOMEM;
+	/* Writes to CoW pages get their own copy.  CoW pages are never jumbos
+	 * (see copy_pages()). */
+	if ((prot & PROT_WRITE) && PAGE_PRESENT(*pte) && (*pte & PTE_COW))
+		return __cow_page(p, va, pte, TRUE);
 	/* a spurious, valid PF is possible due to a legit race: the page might have
 	 * been faulted in by another core already (and raced on the memory lock),
 	 * in which case we should just return. */
@@ -758,6 +1125,9 @@ int __handle_page_fault(struct proc *p, uintptr_t va, int prot)
 			/* TODO: unlock the file */
 			return -ESPIPE; /* linux sends a SIGBUS at access time */
 		}
+		/* Sequential faults (like MAP_POPULATE of an ELF segment) read ahead */
+		pm_readahead(vmr->vm_file->f_mapping, &vmr->vm_file->f_ra, f_idx,
+		             nr_pages(vmr->vm_file->f_dentry->d_inode->i_size));
 		retval = pm_load_page(vmr->vm_file->f_mapping, f_idx, &a_page);
 		/* TODO: should be able to let go of that file shrink-lock now.  We have
 		 * a page refcnt, which might be enough (depending on how it works) */
@@ -780,6 +1150,11 @@ int __handle_page_fault(struct proc *p, uintptr_t va, int prot)
 			if (!(vmr->vm_prot & PROT_WRITE))
 				printd("[kernel] private, but unwritable file mapping of %s "
 				       "at va %p\n", file_name(vmr->vm_file), va);
+		} else if (prot & PROT_WRITE) {
+			/* Shared writes go right to the page cache.  We'll also catch them
+			 * from the PTE when it is unmapped, but until then, the flushers
+			 * should know about them. */
+			pm_dirty_page(vmr->vm_file->f_mapping, a_page);
 		}
 		/* if this is an executable page, we might have to flush the instruction
 		 * cache if our HW requires it. */
@@ -795,6 +1170,54 @@ int __handle_page_fault(struct proc *p, uintptr_t va, int prot)
 	return 0;
 }
 
+#ifdef CONFIG_FAULT_AROUND
+/* Maps the pages of vmr's file around va that are already up to date in the
+ * page cache, up to the FAULT_AROUND_PAGES-aligned window holding va.  This
+ * never starts I/O or allocates memory; anything not cached is left for a
+ * later fault.  Private mappings get the page cache's page read-only and CoW,
+ * instead of the copy __vmr_fault() makes, so they only pay for the copy if
+ * they write.  Assumes you hold the mm_lock. */
+static void fault_around(struct proc *p, struct vm_region *vmr, uintptr_t va)
+{
+	struct page_map *pm = vmr->vm_file->f_mapping;
+	size_t file_pgs = nr_pages(vmr->vm_file->f_dentry->d_inode->i_size);
+	uintptr_t start = ROUNDDOWN(va, FAULT_AROUND_PAGES * PGSIZE);
+	uintptr_t end = start + FAULT_AROUND_PAGES * PGSIZE;
+	unsigned long f_idx;
+	struct page *page;
+	pte_t *pte;
+	int pte_prot;
+
+	if (vmr->vm_flags & MAP_PRIVATE)
+		pte_prot = PTE_USER_RO | PTE_COW;
+	else
+		pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW : PTE_USER_RO;
+	start = MAX(start, vmr->vm_base);
+	end = MIN(end, vmr->vm_end);
+	for (uintptr_t i = start; i < end; i += PGSIZE) {
+		f_idx = (i - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+		if (f_idx >= file_pgs)
+			break;
+		/* The window is within va's page table, which exists by now */
+		pte = pgdir_walk(p->env_pgdir, (void*)i, 0);
+		if (!pte || !PAGE_UNMAPPED(*pte))
+			continue;
+		page = pm_find_page(pm, f_idx);
+		if (!page)
+			continue;
+		if (!(page->pg_flags & PG_UPTODATE)) {
+			page_decref(page);
+			continue;
+		}
+		if (vmr->vm_prot & PROT_EXEC)
+			icache_flush_page((void*)i, page2kva(page));
+		/* The ref from pm_find_page() is stored in the PTE.  The PTE was not
+		 * present, so there's no TLB entry to flush. */
+		*pte = PTE(page2ppn(page), PTE_P | pte_prot);
+	}
+}
+#endif /* CONFIG_FAULT_AROUND */
+
 /* Kernel Dynamic Memory Mappings */
 uintptr_t dyn_vmap_llim = KERN_DYN_TOP;
 spinlock_t dyn_vmap_lock = SPINLOCK_INITIALIZER;
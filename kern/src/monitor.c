@@ -28,6 +28,10 @@
 #include <event.h>
 #include <trap.h>
 #include <time.h>
+#include <topology.h>
+#include <blockdev.h>
+#include <writeback.h>
+#include <reclaim.h>
 
 #include <ros/memlayout.h>
 #include <ros/event.h>
@@ -217,6 +221,7 @@ int mon_cpuinfo(int argc, char **argv, struct hw_trapframe *hw_tf)
 {
 	cprintf("Number of CPUs detected: %d\n", num_cpus);
 	cprintf("Calling CPU's ID: 0x%08x\n", core_id());
+	print_topology();
 
 	if (argc < 2)
 		smp_call_function_self(test_print_info_handler, NULL, 0);
@@ -660,6 +665,12 @@ int mon_trace(int argc, char **argv, struct hw_trapframe *hw_tf)
 		printk("\tpcpui [type [coreid]]: runs pcpui trace ring handlers\n");
 		printk("\tpcpui-reset [noclear]: resets/clears pcpui trace ring\n");
 		printk("\tverbose: toggles verbosity, depends on trace command\n");
+		printk("\ttlb: prints TLB shootdown stats\n");
+		printk("\tkthread: prints kthread blocking and stack pool stats\n");
+		printk("\tblock: prints block device request queue stats\n");
+		printk("\tpagecache: prints page cache hit and readahead stats\n");
+		printk("\twriteback: prints dirty page and flusher stats\n");
+		printk("\treclaim: prints page cache LRU and reclaim stats\n");
 		return 1;
 	}
 	if (!strcmp(argv[1], "syscall")) {
@@ -739,6 +750,18 @@ int mon_trace(int argc, char **argv, struct hw_trapframe *hw_tf)
 			printk("Turning trace verbosity on\n");
 			mon_verbose_trace = TRUE;
 		}
+	} else if (!strcmp(argv[1], "tlb")) {
+		print_tlb_stats();
+	} else if (!strcmp(argv[1], "kthread")) {
+		print_kthread_stats();
+	} else if (!strcmp(argv[1], "block")) {
+		print_bdev_stats();
+	} else if (!strcmp(argv[1], "pagecache")) {
+		print_pm_stats();
+	} else if (!strcmp(argv[1], "writeback")) {
+		print_writeback_stats();
+	} else if (!strcmp(argv[1], "reclaim")) {
+		print_reclaim_stats();
 	} else if (!strcmp(argv[1], "opt2")) {
 		if (argc != 3) {
 			printk("ERRRRRRRRRR.\n");
@@ -894,7 +917,7 @@ int mon_fs(int argc, char **argv, struct hw_trapframe *hw_tf)
 				printk("%p %p %02d     %s\n", d_i, d_i->d_flags,
 				       kref_refcnt(&d_i->d_kref), d_i->d_name.name);
 			}
-			hash_for_each(sb->s_dcache, print_dcache_entry);
+			chash_for_each(sb->s_dcache, print_dcache_entry);
 		}
 		if (argc < 3)
 			return 0;
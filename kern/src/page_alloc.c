@@ -16,13 +16,15 @@
 #include <string.h>
 #include <kmalloc.h>
 #include <blockdev.h>
+#include <smp.h>
+#include <reclaim.h>
 
 #define l1 (available_caches.l1)
 #define l2 (available_caches.l2)
 #define l3 (available_caches.l3)
 
-static void __page_decref(page_t *CT(1) page);
 static error_t __page_alloc_specific(page_t** page, size_t ppn);
+static void __page_init(struct page *page);
 
 #ifdef CONFIG_PAGE_COLORING
 #define NUM_KERNEL_COLORS 8
@@ -35,6 +37,220 @@ static error_t __page_alloc_specific(page_t** page, size_t ppn);
 uint8_t* global_cache_colors_map;
 size_t global_next_color = 0;
 
+/* NUMA nodes.  Arch code tells us which ranges of physical memory belong to
+ * which node before it frees any pages, and which node each core is on once the
+ * cores are up.  With no info, everything is node 0.  Each node has its own
+ * free lists, and page allocations prefer the node of the allocating core. */
+int nr_numa_nodes = 1;
+
+struct numa_mem_range {
+	size_t						start_ppn;
+	size_t						end_ppn;
+	int							node;
+};
+static struct numa_mem_range numa_mem_ranges[MAX_NUMA_MEM_RANGES];
+static int nr_numa_mem_ranges;
+static int core_numa_nodes[MAX_NUM_CPUS];
+
+/* Notes that physical memory [base, base + len) is on node.  Call this before
+ * any of that memory is freed to the allocator. */
+void numa_add_mem_range(physaddr_t base, physaddr_t len, int node)
+{
+	struct numa_mem_range *range;
+
+	assert(node < MAX_NUMA_NODES);
+	if (nr_numa_mem_ranges == MAX_NUMA_MEM_RANGES) {
+		warn("Out of NUMA memory ranges, [%p, %p) will be node 0", base,
+		     base + len);
+		return;
+	}
+	range = &numa_mem_ranges[nr_numa_mem_ranges++];
+	range->start_ppn = base >> PGSHIFT;
+	range->end_ppn = (base + len) >> PGSHIFT;
+	range->node = node;
+	nr_numa_nodes = MAX(nr_numa_nodes, node + 1);
+}
+
+void numa_set_core_node(uint32_t coreid, int node)
+{
+	assert(node < nr_numa_nodes);
+	core_numa_nodes[coreid] = node;
+}
+
+int core2node(uint32_t coreid)
+{
+	return core_numa_nodes[coreid];
+}
+
+/* Returns the node ppn is on.  Memory the arch didn't tell us about is on
+ * node 0. */
+int ppn2node(size_t ppn)
+{
+	if (nr_numa_nodes == 1)
+		return 0;
+	for (int i = 0; i < nr_numa_mem_ranges; i++) {
+		if ((numa_mem_ranges[i].start_ppn <= ppn) &&
+		    (ppn < numa_mem_ranges[i].end_ppn))
+			return numa_mem_ranges[i].node;
+	}
+	return 0;
+}
+
+/* Returns the i'th node to try when allocating for node: node itself first,
+ * then the others in order. */
+static int numa_fallback_node(int node, int i)
+{
+	if (!i)
+		return node;
+	return i - 1 < node ? i - 1 : i;
+}
+
+/* Node's colored lists, one per color */
+static page_list_t *node_colored_lists(int node)
+{
+	return &colored_page_free_list[node * llc_cache->num_colors];
+}
+
+/* Buddy allocator.  Free memory is kept in naturally aligned blocks of 2^order
+ * pages.  Blocks of order >= 1 are on buddy_free_lists[node][order], and single
+ * pages are on their node's colored lists, so the colored allocators keep
+ * working as they always have.  The head page of every free block has PG_BUDDY
+ * set and its order in pg_order; the other pages in the block have neither.
+ *
+ * Freeing a page coalesces it with its buddy (the block it would merge with)
+ * as far as it can, and allocations split the smallest block that works.  When
+ * the colored lists run out, single pages come from splitting a buddy block.
+ * Blocks never span nodes.  Everything here is protected by the
+ * colored_page_free_list_lock, including nr_free_pages, which counts the pages
+ * on the lists. */
+page_list_t buddy_free_lists[MAX_NUMA_NODES][BUDDY_MAX_ORDER + 1];
+
+/* Puts a free block on its list */
+static void __buddy_insert(struct page *page, unsigned int order)
+{
+	size_t ppn = page2ppn(page);
+	int node = ppn2node(ppn);
+
+	page->pg_flags |= PG_BUDDY;
+	page->pg_order = order;
+	nr_free_pages += 1UL << order;
+	if (order)
+		LIST_INSERT_HEAD(&buddy_free_lists[node][order], page, pg_link);
+	else
+		LIST_INSERT_HEAD(&node_colored_lists(node)[get_page_color(ppn,
+		                                                          llc_cache)],
+		                 page, pg_link);
+}
+
+/* Takes a free block off its list, whichever list it is */
+static void __buddy_remove(struct page *page)
+{
+	LIST_REMOVE(page, pg_link);
+	page->pg_flags &= ~PG_BUDDY;
+	nr_free_pages -= 1UL << page->pg_order;
+}
+
+/* Gives a page back to the allocator, merging it with its buddies.  The page
+ * must already have a refcnt of 0.  Hold the lock, or be single-threaded at
+ * boot. */
+void buddy_free_page(struct page *page)
+{
+	size_t ppn = page2ppn(page);
+	size_t buddy_ppn;
+	unsigned int order = 0;
+	struct page *buddy;
+	int node = ppn2node(ppn);
+
+	while (order < BUDDY_MAX_ORDER) {
+		buddy_ppn = ppn ^ (1UL << order);
+		if (buddy_ppn >= max_nr_pages)
+			break;
+		buddy = ppn2page(buddy_ppn);
+		if (!(buddy->pg_flags & PG_BUDDY) || (buddy->pg_order != order))
+			break;
+		/* Free blocks are all on one node, so checking the head will do */
+		if (ppn2node(buddy_ppn) != node)
+			break;
+		__buddy_remove(buddy);
+		ppn = MIN(ppn, buddy_ppn);
+		order++;
+	}
+	__buddy_insert(ppn2page(ppn), order);
+}
+
+/* Splits the free block at page, which is off its list, down to a block of
+ * 'target' order that contains want_ppn.  The other halves go back to their
+ * lists.  Returns the head of the new block (which is off the lists). */
+static struct page *__buddy_split(struct page *page, unsigned int order,
+                                  unsigned int target, size_t want_ppn)
+{
+	size_t ppn = page2ppn(page);
+
+	while (order > target) {
+		order--;
+		if (want_ppn >= ppn + (1UL << order)) {
+			__buddy_insert(ppn2page(ppn), order);
+			ppn += 1UL << order;
+		} else {
+			__buddy_insert(ppn2page(ppn + (1UL << order)), order);
+		}
+	}
+	return ppn2page(ppn);
+}
+
+/* Finds the free block that contains ppn.  Returns 0 if ppn isn't in one,
+ * which happens when the page is sitting in a per-core cache. */
+static struct page *__buddy_find_block(size_t ppn)
+{
+	struct page *head;
+	size_t head_ppn;
+
+	for (unsigned int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+		head_ppn = ROUNDDOWN(ppn, 1UL << i);
+		head = ppn2page(head_ppn);
+		if ((head->pg_flags & PG_BUDDY) &&
+		    (ppn < head_ppn + (1UL << head->pg_order)))
+			return head;
+	}
+	return 0;
+}
+
+/* Returns the first page in the block (of 2^order pages at head_ppn) whose
+ * color is in map, or -1 if there isn't one.  A 0 map means any color. */
+static ssize_t __block_find_color(size_t head_ppn, unsigned int order,
+                                  uint8_t *map)
+{
+	size_t nr_pages = MIN(1UL << order, llc_cache->num_colors);
+
+	for (size_t i = head_ppn; i < head_ppn + nr_pages; i++) {
+		if (!map || GET_BITMASK_BIT(map, get_page_color(i, llc_cache)))
+			return i;
+	}
+	return -1;
+}
+
+/* Breaks up one of node's buddy blocks to get a single page of one of the
+ * colors in map (or any color, if map is 0).  The rest of the block goes back
+ * on the lists.  Returns the page's color, like the colored allocators. */
+static ssize_t __page_alloc_from_buddy(page_t **page, uint8_t *map, int node)
+{
+	struct page *block;
+	ssize_t want_ppn;
+
+	for (unsigned int i = 1; i <= BUDDY_MAX_ORDER; i++) {
+		LIST_FOREACH(block, &buddy_free_lists[node][i], pg_link) {
+			want_ppn = __block_find_color(page2ppn(block), i, map);
+			if (want_ppn < 0)
+				continue;
+			__buddy_remove(block);
+			*page = __buddy_split(block, i, 0, want_ppn);
+			__page_init(*page);
+			return get_page_color(want_ppn, llc_cache);
+		}
+	}
+	return -ENOMEM;
+}
+
 void colored_page_alloc_init()
 {
 	global_cache_colors_map = 
@@ -50,7 +266,8 @@ static void __page_init(struct page *page)
 {
 	memset(page, 0, sizeof(page_t));
 	page_setref(page, 1);
-	sem_init(&page->pg_sem, 0);
+	/* Readahead IO completes, and unlocks pages, from IRQ context */
+	sem_init_irqsave(&page->pg_sem, 0);
 }
 
 #define __PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range, predicate) \
@@ -63,50 +280,286 @@ static void __page_init(struct page *page)
 	}                                                                       \
 	/* Allocate a page from that color */                                   \
 	if(i < (base_color+range)) {                                            \
-		*page = LIST_FIRST(&colored_page_free_list[i]);                     \
+		*page = LIST_FIRST(&lists[i]);                                      \
 		LIST_REMOVE(*page, pg_link);                                        \
+		nr_free_pages--;                                                    \
 		__page_init(*page);                                                 \
 		return i;                                                           \
 	}                                                                       \
 	return -ENOMEM;
 
 static ssize_t __page_alloc_from_color_range(page_t** page,  
+                                           page_list_t *lists,
                                            uint16_t base_color,
                                            uint16_t range) 
 {
 	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range, 
-	                 !LIST_EMPTY(&colored_page_free_list[i]));
+	                 !LIST_EMPTY(&lists[i]));
 }
 
 static ssize_t __page_alloc_from_color_map_range(page_t** page, uint8_t* map, 
+                                              page_list_t *lists,
                                               size_t base_color, size_t range)
 {  
 	__PAGE_ALLOC_FROM_RANGE_GENERIC(page, base_color, range, 
-		    GET_BITMASK_BIT(map, i) && !LIST_EMPTY(&colored_page_free_list[i]))
+		    GET_BITMASK_BIT(map, i) && !LIST_EMPTY(&lists[i]))
 }
 
 static ssize_t __colored_page_alloc(uint8_t* map, page_t** page, 
-                                               size_t next_color)
+                                               size_t next_color, int node)
 {
+	page_list_t *lists = node_colored_lists(node);
 	ssize_t ret;
-	if((ret = __page_alloc_from_color_map_range(page, map, 
+	if((ret = __page_alloc_from_color_map_range(page, map, lists,
 	                           next_color, llc_cache->num_colors - next_color)) < 0)
-		ret = __page_alloc_from_color_map_range(page, map, 0, next_color);
+		ret = __page_alloc_from_color_map_range(page, map, lists, 0,
+		                                        next_color);
 	return ret;
 }
 
-/* Internal version of page_alloc_specific.  Grab the lock first. */
+/* Allocates a page from node, of one of the colors in map (any color if map is
+ * 0), starting at next_color.  Returns the page's color, or -ENOMEM. */
+static ssize_t __page_alloc_from_node(page_t **page, uint8_t *map,
+                                      size_t next_color, int node)
+{
+	page_list_t *lists = node_colored_lists(node);
+	ssize_t ret;
+
+	if (map)
+		ret = __colored_page_alloc(map, page, next_color, node);
+	else if ((ret = __page_alloc_from_color_range(page, lists, next_color,
+	                              llc_cache->num_colors - next_color)) < 0)
+		ret = __page_alloc_from_color_range(page, lists, 0, next_color);
+	if (ret < 0)
+		ret = __page_alloc_from_buddy(page, map, node);
+	return ret;
+}
+
+/* Allocates a page, preferring node and falling back to the others in order.
+ * Returns the page's color, or -ENOMEM. */
+static ssize_t __page_alloc_near(page_t **page, uint8_t *map, size_t next_color,
+                                 int node)
+{
+	ssize_t ret = -ENOMEM;
+
+	for (int i = 0; (ret < 0) && (i < nr_numa_nodes); i++)
+		ret = __page_alloc_from_node(page, map, next_color,
+		                             numa_fallback_node(node, i));
+	return ret;
+}
+
+/* Per-core page caches.  Each core keeps a short list of free pages (refcnt 0,
+ * not on any allocator list) so that most allocs and frees don't touch the
+ * colored_page_free_list_lock.  The lists are refilled and drained in batches
+ * of PCPU_PAGES_BATCH.  Only the owning core touches its cache, with irqs
+ * disabled, since pages can be freed from IRQ context.  The caches only hold
+ * pages from their core's node; remote pages go straight back to their node.
+ *
+ * Each cache also counts how many of its allocations came from the core's own
+ * node (local) or had to go to another node (remote). */
+#define PCPU_PAGES_BATCH	16
+#define PCPU_PAGES_HIGH		(4 * PCPU_PAGES_BATCH)
+
+struct pcpu_page_cache {
+	page_list_t					pages;
+	size_t						nr_pages;
+	unsigned long				nr_local_allocs;
+	unsigned long				nr_remote_allocs;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pcpu_page_cache pcpu_page_caches[MAX_NUM_CPUS];
+
+/* Takes a page of one of the colors in map (any color if map is 0) out of the
+ * cache, or returns 0. */
+static struct page *__pcpu_page_get(struct pcpu_page_cache *pcc, uint8_t *map)
+{
+	struct page *page;
+
+	LIST_FOREACH(page, &pcc->pages, pg_link) {
+		if (!map ||
+		    GET_BITMASK_BIT(map, get_page_color(page2ppn(page), llc_cache))) {
+			LIST_REMOVE(page, pg_link);
+			pcc->nr_pages--;
+			return page;
+		}
+	}
+	return 0;
+}
+
+/* Grabs a batch of pages from node's lists, of the colors in map (any color if
+ * map is 0), starting at *next_color.  Updates *next_color so the caller's
+ * color rotation carries on where the batch left off. */
+static void __pcpu_page_refill(struct pcpu_page_cache *pcc, uint8_t *map,
+                               size_t *next_color, int node)
+{
+	struct page *page;
+	ssize_t ret;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (int i = 0; i < PCPU_PAGES_BATCH; i++) {
+		ret = __page_alloc_from_node(&page, map, *next_color, node);
+		if (ret < 0)
+			break;
+		*next_color = (ret + 1) & (llc_cache->num_colors - 1);
+		page_setref(page, 0);
+		LIST_INSERT_HEAD(&pcc->pages, page, pg_link);
+		pcc->nr_pages++;
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+}
+
+/* Gets a page from another node, when the core's node is out of memory.  The
+ * page doesn't go through the cache.  Returns the page's color, or -ENOMEM. */
+static ssize_t __pcpu_page_alloc_remote(page_t **page, uint8_t *map,
+                                        size_t *next_color, int node)
+{
+	ssize_t ret;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	ret = __page_alloc_near(page, map, *next_color, node);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	if (ret >= 0)
+		*next_color = (ret + 1) & (llc_cache->num_colors - 1);
+	return ret;
+}
+
+/* Gives a batch of pages back to the buddy allocator */
+static void __pcpu_page_drain(struct pcpu_page_cache *pcc, size_t nr)
+{
+	struct page *page;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	while (nr-- && (page = LIST_FIRST(&pcc->pages))) {
+		LIST_REMOVE(page, pg_link);
+		pcc->nr_pages--;
+		buddy_free_page(page);
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+}
+
+/* Allocates and inits a page from this core's cache, refilling it if needed.
+ * Returns the page's color, or -ENOMEM. */
+static ssize_t pcpu_page_alloc(page_t **page, uint8_t *map, size_t *next_color)
+{
+	struct pcpu_page_cache *pcc;
+	struct page *ret;
+	int8_t irq_state = 0;
+	int node;
+	ssize_t color;
+
+	disable_irqsave(&irq_state);
+	pcc = &pcpu_page_caches[core_id()];
+	node = core2node(core_id());
+	ret = __pcpu_page_get(pcc, map);
+	if (!ret) {
+		__pcpu_page_refill(pcc, map, next_color, node);
+		ret = __pcpu_page_get(pcc, map);
+		/* Below the low watermark, the reclaimer frees up some page cache */
+		if (nr_free_pages < reclaim_low_pages)
+			reclaim_wakeup();
+	}
+	if (ret) {
+		pcc->nr_local_allocs++;
+		enable_irqsave(&irq_state);
+		__page_init(ret);
+		*page = ret;
+		return get_page_color(page2ppn(ret), llc_cache);
+	}
+	color = __pcpu_page_alloc_remote(page, map, next_color, node);
+	if (color >= 0)
+		pcc->nr_remote_allocs++;
+	enable_irqsave(&irq_state);
+	return color;
+}
+
+/* Frees a page (refcnt 0) to this core's cache, draining it if it is full */
+static void pcpu_page_free(struct page *page)
+{
+	struct pcpu_page_cache *pcc;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	if (ppn2node(page2ppn(page)) != core2node(core_id())) {
+		spin_lock_irqsave(&colored_page_free_list_lock);
+		buddy_free_page(page);
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+		enable_irqsave(&irq_state);
+		return;
+	}
+	pcc = &pcpu_page_caches[core_id()];
+	LIST_INSERT_HEAD(&pcc->pages, page, pg_link);
+	if (++pcc->nr_pages > PCPU_PAGES_HIGH)
+		__pcpu_page_drain(pcc, PCPU_PAGES_BATCH);
+	enable_irqsave(&irq_state);
+}
+
+/* Prints the NUMA layout and each core's local and remote page allocations */
+void print_numa_info(void)
+{
+	struct pcpu_page_cache *pcc;
+
+	printk("NUMA nodes: %d\n", nr_numa_nodes);
+	for (int i = 0; i < nr_numa_mem_ranges; i++)
+		printk("\tNode %d: [%p, %p)\n", numa_mem_ranges[i].node,
+		       numa_mem_ranges[i].start_ppn << PGSHIFT,
+		       numa_mem_ranges[i].end_ppn << PGSHIFT);
+	printk("Core  Node      Local     Remote\n");
+	for (int i = 0; i < num_cpus; i++) {
+		pcc = &pcpu_page_caches[i];
+		printk("%4d  %4d %10lu %10lu\n", i, core2node(i),
+		       pcc->nr_local_allocs, pcc->nr_remote_allocs);
+	}
+}
+
+/* Internal version of page_alloc_specific.  Grab the lock first.  Returns
+ * -EAGAIN if the page is free but in a per-core cache. */
 static error_t __page_alloc_specific(page_t** page, size_t ppn)
 {
-	page_t* sp_page = ppn2page(ppn);
+	struct page *block;
 	if (!page_is_free(ppn))
 		return -ENOMEM;
-	*page = sp_page;
-	LIST_REMOVE(*page, pg_link);
+	block = __buddy_find_block(ppn);
+	if (!block)
+		return -EAGAIN;
+	__buddy_remove(block);
+	*page = __buddy_split(block, block->pg_order, 0, ppn);
 	__page_init(*page);
 	return 0;
 }
 
+/* IPI handler: gives every page in this core's cache back to the buddy
+ * allocator.  IRQs are off, like for the other cache operations. */
+static void __pcpu_page_drain_all(struct hw_trapframe *hw_tf, void *data)
+{
+	struct pcpu_page_cache *pcc = &pcpu_page_caches[core_id()];
+
+	__pcpu_page_drain(pcc, pcc->nr_pages);
+}
+
+/* Allocates physical page ppn, if it is free.  The buddy allocator can't see
+ * free pages in the per-core caches, and only their own cores can touch them,
+ * so if that's where ppn is, we have every core drain its cache and try again.
+ * Call this with IRQs enabled. */
+static error_t page_alloc_specific(page_t **page, size_t ppn)
+{
+	handler_wrapper_t *wrapper;
+	error_t ret;
+
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	ret = __page_alloc_specific(page, ppn);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	if (ret != -EAGAIN)
+		return ret;
+	if (smp_call_function_all(__pcpu_page_drain_all, 0, &wrapper))
+		return -ENOMEM;
+	smp_call_wait(wrapper);
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	ret = __page_alloc_specific(page, ppn);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	/* Someone could have allocated and freed it again in the meantime */
+	return ret == -EAGAIN ? -ENOMEM : ret;
+}
+
 /**
  * @brief Allocates a physical page from a pool of unused physical memory.
  * Note, the page IS reference counted.
@@ -121,15 +574,12 @@ static error_t __page_alloc_specific(page_t** page, size_t ppn)
  */
 error_t upage_alloc(struct proc* p, page_t** page, int zero)
 {
-	spin_lock_irqsave(&colored_page_free_list_lock);
-	ssize_t ret = __colored_page_alloc(p->cache_colors_map, 
-	                                     page, p->next_cache_color);
-	spin_unlock_irqsave(&colored_page_free_list_lock);
+	ssize_t ret = pcpu_page_alloc(page, p->cache_colors_map,
+	                              &p->next_cache_color);
 
 	if (ret >= 0) {
 		if(zero)
 			memset(page2kva(*page),0,PGSIZE);
-		p->next_cache_color = (ret + 1) & (llc_cache->num_colors-1);
 		return 0;
 	}
 	return ret;
@@ -138,18 +588,10 @@ error_t upage_alloc(struct proc* p, page_t** page, int zero)
 /* Allocates a refcounted page of memory for the kernel's use */
 error_t kpage_alloc(page_t** page) 
 {
-	ssize_t ret;
-	spin_lock_irqsave(&colored_page_free_list_lock);
-	if ((ret = __page_alloc_from_color_range(page, global_next_color, 
-	                            llc_cache->num_colors - global_next_color)) < 0)
-		ret = __page_alloc_from_color_range(page, 0, global_next_color);
+	ssize_t ret = pcpu_page_alloc(page, 0, &global_next_color);
 
-	if (ret >= 0) {
-		global_next_color = ret;        
+	if (ret >= 0)
 		ret = ESUCCESS;
-	}
-	spin_unlock_irqsave(&colored_page_free_list_lock);
-	
 	return ret;
 }
 
@@ -171,10 +613,43 @@ void *kpage_zalloc_addr(void)
 	return retval;
 }
 
+/* Finds 2^order pages, for an order bigger than the buddy allocator tracks, as
+ * a run of adjacent free blocks of the max order on node.  They come off the
+ * lists, and the first one is returned, or 0 if there is no such run. */
+static struct page *__buddy_alloc_run(unsigned int order, int node)
+{
+	size_t nr_blocks = 1UL << (order - BUDDY_MAX_ORDER);
+	size_t block_sz = 1UL << BUDDY_MAX_ORDER;
+	struct page *block, *next;
+	size_t head_ppn, i;
+
+	LIST_FOREACH(block, &buddy_free_lists[node][BUDDY_MAX_ORDER], pg_link) {
+		head_ppn = page2ppn(block);
+		if (head_ppn + nr_blocks * block_sz > max_nr_pages)
+			continue;
+		for (i = 1; i < nr_blocks; i++) {
+			next = ppn2page(head_ppn + i * block_sz);
+			if (!(next->pg_flags & PG_BUDDY) ||
+			    (next->pg_order != BUDDY_MAX_ORDER) ||
+			    (ppn2node(head_ppn + i * block_sz) != node))
+				break;
+		}
+		if (i < nr_blocks)
+			continue;
+		for (i = 0; i < nr_blocks; i++)
+			__buddy_remove(ppn2page(head_ppn + i * block_sz));
+		return block;
+	}
+	return 0;
+}
+
 /**
  * @brief Allocated 2^order contiguous physical pages.  Will increment the
  * reference count for the pages.
  *
+ * The block comes from the buddy allocator, so it is aligned to its size, or
+ * to the largest buddy block (4MB) if it is bigger than that.
+ *
  * @param[in] order order of the allocation
  * @param[in] flags memory allocation flags
  *
@@ -182,47 +657,50 @@ void *kpage_zalloc_addr(void)
  */
 void *get_cont_pages(size_t order, int flags)
 {
-	size_t npages = 1 << order;	
+	struct page *block = 0;
+	unsigned int i;
+	int node;
 
-	size_t naddrpages = max_paddr / PGSIZE;
-	// Find 'npages' free consecutive pages
-	int first = -1;
+	if (!order)
+		return kpage_alloc_addr();
 	spin_lock_irqsave(&colored_page_free_list_lock);
-	for(int i=(naddrpages-1); i>=(npages-1); i--) {
-		int j;
-		for(j=i; j>=(i-(npages-1)); j--) {
-			if( !page_is_free(j) ) {
-				i = j - 1;
-				break;
-			}
+	for (int j = 0; !block && (j < nr_numa_nodes); j++) {
+		node = numa_fallback_node(core2node(core_id()), j);
+		if (order > BUDDY_MAX_ORDER) {
+			block = __buddy_alloc_run(order, node);
+			continue;
 		}
-		if( j == (i-(npages-1)-1)) {
-			first = j+1;
-			break;
+		for (i = order; i <= BUDDY_MAX_ORDER; i++) {
+			block = LIST_FIRST(&buddy_free_lists[node][i]);
+			if (block)
+				break;
 		}
 	}
-	//If we couldn't find them, return NULL
-	if( first == -1 ) {
+	if (!block) {
 		spin_unlock_irqsave(&colored_page_free_list_lock);
 		return NULL;
 	}
-
-	for(int i=0; i<npages; i++) {
-		page_t* page;
-		__page_alloc_specific(&page, first+i);
+	if (order <= BUDDY_MAX_ORDER) {
+		__buddy_remove(block);
+		block = __buddy_split(block, i, order, page2ppn(block));
 	}
+	for (size_t j = 0; j < (1UL << order); j++)
+		__page_init(block + j);
 	spin_unlock_irqsave(&colored_page_free_list_lock);
-	return ppn2kva(first);
+	return page2kva(block);
 }
 
+/* The pages go straight back to the buddy allocator, not the per-core caches,
+ * so the block can coalesce again. */
 void free_cont_pages(void *buf, size_t order)
 {
 	size_t npages = 1 << order;	
 	spin_lock_irqsave(&colored_page_free_list_lock);
 	for (size_t i = kva2ppn(buf); i < kva2ppn(buf) + npages; i++) {
 		page_t* page = ppn2page(i);
-		__page_decref(ppn2page(i));
-		assert(page_is_free(i));
+		assert(kref_refcnt(&page->pg_kref) == 1);
+		page_setref(page, 0);
+		buddy_free_page(page);
 	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
 	return;	
@@ -243,18 +721,12 @@ void free_cont_pages(void *buf, size_t order)
  */
 error_t upage_alloc_specific(struct proc* p, page_t** page, size_t ppn)
 {
-	spin_lock_irqsave(&colored_page_free_list_lock);
-	__page_alloc_specific(page, ppn);
-	spin_unlock_irqsave(&colored_page_free_list_lock);
-	return 0;
+	return page_alloc_specific(page, ppn);
 }
 
 error_t kpage_alloc_specific(page_t** page, size_t ppn)
 {
-	spin_lock_irqsave(&colored_page_free_list_lock);
-	__page_alloc_specific(page, ppn);
-	spin_unlock_irqsave(&colored_page_free_list_lock);
-	return 0;
+	return page_alloc_specific(page, ppn);
 }
 
 /* Check if a page with the given physical page # is free. */
@@ -274,17 +746,8 @@ void page_incref(page_t *page)
 }
 
 /* Decrement the reference count on a page, freeing it if there are no more
- * refs. */
+ * refs.  Don't call this while holding the colored_page_free_list_lock. */
 void page_decref(page_t *page)
-{
-	spin_lock_irqsave(&colored_page_free_list_lock);
-	__page_decref(page);
-	spin_unlock_irqsave(&colored_page_free_list_lock);
-}
-
-/* Decrement the reference count on a page, freeing it if there are no more
- * refs.  Don't call this without holding the lock already. */
-static void __page_decref(page_t *page)
 {
 	kref_put(&page->pg_kref);
 }
@@ -296,13 +759,9 @@ static void page_release(struct kref *kref)
 
 	if (page->pg_flags & PG_BUFFER)
 		free_bhs(page);
-	/* Give our page back to the free list.  The protections for this are that
-	 * the list lock is grabbed by page_decref. */
-	LIST_INSERT_HEAD(
-	   &(colored_page_free_list[get_page_color(page2ppn(page), llc_cache)]),
-	   page,
-	   pg_link
-	);
+	/* Give our page back to this core's cache, which will grab the list lock
+	 * if it needs to drain. */
+	pcpu_page_free(page);
 }
 
 /* Helper when initializing a page - just to prevent the proliferation of
@@ -319,19 +778,20 @@ void page_setref(page_t *page, size_t val)
  * is ready". */
 void lock_page(struct page *page)
 {
+	int8_t irq_state = 0;
 	/* when this returns, we have are the ones to have locked the page */
-	sem_down(&page->pg_sem);
+	sem_down_irqsave(&page->pg_sem, &irq_state);
 	assert(!(page->pg_flags & PG_LOCKED));
 	page->pg_flags |= PG_LOCKED;
 }
 
-/* Unlocks the page, and wakes up whoever is waiting on the lock */
+/* Unlocks the page, and wakes up whoever is waiting on the lock.  Readers wait
+ * on pages that are still being read ahead, so sleepers are expected now. */
 void unlock_page(struct page *page)
 {
+	int8_t irq_state = 0;
 	page->pg_flags &= ~PG_LOCKED;
-	if (sem_up(&page->pg_sem)) {
-		printk("Unexpected sleeper on a page!");	/* til we test this */
-	}
+	sem_up_irqsave(&page->pg_sem, &irq_state);
 }
 
 void print_pageinfo(struct page *page)
@@ -8,7 +8,10 @@
 #include <pmap.h>
 #include <atomic.h>
 #include <radix.h>
+#include <reclaim.h>
+#include <blockdev.h>
 #include <kref.h>
+#include <smp.h>
 #include <assert.h>
 #include <stdio.h>
 
@@ -18,21 +21,25 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 {
 	pm->pm_bdev = host;						/* note the uncounted ref */
 	radix_tree_init(&pm->pm_tree);
-	spinlock_init(&pm->pm_tree_lock);
+	spinlock_init_irqsave(&pm->pm_tree_lock);
 	pm->pm_num_pages = 0;					/* no pages in a new pm */
 	pm->pm_op = op;
 	pm->pm_flags = 0;
+	pm->pm_host_kref = 0;
+	pm->pm_dirtied_at = 0;
+	pm->pm_wb_error = 0;
+	pm->pm_lru = &page_lru;
 }
 
 /* Looks up the index'th page in the page map, returning an incref'd reference,
  * or 0 if it was not in the map. */
 struct page *pm_find_page(struct page_map *pm, unsigned long index)
 {
-	spin_lock(&pm->pm_tree_lock);
+	spin_lock_irqsave(&pm->pm_tree_lock);
 	struct page *page = (struct page*)radix_lookup(&pm->pm_tree, index);
 	if (page)
 		page_incref(page);
-	spin_unlock(&pm->pm_tree_lock);
+	spin_unlock_irqsave(&pm->pm_tree_lock);
 	return page;
 }
 
@@ -43,7 +50,7 @@ struct page *pm_find_page(struct page_map *pm, unsigned long index)
 int pm_insert_page(struct page_map *pm, unsigned long index, struct page *page)
 {
 	int error = 0;
-	spin_lock(&pm->pm_tree_lock);
+	spin_lock_irqsave(&pm->pm_tree_lock);
 	error = radix_insert(&pm->pm_tree, index, page);
 	if (!error) {
 		page_incref(page);
@@ -53,7 +60,9 @@ int pm_insert_page(struct page_map *pm, unsigned long index, struct page *page)
 		page->pg_index = index;
 		pm->pm_num_pages++;
 	}
-	spin_unlock(&pm->pm_tree_lock);
+	spin_unlock_irqsave(&pm->pm_tree_lock);
+	if (!error)
+		pm_lru_add(pm, page);
 	return error;
 }
 
@@ -69,15 +78,43 @@ int pm_remove_page(struct page_map *pm, struct page *page)
 	 * to schedule them for writeback, and then remove them later (callback).
 	 * Also, need to be careful - anyone holding a reference to a page can dirty
 	 * it concurrently. */
-	spin_lock(&pm->pm_tree_lock);
+	spin_lock_irqsave(&pm->pm_tree_lock);
+	assert(!radix_tag_get(&pm->pm_tree, page->pg_index, PM_TAG_WRITEBACK));
 	retval = radix_delete(&pm->pm_tree, page->pg_index);
-	spin_unlock(&pm->pm_tree_lock);
+	spin_unlock_irqsave(&pm->pm_tree_lock);
 	assert(retval == (void*)page);
+	pm_lru_del(pm, page);
+	page->pg_mapping = 0;
 	page_decref(page);
 	pm->pm_num_pages--;
 	return 0;
 }
 
+/* Takes every page out of pm and drops pm's refs on them, for when pm's host
+ * goes away.  No one can be using pm anymore, and its writes must be done. */
+void pm_destroy(struct page_map *pm)
+{
+	struct page *pages[32];
+	unsigned int nr;
+
+	do {
+		spin_lock_irqsave(&pm->pm_tree_lock);
+		nr = radix_gang_lookup(&pm->pm_tree, (void**)pages, 0, 32);
+		for (int i = 0; i < nr; i++) {
+			assert(!radix_tag_get(&pm->pm_tree, pages[i]->pg_index,
+			                      PM_TAG_WRITEBACK));
+			radix_delete(&pm->pm_tree, pages[i]->pg_index);
+			pm->pm_num_pages--;
+		}
+		spin_unlock_irqsave(&pm->pm_tree_lock);
+		for (int i = 0; i < nr; i++) {
+			pm_lru_del(pm, pages[i]);
+			pages[i]->pg_mapping = 0;
+			page_decref(pages[i]);
+		}
+	} while (nr);
+}
+
 /* Makes sure the index'th page of the mapped object is loaded in the page cache
  * and returns its location via **pp.  Note this will give you a refcnt'd
  * reference to the page.  This may block! TODO: (BLK) */
@@ -91,8 +128,11 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	while (!page) {
 		/* kpage_alloc, since we want the page to persist after the proc
 		 * dies (can be used by others, until the inode shuts down). */
-		if (kpage_alloc(&page))
-			return -ENOMEM;
+		if (kpage_alloc(&page)) {
+			/* Direct reclaim: evict some page cache, and try once more */
+			if (!pm_shrink(RECLAIM_BATCH) || kpage_alloc(&page))
+				return -ENOMEM;
+		}
 		/* might want to initialize other things, perhaps in page_alloc() */
 		page->pg_flags = 0;
 		error = pm_insert_page(pm, index, page);
@@ -122,9 +162,13 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	 * us, we skip this since we are the one doing the readpage(). */
 	if (page_was_mapped) {
 		/* is it already here and up to date?  if so, we're done */
-		if (page->pg_flags & PG_UPTODATE)
+		if (page->pg_flags & PG_UPTODATE) {
+			pm_mark_accessed(page);
+			per_cpu_info[core_id()].nr_pm_hits++;
 			return 0;
-		/* if not, try to lock the page (could BLOCK) */
+		}
+		/* if not, try to lock the page (could BLOCK).  Usually, someone is
+		 * reading it in (maybe readahead), and we wait for them. */
 		lock_page(page);
 		/* we got it, is our page still in the cache?  check the mapping.  if
 		 * not, start over, perhaps with EAGAIN and outside support */
@@ -133,11 +177,14 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 		/* double check, are we up to date?  if so, we're done */
 		if (page->pg_flags & PG_UPTODATE) {
 			unlock_page(page);
+			pm_mark_accessed(page);
+			per_cpu_info[core_id()].nr_pm_waits++;
 			return 0;
 		}
 	}
 	/* if we're here, the page is locked by us, and it needs to be read in */
 	assert(page->pg_mapping == pm);
+	per_cpu_info[core_id()].nr_pm_misses++;
 	/* Readpage will block internally, returning when it is done */
 	error = pm->pm_op->readpage(pm, page);
 	assert(!error);
@@ -146,3 +193,133 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	assert(page->pg_flags & PG_UPTODATE);
 	return 0;
 }
+
+void file_ra_state_init(struct file_ra_state *ra)
+{
+	ra->start = 0;
+	ra->size = 0;
+	ra->mark = 0;
+	ra->prev_idx = -1;				/* so reading page 0 first is sequential */
+}
+
+/* Unlocks and drops pages we inserted for readahead but couldn't read.  They
+ * stay in the cache, not up to date, and whoever loads them reads them in. */
+static void pm_abort_readahead(struct page **pages, unsigned int nr)
+{
+	for (int i = 0; i < nr; i++) {
+		unlock_page(pages[i]);
+		page_decref(pages[i]);
+	}
+}
+
+/* Starts reading in whichever of the pages [index, index + nr) aren't in the
+ * cache yet, without waiting for them.  Each run of missing pages goes to
+ * readpages() at once, so the FS can make one request out of it, and the
+ * device is plugged til we're done, so the runs can merge too.  We stop early
+ * if we run out of memory, since this is only a hint. */
+static void pm_start_readahead(struct page_map *pm, unsigned long index,
+                               unsigned long nr)
+{
+	struct block_device *bdev = pm_backing_bdev(pm);
+	struct page *pages[RA_MAX_PAGES];
+	struct page *page;
+	unsigned int nr_pages = 0;
+	int error;
+
+	nr = MIN(nr, RA_MAX_PAGES);
+	if (bdev)
+		bdev_plug(bdev);
+	for (unsigned long i = index; i <= index + nr; i++) {
+		page = 0;
+		if (i < index + nr) {
+			page = pm_find_page(pm, i);
+			if (page) {
+				page_decref(page);
+				page = 0;
+			} else if (!kpage_alloc(&page)) {
+				page->pg_flags = 0;
+				/* On success, page is locked, and our ref is for readpages */
+				if (pm_insert_page(pm, i, page)) {
+					page_decref(page);
+					page = 0;
+				}
+			} else {
+				nr = 0;		/* out of memory, read what we have and stop */
+			}
+		}
+		if (page) {
+			pages[nr_pages++] = page;
+			continue;
+		}
+		/* Page i is cached (or past the end), so the run before it is done */
+		if (!nr_pages)
+			continue;
+		error = pm->pm_op->readpages(pm, pages, nr_pages);
+		if (error)
+			pm_abort_readahead(pages, nr_pages);
+		else
+			per_cpu_info[core_id()].nr_ra_pages += nr_pages;
+		nr_pages = 0;
+	}
+	if (bdev)
+		bdev_unplug(bdev);
+}
+
+/* Tells ra that its reader is about to load page index of pm, which has
+ * nr_pages pages, and reads ahead if it looks like the reader is streaming.
+ * Reading the next page is sequential, and so is skipping ahead within the
+ * last window, which is what faults look like when fault-around mapped the
+ * pages in between.  The first sequential read starts a window at index,
+ * including index itself, so it goes out in the same request as the pages
+ * after it.  Getting to the mark starts the next window, so the IO stays a
+ * window ahead of the reader.
+ *
+ * Racing readers of the same file could mess up ra, but it is only a hint, and
+ * the window never gets bigger than RA_MAX_PAGES. */
+void pm_readahead(struct page_map *pm, struct file_ra_state *ra,
+                  unsigned long index, unsigned long nr_pages)
+{
+	unsigned long prev_idx = ra->prev_idx;
+	unsigned long ra_end = ra->start + ra->size;
+
+	if (!pm->pm_op->readpages)
+		return;
+	ra->prev_idx = index;
+	/* Small reads will load the same page more than once */
+	if (index == prev_idx)
+		return;
+	if ((index != prev_idx + 1) &&
+	    !(ra->size && (index > prev_idx) && (index < ra_end))) {
+		ra->size = 0;
+		return;
+	}
+	if (!ra->size || (index >= ra_end)) {
+		ra->start = index;
+		ra->size = RA_MIN_PAGES;
+		ra->mark = index + RA_MIN_PAGES / 2;
+	} else if (index >= ra->mark) {
+		ra->start = ra_end;
+		ra->size = MIN(ra->size * 2, RA_MAX_PAGES);
+		ra->mark = ra->start;
+	} else {
+		return;
+	}
+	if (ra->start >= nr_pages)
+		return;
+	per_cpu_info[core_id()].nr_ra_windows++;
+	pm_start_readahead(pm, ra->start, MIN(ra->size, nr_pages - ra->start));
+}
+
+/* Prints how each core's page cache loads went, and how much it read ahead */
+void print_pm_stats(void)
+{
+	struct per_cpu_info *pcpui;
+
+	printk("Core         Hits        Waits       Misses   RA windows     RA pages\n");
+	for (int i = 0; i < num_cpus; i++) {
+		pcpui = &per_cpu_info[i];
+		printk("%4d %12llu %12llu %12llu %12llu %12llu\n", i,
+		       pcpui->nr_pm_hits, pcpui->nr_pm_waits, pcpui->nr_pm_misses,
+		       pcpui->nr_ra_windows, pcpui->nr_ra_pages);
+	}
+}
@@ -25,7 +25,7 @@
 physaddr_t max_pmem = 0;	/* Total amount of physical memory (bytes) */
 physaddr_t max_paddr = 0;	/* Maximum addressable physical address */
 size_t max_nr_pages = 0;	/* Number of addressable physical memory pages */
-size_t nr_free_pages = 0;	/* TODO: actually track this, after init */
+size_t nr_free_pages = 0;	/* in the buddy allocator, not per-core caches */
 struct page *pages = 0;
 struct multiboot_info *multiboot_kaddr = 0;
 uintptr_t boot_freemem = 0;
@@ -185,10 +185,8 @@ void *boot_zalloc(size_t amt, size_t align)
  *   - The TLB must be invalidated if a page was formerly present at 'va'.
  *     (this is handled in page_remove)
  *
- * No support for jumbos here.  We will need to be careful when trying to
- * insert regular pages into something that was already jumbo.  We will
- * also need to be careful with our overloading of the PTE_PS and 
- * PTE_PAT flags...
+ * If va is in a jumbo mapping, the jumbo is split into little pages first, and
+ * then va's little page is replaced.
  *
  * @param[in] pgdir the page directory to insert the page into
  * @param[in] pp    a pointr to the page struct representing the
@@ -208,14 +206,22 @@ int page_insert(pde_t *pgdir, struct page *page, void *va, int perm)
 	pte_t* pte = pgdir_walk(pgdir, va, 1);
 	if (!pte)
 		return -ENOMEM;
+	if (PAGE_JUMBO(*pte)) {
+		if (pgdir_split_jumbo(pgdir, va))
+			return -ENOMEM;
+		pte = pgdir_walk(pgdir, va, 1);
+	}
 	/* Two things here:  First, we need to up the ref count of the page we want
 	 * to insert in case it is already mapped at va.  In that case we don't want
 	 * page_remove to ultimately free it, and then for us to continue as if pp
 	 * wasn't freed. (moral = up the ref asap) */
 	kref_get(&page->pg_kref, 1);
-	/* Careful, page remove handles the cases where the page is PAGED_OUT. */
-	if (!PAGE_UNMAPPED(*pte))
-		page_remove(pgdir, va);
+	/* Careful, page remove handles the cases where the page is PAGED_OUT.  It
+	 * can't fail on a little page, but check anyway. */
+	if (!PAGE_UNMAPPED(*pte) && page_remove(pgdir, va)) {
+		page_decref(page);
+		return -ENOMEM;
+	}
 	*pte = PTE(page2ppn(page), PTE_P | perm);
 	return 0;
 }
@@ -228,7 +234,8 @@ int page_insert(pde_t *pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For jumbos, this returns the little page within the jumbo that va is in, and
+ * pte_store gets the jumbo PTE.
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -244,7 +251,7 @@ page_t *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
-	return pa2page(PTE_ADDR(*pte));
+	return kva2page(pte2kva(*pte, va));
 }
 
 /**
@@ -261,29 +268,38 @@ page_t *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
  *     (if such a PTE exists)
  *   - The TLB is invalidated if an entry is removes from the pg dir/pg table.
  *
- * This may be wonky wrt Jumbo pages and decref.  
+ * If va is in a jumbo mapping, the jumbo is split first, and only va's little
+ * page is removed.  If we can't split it, nothing changes.
  *
  * @param pgdir the page directory from with the page sholuld be removed
  * @param va    the virtual address at which the page we are trying to 
  *              remove is mapped
+ *
+ * @return ESUCCESS  on success, including if nothing was mapped at va
+ * @return -ENOMEM   if we couldn't split the jumbo va is in
+ *
  * TODO: consider deprecating this, or at least changing how it works with TLBs.
  * Might want to have the caller need to manage the TLB.  Also note it is used
  * in env_user_mem_free, minus the walk. */
-void page_remove(pde_t *pgdir, void *va)
+int page_remove(pde_t *pgdir, void *va)
 {
 	pte_t *pte;
 	page_t *page;
 
 	pte = pgdir_walk(pgdir,va,0);
 	if (!pte || PAGE_UNMAPPED(*pte))
-		return;
+		return 0;
+	if (PAGE_JUMBO(*pte)) {
+		if (pgdir_split_jumbo(pgdir, va))
+			return -ENOMEM;
+		pte = pgdir_walk(pgdir, va, 0);
+	}
 
 	if (PAGE_PRESENT(*pte)) {
 		/* TODO: (TLB) need to do a shootdown, inval sucks.  And might want to
 		 * manage the TLB / free pages differently. (like by the caller).
 		 * Careful about the proc/memory lock here. */
-		page = ppn2page(PTE2PPN(*pte));
-		*pte = 0;
+		page = ppn2page(PTE2PPN(pte_swap(pte, 0)));
 		tlb_invalidate(pgdir, va);
 		page_decref(page);
 	} else if (PAGE_PAGED_OUT(*pte)) {
@@ -291,6 +307,17 @@ void page_remove(pde_t *pgdir, void *va)
 		panic("Swapping not supported!");
 		*pte = 0;
 	}
+	return 0;
+}
+
+/* Drops the refs a jumbo PTE holds, one on each of its little pages.  The
+ * caller clears the PTE and deals with the TLB. */
+void jumbo_decref(pte_t pte)
+{
+	struct page *page = pa2page(PTE_ADDR(pte));
+
+	for (int i = 0; i < JPGSIZE / PGSIZE; i++)
+		page_decref(page + i);
 }
 
 /**
@@ -20,8 +20,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
-#include <hashtable.h>
 #include <slab.h>
+#include <kmalloc.h>
 #include <sys/queue.h>
 #include <frontend.h>
 #include <monitor.h>
@@ -45,8 +45,16 @@ static void restore_vc_fp_state(struct preempt_data *vcpd);
 #define PID_MAX 32767 // goes from 0 to 32767, with 0 reserved
 static DECL_BITMASK(pid_bmask, PID_MAX + 1);
 spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
-struct hashtable *pid_hash;
-spinlock_t pid_hash_lock; // initialized in proc_init
+
+/* pid -> proc table.  It's two levels: chunks of PID_CHUNK_SZ slots are
+ * allocated the first time we hand out a pid in them, and are never freed.
+ * Writers hold pid_table_lock.  pid2proc() doesn't lock at all. */
+#define PID_CHUNK_SHIFT 8
+#define PID_CHUNK_SZ (1 << PID_CHUNK_SHIFT)
+#define PID_CHUNK_MASK (PID_CHUNK_SZ - 1)
+#define NR_PID_CHUNKS ((PID_MAX + 1) / PID_CHUNK_SZ)
+static struct proc **pid_table[NR_PID_CHUNKS];
+spinlock_t pid_table_lock = SPINLOCK_INITIALIZER;
 
 /* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
  * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
@@ -81,6 +89,47 @@ static void put_free_pid(pid_t pid)
 	spin_unlock(&pid_bmask_lock);
 }
 
+/* Makes sure pid's chunk of the pid table exists, so __proc_ready() won't need
+ * to allocate. */
+static error_t pid_table_prep(pid_t pid)
+{
+	struct proc **chunk;
+
+	if (ACCESS_ONCE(pid_table[pid >> PID_CHUNK_SHIFT]))
+		return 0;
+	chunk = kzmalloc(PID_CHUNK_SZ * sizeof(struct proc*), 0);
+	if (!chunk)
+		return -ENOMEM;
+	spin_lock(&pid_table_lock);
+	if (!pid_table[pid >> PID_CHUNK_SHIFT]) {
+		wmb();	/* the zeroes are visible before the chunk is */
+		pid_table[pid >> PID_CHUNK_SHIFT] = chunk;
+		chunk = 0;
+	}
+	spin_unlock(&pid_table_lock);
+	kfree(chunk);	/* if someone beat us to it */
+	return 0;
+}
+
+/* Runs func on every proc in the pid table.  The table is locked, so func can't
+ * block or create or free procs. */
+void pid_for_each(void (*func)(struct proc *p))
+{
+	struct proc **chunk;
+
+	spin_lock(&pid_table_lock);
+	for (int i = 0; i < NR_PID_CHUNKS; i++) {
+		chunk = pid_table[i];
+		if (!chunk)
+			continue;
+		for (int j = 0; j < PID_CHUNK_SZ; j++) {
+			if (chunk[j])
+				func(chunk[j]);
+		}
+	}
+	spin_unlock(&pid_table_lock);
+}
+
 /* While this could be done with just an assignment, this gives us the
  * opportunity to check for bad transitions.  Might compile these out later, so
  * we shouldn't rely on them for sanity checking from userspace.  */
@@ -150,19 +199,33 @@ int __proc_set_state(struct proc *p, uint32_t state)
 
 /* Returns a pointer to the proc with the given pid, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).
+ *
+ * There's no lock.  Between reading the slot and getting the ref, p could have
+ * been freed and even reallocated as another proc.  That's safe since the
+ * proc_cache is KMC_TYPESAFE: the memory is always a struct proc, whose kref is
+ * 0 while it is free.  If we got a ref, we check that p is still in the slot;
+ * if not, it isn't the proc we were looking for. */
 struct proc *pid2proc(pid_t pid)
 {
-	spin_lock(&pid_hash_lock);
-	struct proc *p = hashtable_search(pid_hash, (void*)(long)pid);
-	if (p)
+	struct proc **chunk, *p;
+
+	if ((pid <= 0) || (pid > PID_MAX))
+		return 0;
+	chunk = ACCESS_ONCE(pid_table[pid >> PID_CHUNK_SHIFT]);
+	if (!chunk)
+		return 0;
+	while (1) {
+		p = ACCESS_ONCE(chunk[pid & PID_CHUNK_MASK]);
+		if (!p)
+			return 0;
 		if (!kref_get_not_zero(&p->p_kref, 1))
-			p = 0;
-	spin_unlock(&pid_hash_lock);
-	return p;
+			return 0;
+		/* the atomic in get_not_zero orders this read after it */
+		if (ACCESS_ONCE(chunk[pid & PID_CHUNK_MASK]) == p)
+			return p;
+		proc_decref(p);
+	}
 }
 
 /* Performs any initialization related to processes, such as create the proc
@@ -172,14 +235,12 @@ void proc_init(void)
 {
 	/* Catch issues with the vcoremap and TAILQ_ENTRY sizes */
 	static_assert(sizeof(TAILQ_ENTRY(vcore)) == sizeof(void*) * 2);
+	/* pid2proc() relies on freed procs staying procs */
 	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
-	             MAX(ARCH_CL_SIZE, __alignof__(struct proc)), 0, 0, 0);
-	/* Init PID mask and hash.  pid 0 is reserved. */
+	             MAX(ARCH_CL_SIZE, __alignof__(struct proc)), KMC_TYPESAFE, 0,
+	             0);
+	/* Init PID mask.  pid 0 is reserved. */
 	SET_BITMASK_BIT(pid_bmask, 0);
-	spinlock_init(&pid_hash_lock);
-	spin_lock(&pid_hash_lock);
-	pid_hash = create_hashtable(100, __generic_hash, __generic_eq);
-	spin_unlock(&pid_hash_lock);
 	schedule_init();
 
 	atomic_init(&num_envs, 0);
@@ -237,9 +298,6 @@ error_t proc_alloc(struct proc **pp, struct proc *parent)
 
 	{ INITSTRUCT(*p)
 
-	/* only one ref, which we pass back.  the old 'existence' ref is managed by
-	 * the ksched */
-	kref_init(&p->p_kref, __proc_free, 1);
 	// Setup the default map of where to get cache colors from
 	p->cache_colors_map = global_cache_colors_map;
 	p->next_cache_color = 0;
@@ -252,6 +310,16 @@ error_t proc_alloc(struct proc **pp, struct proc *parent)
 		kmem_cache_free(proc_cache, p);
 		return -ENOFREEPID;
 	}
+	if ((r = pid_table_prep(p->pid))) {
+		put_free_pid(p->pid);
+		kmem_cache_free(proc_cache, p);
+		return r;
+	}
+	/* only one ref, which we pass back.  the old 'existence' ref is managed by
+	 * the ksched.  The cache is typesafe, so a stale pid2proc() can try to get
+	 * a ref at any time.  Until now the kref is 0, so the error paths above
+	 * free the proc the way __proc_free() does. */
+	kref_init(&p->p_kref, __proc_free, 1);
 	/* Set the basic status variables. */
 	spinlock_init(&p->proc_lock);
 	p->exitcode = 1337;	/* so we can see processes killed by the kernel */
@@ -272,6 +340,7 @@ error_t proc_alloc(struct proc **pp, struct proc *parent)
 	p->heap_top = 0;
 	spinlock_init(&p->mm_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
+	p->vmr_root = 0;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before initing
 	 * procinfo. */
@@ -318,16 +387,17 @@ error_t proc_alloc(struct proc **pp, struct proc *parent)
 
 /* We have a bunch of different ways to make processes.  Call this once the
  * process is ready to be used by the rest of the system.  For now, this just
- * means when it is ready to be named via the pidhash.  In the future, we might
+ * means when it is ready to be named via the pid table.  In the future, we might
  * push setting the state to CREATED into here. */
 void __proc_ready(struct proc *p)
 {
 	/* Tell the ksched about us.  TODO: do we need to worry about the ksched
-	 * doing stuff to us before we're added to the pid_hash? */
+	 * doing stuff to us before we're added to the pid table? */
 	__sched_proc_register(p);
-	spin_lock(&pid_hash_lock);
-	hashtable_insert(pid_hash, (void*)(long)p->pid, p);
-	spin_unlock(&pid_hash_lock);
+	spin_lock(&pid_table_lock);
+	wmb();	/* p is set up before pid2proc() can find it */
+	pid_table[p->pid >> PID_CHUNK_SHIFT][p->pid & PID_CHUNK_MASK] = p;
+	spin_unlock(&pid_table_lock);
 }
 
 /* Creates a process from the specified file, argvs, and envps.  Tempted to get
@@ -370,11 +440,12 @@ static void __proc_free(struct kref *kref)
 			cache_color_free(llc_cache, p->cache_colors_map);
 		cache_colors_map_free(p->cache_colors_map);
 	}
-	/* Remove us from the pid_hash and give our PID back (in that order). */
-	spin_lock(&pid_hash_lock);
-	if (!hashtable_remove(pid_hash, (void*)(long)p->pid))
+	/* Remove us from the pid table and give our PID back (in that order). */
+	spin_lock(&pid_table_lock);
+	if (pid_table[p->pid >> PID_CHUNK_SHIFT][p->pid & PID_CHUNK_MASK] != p)
 		panic("Proc not in the pid table in %s", __FUNCTION__);
-	spin_unlock(&pid_hash_lock);
+	pid_table[p->pid >> PID_CHUNK_SHIFT][p->pid & PID_CHUNK_MASK] = 0;
+	spin_unlock(&pid_table_lock);
 	put_free_pid(p->pid);
 	/* Flush all mapped pages in the user portion of the address space */
 	env_user_mem_free(p, 0, UVPT);
@@ -1679,31 +1750,40 @@ void switch_back(struct proc *new_p, struct proc *old_proc)
 	}
 }
 
-/* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+/* Shoots down the virtual addresses [start, end) on every core running p.
+ * Callers should batch up their PTE changes (struct tlb_batch) and call this
+ * once per mm operation.
  *
- * Would be nice to have a broadcast kmsg at this point.  Note this may send a
- * message to the calling core (interrupting it, possibly while holding the
- * proc_lock).  We don't need to process routine messages since it's an
- * immediate message. */
+ * We only hold the proc_lock long enough to see which cores to hit, and skip
+ * vcores that aren't mapped (they'll have no translations for p).  Then we
+ * queue a message for each remote core and send the IPIs afterwards, so they
+ * all flush in parallel.  If the calling core is one of p's, we flush it
+ * directly, instead of IPIing ourselves. */
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
 {
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct vcore *vc_i;
-	/* TODO: we might be able to avoid locking here in the future (we must hit
-	 * all online, and we can check __mapped).  it'll be complicated. */
+	DECL_BITMASK(targets, MAX_NUM_CPUS);
+	bool flush_local = FALSE;
+
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	if (start >= end)
+		return;
+	CLR_BITMASK(targets, MAX_NUM_CPUS);
 	spin_lock(&p->proc_lock);
 	switch (p->state) {
 		case (PROC_RUNNING_S):
-			tlbflush();
+			flush_local = TRUE;
 			break;
 		case (PROC_RUNNING_M):
-			/* TODO: (TLB) sanity checks and rounding on the ranges */
 			TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-				send_kernel_message(vc_i->pcoreid, __tlbshootdown, start, end,
-				                    0, KMSG_IMMEDIATE);
+				if (!vcore_is_mapped(p, vcore2vcoreid(p, vc_i)))
+					continue;
+				if (vc_i->pcoreid == core_id())
+					flush_local = TRUE;
+				else
+					SET_BITMASK_BIT(targets, vc_i->pcoreid);
 			}
 			break;
 		case (PROC_DYING):
@@ -1716,6 +1796,24 @@ void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
 			     __FUNCTION__);
 	}
 	spin_unlock(&p->proc_lock);
+	pcpui->nr_tlb_ipis += send_kernel_message_multi(targets, __tlbshootdown,
+	                                                start, end, 0,
+	                                                KMSG_IMMEDIATE);
+	if (flush_local)
+		__tlbshootdown(core_id(), start, end, 0);
+}
+
+/* Prints how many shootdown IPIs each core sent, and how it flushed */
+void print_tlb_stats(void)
+{
+	struct per_cpu_info *pcpui;
+
+	printk("Core  IPIs sent  Pages invlpg'd  Full flushes\n");
+	for (int i = 0; i < num_cpus; i++) {
+		pcpui = &per_cpu_info[i];
+		printk("%4d %10llu %15llu %13llu\n", i, pcpui->nr_tlb_ipis,
+		       pcpui->nr_tlb_invlpgs, pcpui->nr_tlb_flushes);
+	}
 }
 
 /* Helper, used by __startcore and __set_curctx, which sets up cur_ctx to run a
@@ -2066,26 +2164,34 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
 }
 
 /* Kernel message handler, usually sent IMMEDIATE, to shoot down virtual
- * addresses from a0 to a1. */
+ * addresses from a0 to a1 (page aligned).  Past a point, one full flush is
+ * cheaper than invlpg'ing every page. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	uintptr_t start = (uintptr_t)a0;
+	uintptr_t end = (uintptr_t)a1;
+	size_t nr_pages = (end - start) >> PGSHIFT;
+
+	if (nr_pages > TLB_SHOOTDOWN_MAX_INVLPG) {
+		tlbflush();
+		pcpui->nr_tlb_flushes++;
+		return;
+	}
+	for (uintptr_t va = start; va < end; va += PGSIZE)
+		invlpg((void*)va);
+	pcpui->nr_tlb_invlpgs += nr_pages;
 }
 
 void print_allpids(void)
 {
-	void print_proc_state(void *item)
+	void print_proc_state(struct proc *p)
 	{
-		struct proc *p = (struct proc*)item;
-		assert(p);
 		printk("%8d %-10s %6d\n", p->pid, procstate2str(p->state), p->ppid);
 	}
 	printk("     PID STATE      Parent    \n");
 	printk("------------------------------\n");
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, print_proc_state);
-	spin_unlock(&pid_hash_lock);
+	pid_for_each(print_proc_state);
 }
 
 void print_proc_info(pid_t pid)
@@ -2144,11 +2250,9 @@ void print_proc_info(pid_t pid)
 void check_my_owner(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	void shazbot(void *item)
+	void shazbot(struct proc *p)
 	{
-		struct proc *p = (struct proc*)item;
 		struct vcore *vc_i;
-		assert(p);
 		spin_lock(&p->proc_lock);
 		TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
 			/* this isn't true, a __startcore could be on the way and we're
@@ -2156,12 +2260,12 @@ void check_my_owner(void)
 			if (vc_i->pcoreid == core_id()) {
 				/* Immediate message was sent, we should get it when we enable
 				 * interrupts, which should cause us to skip cpu_halt() */
-				if (!STAILQ_EMPTY(&pcpui->immed_amsgs))
+				if (has_immed_kmsgs(core_id()))
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
 				spin_unlock(&p->proc_lock);
-				spin_unlock(&pid_hash_lock);
+				spin_unlock(&pid_table_lock);
 				monitor(0);
 			}
 		}
@@ -2170,8 +2274,6 @@ void check_my_owner(void)
 	assert(!irq_is_enabled());
 	extern int booting;
 	if (!booting && !pcpui->owning_proc) {
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, shazbot);
-		spin_unlock(&pid_hash_lock);
+		pid_for_each(shazbot);
 	}
 }
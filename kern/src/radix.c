@@ -2,7 +2,7 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Radix Trees!  Just the basics, doesn't do tagging or anything fancy. */
+ * Radix Trees!  The basics, plus tagging and gang lookups. */
 
 #include <ros/errno.h>
 #include <radix.h>
@@ -15,6 +15,7 @@ static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               unsigned long key,
                                               bool extend);
 static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot);
+static void __radix_untag(struct radix_node *r_node, unsigned int idx, int tag);
 
 /* Initializes the radix tree system, mostly just builds the kcache */
 void radix_init(void)
@@ -59,6 +60,9 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item)
 		if (tree->root) {
 			/* tree->root is the old root, now a child of the future root */
 			r_node->items[0] = tree->root;
+			for (int i = 0; i < RADIX_NR_TAGS; i++)
+				if (tree->root->tags[i])
+					r_node->tags[i] = 1;
 			tree->root->parent = r_node;
 			tree->root->my_slot = (struct radix_node**)&r_node->items[0];
 			r_node->num_items = 1;
@@ -89,7 +93,12 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item)
  * nothing left, potentially recursively. */
 static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot)
 {
+	unsigned int idx = (void**)slot - r_node->items;
+
 	assert(*slot);		/* make sure there is something there */
+	for (int i = 0; i < RADIX_NR_TAGS; i++)
+		if (r_node->tags[i] & (1ULL << idx))
+			__radix_untag(r_node, idx, i);
 	*slot = 0;
 	r_node->num_items--;
 	/* this check excludes the root, but the if else handles it.  For now, once
@@ -197,14 +206,46 @@ void **radix_lookup_slot(struct radix_tree *tree, unsigned long key)
 	return &r_node->items[key];
 }
 
+/* Helper, collects up to max_items items under r_node with keys of at least
+ * first, in key order.  r_node is at height (1 for a leaf) and its first key is
+ * base.  A tag of -1 means any item. */
+static unsigned int __radix_gang_lookup(struct radix_node *r_node,
+                                        unsigned int height, unsigned long base,
+                                        unsigned long first, void **results,
+                                        unsigned int max_items, int tag)
+{
+	unsigned long span = 1UL << (LOG_RNODE_SLOTS * (height - 1));
+	unsigned int nr = 0;
+
+	for (int i = 0; (i < NR_RNODE_SLOTS) && (nr < max_items); i++) {
+		if (!r_node->items[i])
+			continue;
+		if ((tag >= 0) && !(r_node->tags[tag] & (1ULL << i)))
+			continue;
+		/* everything under this slot is before first */
+		if (base + (i + 1) * span <= first)
+			continue;
+		if (height == 1)
+			results[nr++] = r_node->items[i];
+		else
+			nr += __radix_gang_lookup(r_node->items[i], height - 1,
+			                          base + i * span, first, results + nr,
+			                          max_items - nr, tag);
+	}
+	return nr;
+}
+
+/* Fills results with up to max_items items, starting from key first, in key
+ * order.  Returns how many it found. */
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	if (!tree->root)
+		return 0;
+	return __radix_gang_lookup(tree->root, tree->depth, 0, first, results,
+	                           max_items, -1);
 }
 
-
 int radix_grow(struct radix_tree *tree, unsigned long max)
 {
 	panic("Not implemented");
@@ -218,35 +259,83 @@ int radix_preload(struct radix_tree *tree, int flags)
 }
 
 
+/* Returns the index of r_node's slot in its parent */
+static unsigned int __radix_node_idx(struct radix_node *r_node)
+{
+	return (void**)r_node->my_slot - r_node->parent->items;
+}
+
+/* Clears tag on r_node's slot idx, and on the way up for every node that no
+ * longer has anything tagged under it. */
+static void __radix_untag(struct radix_node *r_node, unsigned int idx, int tag)
+{
+	while (1) {
+		r_node->tags[tag] &= ~(1ULL << idx);
+		if (r_node->tags[tag] || !r_node->parent)
+			return;
+		idx = __radix_node_idx(r_node);
+		r_node = r_node->parent;
+	}
+}
+
+/* Tags the item at key, returning the item, or 0 if there isn't one. */
 void *radix_tag_set(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	unsigned int idx = key & (NR_RNODE_SLOTS - 1);
+	void *item;
+
+	if (!r_node || !(item = r_node->items[idx]))
+		return 0;
+	/* Once we find a node with the bit set, its ancestors have it too */
+	while (!(r_node->tags[tag] & (1ULL << idx))) {
+		r_node->tags[tag] |= 1ULL << idx;
+		if (!r_node->parent)
+			break;
+		idx = __radix_node_idx(r_node);
+		r_node = r_node->parent;
+	}
+	return item;
 }
 
+/* Untags the item at key, returning the item, or 0 if there isn't one. */
 void *radix_tag_clear(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	unsigned int idx = key & (NR_RNODE_SLOTS - 1);
+	void *item;
+
+	if (!r_node || !(item = r_node->items[idx]))
+		return 0;
+	if (r_node->tags[tag] & (1ULL << idx))
+		__radix_untag(r_node, idx, tag);
+	return item;
 }
 
 int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	unsigned int idx = key & (NR_RNODE_SLOTS - 1);
+
+	if (!r_node || !r_node->items[idx])
+		return 0;
+	return r_node->tags[tag] & (1ULL << idx) ? 1 : 0;
 }
 
+/* Returns whether anything in the tree has tag */
 int radix_tree_tagged(struct radix_tree *tree, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	return tree->root && tree->root->tags[tag];
 }
 
+/* Like radix_gang_lookup(), but only for items with tag */
 int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
                           unsigned long first, unsigned int max_items, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	if (!tree->root)
+		return 0;
+	return __radix_gang_lookup(tree->root, tree->depth, 0, first, results,
+	                           max_items, tag);
 }
 
 void print_radix_tree(struct radix_tree *tree)
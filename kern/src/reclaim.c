@@ -0,0 +1,315 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Page cache reclaim, see reclaim.h.
+ *
+ * Lock ordering: an LRU's lock, then a pm's pm_tree_lock.  A page is on the
+ * lists from right after pm_insert_page() until someone takes it out of its
+ * pm, and pms take their pages off the lists before they go away, so while we
+ * hold a page's LRU lock, its pg_mapping is safe to lock.
+ *
+ * We only evict pages that no one else has a ref on.  That covers pages under
+ * IO, pages someone is reading, and pages mapped into a process, including
+ * the read-only CoW mappings of the page cache that fault-around makes.
+ * Eviction never blocks, so it is safe for direct reclaim too. */
+
+#include <reclaim.h>
+#include <pagemap.h>
+#include <page_alloc.h>
+#include <writeback.h>
+#include <pmap.h>
+#include <kthread.h>
+#include <alarm.h>
+#include <smp.h>
+#include <trap.h>
+#include <atomic.h>
+#include <kref.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Every pm's pages are on this one, unless the pm has its own */
+struct page_lru page_lru = {
+	.inactive = TAILQ_HEAD_INITIALIZER(page_lru.inactive),
+	.active = TAILQ_HEAD_INITIALIZER(page_lru.active),
+	.lock = SPINLOCK_INITIALIZER_IRQSAVE,
+};
+
+size_t reclaim_low_pages;		/* 0 until the reclaimer is running */
+static size_t reclaim_high_pages;
+static struct semaphore reclaim_sem;
+static atomic_t reclaim_kicked;
+
+/* Only the reclaimer and pm_shrink() use these */
+static uint64_t nr_wakeups;
+static atomic_t nr_direct;
+
+/* For pms with their own LRU, which set pm_lru after pm_init().  Reclaim only
+ * gets to their pages through page_lru_shrink(). */
+void page_lru_init(struct page_lru *lru)
+{
+	memset(lru, 0, sizeof(struct page_lru));
+	TAILQ_INIT(&lru->inactive);
+	TAILQ_INIT(&lru->active);
+	spinlock_init_irqsave(&lru->lock);
+}
+
+static unsigned long pm_shadow_key(struct page_map *pm, unsigned long index)
+{
+	return ((uintptr_t)pm ^ (index * 0x9e3779b9UL)) | 1;
+}
+
+static unsigned long *pm_shadow_slot(struct page_lru *lru, unsigned long key)
+{
+	return &lru->shadows[(key ^ (key >> 12)) & (RECLAIM_NR_SHADOWS - 1)];
+}
+
+static void __lru_insert(struct page_lru *lru, struct page *page, uint8_t list)
+{
+	page->pg_lru_list = list;
+	if (list == PG_LRU_ACTIVE) {
+		TAILQ_INSERT_TAIL(&lru->active, page, pg_lru);
+		lru->nr_active++;
+	} else {
+		TAILQ_INSERT_TAIL(&lru->inactive, page, pg_lru);
+		lru->nr_inactive++;
+	}
+}
+
+static void __lru_remove(struct page_lru *lru, struct page *page)
+{
+	if (page->pg_lru_list == PG_LRU_ACTIVE) {
+		TAILQ_REMOVE(&lru->active, page, pg_lru);
+		lru->nr_active--;
+	} else {
+		TAILQ_REMOVE(&lru->inactive, page, pg_lru);
+		lru->nr_inactive--;
+	}
+	page->pg_lru_list = PG_LRU_NONE;
+}
+
+/* Puts a page that was just added to pm on pm's LRU lists.  Call this without
+ * holding pm's lock. */
+void pm_lru_add(struct page_map *pm, struct page *page)
+{
+	struct page_lru *lru = pm->pm_lru;
+	unsigned long key = pm_shadow_key(pm, page->pg_index);
+	unsigned long *shadow = pm_shadow_slot(lru, key);
+	bool refault = *shadow == key;
+
+	if (refault)
+		*shadow = 0;
+	/* It could have been hit in its last life */
+	page->pg_refs = 0;
+	spin_lock_irqsave(&lru->lock);
+	if (refault) {
+		__lru_insert(lru, page, PG_LRU_ACTIVE);
+		lru->stats.nr_refaults++;
+	} else {
+		__lru_insert(lru, page, PG_LRU_INACTIVE);
+	}
+	spin_unlock_irqsave(&lru->lock);
+}
+
+/* Takes a page off pm's LRU lists, for when it leaves pm.  The page might not
+ * be on them, if reclaim already took it off. */
+void pm_lru_del(struct page_map *pm, struct page *page)
+{
+	struct page_lru *lru = pm->pm_lru;
+
+	spin_lock_irqsave(&lru->lock);
+	if (page->pg_lru_list != PG_LRU_NONE)
+		__lru_remove(lru, page);
+	spin_unlock_irqsave(&lru->lock);
+}
+
+/* Moves the oldest active page to the inactive list, unless it was hit since
+ * it got on the active list, in which case it goes around again. */
+static void __lru_deactivate_one(struct page_lru *lru)
+{
+	struct page *page = TAILQ_FIRST(&lru->active);
+
+	if (!page)
+		return;
+	__lru_remove(lru, page);
+	if (page->pg_refs) {
+		page->pg_refs = 0;
+		__lru_insert(lru, page, PG_LRU_ACTIVE);
+		return;
+	}
+	__lru_insert(lru, page, PG_LRU_INACTIVE);
+	lru->stats.nr_deactivated++;
+}
+
+/* Tries to evict page, which is the oldest inactive page.  Returns TRUE if we
+ * took it out of its pm, in which case the caller drops the pm's ref once it
+ * lets go of the LRU lock.  Otherwise, the page goes back on a list. */
+static bool __lru_try_evict(struct page_lru *lru, struct page *page,
+                            bool *saw_dirty)
+{
+	struct page_map *pm = page->pg_mapping;
+	unsigned long key;
+	bool busy, dirty;
+
+	__lru_remove(lru, page);
+	lru->stats.nr_scanned++;
+	/* Hit at least twice while inactive */
+	if (page->pg_refs >= 2) {
+		page->pg_refs = 0;
+		__lru_insert(lru, page, PG_LRU_ACTIVE);
+		lru->stats.nr_activated++;
+		return FALSE;
+	}
+	page->pg_refs = 0;
+	assert(pm);
+	spin_lock_irqsave(&pm->pm_tree_lock);
+	/* Someone is taking it out of the cache, and will find it off the lists */
+	if (radix_lookup(&pm->pm_tree, page->pg_index) != page) {
+		spin_unlock_irqsave(&pm->pm_tree_lock);
+		return FALSE;
+	}
+	busy = (kref_refcnt(&page->pg_kref) > 1) || (page->pg_flags & PG_LOCKED);
+	dirty = radix_tag_get(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY) ||
+	        radix_tag_get(&pm->pm_tree, page->pg_index, PM_TAG_WRITEBACK);
+	if (!busy && !dirty) {
+		radix_delete(&pm->pm_tree, page->pg_index);
+		pm->pm_num_pages--;
+		page->pg_mapping = 0;
+	}
+	spin_unlock_irqsave(&pm->pm_tree_lock);
+	if (!busy && !dirty) {
+		key = pm_shadow_key(pm, page->pg_index);
+		*pm_shadow_slot(lru, key) = key;
+		lru->stats.nr_evicted++;
+		return TRUE;
+	}
+	if (busy || !pm->pm_op->writepages) {
+		/* In use, or dirty with nowhere to write it */
+		__lru_insert(lru, page, PG_LRU_ACTIVE);
+		lru->stats.nr_activated++;
+	} else {
+		/* It'll be clean once the flushers get to it */
+		__lru_insert(lru, page, PG_LRU_INACTIVE);
+		lru->stats.nr_rotated++;
+		*saw_dirty = TRUE;
+	}
+	return FALSE;
+}
+
+/* Evicts up to nr_to_free of lru's pages, looking at each inactive page at
+ * most once.  Never blocks.  Returns how many we freed. */
+unsigned long page_lru_shrink(struct page_lru *lru, unsigned long nr_to_free)
+{
+	struct page *evicted[RECLAIM_BATCH];
+	unsigned int nr_evicted;
+	unsigned long nr_freed = 0;
+	unsigned long budget;
+	bool saw_dirty = FALSE;
+	struct page *page;
+
+	spin_lock_irqsave(&lru->lock);
+	budget = MAX(lru->nr_inactive, RECLAIM_BATCH);
+	spin_unlock_irqsave(&lru->lock);
+	while (budget && (nr_freed < nr_to_free)) {
+		nr_evicted = 0;
+		spin_lock_irqsave(&lru->lock);
+		for (int i = 0; (i < RECLAIM_BATCH) && budget &&
+		                (nr_freed + nr_evicted < nr_to_free); i++) {
+			/* Keep the inactive list at least as long as the active one */
+			if (lru->nr_active > lru->nr_inactive)
+				__lru_deactivate_one(lru);
+			page = TAILQ_FIRST(&lru->inactive);
+			if (!page) {
+				budget = 0;
+				break;
+			}
+			budget--;
+			if (__lru_try_evict(lru, page, &saw_dirty))
+				evicted[nr_evicted++] = page;
+		}
+		spin_unlock_irqsave(&lru->lock);
+		/* Frees the page, and its BHs */
+		for (int i = 0; i < nr_evicted; i++)
+			page_decref(evicted[i]);
+		nr_freed += nr_evicted;
+	}
+	if (saw_dirty)
+		writeback_wakeup();
+	return nr_freed;
+}
+
+/* Direct reclaim: evicts up to nr_to_free pages for a caller that is out of
+ * memory.  Never blocks.  Returns how many pages we freed. */
+unsigned long pm_shrink(unsigned long nr_to_free)
+{
+	atomic_inc(&nr_direct);
+	return page_lru_shrink(&page_lru, nr_to_free);
+}
+
+/* Called by the page allocator when it drops below the low watermark.  It's OK
+ * to call this from anywhere, and with IRQs disabled. */
+void reclaim_wakeup(void)
+{
+	int8_t irq_state = 0;
+
+	if (atomic_cas(&reclaim_kicked, 0, 1))
+		sem_up_irqsave(&reclaim_sem, &irq_state);
+}
+
+static void reclaim_sleep(uint64_t usec)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	struct alarm_waiter a_waiter;
+
+	init_awaiter(&a_waiter, 0);
+	set_awaiter_rel(&a_waiter, usec);
+	set_alarm(tchain, &a_waiter);
+	sleep_on_awaiter(&a_waiter);
+}
+
+/* Reclaimer kthread, started as a routine kernel message that never returns.
+ * Frees pages until we're over the high watermark.  If there's nothing it can
+ * evict, it waits a bit before listening to the allocator again, so the
+ * flushers can clean some pages. */
+static void reclaimer(uint32_t srcid, long a0, long a1, long a2)
+{
+	int8_t irq_state = 0;
+
+	while (1) {
+		sem_down_irqsave(&reclaim_sem, &irq_state);
+		nr_wakeups++;
+		while (nr_free_pages < reclaim_high_pages) {
+			if (!page_lru_shrink(&page_lru, RECLAIM_BATCH)) {
+				reclaim_sleep(RECLAIM_BACKOFF_USEC);
+				break;
+			}
+		}
+		atomic_set(&reclaim_kicked, 0);
+	}
+}
+
+/* Sets the watermarks and starts the reclaimer on the calling core */
+void reclaim_init(void)
+{
+	sem_init_irqsave(&reclaim_sem, 0);
+	atomic_init(&reclaim_kicked, 0);
+	reclaim_high_pages = max_nr_pages >> RECLAIM_HIGH_SHIFT;
+	send_kernel_message(core_id(), reclaimer, 0, 0, 0, KMSG_ROUTINE);
+	/* The allocator starts waking us up once this is set */
+	reclaim_low_pages = max_nr_pages >> RECLAIM_LOW_SHIFT;
+}
+
+void print_reclaim_stats(void)
+{
+	struct reclaim_stats *stats = &page_lru.stats;
+
+	printk("Free pages: %lu, low watermark %lu, high %lu\n", nr_free_pages,
+	       reclaim_low_pages, reclaim_high_pages);
+	printk("Active: %lu, inactive: %lu, wakeups: %llu, direct: %ld\n",
+	       page_lru.nr_active, page_lru.nr_inactive, nr_wakeups,
+	       atomic_read(&nr_direct));
+	printk("Scanned: %llu, evicted: %llu, refaults: %llu\n", stats->nr_scanned,
+	       stats->nr_evicted, stats->nr_refaults);
+	printk("Activated: %llu, deactivated: %llu, rotated: %llu\n",
+	       stats->nr_activated, stats->nr_deactivated, stats->nr_rotated);
+}
@@ -19,23 +19,57 @@
 #include <alarm.h>
 #include <sys/queue.h>
 #include <kmalloc.h>
+#include <page_alloc.h>
+#include <topology.h>
+#include <ros/resource.h>
+#include <arsc_server.h>
 
 /* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
  * waiting or otherwise not considered for sched decisions. */
 struct proc_list unrunnable_scps = TAILQ_HEAD_INITIALIZER(unrunnable_scps);
 struct proc_list runnable_scps = TAILQ_HEAD_INITIALIZER(runnable_scps);
-/* mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
- * I'm expecting to want the flexibility of the pointers later. */
+/* mcp lists.  The ksched only looks at 'hungry' MCPs: the primary list holds
+ * the ones it has yet to look at, and the secondary holds the ones it looked at
+ * that still want more cores.  MCPs that got everything they wanted (or are
+ * WAITING) are 'sated', and stay off the hungry lists until their demand might
+ * have changed (pokes, wakeups, preemptions), so the cost of a ksched pass
+ * depends on how many MCPs want something, not on how many exist. */
 struct proc_list all_mcps_1 = TAILQ_HEAD_INITIALIZER(all_mcps_1);
 struct proc_list all_mcps_2 = TAILQ_HEAD_INITIALIZER(all_mcps_2);
 struct proc_list *primary_mcps = &all_mcps_1;
 struct proc_list *secondary_mcps = &all_mcps_2;
+struct proc_list sated_mcps = TAILQ_HEAD_INITIALIZER(sated_mcps);
+
+/* Procs can change their amt_wanted without poking us.  Every so often, we
+ * look at all of the sated MCPs again, just in case. */
+#define KSCHED_RESCAN_TICKS 100
+static unsigned int ksched_ticks;
+static bool ksched_rescan;
 
 /* The pcores in the system.  (array gets alloced in init()).  */
 struct sched_pcore *all_pcores;
 
-/* TAILQ of all unallocated, idle (CG) cores */
-struct sched_pcore_tailq idlecores = TAILQ_HEAD_INITIALIZER(idlecores);
+/* Unallocated, idle (CG) cores, in a pool per NUMA node.  Each pool has its own
+ * lock, so cores coming and going on different nodes don't contend. */
+struct sched_idle_pool {
+	spinlock_t					lock;
+	struct sched_pcore_tailq	cores;
+	unsigned int				nr_cores;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+static struct sched_idle_pool idle_pools[MAX_NUMA_NODES];
+
+/* When the ksched gives a proc cores that aren't provisioned to it, it picks
+ * the idle cores that best fit the proc's placement policy, given the cores it
+ * already has.  These are counts per (dense) topology id.  Only the MCP ksched
+ * uses this, and it only runs on one core at a time, so it's a global. */
+static struct core_placement {
+	int							policy;
+	uint8_t						llc_mine[MAX_NUM_CPUS];
+	uint8_t						socket_mine[MAX_NUM_CPUS];
+	uint8_t						phys_mine[MAX_NUM_CPUS];	/* p's threads */
+	uint8_t						phys_busy[MAX_NUM_CPUS];	/* others' threads */
+	uint8_t						llc_idle[MAX_NUM_CPUS];
+} placement;
 
 /* Helper, defined below */
 static void __core_request(struct proc *p, uint32_t amt_needed);
@@ -47,6 +81,11 @@ static void switch_lists(struct proc *p, struct proc_list *old,
 static uint32_t spc2pcoreid(struct sched_pcore *spc);
 static struct sched_pcore *pcoreid2spc(uint32_t pcoreid);
 static bool is_ll_core(uint32_t pcoreid);
+static void put_idle_spc(struct sched_pcore *spc);
+static void remove_idle_spc(struct sched_pcore *spc);
+static struct sched_pcore *get_idle_spc(int node);
+static void placement_init(struct proc *p);
+static struct sched_pcore *get_placed_idle_spc(void);
 static void __prov_track_alloc(struct proc *p, uint32_t pcoreid);
 static void __prov_track_dealloc(struct proc *p, uint32_t pcoreid);
 static void __prov_track_dealloc_bulk(struct proc *p, uint32_t *pc_arr,
@@ -69,20 +108,21 @@ static uint32_t get_cores_needed(struct proc *p);
  * struct that can handle the posting of different types of work. */
 struct poke_tracker ksched_poker = {0, 0, __run_mcp_ksched};
 
-/* this 'big ksched lock' protects a bunch of things, which i may make fine
- * grained: */
+/* The ksched's locks.  Lock ordering is proclist_lock -> prov_lock -> an idle
+ * pool's lock.  Some of our callbacks are called with a proc_lock held, so a
+ * proc_lock comes before prov_lock and the pool locks. */
 /* - protects the integrity of proc tailqs/structures, as well as the membership
  * of a proc on those lists.  proc lifetime within the ksched but outside this
  * lock is protected by the proc kref. */
-//spinlock_t proclist_lock = SPINLOCK_INITIALIZER; /* subsumed by bksl */
+spinlock_t proclist_lock = SPINLOCK_INITIALIZER;
 /* - protects the provisioning assignment, membership of sched_pcores in
  * provision lists, and the integrity of all prov lists (the lists of each
- * proc).  does NOT protect spc->alloc_proc. */
-//spinlock_t prov_lock = SPINLOCK_INITIALIZER;
-/* - protects allocation structures: spc->alloc_proc, the integrity and
- * membership of the idelcores tailq. */
-//spinlock_t alloc_lock = SPINLOCK_INITIALIZER;
-spinlock_t sched_lock = SPINLOCK_INITIALIZER;
+ * proc).  Since the prov list a pcore is on depends on spc->alloc_proc, this
+ * also protects alloc_proc. */
+spinlock_t prov_lock = SPINLOCK_INITIALIZER;
+/* - each idle pool's lock protects the membership of its tailq and the pcores'
+ * 'idle' flags.  A pcore is tracked dealloc'd before it goes in a pool, so
+ * anything the ksched pulls from a pool is unallocated. */
 
 /* Alarm struct, for our example 'timer tick' */
 struct alarm_waiter ksched_waiter;
@@ -110,6 +150,8 @@ static void __just_sched(uint32_t srcid, long a0, long a1, long a2)
 static void __ksched_tick(uint32_t srcid, long a0, long a1, long a2)
 {
 	/* TODO: imagine doing some accounting here */
+	if (!(++ksched_ticks % KSCHED_RESCAN_TICKS))
+		ksched_rescan = TRUE;
 	schedule();
 	/* Set our alarm to go off, incrementing from our last tick (instead of
 	 * setting it relative to now, since some time has passed since the alarm
@@ -127,34 +169,39 @@ static void __kalarm(struct alarm_waiter *waiter)
 
 void schedule_init(void)
 {
-	spin_lock(&sched_lock);
 	/* init provisioning stuff */
 	all_pcores = kmalloc(sizeof(struct sched_pcore) * num_cpus, 0);
 	memset(all_pcores, 0, sizeof(struct sched_pcore) * num_cpus);
+	for (int i = 0; i < MAX_NUMA_NODES; i++) {
+		spinlock_init(&idle_pools[i].lock);
+		TAILQ_INIT(&idle_pools[i].cores);
+		idle_pools[i].nr_cores = 0;
+	}
 	assert(!core_id());		/* want the alarm on core0 for now */
 	init_awaiter(&ksched_waiter, __kalarm);
 	set_ksched_alarm();
-	/* init the idlecore list.  if they turned off hyperthreading, give them the
+	/* init the idle pools.  if they turned off hyperthreading, give them the
 	 * odds from 1..max-1.  otherwise, give them everything by 0 (default mgmt
 	 * core).  TODO: (CG/LL) better LL/CG mgmt */
 #ifndef CONFIG_DISABLE_SMT
 	for (int i = 1; i < num_cpus; i++)
-		TAILQ_INSERT_TAIL(&idlecores, pcoreid2spc(i), alloc_next);
+		put_idle_spc(pcoreid2spc(i));
 #else
 	assert(!(num_cpus % 2));
 	for (int i = 1; i < num_cpus; i += 2)
-		TAILQ_INSERT_TAIL(&idlecores, pcoreid2spc(i), alloc_next);
+		put_idle_spc(pcoreid2spc(i));
 #endif /* CONFIG_DISABLE_SMT */
 #ifdef CONFIG_ARSC_SERVER
-	struct sched_pcore *a_core = TAILQ_FIRST(&idlecores);
-	assert(a_core);
-	TAILQ_REMOVE(&idlecores, a_core, alloc_next);
-	send_kernel_message(spc2pcoreid(a_core), arsc_server, 0, 0, 0,
-	                    KMSG_ROUTINE);
-	warn("Using core %d for the ARSCs - there are probably issues with this.",
-	     spc2pcoreid(a_core));
+	/* Spread the servers across the nodes.  They never go back to the pools. */
+	int nr_arsc = arsc_init();
+	for (int i = 0; i < nr_arsc; i++) {
+		struct sched_pcore *a_core = get_idle_spc(i % nr_numa_nodes);
+		assert(a_core);
+		send_kernel_message(spc2pcoreid(a_core), arsc_server, i, 0, 0,
+		                    KMSG_ROUTINE);
+		printk("Using core %d for ARSC server %d\n", spc2pcoreid(a_core), i);
+	}
 #endif /* CONFIG_ARSC_SERVER */
-	spin_unlock(&sched_lock);
 	return;
 }
 
@@ -168,6 +215,62 @@ static struct sched_pcore *pcoreid2spc(uint32_t pcoreid)
 	return &all_pcores[pcoreid];
 }
 
+static struct sched_idle_pool *spc2pool(struct sched_pcore *spc)
+{
+	return &idle_pools[core2node(spc2pcoreid(spc))];
+}
+
+/* Puts an unallocated pcore in its node's idle pool.  Track the dealloc first,
+ * so that no one pulls a core from the pool that still looks allocated. */
+static void put_idle_spc(struct sched_pcore *spc)
+{
+	struct sched_idle_pool *pool = spc2pool(spc);
+	spin_lock(&pool->lock);
+	assert(!spc->idle);
+	TAILQ_INSERT_TAIL(&pool->cores, spc, alloc_next);
+	pool->nr_cores++;
+	spc->idle = TRUE;
+	spin_unlock(&pool->lock);
+}
+
+/* Pulls a specific pcore, which must be idle, from its pool */
+static void remove_idle_spc(struct sched_pcore *spc)
+{
+	struct sched_idle_pool *pool = spc2pool(spc);
+	spin_lock(&pool->lock);
+	assert(spc->idle);
+	TAILQ_REMOVE(&pool->cores, spc, alloc_next);
+	pool->nr_cores--;
+	spc->idle = FALSE;
+	spin_unlock(&pool->lock);
+}
+
+/* Pulls the first idle pcore from node's pool, or from the other nodes' pools
+ * if node has none.  Returns 0 if there are no idle pcores. */
+static struct sched_pcore *get_idle_spc(int node)
+{
+	struct sched_idle_pool *pool;
+	struct sched_pcore *spc;
+
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		pool = &idle_pools[(node + i) % nr_numa_nodes];
+		/* lockless peek, to skip empty pools */
+		if (!pool->nr_cores)
+			continue;
+		spin_lock(&pool->lock);
+		spc = TAILQ_FIRST(&pool->cores);
+		if (spc) {
+			TAILQ_REMOVE(&pool->cores, spc, alloc_next);
+			pool->nr_cores--;
+			spc->idle = FALSE;
+		}
+		spin_unlock(&pool->lock);
+		if (spc)
+			return spc;
+	}
+	return 0;
+}
+
 /* Round-robins on whatever list it's on */
 static void add_to_list(struct proc *p, struct proc_list *new)
 {
@@ -199,6 +302,17 @@ static void remove_from_any_list(struct proc *p)
 	}
 }
 
+/* Makes sure the MCP ksched looks at p the next time it runs.  If p isn't
+ * sated, it is either hungry already, or off the lists (dying or being serviced
+ * by the ksched, which checks p's demand when it is done). */
+static void mark_hungry(struct proc *p)
+{
+	spin_lock(&proclist_lock);
+	if ((p->state != PROC_DYING) && (p->ksched_data.cur_list == &sated_mcps))
+		switch_lists(p, &sated_mcps, primary_mcps);
+	spin_unlock(&proclist_lock);
+}
+
 /************** Process Management Callbacks **************/
 /* a couple notes:
  * - the proc lock is NOT held for any of these calls.  currently, there is no
@@ -214,22 +328,25 @@ void __sched_proc_register(struct proc *p)
 	assert(p->state != PROC_DYING);	/* shouldn't be abel to happen yet */
 	/* one ref for the proc's existence, cradle-to-grave */
 	proc_incref(p, 1);	/* need at least this OR the 'one for existing' */
-	spin_lock(&sched_lock);
+	spin_lock(&prov_lock);
 	TAILQ_INIT(&p->ksched_data.prov_alloc_me);
 	TAILQ_INIT(&p->ksched_data.prov_not_alloc_me);
+	spin_unlock(&prov_lock);
+	p->ksched_data.core_placement = CORE_PLACE_PACK;
+	spin_lock(&proclist_lock);
 	add_to_list(p, &unrunnable_scps);
-	spin_unlock(&sched_lock);
+	spin_unlock(&proclist_lock);
 }
 
 /* Returns 0 if it succeeded, an error code otherwise. */
 void __sched_proc_change_to_m(struct proc *p)
 {
-	spin_lock(&sched_lock);
+	spin_lock(&proclist_lock);
 	/* Need to make sure they aren't dying.  if so, we already dealt with their
 	 * list membership, etc (or soon will).  taking advantage of the 'immutable
 	 * state' of dying (so long as refs are held). */
 	if (p->state == PROC_DYING) {
-		spin_unlock(&sched_lock);
+		spin_unlock(&proclist_lock);
 		return;
 	}
 	/* Catch user bugs */
@@ -242,7 +359,7 @@ void __sched_proc_change_to_m(struct proc *p)
 	remove_from_list(p, &unrunnable_scps);
 	//remove_from_any_list(p); 	/* ^^ instead of this */
 	add_to_list(p, primary_mcps);
-	spin_unlock(&sched_lock);
+	spin_unlock(&proclist_lock);
 	//poke_ksched(p, RES_CORES);
 }
 
@@ -267,20 +384,22 @@ static void unprov_pcore_list(struct sched_pcore_tailq *list_head)
  * __proc_free will be called (when the last one is done). */
 void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 {
-	spin_lock(&sched_lock);
+	/* Remove from whatever list we are on (if any - might not be on one if it
+	 * was in the middle of __run_mcp_sched) */
+	spin_lock(&proclist_lock);
+	remove_from_any_list(p);
+	spin_unlock(&proclist_lock);
+	spin_lock(&prov_lock);
 	/* Unprovision any cores.  Note this is different than track_dealloc.
 	 * The latter does bookkeeping when an allocation changes.  This is a
 	 * bulk *provisioning* change. */
 	unprov_pcore_list(&p->ksched_data.prov_alloc_me);
 	unprov_pcore_list(&p->ksched_data.prov_not_alloc_me);
-	/* Remove from whatever list we are on (if any - might not be on one if it
-	 * was in the middle of __run_mcp_sched) */
-	remove_from_any_list(p);
-	if (nr_cores) {
-		__put_idle_cores(p, pc_arr, nr_cores);
+	if (nr_cores)
 		__prov_track_dealloc_bulk(p, pc_arr, nr_cores);
-	}
-	spin_unlock(&sched_lock);
+	spin_unlock(&prov_lock);
+	if (nr_cores)
+		__put_idle_cores(p, pc_arr, nr_cores);
 	/* Drop the cradle-to-the-grave reference, jet-li */
 	proc_decref(p);
 }
@@ -288,13 +407,8 @@ void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_mcp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
-	if (p->state == PROC_DYING) {
-		spin_unlock(&sched_lock);
-		return;
-	}
 	/* could try and prioritize p somehow (move it to the front of the list). */
-	spin_unlock(&sched_lock);
+	mark_hungry(p);
 	/* note they could be dying at this point too. */
 	poke(&ksched_poker, p);
 }
@@ -302,15 +416,15 @@ void __sched_mcp_wakeup(struct proc *p)
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_scp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
+	spin_lock(&proclist_lock);
 	if (p->state == PROC_DYING) {
-		spin_unlock(&sched_lock);
+		spin_unlock(&proclist_lock);
 		return;
 	}
 	/* might not be on a list if it is new.  o/w, it should be unrunnable */
 	remove_from_any_list(p);
 	add_to_list(p, &runnable_scps);
-	spin_unlock(&sched_lock);
+	spin_unlock(&proclist_lock);
 }
 
 /* Callback to return a core to the ksched, which tracks it as idle and
@@ -320,40 +434,37 @@ void __sched_scp_wakeup(struct proc *p)
  * a scheduling decision (or at least plan to). */
 void __sched_put_idle_core(struct proc *p, uint32_t coreid)
 {
-	struct sched_pcore *spc = pcoreid2spc(coreid);
-	spin_lock(&sched_lock);
-	TAILQ_INSERT_TAIL(&idlecores, spc, alloc_next);
+	spin_lock(&prov_lock);
 	__prov_track_dealloc(p, coreid);
-	spin_unlock(&sched_lock);
+	spin_unlock(&prov_lock);
+	put_idle_spc(pcoreid2spc(coreid));
 }
 
-/* Helper for put_idle and core_req.  Note this does not track_dealloc.  When we
- * get rid of / revise proc_preempt_all and put_idle_cores, we can get rid of
- * this.  (the ksched will never need it - only external callers). */
+/* Helper for put_idle and core_req.  Note this does not track_dealloc, which
+ * callers must do first.  When we get rid of / revise proc_preempt_all and
+ * put_idle_cores, we can get rid of this.  (the ksched will never need it -
+ * only external callers). */
 static void __put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 {
-	struct sched_pcore *spc_i;
-	for (int i = 0; i < num; i++) {
-		spc_i = pcoreid2spc(pc_arr[i]);
-		TAILQ_INSERT_TAIL(&idlecores, spc_i, alloc_next);
-	}
+	for (int i = 0; i < num; i++)
+		put_idle_spc(pcoreid2spc(pc_arr[i]));
 }
 
 /* Callback, bulk interface for put_idle.  Note this one also calls track_dealloc,
  * which the internal version does not.  The proclock is held for this. */
 void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 {
-	spin_lock(&sched_lock);
+	spin_lock(&prov_lock);
+	__prov_track_dealloc_bulk(p, pc_arr, num);
+	spin_unlock(&prov_lock);
 	/* TODO: when we revise this func, look at __put_idle */
 	__put_idle_cores(p, pc_arr, num);
-	__prov_track_dealloc_bulk(p, pc_arr, num);
-	spin_unlock(&sched_lock);
 	/* could trigger a sched decision here */
 }
 
 /* mgmt/LL cores should call this to schedule the calling core and give it to an
- * SCP.  will also prune the dead SCPs from the list.  hold the lock before
- * calling.  returns TRUE if it scheduled a proc. */
+ * SCP.  will also prune the dead SCPs from the list.  hold the proclist_lock
+ * before calling.  returns TRUE if it scheduled a proc. */
 static bool __schedule_scp(void)
 {
 	// TODO: sort out lock ordering (proc_run_s also locks)
@@ -449,62 +560,61 @@ static uint32_t get_cores_needed(struct proc *p)
  * such that it's an optimization. */
 static void __run_mcp_ksched(void *arg)
 {
-	struct proc *p, *temp;
+	struct proc *p;
 	uint32_t amt_needed;
 	struct proc_list *temp_mcp_list;
 	/* locking to protect the MCP lists' integrity and membership */
-	spin_lock(&sched_lock);
-	/* 2-pass scheme: check each proc on the primary list (FCFS).  if they need
-	 * nothing, put them on the secondary list.  if they need something, rip
-	 * them off the list, service them, and if they are still not dying, put
-	 * them on the secondary list.  We cull the entire primary list, so that
-	 * when we start from the beginning each time, we aren't repeatedly checking
-	 * procs we looked at on previous waves.
+	spin_lock(&proclist_lock);
+	if (ksched_rescan) {
+		ksched_rescan = FALSE;
+		while ((p = TAILQ_FIRST(&sated_mcps)))
+			switch_lists(p, &sated_mcps, primary_mcps);
+	}
+	/* Check each hungry proc on the primary list (FCFS).  if they need nothing
+	 * (or are WAITING), they are sated.  if they need something, rip them off
+	 * the list, service them, and if they are still not dying, put them on the
+	 * secondary list if they still want more, or the sated list if not.  We
+	 * cull the entire primary list, so that when we start from the beginning
+	 * each time, we aren't repeatedly checking procs we looked at on previous
+	 * waves.  Procs that get poked while we run go on the primary list, and
+	 * we'll get to them on this pass.
 	 *
 	 * TODO: we could modify this such that procs that we failed to service move
-	 * to yet another list or something.  We can also move the WAITINGs to
-	 * another list and have wakeup move them back, etc. */
-	while (!TAILQ_EMPTY(primary_mcps)) {
-		TAILQ_FOREACH_SAFE(p, primary_mcps, ksched_data.proc_link, temp) {
-			if (p->state == PROC_WAITING) {	/* unlocked peek at the state */
-				switch_lists(p, primary_mcps, secondary_mcps);
-				continue;
-			}
-			amt_needed = get_cores_needed(p);
-			if (!amt_needed) {
-				switch_lists(p, primary_mcps, secondary_mcps);
-				continue;
-			}
-			/* o/w, we want to give cores to this proc */
-			remove_from_list(p, primary_mcps);
-			/* now it won't die, but it could get removed from lists and have
-			 * its stuff unprov'd when we unlock */
-			proc_incref(p, 1);
-			/* GIANT WARNING: __core_req will unlock the sched lock for a bit.
-			 * It will return with it locked still.  We could unlock before we
-			 * pass in, but they will relock right away. */
-			// notionally_unlock(&ksched_lock);	/* for mouse-eyed viewers */
-			__core_request(p, amt_needed);
-			// notionally_lock(&ksched_lock);
-			/* Peeking at the state is okay, since we hold a ref.  Once it is
-			 * DYING, it'll remain DYING until we decref.  And if there is a
-			 * concurrent death, that will spin on the ksched lock (which we
-			 * hold, and which protects the proc lists). */
-			if (p->state != PROC_DYING)
-				add_to_list(p, secondary_mcps);
-			proc_decref(p);			/* fyi, this may trigger __proc_free */
-			/* need to break: the proc lists may have changed when we unlocked
-			 * in core_req in ways that the FOREACH_SAFE can't handle. */
-			break;
+	 * to yet another list or something. */
+	while ((p = TAILQ_FIRST(primary_mcps))) {
+		if (p->state == PROC_WAITING) {	/* unlocked peek at the state */
+			switch_lists(p, primary_mcps, &sated_mcps);
+			continue;
+		}
+		amt_needed = get_cores_needed(p);
+		if (!amt_needed) {
+			switch_lists(p, primary_mcps, &sated_mcps);
+			continue;
 		}
+		/* o/w, we want to give cores to this proc */
+		remove_from_list(p, primary_mcps);
+		/* now it won't die, but it could get removed from lists and have
+		 * its stuff unprov'd when we unlock */
+		proc_incref(p, 1);
+		spin_unlock(&proclist_lock);
+		__core_request(p, amt_needed);
+		spin_lock(&proclist_lock);
+		/* Peeking at the state is okay, since we hold a ref.  Once it is
+		 * DYING, it'll remain DYING until we decref.  And if there is a
+		 * concurrent death, that will spin on the proclist lock (which we
+		 * hold, and which protects the proc lists).  We check what they need
+		 * again, since they may have changed it while we were unlocked. */
+		if (p->state != PROC_DYING)
+			add_to_list(p, get_cores_needed(p) ? secondary_mcps : &sated_mcps);
+		proc_decref(p);			/* fyi, this may trigger __proc_free */
 	}
-	/* at this point, we moved all the procs over to the secondary list, and
-	 * attempted to service the ones that wanted something.  now just swap the
-	 * lists for the next invocation of the ksched. */
+	/* at this point, the procs we looked at that still want something are on
+	 * the secondary list.  swap the lists for the next invocation of the
+	 * ksched. */
 	temp_mcp_list = primary_mcps;
 	primary_mcps = secondary_mcps;
 	secondary_mcps = temp_mcp_list;
-	spin_unlock(&sched_lock);
+	spin_unlock(&proclist_lock);
 }
 
 /* Something has changed, and for whatever reason the scheduler should
@@ -517,9 +627,9 @@ void schedule(void)
 	 * run again, so merely a poke is sufficient. */
 	poke(&ksched_poker, 0);
 	if (management_core()) {
-		spin_lock(&sched_lock);
+		spin_lock(&proclist_lock);
 		__schedule_scp();
-		spin_unlock(&sched_lock);
+		spin_unlock(&proclist_lock);
 	}
 }
 
@@ -532,6 +642,8 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 	 * other structs/flags) */
 	if (!__proc_is_mcp(p))
 		return;
+	/* their demand may have changed, so the ksched needs to look at them */
+	mark_hungry(p);
 	poke(&ksched_poker, p);
 }
 
@@ -544,9 +656,9 @@ void cpu_bored(void)
 	bool new_proc = FALSE;
 	if (!management_core())
 		return;
-	spin_lock(&sched_lock);
+	spin_lock(&proclist_lock);
 	new_proc = __schedule_scp();
-	spin_unlock(&sched_lock);
+	spin_unlock(&proclist_lock);
 	/* if we just scheduled a proc, we need to manually restart it, instead of
 	 * returning.  if we return, the core will halt. */
 	if (new_proc) {
@@ -578,8 +690,8 @@ uint32_t max_vcores(struct proc *p)
 }
 
 /* This deals with a request for more cores.  The amt of new cores needed is
- * passed in.  The ksched lock is held, but we are free to unlock if we want
- * (and we must, if calling out of the ksched to anything high-level).
+ * passed in.  No ksched locks are held.  Only the MCP ksched calls this (we
+ * hold the poke), so we are the only allocator and the only preemptor.
  *
  * Side note: if we want to warn, then we can't deal with this proc's prov'd
  * cores until we wait til the alarm goes off.  would need to put all
@@ -590,11 +702,11 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 {
 	uint32_t nr_to_grant = 0;
 	uint32_t corelist[num_cpus];
-	struct sched_pcore *spc_i, *temp;
+	struct sched_pcore *spc_i;
 	struct proc *proc_to_preempt;
 	bool success;
-	/* we come in holding the ksched lock, and we hold it here to protect
-	 * allocations and provisioning. */
+	/* the prov lock protects allocations and provisioning. */
+	spin_lock(&prov_lock);
 	/* get all available cores from their prov_not_alloc list.  the list might
 	 * change when we unlock (new cores added to it, or the entire list emptied,
 	 * but no core allocations will happen (we hold the poke)). */
@@ -612,11 +724,14 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			assert(proc_to_preempt != p);
 			/* need to keep a valid, external ref when we unlock */
 			proc_incref(proc_to_preempt, 1);
-			spin_unlock(&sched_lock);
+			spin_unlock(&prov_lock);
 			/* sending no warning time for now - just an immediate preempt. */
 			success = proc_preempt_core(proc_to_preempt, spc2pcoreid(spc_i), 0);
-			/* reaquire locks to protect provisioning and idle lists */
-			spin_lock(&sched_lock);
+			/* it lost a core, so it probably wants one again */
+			if (success)
+				mark_hungry(proc_to_preempt);
+			/* reaquire locks to protect provisioning */
+			spin_lock(&prov_lock);
 			if (success) {
 				/* we preempted it before the proc could yield or die.
 				 * alloc_proc should not have changed (it'll change in death and
@@ -630,16 +745,12 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 				__prov_track_dealloc(proc_to_preempt, spc2pcoreid(spc_i));
 				/* here, we rely on the fact that we are the only preemptor.  we
 				 * assume no one else preempted it, so we know it is available*/
-				TAILQ_INSERT_TAIL(&idlecores, spc_i, alloc_next);
+				put_idle_spc(spc_i);
 			} else {
 				/* the preempt failed, which should only happen if the pcore was
 				 * unmapped (could be dying, could be yielding, but NOT
 				 * preempted).  whoever unmapped it also triggered (or will soon
-				 * trigger) a track_dealloc and put it on the idle list.  our
-				 * signal for this is spc_i->alloc_proc being 0.  We need to
-				 * spin and let whoever is trying to free the core grab the
-				 * ksched lock.  We could use an 'ignore_next_idle' flag per
-				 * sched_pcore, but it's not critical anymore.
+				 * trigger) a track_dealloc and put it in an idle pool.
 				 *
 				 * Note, we're relying on us being the only preemptor - if the
 				 * core was unmapped by *another* preemptor, there would be no
@@ -647,27 +758,37 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 				 * branch in another thread).  likewise, if there were another
 				 * allocator, the pcore could have been put on the idle list and
 				 * then quickly removed/allocated. */
-				cmb();
-				while (spc_i->alloc_proc) {
-					/* this loop should be very rare */
-					spin_unlock(&sched_lock);
-					udelay(1);
-					spin_lock(&sched_lock);
-				}
 			}
 			/* no longer need to keep p_to_pre alive */
 			proc_decref(proc_to_preempt);
+			/* whoever deallocated the core puts it in an idle pool after
+			 * tracking the dealloc, and might not have gotten to it yet.  our
+			 * signal for this is spc_i->idle.  We need to spin and let them
+			 * grab the prov lock.  We could use an 'ignore_next_idle' flag per
+			 * sched_pcore, but it's not critical anymore. */
+			cmb();
+			while (!spc_i->idle) {
+				/* this loop should be very rare */
+				spin_unlock(&prov_lock);
+				udelay(1);
+				spin_lock(&prov_lock);
+			}
 			/* might not be prov to p anymore (rare race).  spc_i is idle - we
 			 * might get it later, or maybe we'll give it to its rightful proc*/
 			if (spc_i->prov_proc != p)
 				continue;
+		} else if (!spc_i->idle) {
+			/* It's being freed, but isn't in a pool yet (or it is a core the
+			 * ksched doesn't give out).  p is still hungry, so we'll try again
+			 * on a later pass. */
+			break;
 		}
 		/* at this point, the pcore is idle, regardless of how we got here
 		 * (successful preempt, failed preempt, or it was idle in the first
 		 * place.  the core is still provisioned.  lets pull from the idle list
 		 * and add it to the pc_arr for p.  here, we rely on the fact that we
 		 * are the only allocator (spc_i is still idle, despite unlocking). */
-		TAILQ_REMOVE(&idlecores, spc_i, alloc_next);
+		remove_idle_spc(spc_i);
 		/* At this point, we have the core, ready to try to give it to the proc.
 		 * It is on no alloc lists, and is track_dealloc'd() (regardless of how
 		 * we got here).
@@ -678,23 +799,25 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		nr_to_grant++;
 		__prov_track_alloc(p, spc2pcoreid(spc_i));
 	}
-	/* Try to get cores from the idle list that aren't prov to me (FCFS) */
-	TAILQ_FOREACH_SAFE(spc_i, &idlecores, alloc_next, temp) {
-		if (nr_to_grant == amt_needed)
+	/* Try to get cores from the idle pools that aren't prov to me, placed near
+	 * (or away from) the ones it has, depending on its policy. */
+	if (nr_to_grant < amt_needed)
+		placement_init(p);
+	while (nr_to_grant < amt_needed) {
+		spc_i = get_placed_idle_spc();
+		if (!spc_i)
 			break;
-		TAILQ_REMOVE(&idlecores, spc_i, alloc_next);
 		corelist[nr_to_grant] = spc2pcoreid(spc_i);
 		nr_to_grant++;
 		__prov_track_alloc(p, spc2pcoreid(spc_i));
 	}
+	/* Need to unlock before calling out to proc code.  We are somewhat relying
+	 * on being the only one allocating 'thread' here, since another allocator
+	 * could have seen these cores (if they are prov to some proc) and could be
+	 * trying to give them out (and assuming they are already idle). */
+	spin_unlock(&prov_lock);
 	/* Now, actually give them out */
 	if (nr_to_grant) {
-		/* Need to unlock before calling out to proc code.  We are somewhat
-		 * relying on being the only one allocating 'thread' here, since another
-		 * allocator could have seen these cores (if they are prov to some proc)
-		 * and could be trying to give them out (and assuming they are already
-		 * on the idle list). */
-		spin_unlock(&sched_lock);
 		/* give them the cores.  this will start up the extras if RUNNING_M. */
 		spin_lock(&p->proc_lock);
 		/* if they fail, it is because they are WAITING or DYING.  we could give
@@ -704,11 +827,12 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		 * just need to check at some point in the ksched loop. */
 		if (__proc_give_cores(p, corelist, nr_to_grant)) {
 			spin_unlock(&p->proc_lock);
-			/* we failed, put the cores and track their dealloc.  lock is
-			 * protecting those structures. */
-			spin_lock(&sched_lock);
-			__put_idle_cores(p, corelist, nr_to_grant);
+			/* we failed, track their dealloc and put the cores back.  the prov
+			 * lock is protecting the prov structures. */
+			spin_lock(&prov_lock);
 			__prov_track_dealloc_bulk(p, corelist, nr_to_grant);
+			spin_unlock(&prov_lock);
+			__put_idle_cores(p, corelist, nr_to_grant);
 		} else {
 			/* at some point after giving cores, call proc_run_m() (harmless on
 			 * RUNNING_Ms).  You can give small groups of cores, then run them
@@ -716,11 +840,116 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			 * for bulk preempted processes). */
 			__proc_run_m(p);
 			spin_unlock(&p->proc_lock);
-			/* main mcp_ksched wants this held (it came to __core_req held) */
-			spin_lock(&sched_lock);
 		}
 	}
-	/* note the ksched lock is still held */
+}
+
+/* Helper: counts where p's cores, the idle cores, and everyone else's cores
+ * are.  Call with the prov lock held, after p got any of its provisioned cores,
+ * so alloc_proc is stable. */
+static void placement_init(struct proc *p)
+{
+	struct sched_pcore *spc;
+	struct core_topology *topo;
+
+	memset(&placement, 0, sizeof(placement));
+	placement.policy = p->ksched_data.core_placement;
+	for (int i = 0; i < num_cpus; i++) {
+		spc = pcoreid2spc(i);
+		topo = &cpu_topology[i];
+		if (spc->alloc_proc == p) {
+			placement.llc_mine[topo->llc]++;
+			placement.socket_mine[topo->socket]++;
+			placement.phys_mine[topo->phys_core]++;
+		} else if (spc->idle) {
+			placement.llc_idle[topo->llc]++;
+		} else {
+			/* allocated to someone else, or not one of ours to give out */
+			placement.phys_busy[topo->phys_core]++;
+		}
+	}
+}
+
+/* Helper: how good of a fit pcoreid is for the proc we're placing.  Higher is
+ * better.  The terms are shifted so that they are compared in order: SMT
+ * siblings first, then sharing (or not) an LLC, then a socket.  Ties go to the
+ * LLC with more idle cores, so the proc has room to grow. */
+static int64_t placement_score(uint32_t pcoreid)
+{
+	struct core_topology *topo = &cpu_topology[pcoreid];
+	int64_t shared, score;
+
+	shared = ((int64_t)placement.llc_mine[topo->llc] << 20) |
+	         ((int64_t)placement.socket_mine[topo->socket] << 10);
+	score = placement.llc_idle[topo->llc];
+	switch (placement.policy) {
+		case CORE_PLACE_PACK_SMT:
+			score += (int64_t)placement.phys_mine[topo->phys_core] << 40;
+			score -= (int64_t)placement.phys_busy[topo->phys_core] << 30;
+			score += shared;
+			break;
+		case CORE_PLACE_SPREAD:
+			score -= (int64_t)(placement.phys_mine[topo->phys_core] +
+			                   placement.phys_busy[topo->phys_core]) << 30;
+			score -= shared;
+			break;
+		case CORE_PLACE_PACK:
+		default:
+			score -= (int64_t)(placement.phys_mine[topo->phys_core] +
+			                   placement.phys_busy[topo->phys_core]) << 30;
+			score += shared;
+			break;
+	}
+	return score;
+}
+
+/* Pulls the idle pcore that best fits the proc placement_init() was called for
+ * out of its pool, and counts it as the proc's.  Returns 0 if there are no idle
+ * cores.  Call with the prov lock held. */
+static struct sched_pcore *get_placed_idle_spc(void)
+{
+	struct sched_pcore *spc, *best = 0;
+	struct core_topology *topo;
+	int64_t score, best_score = 0;
+
+	for (int i = 0; i < num_cpus; i++) {
+		spc = pcoreid2spc(i);
+		/* lockless peek.  cores only leave the pools when the ksched (us)
+		 * takes them, so if it is idle now, it will be when we remove it. */
+		if (!spc->idle)
+			continue;
+		score = placement_score(i);
+		if (!best || (score > best_score)) {
+			best = spc;
+			best_score = score;
+		}
+	}
+	if (!best)
+		return 0;
+	remove_idle_spc(best);
+	topo = &cpu_topology[spc2pcoreid(best)];
+	placement.llc_mine[topo->llc]++;
+	placement.socket_mine[topo->socket]++;
+	placement.phys_mine[topo->phys_core]++;
+	placement.llc_idle[topo->llc]--;
+	return best;
+}
+
+/* Sets how the ksched places p's cores.  Only affects cores that aren't
+ * provisioned to p. */
+int sched_set_core_placement(struct proc *p, int policy)
+{
+	switch (policy) {
+		case CORE_PLACE_PACK:
+		case CORE_PLACE_PACK_SMT:
+		case CORE_PLACE_SPREAD:
+			break;
+		default:
+			set_errno(EINVAL);
+			return -1;
+	}
+	p->ksched_data.core_placement = policy;
+	return 0;
 }
 
 /* TODO: need more thorough CG/LL management.  For now, core0 is the only LL
@@ -794,10 +1023,8 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 		return -1;
 	}
 	spc = pcoreid2spc(pcoreid);
-	/* Note the sched lock protects the spc tailqs for all procs in this code.
-	 * If we need a finer grained sched lock, this is one place where we could
-	 * have a different lock */
-	spin_lock(&sched_lock);
+	/* Note the prov lock protects the spc tailqs for all procs in this code. */
+	spin_lock(&prov_lock);
 	/* If the core is already prov to someone else, take it away.  (last write
 	 * wins, some other layer or new func can handle permissions). */
 	if (spc->prov_proc) {
@@ -821,7 +1048,7 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 		}
 	}
 	spc->prov_proc = p;
-	spin_unlock(&sched_lock);
+	spin_unlock(&prov_lock);
 	return 0;
 }
 
@@ -829,7 +1056,7 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 void sched_diag(void)
 {
 	struct proc *p;
-	spin_lock(&sched_lock);
+	spin_lock(&proclist_lock);
 	TAILQ_FOREACH(p, &runnable_scps, ksched_data.proc_link)
 		printk("Runnable _S PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, &unrunnable_scps, ksched_data.proc_link)
@@ -838,7 +1065,9 @@ void sched_diag(void)
 		printk("Primary MCP PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link)
 		printk("Secondary MCP PID: %d\n", p->pid);
-	spin_unlock(&sched_lock);
+	TAILQ_FOREACH(p, &sated_mcps, ksched_data.proc_link)
+		printk("Sated MCP PID: %d\n", p->pid);
+	spin_unlock(&proclist_lock);
 	return;
 }
 
@@ -847,9 +1076,12 @@ void print_idlecoremap(void)
 	struct sched_pcore *spc_i;
 	/* not locking, so we can look at this without deadlocking. */
 	printk("Idle cores (unlocked!):\n");
-	TAILQ_FOREACH(spc_i, &idlecores, alloc_next)
-		printk("Core %d, prov to %d (%p)\n", spc2pcoreid(spc_i),
-		       spc_i->prov_proc ? spc_i->prov_proc->pid : 0, spc_i->prov_proc);
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		TAILQ_FOREACH(spc_i, &idle_pools[i].cores, alloc_next)
+			printk("Core %d (node %d), prov to %d (%p)\n", spc2pcoreid(spc_i),
+			       i, spc_i->prov_proc ? spc_i->prov_proc->pid : 0,
+			       spc_i->prov_proc);
+	}
 }
 
 void print_resources(struct proc *p)
@@ -864,14 +1096,7 @@ void print_resources(struct proc *p)
 
 void print_all_resources(void)
 {
-	/* Hash helper */
-	void __print_resources(void *item)
-	{
-		print_resources((struct proc*)item);
-	}
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, __print_resources);
-	spin_unlock(&pid_hash_lock);
+	pid_for_each(print_resources);
 }
 
 void print_prov_map(void)
@@ -905,19 +1130,18 @@ void print_proc_prov(struct proc *p)
 
 void next_core(uint32_t pcoreid)
 {
-	struct sched_pcore *spc_i;
-	bool match = FALSE;
-	spin_lock(&sched_lock);
-	TAILQ_FOREACH(spc_i, &idlecores, alloc_next) {
-		if (spc2pcoreid(spc_i) == pcoreid) {
-			match = TRUE;
-			break;
-		}
-	}
-	if (match) {
-		TAILQ_REMOVE(&idlecores, spc_i, alloc_next);
-		TAILQ_INSERT_HEAD(&idlecores, spc_i, alloc_next);
-		printk("Pcore %d will be given out next (from the idles)\n", pcoreid);
+	struct sched_pcore *spc;
+	struct sched_idle_pool *pool;
+	if (pcoreid >= num_cpus)
+		return;
+	spc = pcoreid2spc(pcoreid);
+	pool = spc2pool(spc);
+	spin_lock(&pool->lock);
+	if (spc->idle) {
+		TAILQ_REMOVE(&pool->cores, spc, alloc_next);
+		TAILQ_INSERT_HEAD(&pool->cores, spc, alloc_next);
+		printk("Pcore %d will be given out next from node %d's idles\n",
+		       pcoreid, core2node(pcoreid));
 	}
-	spin_unlock(&sched_lock);
+	spin_unlock(&pool->lock);
 }
@@ -6,9 +6,13 @@
  *
  * Slab allocator, based on the SunOS 5.4 allocator paper.
  *
- * Note that we don't have a hash table for buf to bufctl for the large buffer
- * objects, so we use the same style for small objects: store the pointer to the
- * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
+ * Small objects store the pointer to the next free object at the end of the
+ * object.  Large objects keep nothing in the buffer: we find the bufctl of an
+ * allocated buffer with the cache's hash table (section 3.6 of the paper).
+ *
+ * The magazine layer sits in front of all of this.  kmem_cache_alloc() and
+ * kmem_cache_free() go through the magazines, and the __kmem_*_slab()
+ * functions are the slab layer underneath.
  */
 
 #ifdef __IVY__
@@ -20,6 +24,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <pmap.h>
+#include <smp.h>
 
 struct kmem_cache_list kmem_caches;
 spinlock_t kmem_caches_lock;
@@ -27,10 +32,18 @@ spinlock_t kmem_caches_lock;
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
 static void kmem_cache_grow(struct kmem_cache *cp);
+static struct kmem_pcpu_cache *build_pcpu_caches(void);
+static void drain_pcpu_cache(struct kmem_cache *cp,
+                             struct kmem_pcpu_cache *pcc);
+static void drain_depot(struct kmem_cache *cp);
+static size_t hash_order(size_t nr_buckets);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
 struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+/* Magazines and the per-core arrays of kmem_pcpu_caches.  The latter is only
+ * set once we know how many cores there are. */
+struct kmem_cache *kmem_magazine_cache, *kmem_pcpu_cache_cache;
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -50,7 +63,24 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
-	
+	kc->nr_slab_grows = 0;
+	kc->alloc_hash = 0;
+	kc->nr_hash_buckets = 0;
+	kc->nr_hash_items = 0;
+	/* Large objects are packed at their aligned size, so the low bits of the
+	 * address are (mostly) the same for all of them. */
+	kc->hash_shift = LOG2_DOWN(ROUNDUP(obj_size, align));
+	spinlock_init_irqsave(&kc->depot.lock);
+	SLIST_INIT(&kc->depot.full_mags);
+	SLIST_INIT(&kc->depot.empty_mags);
+	kc->depot.nr_full = 0;
+	kc->depot.nr_empty = 0;
+	kc->depot.nr_refills = 0;
+	kc->pcpu_caches = 0;
+	/* Caches made after kmem_cache_init_pcpu() get their magazines now */
+	if (!(flags & KMC_NOMAG) && kmem_pcpu_cache_cache)
+		kc->pcpu_caches = build_pcpu_caches();
+
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
 	spin_lock_irqsave(&kmem_caches_lock);
@@ -76,13 +106,47 @@ void kmem_cache_init(void)
 	 * kmem_cache_cache. */
 	__kmem_cache_create(&kmem_cache_cache, "kmem_cache",
 	                    sizeof(struct kmem_cache),
-	                    __alignof__(struct kmem_cache), 0, NULL, NULL);
-	/* Build the slab and bufctl caches */
+	                    __alignof__(struct kmem_cache), KMC_NOMAG, NULL, NULL);
+	/* Build the slab and bufctl caches.  These are used by the slab layer
+	 * itself, so they don't get magazines. */
 	kmem_slab_cache = kmem_cache_create("kmem_slab", sizeof(struct kmem_slab),
-	                       __alignof__(struct kmem_slab), 0, NULL, NULL); 
+	                       __alignof__(struct kmem_slab), KMC_NOMAG, NULL, NULL);
 	kmem_bufctl_cache = kmem_cache_create("kmem_bufctl",
 	                         sizeof(struct kmem_bufctl),
-	                         __alignof__(struct kmem_bufctl), 0, NULL, NULL); 
+	                         __alignof__(struct kmem_bufctl), KMC_NOMAG, NULL,
+	                         NULL);
+	kmem_magazine_cache = kmem_cache_create("kmem_magazine",
+	                           sizeof(struct kmem_magazine),
+	                           __alignof__(struct kmem_magazine), KMC_NOMAG,
+	                           NULL, NULL);
+}
+
+/* Builds the per-core front ends for a cache.  Magazines are loaded lazily, the
+ * first time a core frees an object. */
+static struct kmem_pcpu_cache *build_pcpu_caches(void)
+{
+	struct kmem_pcpu_cache *pcc = kmem_cache_alloc(kmem_pcpu_cache_cache, 0);
+	memset(pcc, 0, sizeof(struct kmem_pcpu_cache) * num_cpus);
+	/* make sure the zeros are visible before the caller publishes pcc */
+	wmb();
+	return pcc;
+}
+
+/* Turns on the magazine layer, once we know how many cores there are.  Until
+ * then, everyone goes straight to the slabs.  Cores that see pcpu_caches == 0
+ * just use the slab layer, so this is safe to do while the caches are in use. */
+void kmem_cache_init_pcpu(void)
+{
+	struct kmem_cache *i;
+	kmem_pcpu_cache_cache = kmem_cache_create("kmem_pcpu_caches",
+	                             sizeof(struct kmem_pcpu_cache) * num_cpus,
+	                             ARCH_CL_SIZE, KMC_NOMAG, NULL, NULL);
+	spin_lock_irqsave(&kmem_caches_lock);
+	SLIST_FOREACH(i, &kmem_caches, link) {
+		if (!(i->flags & KMC_NOMAG) && !i->pcpu_caches)
+			i->pcpu_caches = build_pcpu_caches();
+	}
+	spin_unlock_irqsave(&kmem_caches_lock);
 }
 
 /* Cache management */
@@ -96,6 +160,25 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
 	return kc;
 }
 
+/* Marks the nr_pgs pages starting at page as backing one of cp's slabs, so
+ * that kfree() can find cp from any buffer in them. */
+static void kmem_slab_tag(struct kmem_cache *cp, struct page *page,
+                          size_t nr_pgs)
+{
+	for (int i = 0; i < nr_pgs; i++) {
+		page[i].pg_flags |= PG_SLAB;
+		page[i].pg_private = cp;
+	}
+}
+
+static void kmem_slab_untag(struct page *page, size_t nr_pgs)
+{
+	for (int i = 0; i < nr_pgs; i++) {
+		page[i].pg_flags &= ~PG_SLAB;
+		page[i].pg_private = 0;
+	}
+}
+
 static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 {
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
@@ -107,6 +190,8 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 				buf += a_slab->obj_size;
 			}
 		}
+		kmem_slab_untag(kva2page((void*)ROUNDDOWN((uintptr_t)a_slab, PGSIZE)),
+		                1);
 		page_decref(kva2page((void*)ROUNDDOWN((uintptr_t)a_slab, PGSIZE)));
 	} else {
 		struct kmem_bufctl *i;
@@ -121,11 +206,12 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			// Track the lowest buffer address, which is the start of the buffer
 			page_start = MIN(page_start, i->buf_addr);
 			/* Deconstruct all the objects, if necessary */
-			if (cp->dtor) // TODO: (BUF)
+			if (cp->dtor)
 				cp->dtor(i->buf_addr, cp->obj_size);
 			kmem_cache_free(kmem_bufctl_cache, i);
 		}
 		// free the pages for the slab's buffer
+		kmem_slab_untag(kva2page(page_start), 1 << order_pg_alloc);
 		free_cont_pages(page_start, order_pg_alloc);
 		// free the slab object
 		kmem_cache_free(kmem_slab_cache, a_slab);
@@ -138,6 +224,15 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
+	/* Give back every object the magazines are holding onto, from all cores.
+	 * We're the only user of cp, so this is safe. */
+	if (cp->pcpu_caches) {
+		for (int i = 0; i < num_cpus; i++)
+			drain_pcpu_cache(cp, &cp->pcpu_caches[i]);
+		drain_depot(cp);
+		kmem_cache_free(kmem_pcpu_cache_cache, cp->pcpu_caches);
+		cp->pcpu_caches = 0;
+	}
 	spin_lock_irqsave(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -150,6 +245,10 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 		kmem_slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
+	if (cp->alloc_hash) {
+		assert(!cp->nr_hash_items);
+		free_cont_pages(cp->alloc_hash, hash_order(cp->nr_hash_buckets));
+	}
 	spin_lock_irqsave(&kmem_caches_lock);
 	SLIST_REMOVE(&kmem_caches, cp, kmem_cache, link);
 	spin_unlock_irqsave(&kmem_caches_lock);
@@ -157,8 +256,81 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+/* Page order of a hash table with nr_buckets */
+static size_t hash_order(size_t nr_buckets)
+{
+	return LOG2_UP(ROUNDUP(nr_buckets * sizeof(struct kmem_bufctl_list),
+	                       PGSIZE) / PGSIZE);
+}
+
+static struct kmem_bufctl_list *buf_hash_bucket(struct kmem_cache *cp,
+                                                void *buf)
+{
+	size_t idx = ((uintptr_t)buf >> cp->hash_shift) &
+	             (cp->nr_hash_buckets - 1);
+	return &cp->alloc_hash[idx];
+}
+
+/* Allocates a hash table of nr_buckets (a power of two), or 0 on failure. */
+static struct kmem_bufctl_list *alloc_hash_table(size_t nr_buckets)
+{
+	struct kmem_bufctl_list *table = get_cont_pages(hash_order(nr_buckets), 0);
+	if (!table)
+		return 0;
+	for (int i = 0; i < nr_buckets; i++)
+		TAILQ_INIT(&table[i]);
+	return table;
+}
+
+/* Doubles the hash table, rehashing everything.  If we can't get the memory,
+ * we just keep using the old one; the chains are longer, but still correct.
+ * Hold the cache_lock. */
+static void grow_hash_table(struct kmem_cache *cp)
+{
+	struct kmem_bufctl_list *old_table = cp->alloc_hash;
+	size_t old_nr_buckets = cp->nr_hash_buckets;
+	struct kmem_bufctl *i;
+
+	cp->alloc_hash = alloc_hash_table(old_nr_buckets * 2);
+	if (!cp->alloc_hash) {
+		cp->alloc_hash = old_table;
+		return;
+	}
+	cp->nr_hash_buckets = old_nr_buckets * 2;
+	for (int j = 0; j < old_nr_buckets; j++) {
+		while ((i = TAILQ_FIRST(&old_table[j]))) {
+			TAILQ_REMOVE(&old_table[j], i, link);
+			TAILQ_INSERT_HEAD(buf_hash_bucket(cp, i->buf_addr), i, link);
+		}
+	}
+	free_cont_pages(old_table, hash_order(old_nr_buckets));
+}
+
+static void buf_hash_insert(struct kmem_cache *cp, struct kmem_bufctl *bufctl)
+{
+	TAILQ_INSERT_HEAD(buf_hash_bucket(cp, bufctl->buf_addr), bufctl, link);
+	if (++cp->nr_hash_items > cp->nr_hash_buckets * KMC_HASH_MAX_LOAD)
+		grow_hash_table(cp);
+}
+
+/* Finds and removes buf's bufctl from the hash. */
+static struct kmem_bufctl *buf_hash_remove(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_bufctl_list *bucket = buf_hash_bucket(cp, buf);
+	struct kmem_bufctl *i;
+
+	TAILQ_FOREACH(i, bucket, link) {
+		if (i->buf_addr == buf) {
+			TAILQ_REMOVE(bucket, i, link);
+			cp->nr_hash_items--;
+			return i;
+		}
+	}
+	panic("Freeing buf %p, not allocated from %s!", buf, cp->name);
+}
+
+/* Slab layer: gets an object from the slabs, growing if necessary. */
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 {
 	void *retval = NULL;
 	spin_lock_irqsave(&cp->cache_lock);
@@ -185,6 +357,7 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 		// rip the first bufctl out of the partial slab's buf list
 		struct kmem_bufctl *a_bufctl = TAILQ_FIRST(&a_slab->bufctl_freelist);
 		TAILQ_REMOVE(&a_slab->bufctl_freelist, a_bufctl, link);
+		buf_hash_insert(cp, a_bufctl);
 		retval = a_bufctl->buf_addr;
 	}
 	a_slab->num_busy_obj++;
@@ -198,13 +371,8 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 	return retval;
 }
 
-static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
-{
-	// TODO: hash table for back reference (BUF)
-	return *((struct kmem_bufctl**)(buf + offset));
-}
-
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+/* Slab layer: returns an object to its slab. */
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -220,8 +388,7 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 		a_slab->free_small_obj = buf;
 	} else {
 		/* Give the bufctl back to the parent slab */
-		// TODO: (BUF) change the interface to not take an offset
-		a_bufctl = buf2bufctl(buf, cp->obj_size);
+		a_bufctl = buf_hash_remove(cp, buf);
 		a_slab = a_bufctl->my_slab;
 		TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
 	}
@@ -239,6 +406,194 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
+/* Magazine layer.  The depot helpers return 0 if they have nothing to trade. */
+static struct kmem_magazine *depot_get_full(struct kmem_cache *cp)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_magazine *mag;
+
+	spin_lock_irqsave(&depot->lock);
+	mag = SLIST_FIRST(&depot->full_mags);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->full_mags, link);
+		depot->nr_full--;
+		depot->nr_refills++;
+	}
+	spin_unlock_irqsave(&depot->lock);
+	return mag;
+}
+
+static struct kmem_magazine *depot_get_empty(struct kmem_cache *cp)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_magazine *mag;
+
+	spin_lock_irqsave(&depot->lock);
+	mag = SLIST_FIRST(&depot->empty_mags);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty_mags, link);
+		depot->nr_empty--;
+	}
+	spin_unlock_irqsave(&depot->lock);
+	return mag;
+}
+
+static void depot_put_full(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	struct kmem_depot *depot = &cp->depot;
+
+	spin_lock_irqsave(&depot->lock);
+	SLIST_INSERT_HEAD(&depot->full_mags, mag, link);
+	depot->nr_full++;
+	spin_unlock_irqsave(&depot->lock);
+}
+
+static void depot_put_empty(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	struct kmem_depot *depot = &cp->depot;
+
+	spin_lock_irqsave(&depot->lock);
+	SLIST_INSERT_HEAD(&depot->empty_mags, mag, link);
+	depot->nr_empty++;
+	spin_unlock_irqsave(&depot->lock);
+}
+
+static bool mag_is_empty(struct kmem_magazine *mag)
+{
+	return !mag || !mag->nr_rounds;
+}
+
+static bool mag_is_full(struct kmem_magazine *mag)
+{
+	return mag && mag->nr_rounds == KMC_MAG_SZ;
+}
+
+/* Returns all of a magazine's rounds to the slab layer and frees it. */
+static void drain_mag(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	if (!mag)
+		return;
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(cp, mag->rounds[i]);
+	kmem_cache_free(kmem_magazine_cache, mag);
+}
+
+static void drain_pcpu_cache(struct kmem_cache *cp,
+                             struct kmem_pcpu_cache *pcc)
+{
+	drain_mag(cp, pcc->loaded);
+	drain_mag(cp, pcc->prev);
+	pcc->loaded = 0;
+	pcc->prev = 0;
+}
+
+/* Empties the depot, returning its objects to the slabs. */
+static void drain_depot(struct kmem_cache *cp)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_mag_list full, empty;
+	struct kmem_magazine *mag;
+
+	/* Pull them off the depot first, so we don't hold the depot lock while we
+	 * grab the cache_lock. */
+	spin_lock_irqsave(&depot->lock);
+	full = depot->full_mags;
+	empty = depot->empty_mags;
+	SLIST_INIT(&depot->full_mags);
+	SLIST_INIT(&depot->empty_mags);
+	depot->nr_full = 0;
+	depot->nr_empty = 0;
+	spin_unlock_irqsave(&depot->lock);
+	while ((mag = SLIST_FIRST(&full))) {
+		SLIST_REMOVE_HEAD(&full, link);
+		drain_mag(cp, mag);
+	}
+	while ((mag = SLIST_FIRST(&empty))) {
+		SLIST_REMOVE_HEAD(&empty, link);
+		drain_mag(cp, mag);
+	}
+}
+
+/* Front end: clients of caches use these.
+ *
+ * We disable irqs instead of locking the pcpu cache, since the only other
+ * thing that can touch it is an interrupt handler on this core.  Once both of
+ * our magazines are empty, we trade our prev for a full one from the depot, and
+ * if there aren't any, we go to the slab layer. */
+void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	void *retval;
+	int8_t irq_state = 0;
+
+	if (!cp->pcpu_caches)
+		return __kmem_alloc_from_slab(cp, flags);
+	disable_irqsave(&irq_state);
+	pcc = &cp->pcpu_caches[core_id()];
+	pcc->nr_allocs++;
+	if (!mag_is_empty(pcc->loaded)) {
+		pcc->nr_mag_hits++;
+	} else if (!mag_is_empty(pcc->prev)) {
+		mag = pcc->prev;
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		pcc->nr_mag_hits++;
+	} else {
+		mag = depot_get_full(cp);
+		if (!mag) {
+			enable_irqsave(&irq_state);
+			return __kmem_alloc_from_slab(cp, flags);
+		}
+		if (pcc->prev)
+			depot_put_empty(cp, pcc->prev);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+	}
+	retval = pcc->loaded->rounds[--pcc->loaded->nr_rounds];
+	enable_irqsave(&irq_state);
+	return retval;
+}
+
+/* Frees go into our loaded magazine.  When both of our magazines are full, we
+ * give prev to the depot and get an empty one, allocating a new magazine if the
+ * depot has none.  The depot grows this way, and shrinks in kmem_cache_reap. */
+void kmem_cache_free(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	int8_t irq_state = 0;
+
+	if (!cp->pcpu_caches) {
+		__kmem_free_to_slab(cp, buf);
+		return;
+	}
+	disable_irqsave(&irq_state);
+	pcc = &cp->pcpu_caches[core_id()];
+	if (!pcc->loaded || mag_is_full(pcc->loaded)) {
+		if (pcc->prev && !pcc->prev->nr_rounds) {
+			mag = pcc->prev;
+			pcc->prev = pcc->loaded;
+			pcc->loaded = mag;
+		} else {
+			mag = depot_get_empty(cp);
+			if (!mag) {
+				mag = kmem_cache_alloc(kmem_magazine_cache, 0);
+				mag->nr_rounds = 0;
+			}
+			/* loaded is either full or missing.  prev is the same. */
+			if (pcc->loaded) {
+				if (pcc->prev)
+					depot_put_full(cp, pcc->prev);
+				pcc->prev = pcc->loaded;
+			}
+			pcc->loaded = mag;
+		}
+	}
+	pcc->loaded->rounds[pcc->loaded->nr_rounds++] = buf;
+	enable_irqsave(&irq_state);
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -256,6 +611,7 @@ static void kmem_cache_grow(struct kmem_cache *cp)
 		page_t *a_page;
 		if (kpage_alloc(&a_page))
 			panic("[German Accent]: OOM for a small slab growth!!!");
+		kmem_slab_tag(cp, a_page, 1);
 		// the slab struct is stored at the end of the page
 		a_slab = (struct kmem_slab*)(page2kva(a_page) + PGSIZE -
 		                             sizeof(struct kmem_slab));
@@ -278,9 +634,15 @@ static void kmem_cache_grow(struct kmem_cache *cp)
 		}
 		*((uintptr_t**)(buf + cp->obj_size)) = NULL;
 	} else {
+		if (!cp->alloc_hash) {
+			cp->alloc_hash = alloc_hash_table(KMC_HASH_INIT_SZ);
+			if (!cp->alloc_hash)
+				panic("[German Accent]: OOM for a slab hash table!!!");
+			cp->nr_hash_buckets = KMC_HASH_INIT_SZ;
+		}
 		a_slab = kmem_cache_alloc(kmem_slab_cache, 0);
-		// TODO: hash table for back reference (BUF)
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+		/* No bookkeeping in the buffers, so they are packed back to back */
+		a_slab->obj_size = ROUNDUP(cp->obj_size, cp->align);
 		/* Figure out how much memory we want.  We need at least min_pgs.  We'll
 		 * ask for the next highest order (power of 2) number of pages */
 		size_t min_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
@@ -289,6 +651,7 @@ static void kmem_cache_grow(struct kmem_cache *cp)
 		void *buf = get_cont_pages(order_pg_alloc, 0);
 		if (!buf)
 			panic("[German Accent]: OOM for a large slab growth!!!");
+		kmem_slab_tag(cp, kva2page(buf), 1 << order_pg_alloc);
 		a_slab->num_busy_obj = 0;
 		/* The number of objects is based on the rounded up amt requested. */
 		a_slab->num_total_obj = ((1 << order_pg_alloc) * PGSIZE) /
@@ -303,22 +666,29 @@ static void kmem_cache_grow(struct kmem_cache *cp)
 			TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
 			a_bufctl->buf_addr = buf;
 			a_bufctl->my_slab = a_slab;
-			// TODO: (BUF) write the bufctl reference at the bottom of the buffer.
-			*(struct kmem_bufctl**)(buf + cp->obj_size) = a_bufctl;
 			buf += a_slab->obj_size;
 		}
 	}
 	// add a_slab to the empty_list
 	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+	cp->nr_slab_grows++;
 }
 
 /* This deallocs every slab from the empty list.  TODO: think a bit more about
  * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+ * thrashing.  See 3.4 in the paper.
+ *
+ * We also empty the depot first, so its objects can make slabs empty.  We can't
+ * touch the other cores' magazines, so those objects stay out. */
 void kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
-	
+
+	/* Lockless lookups might still be touching freed objects */
+	if (cp->flags & KMC_TYPESAFE)
+		return;
+	if (cp->pcpu_caches)
+		drain_depot(cp);
 	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_lock_irqsave(&cp->cache_lock);
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
@@ -344,7 +714,29 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printk("Slab Partial: %p\n", cp->partial_slab_list);
 	printk("Slab Empty: %p\n", cp->empty_slab_list);
 	printk("Current Allocations: %d\n", cp->nr_cur_alloc);
+	printk("Slab Grows: %d\n", cp->nr_slab_grows);
+	if (cp->alloc_hash)
+		printk("Hash: %d items, %d buckets\n", cp->nr_hash_items,
+		       cp->nr_hash_buckets);
 	spin_unlock_irqsave(&cp->cache_lock);
+	if (!cp->pcpu_caches) {
+		printk("Magazines: off\n");
+		return;
+	}
+	/* These are racy reads of the other cores' stats, which is fine */
+	unsigned long nr_allocs = 0, nr_hits = 0;
+	for (int i = 0; i < num_cpus; i++) {
+		nr_allocs += cp->pcpu_caches[i].nr_allocs;
+		nr_hits += cp->pcpu_caches[i].nr_mag_hits;
+	}
+	printk("Magazine Allocs: %d\n", nr_allocs);
+	printk("Magazine Hits: %d (%d%%)\n", nr_hits,
+	       nr_allocs ? nr_hits * 100 / nr_allocs : 0);
+	spin_lock_irqsave(&cp->depot.lock);
+	printk("Depot Refills: %d\n", cp->depot.nr_refills);
+	printk("Depot Magazines: %d full, %d empty\n", cp->depot.nr_full,
+	       cp->depot.nr_empty);
+	spin_unlock_irqsave(&cp->depot.lock);
 }
 
 void print_kmem_slab(struct kmem_slab *slab)
@@ -94,12 +94,15 @@ void smp_percpu_init(void)
 	 * x86), since this runs in irq context. */
 	/* Do this first */
 	__arch_pcpu_init(coreid);
-	per_cpu_info[coreid].spare = 0;
+	kthread_pool_init(&per_cpu_info[coreid].kthread_pool);
 	/* Init relevant lists */
 	spinlock_init_irqsave(&per_cpu_info[coreid].immed_amsg_lock);
 	STAILQ_INIT(&per_cpu_info[coreid].immed_amsgs);
 	spinlock_init_irqsave(&per_cpu_info[coreid].routine_amsg_lock);
 	STAILQ_INIT(&per_cpu_info[coreid].routine_amsgs);
+	/* Until these exist, senders will use the lists */
+	pcpui->immed_amsg_ring = kmsg_ring_alloc();
+	pcpui->routine_amsg_ring = kmsg_ring_alloc();
 	/* Initialize the per-core timer chain */
 	init_timer_chain(&per_cpu_info[coreid].tchain, set_pcpu_alarm_interrupt);
 #ifdef CONFIG_KTHREAD_POISON
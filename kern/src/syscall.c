@@ -98,8 +98,9 @@ static void finish_current_sysc(int retval)
 void set_errno(int errno)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	if (pcpui->cur_sysc)
-		pcpui->cur_sysc->err = errno;
+	if (!pcpui->cur_sysc)
+		return;
+	pcpui->cur_sysc->err = errno;
 }
 
 void set_errstr(char *errstr)
@@ -442,8 +443,9 @@ static ssize_t sys_fork(env_t* e)
 	}
 	/* Switch to the new proc's address space and finish the syscall.  We'll
 	 * never naturally finish this syscall for the new proc, since its memory
-	 * is cloned before we return for the original process.  If we ever do CoW
-	 * for forked memory, this will be the first place that gets CoW'd. */
+	 * is cloned before we return for the original process.  The memory is CoW,
+	 * so our write faults and gives the child its own copy of this page (see
+	 * kernel_cow_fault()). */
 	temp = switch_to(env);
 	finish_current_sysc(0);
 	switch_back(env, temp);
@@ -777,6 +779,12 @@ static int prov_resource(struct proc *target, unsigned int res_type,
 			/* in the off chance we have a kernel scheduler that can't
 			 * provision, we'll need to change this. */
 			return provision_core(target, res_val);
+		case (PROV_CORE_PLACEMENT):
+			if (!target) {
+				set_errno(EINVAL);
+				return -1;
+			}
+			return sched_set_core_placement(target, res_val);
 		default:
 			printk("[kernel] received provisioning for unknown resource %d\n",
 			       res_type);
@@ -1511,6 +1519,36 @@ all_out:
 	return retval;
 }
 
+/* Helper for fsync and fdatasync, which only differ in whether the FS has to
+ * write out the inode too. */
+static intreg_t __sys_fsync(struct proc *p, int fd, int datasync)
+{
+	int retval;
+	struct file *file = get_file_from_fd(&p->open_files, fd);
+	if (!file) {
+		set_errno(EBADF);
+		return -1;
+	}
+	if (!file->f_op->fsync) {
+		kref_put(&file->f_kref);
+		set_errno(EINVAL);
+		return -1;
+	}
+	retval = file->f_op->fsync(file, file->f_dentry, datasync);
+	kref_put(&file->f_kref);
+	return retval;
+}
+
+intreg_t sys_fsync(struct proc *p, int fd)
+{
+	return __sys_fsync(p, fd, FALSE);
+}
+
+intreg_t sys_fdatasync(struct proc *p, int fd)
+{
+	return __sys_fsync(p, fd, TRUE);
+}
+
 intreg_t sys_gettimeofday(struct proc *p, int *buf)
 {
 	static spinlock_t gtod_lock = SPINLOCK_INITIALIZER;
@@ -1689,6 +1727,8 @@ const static struct sys_table_entry syscall_table[] = {
 	[SYS_mkdir] = {(syscall_t)sys_mkdir, "mkdri"},
 	[SYS_rmdir] = {(syscall_t)sys_rmdir, "rmdir"},
 	[SYS_pipe] = {(syscall_t)sys_pipe, "pipe"},
+	[SYS_fsync] = {(syscall_t)sys_fsync, "fsync"},
+	[SYS_fdatasync] = {(syscall_t)sys_fdatasync, "fdatasync"},
 	[SYS_gettimeofday] = {(syscall_t)sys_gettimeofday, "gettime"},
 	[SYS_tcgetattr] = {(syscall_t)sys_tcgetattr, "tcgetattr"},
 	[SYS_tcsetattr] = {(syscall_t)sys_tcsetattr, "tcsetattr"},
@@ -1768,21 +1808,96 @@ void run_local_syscall(struct syscall *sysc)
 	pcpui->cur_sysc = 0;	/* no longer working on sysc */
 }
 
+/* Finishes sysc with err without running it.  p's address space is loaded. */
+static void fail_batched_syscall(struct proc *p, struct syscall *sysc, int err)
+{
+	/* An earlier call could have unmapped it */
+	if (!user_mem_check(p, sysc, sizeof(struct syscall), sizeof(uintptr_t),
+	                    PTE_USER_RW))
+		return;
+	sysc->retval = -1;
+	sysc->err = err;
+	finish_sysc(sysc, p);
+}
+
+/* Runs sysc, the first of the nr_syscs left in its batch.  exec can't have any
+ * left behind it, since it replaces the memory they are in. */
+static void run_batched_syscall(struct proc *p, struct syscall *sysc,
+                                unsigned int nr_syscs)
+{
+	if ((nr_syscs > 1) && (ACCESS_ONCE(sysc->num) == SYS_exec))
+		fail_batched_syscall(p, sysc, EINVAL);
+	else
+		run_local_syscall(sysc);
+}
+
+/* Routine kmsg that runs the rest of a batch of syscalls: a2 of them, starting
+ * at a1, for proc a0.  The sender gave us a ref on the proc.  We send the next
+ * one off before running ours, which can block like any other, so there's only
+ * one kmsg and one ref out for a batch at a time, no matter how big it is.
+ *
+ * Syscalls assume the core is running p and that cur_ctx is p's.  An earlier
+ * call in the batch could have changed that (yield, exit, change_to_m), in
+ * which case the rest of the batch fails with ECANCELED. */
+static void __run_batched_syscall(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+	struct syscall *sysc = (struct syscall*)a1;
+	unsigned int nr_syscs = a2;
+	struct proc *old_proc;
+	struct per_cpu_info *pcpui;
+
+	/* No point in running the rest for a process that is going away */
+	if ((nr_syscs > 1) && (p->state != PROC_DYING)) {
+		proc_incref(p, 1);
+		send_kernel_message(core_id(), __run_batched_syscall, (long)p,
+		                    (long)(sysc + 1), nr_syscs - 1, KMSG_ROUTINE);
+	}
+	/* We're usually on the core that trapped, before it returns to p, so this
+	 * is a noop.  But we could have been preempted or idled since then. */
+	old_proc = switch_to(p);
+	/* RKMs run with IRQs off, and syscalls expect them on */
+	enable_irq();
+	pcpui = &per_cpu_info[core_id()];
+	if ((pcpui->owning_proc == p) && pcpui->cur_ctx)
+		run_batched_syscall(p, sysc, nr_syscs);
+	else
+		fail_batched_syscall(p, sysc, ECANCELED);
+	/* Need to re-load, in case we blocked and were restarted elsewhere */
+	switch_back(p, old_proc);
+	proc_decref(p);
+}
+
 /* A process can trap and call this function, which will set up the core to
  * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  If there is
- * at least one, it will run it directly. */
+ * at least one, it will run it directly.
+ *
+ * The rest of the batch go out one at a time in routine kmsgs on this core,
+ * which run before we return to userspace (or when we would idle, if the first
+ * one blocks).  That way one blocking call doesn't hold up the others, and each
+ * one finishes with SC_DONE / __signal_syscall as usual. */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 {
-	int retval;
 	/* Careful with pcpui here, we could have migrated */
 	if (!nr_syscs)
 		return;
-	/* For all after the first call, send ourselves a KMSG (TODO). */
-	if (nr_syscs != 1)
-		warn("Only one supported (Debutante calls: %d)\n", nr_syscs);
+	/* Abort on mem check failure, for now (like run_local_syscall()).  We need
+	 * the whole array to be legit before we hand out pieces of it. */
+	if (nr_syscs > UMAPTOP / sizeof(struct syscall))
+		return;
+	if (!user_mem_check(p, sysc, nr_syscs * sizeof(struct syscall),
+	                    sizeof(uintptr_t), PTE_USER_RW))
+		return;
+	/* Send the rest first, since we might not return from the first call (it
+	 * could yield or exit).  The kmsg keeps a ref on p. */
+	if (nr_syscs > 1) {
+		proc_incref(p, 1);
+		send_kernel_message(core_id(), __run_batched_syscall, (long)p,
+		                    (long)&sysc[1], nr_syscs - 1, KMSG_ROUTINE);
+	}
 	/* Call the first one directly.  (we already checked to make sure there is
 	 * 1) */
-	run_local_syscall(sysc);
+	run_batched_syscall(p, sysc, nr_syscs);
 }
 
 /* Call this when something happens on the syscall where userspace might want to
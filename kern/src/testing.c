@@ -31,6 +31,8 @@
 #include <slab.h>
 #include <kmalloc.h>
 #include <hashtable.h>
+#include <chashtable.h>
+#include <blockdev.h>
 #include <radix.h>
 #include <monitor.h>
 #include <kthread.h>
@@ -39,6 +41,8 @@
 #include <ucq.h>
 #include <setjmp.h>
 #include <apipe.h>
+#include <writeback.h>
+#include <reclaim.h>
 
 #define l1 (available_caches.l1)
 #define l2 (available_caches.l2)
@@ -752,20 +756,30 @@ void test_kmalloc(void)
 {
 	printk("Testing Kmalloc\n");
 	void *bufs[NUM_KMALLOC_CACHES + 1];	
-	size_t size;
+	size_t size = KMALLOC_ALIGNMENT;
 	for (int i = 0; i < NUM_KMALLOC_CACHES + 1; i++){
-		size = (KMALLOC_SMALLEST << i) - KMALLOC_OFFSET;
 		bufs[i] = kmalloc(size, 0);
-		printk("Size %d, Addr = %p\n", size, bufs[i]);
+		printk("Size %d, Addr = %p, ksize %d\n", size, bufs[i], ksize(bufs[i]));
+		assert(ksize(bufs[i]) >= size);
+		assert(!((uintptr_t)bufs[i] % KMALLOC_ALIGNMENT));
+		/* Just over the previous class, so we touch each one */
+		size = ksize(bufs[i]) + 1;
 	}
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
 		printk("Freeing buffer %d\n", i);
-		kfree(bufs[i]);
+		if (i % 2)
+			kfree(bufs[i]);
+		else
+			kfree_sized(bufs[i], ksize(bufs[i]));
 	}
+	kfree(bufs[NUM_KMALLOC_CACHES]);
 	printk("Testing a large kmalloc\n");
 	size = (KMALLOC_LARGEST << 2);
 	bufs[0] = kmalloc(size, 0);
 	printk("Size %d, Addr = %p\n", size, bufs[0]);
+	assert(ksize(bufs[0]) >= size);
+	bufs[0] = krealloc(bufs[0], size << 1, 0);
+	assert(ksize(bufs[0]) >= size << 1);
 	kfree(bufs[0]);
 }
 
@@ -1058,6 +1072,7 @@ void test_vm_regions(void)
 	struct proc pr, *p = &pr;	/* too lazy to even create one */
 	int n = 0;
 	TAILQ_INIT(&p->vm_regions);
+	p->vmr_root = 0;
 
 	struct vmr_summary {
 		uintptr_t base; 
@@ -1715,3 +1730,686 @@ void test_apipe(void)
 	 * might expect us to return while being on core 0 (like if we were kfunc'd
 	 * from the monitor.  Be careful if you copy this code. */
 }
+
+/* Runs func(arg) on every core at once and waits for them all to finish.  The
+ * other cores get it in a routine kmsg, and we call it directly, all with IRQs
+ * on.  Our IRQ state is the same when we return.  Returns how many usec that
+ * took.  Run it with the other cores idle. */
+struct test_all_cores {
+	void						(*func)(void *arg);
+	void						*arg;
+	atomic_t					nr_running;
+};
+
+static void __test_all_cores_handler(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct test_all_cores *tac = (struct test_all_cores*)a0;
+
+	/* RKMs run with IRQs off */
+	enable_irq();
+	tac->func(tac->arg);
+	atomic_dec(&tac->nr_running);
+}
+
+static uint64_t test_on_all_cores(void (*func)(void *arg), void *arg)
+{
+	struct test_all_cores tac = {func, arg};
+	bool irq_was_on = irq_is_enabled();
+	uint64_t start = read_tsc();
+
+	atomic_init(&tac.nr_running, num_cpus);
+	for (int i = 0; i < num_cpus; i++) {
+		if (i == core_id())
+			continue;
+		send_kernel_message(i, __test_all_cores_handler, (long)&tac, 0, 0,
+		                    KMSG_ROUTINE);
+	}
+	__test_all_cores_handler(0, (long)&tac, 0, 0);
+	/* the handler turned them on for us too */
+	if (!irq_was_on)
+		disable_irq();
+	while (atomic_read(&tac.nr_running))
+		cpu_relax();
+	return tsc2usec(read_tsc() - start);
+}
+
+/* Each core allocs batches of pages and writes its own tag into each.  If two
+ * cores ever got the same page, one of them would find the other's tag. */
+#define TEST_PG_BATCH 64
+#define TEST_PG_ITERS 10000
+
+static void __test_page_alloc_core(void *arg)
+{
+	struct page *pages[TEST_PG_BATCH];
+	uintptr_t tag = core_id() * TEST_PG_BATCH;
+
+	for (int i = 0; i < TEST_PG_ITERS; i++) {
+		for (int j = 0; j < TEST_PG_BATCH; j++) {
+			assert(!kpage_alloc(&pages[j]));
+			assert(kref_refcnt(&pages[j]->pg_kref) == 1);
+			assert(!(pages[j]->pg_flags & PG_BUDDY));
+			*(uintptr_t*)page2kva(pages[j]) = tag + j;
+		}
+		for (int j = 0; j < TEST_PG_BATCH; j++) {
+			assert(*(uintptr_t*)page2kva(pages[j]) == tag + j);
+			page_decref(pages[j]);
+		}
+	}
+}
+
+/* Hammers the page allocator from every core, checking that no page is handed
+ * out twice, and reports the aggregate throughput.  Then makes sure a page that
+ * went back to a per-core cache can still be allocated by its number. */
+void test_page_alloc_scaling(void)
+{
+	uint64_t usec;
+	size_t nr_pages = (size_t)num_cpus * TEST_PG_BATCH * TEST_PG_ITERS;
+	struct page *page;
+	size_t ppn;
+
+	usec = test_on_all_cores(__test_page_alloc_core, 0);
+	printk("[TEST-PAGE-ALLOC] %d cores, %lu pages in %llu usec: %llu pages/sec\n",
+	       num_cpus, nr_pages, usec, usec ? nr_pages * 1000000 / usec : 0);
+	assert(!kpage_alloc(&page));
+	ppn = page2ppn(page);
+	assert(kpage_alloc_specific(&page, ppn) == -ENOMEM);
+	page_decref(page);
+	assert(!kpage_alloc_specific(&page, ppn));
+	assert(page2ppn(page) == ppn);
+	page_decref(page);
+	printk("[TEST-PAGE-ALLOC] Passed\n");
+}
+
+/* a0 is a counter of messages received, a1 is the sequence number the sender
+ * gave this message.  Messages from one sender must arrive in order, even when
+ * they overflow the kmsg ring. */
+#define TEST_KMSG_ITERS 10000
+
+static void __test_kmsg_latency_handler(uint32_t srcid, long a0, long a1,
+                                        long a2)
+{
+	atomic_t *nr_recvd = (atomic_t*)a0;
+
+	assert(atomic_read(nr_recvd) == a1);
+	atomic_inc(nr_recvd);
+}
+
+/* Measures the round trip of an immediate kmsg to each other core (send, and
+ * wait to see the handler run), then how fast we can stream them to one core.
+ * Run it with the other cores idle. */
+void test_kmsg_latency(void)
+{
+	atomic_t nr_recvd;
+	uint64_t start, usec;
+
+	for (int i = 0; i < num_cpus; i++) {
+		if (i == core_id())
+			continue;
+		atomic_init(&nr_recvd, 0);
+		start = read_tsc();
+		for (int j = 0; j < TEST_KMSG_ITERS; j++) {
+			send_kernel_message(i, __test_kmsg_latency_handler,
+			                    (long)&nr_recvd, j, 0, KMSG_IMMEDIATE);
+			while (atomic_read(&nr_recvd) != j + 1)
+				cpu_relax();
+		}
+		usec = tsc2usec(read_tsc() - start);
+		printk("[TEST-KMSG] core %d -> %d: %llu nsec per round trip\n",
+		       core_id(), i, usec * 1000 / TEST_KMSG_ITERS);
+	}
+	if (num_cpus < 2)
+		return;
+	/* Stream without waiting, which will overflow the ring */
+	atomic_init(&nr_recvd, 0);
+	start = read_tsc();
+	for (int j = 0; j < TEST_KMSG_ITERS; j++)
+		send_kernel_message(core_id() ? 0 : 1, __test_kmsg_latency_handler,
+		                    (long)&nr_recvd, j, 0, KMSG_IMMEDIATE);
+	while (atomic_read(&nr_recvd) != TEST_KMSG_ITERS)
+		cpu_relax();
+	usec = tsc2usec(read_tsc() - start);
+	printk("[TEST-KMSG] streamed %d kmsgs in %llu usec: %llu kmsgs/sec\n",
+	       TEST_KMSG_ITERS, usec, usec ? TEST_KMSG_ITERS * 1000000ULL / usec : 0);
+}
+
+/* Each core creates and destroys procs.  While it has one, it looks up the pid
+ * that the next core created last, which that core could be freeing, or reusing
+ * the memory of, at the same time.  pid2proc() has to return the proc with that
+ * pid or nothing.  arg is the array of each core's last pid. */
+#define TEST_PID2PROC_ITERS 1000
+
+static void __test_pid2proc_core(void *arg)
+{
+	pid_t *last_pids = (pid_t*)arg;
+	struct proc *p, *found;
+	pid_t pid;
+
+	for (int i = 0; i < TEST_PID2PROC_ITERS; i++) {
+		assert(!proc_alloc(&p, 0));
+		__proc_ready(p);
+		/* Our ref keeps it in the table */
+		found = pid2proc(p->pid);
+		assert(found == p);
+		proc_decref(found);
+		ACCESS_ONCE(last_pids[core_id()]) = p->pid;
+		pid = ACCESS_ONCE(last_pids[(core_id() + 1) % num_cpus]);
+		found = pid2proc(pid);
+		if (found) {
+			assert(found->pid == pid);
+			proc_decref(found);
+		}
+		proc_destroy(p);
+		proc_decref(p);
+	}
+}
+
+/* Each core looks up the pids of a set of live procs, over and over.  arg is
+ * the array of pids. */
+#define TEST_PID2PROC_NR_LIVE 64
+#define TEST_PID2PROC_LOOKUPS 100000
+
+static void __test_pid2proc_lookup_core(void *arg)
+{
+	pid_t *pids = (pid_t*)arg;
+	struct proc *found;
+	pid_t pid;
+
+	for (int i = 0; i < TEST_PID2PROC_LOOKUPS; i++) {
+		pid = pids[(i + core_id()) % TEST_PID2PROC_NR_LIVE];
+		found = pid2proc(pid);
+		assert(found && found->pid == pid);
+		proc_decref(found);
+	}
+}
+
+/* Checks pid2proc() on bad pids and a proc's whole life, then churns procs on
+ * every core while they look up each other's pids.  Last, it times lookups of
+ * live procs on one core and on all of them. */
+void test_pid2proc(void)
+{
+	pid_t last_pids[MAX_NUM_CPUS] = {0};
+	struct proc *live[TEST_PID2PROC_NR_LIVE];
+	pid_t live_pids[TEST_PID2PROC_NR_LIVE];
+	struct proc *p;
+	pid_t pid;
+	uint64_t start, usec, nr_lookups;
+
+	assert(!pid2proc(0));
+	assert(!pid2proc(-1));
+	assert(!proc_alloc(&p, 0));
+	pid = p->pid;
+	assert(!pid2proc(pid));
+	__proc_ready(p);
+	assert(pid2proc(pid) == p);
+	proc_decref(p);
+	proc_destroy(p);
+	proc_decref(p);
+	assert(!pid2proc(pid));
+	test_on_all_cores(__test_pid2proc_core, last_pids);
+
+	for (int i = 0; i < TEST_PID2PROC_NR_LIVE; i++) {
+		assert(!proc_alloc(&live[i], 0));
+		__proc_ready(live[i]);
+		live_pids[i] = live[i]->pid;
+	}
+	start = read_tsc();
+	__test_pid2proc_lookup_core(live_pids);
+	usec = tsc2usec(read_tsc() - start);
+	printk("[TEST-PID2PROC] 1 core, %d lookups in %llu usec: %llu lookups/sec\n",
+	       TEST_PID2PROC_LOOKUPS, usec,
+	       usec ? TEST_PID2PROC_LOOKUPS * 1000000ULL / usec : 0);
+	nr_lookups = (uint64_t)num_cpus * TEST_PID2PROC_LOOKUPS;
+	usec = test_on_all_cores(__test_pid2proc_lookup_core, live_pids);
+	printk("[TEST-PID2PROC] %d cores, %llu lookups in %llu usec: %llu "
+	       "lookups/sec\n", num_cpus, nr_lookups, usec,
+	       usec ? nr_lookups * 1000000 / usec : 0);
+	for (int i = 0; i < TEST_PID2PROC_NR_LIVE; i++) {
+		proc_destroy(live[i]);
+		proc_decref(live[i]);
+	}
+	printk("[TEST-PID2PROC] Passed\n");
+}
+
+/* Each core inserts, finds, and removes its own range of keys in a shared
+ * chashtable, which grows while the others are using it.  arg is the table. */
+#define TEST_CHT_KEYS 4096
+
+static void __test_chashtable_core(void *arg)
+{
+	struct chashtable *h = (struct chashtable*)arg;
+	/* keys are never 0, since 0 means 'not found' for the values */
+	uintptr_t base = core_id() * TEST_CHT_KEYS + 1;
+
+	for (uintptr_t k = base; k < base + TEST_CHT_KEYS; k++)
+		assert(!chashtable_insert(h, (void*)k, (void*)k));
+	for (uintptr_t k = base; k < base + TEST_CHT_KEYS; k++)
+		assert(chashtable_search(h, (void*)k) == (void*)k);
+	for (uintptr_t k = base; k < base + TEST_CHT_KEYS; k += 2)
+		assert(chashtable_remove(h, (void*)k) == (void*)k);
+	for (uintptr_t k = base; k < base + TEST_CHT_KEYS; k++)
+		assert(chashtable_search(h, (void*)k) ==
+		       ((k - base) % 2 ? (void*)k : 0));
+}
+
+/* Checks that keys [1, nr_keys) are in h, other than the ones below first_key,
+ * which were removed. */
+static void __test_chashtable_check(struct chashtable *h, uintptr_t first_key,
+                                    uintptr_t nr_keys)
+{
+	for (uintptr_t k = 1; k < nr_keys; k++)
+		assert(chashtable_search(h, (void*)k) ==
+		       (k < first_key ? 0 : (void*)k));
+	assert(chashtable_count(h) == nr_keys - first_key);
+}
+
+/* Checks the chashtable on one core, including every lookup at each step of a
+ * resize, then has every core use one table while it grows several times. */
+void test_chashtable(void)
+{
+	struct chashtable *h;
+	size_t nr_found = 0;
+	size_t old_buckets;
+	uintptr_t first_key = 1, nr_keys = 1;
+	uint64_t usec;
+
+	void __count(void *v)
+	{
+		nr_found++;
+	}
+	bool __no_get(void *v)
+	{
+		return FALSE;
+	}
+	h = create_chashtable(0, __generic_hash, __generic_eq);
+	assert(h);
+	assert(!chashtable_insert(h, (void*)5, (void*)55));
+	assert(chashtable_search(h, (void*)5) == (void*)55);
+	assert(!chashtable_search_get(h, (void*)5, __no_get));
+	assert(!chashtable_remove_if(h, (void*)5, __no_get));
+	assert(chashtable_remove(h, (void*)5) == (void*)55);
+	assert(!chashtable_search(h, (void*)5));
+	assert(!chashtable_count(h));
+
+	/* Fill it until it starts growing */
+	old_buckets = h->cur->nr_buckets;
+	while (!h->old) {
+		assert(!chashtable_insert(h, (void*)nr_keys, (void*)nr_keys));
+		nr_keys++;
+	}
+	assert(h->cur->nr_buckets == 2 * old_buckets);
+	__test_chashtable_check(h, first_key, nr_keys);
+	/* Every remove and insert moves some buckets.  Lookups have to find the
+	 * keys in whichever table they are in at each step. */
+	for (int i = 0; h->old; i++) {
+		if (i % 2) {
+			assert(chashtable_remove(h, (void*)first_key) == (void*)first_key);
+			first_key++;
+		} else {
+			assert(!chashtable_insert(h, (void*)nr_keys, (void*)nr_keys));
+			nr_keys++;
+		}
+		__test_chashtable_check(h, first_key, nr_keys);
+	}
+	assert(h->cur->nr_buckets == 2 * old_buckets);
+	chash_for_each(h, __count);
+	assert(nr_found == nr_keys - first_key);
+	chashtable_destroy(h);
+
+	nr_found = 0;
+	h = create_chashtable(0, __generic_hash, __generic_eq);
+	assert(h);
+	usec = test_on_all_cores(__test_chashtable_core, h);
+	assert(chashtable_count(h) == num_cpus * TEST_CHT_KEYS / 2);
+	chash_for_each(h, __count);
+	assert(nr_found == num_cpus * TEST_CHT_KEYS / 2);
+	printk("[TEST-CHT] %d cores, %d keys each, %llu usec, %lu buckets\n",
+	       num_cpus, TEST_CHT_KEYS, usec, h->cur->nr_buckets);
+	chashtable_destroy(h);
+}
+
+/* Sets 100k alarms at random times over the next second on this core's
+ * tchain, unsets a third of them, and makes sure the rest go off, none of them
+ * early.  Reports the cycles per set and unset, which shouldn't depend on how
+ * many alarms are set.  The waiters are too big for one allocation, so they
+ * come in chunks. */
+#define TEST_ALARM_NR 100000
+#define TEST_ALARM_CHUNK 10000
+#define TEST_ALARM_NR_CHUNKS (TEST_ALARM_NR / TEST_ALARM_CHUNK)
+
+void test_alarm_wheel(void)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	struct alarm_waiter *chunks[TEST_ALARM_NR_CHUNKS];
+	uint64_t seed = 1, now, start, set_cycles, unset_cycles;
+	uint64_t range = usec2tsc(1000000);
+	int nr_unset = 0;
+	int nr_fired = 0;
+	int8_t irq_state = 0;
+
+	void __alarm_fired(struct alarm_waiter *waiter)
+	{
+		assert(read_tsc() >= waiter->wake_up_time);
+		nr_fired++;
+	}
+	struct alarm_waiter *__waiter(int i)
+	{
+		return &chunks[i / TEST_ALARM_CHUNK][i % TEST_ALARM_CHUNK];
+	}
+	static_assert(TEST_ALARM_NR % TEST_ALARM_CHUNK == 0);
+	static_assert(sizeof(struct alarm_waiter) * TEST_ALARM_CHUNK <=
+	              PGSIZE << BUDDY_MAX_ORDER);
+	for (int i = 0; i < TEST_ALARM_NR_CHUNKS; i++) {
+		chunks[i] = kmalloc(sizeof(struct alarm_waiter) * TEST_ALARM_CHUNK, 0);
+		assert(chunks[i]);
+	}
+	/* Keep the alarms from going off while we set them, so the timings are
+	 * just set_alarm() */
+	disable_irqsave(&irq_state);
+	now = read_tsc();
+	for (int i = 0; i < TEST_ALARM_NR; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		init_awaiter(__waiter(i), __alarm_fired);
+		set_awaiter_abs(__waiter(i), now + (seed >> 11) % range);
+	}
+	start = read_tsc();
+	for (int i = 0; i < TEST_ALARM_NR; i++)
+		set_alarm(tchain, __waiter(i));
+	set_cycles = read_tsc() - start;
+	start = read_tsc();
+	for (int i = 0; i < TEST_ALARM_NR; i += 3) {
+		unset_alarm(tchain, __waiter(i));
+		nr_unset++;
+	}
+	unset_cycles = read_tsc() - start;
+	/* Unsetting twice is fine */
+	unset_alarm(tchain, __waiter(0));
+	enable_irqsave(&irq_state);
+	/* None could go off til now, so every unset one was still armed */
+	while (ACCESS_ONCE(nr_fired) + nr_unset < TEST_ALARM_NR) {
+		if (read_tsc() > now + 2 * range) {
+			printk("[TEST-ALARM] Only %d of %d alarms went off!\n", nr_fired,
+			       TEST_ALARM_NR - nr_unset);
+			print_chain(tchain);
+			panic("Lost alarms");
+		}
+		cpu_relax();
+	}
+	printk("[TEST-ALARM] %d alarms: %llu cycles per set, %llu per unset\n",
+	       TEST_ALARM_NR, set_cycles / TEST_ALARM_NR, unset_cycles / nr_unset);
+	for (int i = 0; i < TEST_ALARM_NR_CHUNKS; i++)
+		kfree(chunks[i]);
+}
+
+/* Plugs a fake block device, submits requests for sectors 7 down to 0 and one
+ * far away, and checks that the queue merged the first eight into one dispatch
+ * and sent them out in sector order. */
+void test_block_queue(void)
+{
+	struct block_device *bdev = kzmalloc(sizeof(struct block_device), 0);
+	struct block_request *breqs = kzmalloc(sizeof(struct block_request) * 9,
+	                                       0);
+	struct buffer_head *bhs = kzmalloc(sizeof(struct buffer_head) * 9, 0);
+	unsigned long dispatched[9];
+	int nr_dispatched = 0;
+	int nr_done = 0;
+
+	void __fake_submit(struct block_device *bdev, struct block_request *breq)
+	{
+		dispatched[nr_dispatched++] = breq->first_sector;
+		dispatched[nr_dispatched++] = breq->nr_sector;
+		bdev_complete_request(breq);
+	}
+	void __fake_done(struct block_request *breq)
+	{
+		nr_done++;
+	}
+	assert(bdev && breqs && bhs);
+	bdev->b_nr_sector = 1000;
+	strncpy(bdev->b_name, "TESTBDEV", BDEV_INLINE_NAME);
+	bdev->b_submit = __fake_submit;
+	bdev->b_max_in_flight = 1;
+	bdev_register(bdev);
+	bdev_plug(bdev);
+	for (int i = 0; i < 9; i++) {
+		bhs[i].bh_sector = i < 8 ? 7 - i : 100;
+		bhs[i].bh_nr_sector = 1;
+		breqs[i].flags = BREQ_READ;
+		breqs[i].callback = __fake_done;
+		breqs[i].bhs = breqs[i].local_bhs;
+		breqs[i].bhs[0] = &bhs[i];
+		breqs[i].nr_bhs = 1;
+		assert(!bdev_submit_request(bdev, &breqs[i]));
+	}
+	assert(!nr_dispatched);
+	bdev_unplug(bdev);
+	assert(nr_done == 9);
+	assert(nr_dispatched == 4);
+	assert(dispatched[0] == 0 && dispatched[1] == 8);
+	assert(dispatched[2] == 100 && dispatched[3] == 1);
+	assert(bdev->b_queue.nr_merges == 7);
+	printk("[TEST-BLOCK] Passed\n");
+	print_bdev_stats();
+	bdev_unregister(bdev);
+	kfree(bdev);
+	kfree(breqs);
+	kfree(bhs);
+}
+
+/* The page cache tests use fake page maps, with no host.  Reading a page just
+ * marks it up to date, and each has its own LRU, so reclaim only sees the
+ * test's pages. */
+struct test_pm {
+	struct page_map				pm;
+	struct page_map_operations	ops;
+	struct page_lru				lru;
+};
+
+static int __test_pm_readpage(struct page_map *pm, struct page *page)
+{
+	page->pg_flags |= PG_UPTODATE;
+	return 0;
+}
+
+/* Either op can be 0.  Free it with test_pm_destroy(). */
+static struct page_map *test_pm_create(int (*readpages)(struct page_map *,
+                                                        struct page **,
+                                                        unsigned int),
+                                       int (*writepages)(struct page_map *,
+                                                         struct page **,
+                                                         unsigned int))
+{
+	struct test_pm *tpm = kzmalloc(sizeof(struct test_pm), 0);
+
+	assert(tpm);
+	tpm->ops.readpage = __test_pm_readpage;
+	tpm->ops.readpages = readpages;
+	tpm->ops.writepages = writepages;
+	page_lru_init(&tpm->lru);
+	pm_init(&tpm->pm, &tpm->ops, 0);
+	tpm->pm.pm_lru = &tpm->lru;
+	return &tpm->pm;
+}
+
+static void test_pm_destroy(struct page_map *pm)
+{
+	pm_destroy(pm);
+	kfree(pm);
+}
+
+/* Reads a fake 40 page file sequentially and checks that the readahead windows
+ * double and stay ahead of the reader, then reads it again and checks that
+ * nothing cached gets read twice. */
+void test_readahead(void)
+{
+	struct page_map *pm;
+	struct file_ra_state ra;
+	struct page *page;
+	unsigned long windows[8][2];
+	int nr_windows = 0;
+
+	int __fake_readpages(struct page_map *pm, struct page **pages,
+	                     unsigned int nr)
+	{
+		assert(nr_windows < 8);
+		windows[nr_windows][0] = pages[0]->pg_index;
+		windows[nr_windows][1] = nr;
+		nr_windows++;
+		for (int i = 0; i < nr; i++) {
+			assert(pages[i]->pg_index == pages[0]->pg_index + i);
+			pages[i]->pg_flags |= PG_UPTODATE;
+			unlock_page(pages[i]);
+			page_decref(pages[i]);
+		}
+		return 0;
+	}
+	pm = test_pm_create(__fake_readpages, 0);
+	file_ra_state_init(&ra);
+	for (int i = 0; i < 40; i++) {
+		pm_readahead(pm, &ra, i, 40);
+		assert(!pm_load_page(pm, i, &page));
+		page_decref(page);
+	}
+	assert(nr_windows == 4);
+	assert(windows[0][0] == 0 && windows[0][1] == 4);
+	assert(windows[1][0] == 4 && windows[1][1] == 8);
+	assert(windows[2][0] == 12 && windows[2][1] == 16);
+	assert(windows[3][0] == 28 && windows[3][1] == 12);
+	/* A random read collapses the window */
+	pm_readahead(pm, &ra, 5, 40);
+	assert(!ra.size);
+	file_ra_state_init(&ra);
+	for (int i = 0; i < 40; i++)
+		pm_readahead(pm, &ra, i, 40);
+	assert(nr_windows == 4);
+	printk("[TEST-READAHEAD] Passed\n");
+	test_pm_destroy(pm);
+}
+
+/* Dirties a few runs of pages in a fake page map and makes sure writeback
+ * clusters them, clears the tags, and reports errors once. */
+void test_writeback(void)
+{
+	struct page_map *pm;
+	struct page *pages[10];
+	unsigned long clusters[8][2];
+	int nr_clusters = 0;
+	bool fail = FALSE;
+
+	/* Finishes the writes right away, like a very fast disk */
+	int __fake_writepages(struct page_map *pm, struct page **pages,
+	                      unsigned int nr)
+	{
+		assert(nr_clusters < 8);
+		clusters[nr_clusters][0] = pages[0]->pg_index;
+		clusters[nr_clusters][1] = nr;
+		nr_clusters++;
+		for (int i = 0; i < nr; i++) {
+			assert(pages[i]->pg_index == pages[0]->pg_index + i);
+			assert(radix_tag_get(&pm->pm_tree, pages[i]->pg_index,
+			                     PM_TAG_WRITEBACK));
+			pm_end_page_writeback(pages[i], fail);
+		}
+		return 0;
+	}
+	pm = test_pm_create(0, __fake_writepages);
+	for (int i = 0; i < 10; i++)
+		assert(!pm_load_page(pm, i, &pages[i]));
+	/* Runs of 0-4, 6, and 8-9, with 2 dirtied twice */
+	for (int i = 0; i < 10; i++) {
+		if ((i != 5) && (i != 7))
+			pm_dirty_page(pm, pages[i]);
+	}
+	pm_dirty_page(pm, pages[2]);
+	assert(radix_tree_tagged(&pm->pm_tree, PM_TAG_DIRTY));
+	assert(!pm_writeback(pm, TRUE));
+	assert(nr_clusters == 3);
+	assert(clusters[0][0] == 0 && clusters[0][1] == 5);
+	assert(clusters[1][0] == 6 && clusters[1][1] == 1);
+	assert(clusters[2][0] == 8 && clusters[2][1] == 2);
+	assert(!radix_tree_tagged(&pm->pm_tree, PM_TAG_DIRTY));
+	assert(!radix_tree_tagged(&pm->pm_tree, PM_TAG_WRITEBACK));
+	assert(!(pm->pm_flags & PM_DIRTY_LISTED));
+	/* Clean pages don't get written again */
+	assert(!pm_writeback(pm, TRUE));
+	assert(nr_clusters == 3);
+	/* Errors get reported by the next wait, and only once */
+	fail = TRUE;
+	pm_dirty_page(pm, pages[7]);
+	assert(pm_writeback(pm, TRUE) == -EIO);
+	assert(clusters[3][0] == 7 && clusters[3][1] == 1);
+	assert(!pm_wait_writeback(pm));
+	printk("[TEST-WRITEBACK] Passed\n");
+	for (int i = 0; i < 10; i++)
+		page_decref(pages[i]);
+	test_pm_destroy(pm);
+}
+
+/* Loads 8 pages of a fake page map, and checks which ones reclaim evicts: 0
+ * and 1 were hit twice and go to the active list, 2 is dirty with nowhere to
+ * write it, and 3 is in use, so the first two evicted are 4 and 5.  Reloading 4
+ * is a refault, which goes right to the active list.  Then 1 gets hit while
+ * it is active, so it goes around the active list again, and 2 is the one that
+ * gets deactivated, while 6 and 7 are evicted. */
+void test_reclaim(void)
+{
+	struct page_map *pm = test_pm_create(0, 0);
+	struct page_lru *lru = pm->pm_lru;
+	struct page *page, *held;
+
+	/* Checks that exactly the pages in the mask are in the cache */
+	void __check_cached(unsigned int mask)
+	{
+		for (int i = 0; i < 8; i++) {
+			page = pm_find_page(pm, i);
+			assert(!page == !(mask & (1 << i)));
+			if (page)
+				page_decref(page);
+		}
+		assert(pm->pm_num_pages == __builtin_popcount(mask));
+	}
+	void __load(int i)
+	{
+		assert(!pm_load_page(pm, i, &page));
+		page_decref(page);
+	}
+	for (int i = 0; i < 8; i++)
+		__load(i);
+	assert(lru->nr_inactive == 8 && !lru->nr_active);
+	for (int i = 0; i < 4; i++)
+		__load(i % 2);
+	page = pm_find_page(pm, 2);
+	pm_dirty_page(pm, page);
+	page_decref(page);
+	held = pm_find_page(pm, 3);
+
+	/* Scans 0-3, which all go to the active list, then evicts 4.  That leaves
+	 * more active pages than inactive, so 0 (no longer hit) goes back to the
+	 * inactive list before 5 is evicted. */
+	assert(page_lru_shrink(lru, 2) == 2);
+	__check_cached(0xcf);
+	assert(lru->nr_active == 3 && lru->nr_inactive == 3);
+	assert(lru->stats.nr_scanned == 6);
+	assert(lru->stats.nr_activated == 4);
+	assert(lru->stats.nr_deactivated == 1);
+	assert(lru->stats.nr_evicted == 2);
+
+	__load(4);
+	assert(lru->stats.nr_refaults == 1);
+	page = pm_find_page(pm, 4);
+	assert(page->pg_lru_list == PG_LRU_ACTIVE);
+	page_decref(page);
+	/* 1 is at the head of the active list, and gets another pass */
+	__load(1);
+	assert(page_lru_shrink(lru, 2) == 2);
+	__check_cached(0x1f);
+	page = pm_find_page(pm, 1);
+	assert(page->pg_lru_list == PG_LRU_ACTIVE);
+	page_decref(page);
+	page = pm_find_page(pm, 2);
+	assert(page->pg_lru_list == PG_LRU_INACTIVE);
+	page_decref(page);
+	assert(lru->stats.nr_evicted == 4);
+	printk("[TEST-RECLAIM] Passed\n");
+	page_decref(held);
+	test_pm_destroy(pm);
+}
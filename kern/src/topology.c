@@ -0,0 +1,52 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * CPU topology map.  See topology.h. */
+
+#include <topology.h>
+#include <smp.h>
+#include <stdio.h>
+#include <assert.h>
+
+struct core_topology cpu_topology[MAX_NUM_CPUS];
+int nr_sockets, nr_llcs, nr_phys_cores;
+
+/* Helper: renumbers the raw ids at offset 'field' in each core's topology into
+ * 0..n-1, in order of first appearance.  Returns n. */
+static int densify_ids(size_t field)
+{
+	int raw_ids[MAX_NUM_CPUS];
+	int nr_ids = 0;
+	int *id, i;
+
+	for (int core = 0; core < num_cpus; core++) {
+		id = (void*)&cpu_topology[core] + field;
+		for (i = 0; i < nr_ids; i++) {
+			if (raw_ids[i] == *id)
+				break;
+		}
+		if (i == nr_ids)
+			raw_ids[nr_ids++] = *id;
+		*id = i;
+	}
+	return nr_ids;
+}
+
+/* Call once all cores are up and have their os core ids */
+void topology_init(void)
+{
+	arch_topology_init();
+	nr_sockets = densify_ids(offsetof(struct core_topology, socket));
+	nr_llcs = densify_ids(offsetof(struct core_topology, llc));
+	nr_phys_cores = densify_ids(offsetof(struct core_topology, phys_core));
+	printk("CPU topology: %d sockets, %d LLCs, %d cores, %d threads\n",
+	       nr_sockets, nr_llcs, nr_phys_cores, num_cpus);
+}
+
+void print_topology(void)
+{
+	printk("Core  Socket  LLC  Phys core\n");
+	for (int i = 0; i < num_cpus; i++)
+		printk("%4d %7d %4d %10d\n", i, cpu_topology[i].socket,
+		       cpu_topology[i].llc, cpu_topology[i].phys_core);
+}
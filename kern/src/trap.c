@@ -12,6 +12,9 @@
 #include <assert.h>
 #include <kdebug.h>
 #include <kmalloc.h>
+#include <string.h>
+#include <ros/bcq.h>
+#include <bitmask.h>
 
 struct kmem_cache *kernel_msg_cache;
 
@@ -21,41 +24,140 @@ void kernel_msg_init(void)
 	                   sizeof(struct kernel_message), ARCH_CL_SIZE, 0, 0, 0);
 }
 
-uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
-                             long arg2, int type)
+/* Allocates a ring for a core's kmsgs.  The BCQ indexes start at 0. */
+struct kmsg_bcq *kmsg_ring_alloc(void)
 {
-	kernel_message_t *k_msg;
-	assert(pc);
-	// note this will be freed on the destination core
+	struct kmsg_bcq *ring = kmalloc(sizeof(struct kmsg_bcq), KMALLOC_WAIT);
+	memset(ring, 0, sizeof(struct kmsg_bcq));
+	return ring;
+}
+
+/* Puts msg on a core's ring, or on the overflow list if the ring is full.  Once
+ * something is on the list, we keep using the list until the receiver drains
+ * it, so that a sender's messages don't pass each other.  The receiver always
+ * drains the ring before the list.
+ *
+ * Callers need IRQs disabled: the receiver spins on a ring slot we've claimed
+ * until we fill it in, so we can't be interrupted in between. */
+static void __kmsg_enqueue(struct kmsg_bcq *ring, spinlock_t *list_lock,
+                           struct kernel_msg_list *list,
+                           struct kernel_message *msg)
+{
+	struct kernel_message *k_msg;
+
+	/* Lockless peek at the list is okay.  If we see it empty just as someone
+	 * else adds to it, our messages weren't ordered anyways. */
+	if (ring && STAILQ_EMPTY(list) && !bcq_enqueue(ring, msg, KMSG_RING_SZ, 0))
+		return;
+	/* note this will be freed on the destination core */
 	k_msg = kmem_cache_alloc(kernel_msg_cache, 0);
-	k_msg->srcid = core_id();
-	k_msg->dstid = dst;
-	k_msg->pc = pc;
-	k_msg->arg0 = arg0;
-	k_msg->arg1 = arg1;
-	k_msg->arg2 = arg2;
+	*k_msg = *msg;
+	spin_lock_irqsave(list_lock);
+	STAILQ_INSERT_TAIL(list, k_msg, link);
+	spin_unlock_irqsave(list_lock);
+}
+
+/* Copies out the next message from a core's ring, then from its overflow list.
+ * Only call this on the core that owns the ring.  Returns FALSE if there was
+ * no message. */
+static bool __kmsg_dequeue(struct kmsg_bcq *ring, spinlock_t *list_lock,
+                           struct kernel_msg_list *list,
+                           struct kernel_message *msg)
+{
+	struct kernel_message *k_msg;
+
+	if (ring && !bcq_dequeue(ring, msg, KMSG_RING_SZ))
+		return TRUE;
+	/* Avoid locking if the list appears empty (lockless peak is okay) */
+	if (STAILQ_EMPTY(list))
+		return FALSE;
+	/* The lock serves as a cmb to force a re-read of the head of the list */
+	spin_lock(list_lock);
+	k_msg = STAILQ_FIRST(list);
+	if (k_msg)
+		STAILQ_REMOVE_HEAD(list, link);
+	spin_unlock(list_lock);
+	if (!k_msg)
+		return FALSE;
+	*msg = *k_msg;
+	kmem_cache_free(kernel_msg_cache, (void*)k_msg);
+	return TRUE;
+}
+
+/* Queues a message for dst, without sending the IPI */
+static void __send_kmsg_noipi(uint32_t dst, amr_t pc, long arg0, long arg1,
+                              long arg2, int type)
+{
+	struct per_cpu_info *dst_pcpui = &per_cpu_info[dst];
+	struct kernel_message msg;
+	int8_t irq_state = 0;
+
+	assert(pc);
+	msg.srcid = core_id();
+	msg.dstid = dst;
+	msg.pc = pc;
+	msg.arg0 = arg0;
+	msg.arg1 = arg1;
+	msg.arg2 = arg2;
+	disable_irqsave(&irq_state);
 	switch (type) {
 		case KMSG_IMMEDIATE:
-			spin_lock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].immed_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
+			__kmsg_enqueue(dst_pcpui->immed_amsg_ring,
+			               &dst_pcpui->immed_amsg_lock,
+			               &dst_pcpui->immed_amsgs, &msg);
 			break;
 		case KMSG_ROUTINE:
-			spin_lock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].routine_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
+			__kmsg_enqueue(dst_pcpui->routine_amsg_ring,
+			               &dst_pcpui->routine_amsg_lock,
+			               &dst_pcpui->routine_amsgs, &msg);
 			break;
 		default:
 			panic("Unknown type of kernel message!");
 	}
-	/* since we touched memory the other core will touch (the lock), we don't
-	 * need an wmb_f() */
+	enable_irqsave(&irq_state);
+}
+
+/* Sends the IPI for a message __send_kmsg_noipi() queued.  The ring's CASs (or
+ * the list's lock) are our write barrier, since we touched memory the other
+ * core will touch, so we don't need an wmb_f(). */
+static void __send_kmsg_ipi(uint32_t dst, int type)
+{
 	/* if we're sending a routine message locally, we don't want/need an IPI */
-	if ((dst != k_msg->srcid) || (type == KMSG_IMMEDIATE))
+	if ((dst != core_id()) || (type == KMSG_IMMEDIATE))
 		send_ipi(dst, I_KERNEL_MSG);
+}
+
+uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                             long arg2, int type)
+{
+	__send_kmsg_noipi(dst, pc, arg0, arg1, arg2, type);
+	__send_kmsg_ipi(dst, type);
 	return 0;
 }
 
+/* Sends the same message to every core set in the bitmask cores (MAX_NUM_CPUS
+ * bits).  All of the messages are queued before any IPIs go out, so the cores
+ * handle them in parallel.  We have no multicast IPI (x86 uses physical
+ * destinations), so it is still one IPI per core.  Returns the number of cores
+ * we sent to. */
+int send_kernel_message_multi(uint8_t *cores, amr_t pc, long arg0, long arg1,
+                              long arg2, int type)
+{
+	int nr_sent = 0;
+
+	for (int i = 0; i < num_cpus; i++) {
+		if (GET_BITMASK_BIT(cores, i))
+			__send_kmsg_noipi(i, pc, arg0, arg1, arg2, type);
+	}
+	for (int i = 0; i < num_cpus; i++) {
+		if (GET_BITMASK_BIT(cores, i)) {
+			__send_kmsg_ipi(i, type);
+			nr_sent++;
+		}
+	}
+	return nr_sent;
+}
+
 /* Kernel message IPI/IRQ handler.
  *
  * This processes immediate messages, and that's it (it used to handle routines
@@ -68,37 +170,33 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	struct kernel_message *kmsg_i, *temp;
+	struct kernel_message msg;
 	assert(!irq_is_enabled());
-	/* Avoid locking if the list appears empty (lockless peak is okay) */
-	if (STAILQ_EMPTY(&pcpui->immed_amsgs))
-		return;
-	/* The lock serves as a cmb to force a re-read of the head of the list */
-	spin_lock(&pcpui->immed_amsg_lock);
-	STAILQ_FOREACH_SAFE(kmsg_i, &pcpui->immed_amsgs, link, temp) {
-		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
-		kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
-		STAILQ_REMOVE(&pcpui->immed_amsgs, kmsg_i, kernel_message, link);
-		kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
+	while (__kmsg_dequeue(pcpui->immed_amsg_ring, &pcpui->immed_amsg_lock,
+	                      &pcpui->immed_amsgs, &msg)) {
+		pcpui_trace_kmsg(pcpui, (uintptr_t)msg.pc);
+		msg.pc(msg.srcid, msg.arg0, msg.arg1, msg.arg2);
 	}
-	spin_unlock(&pcpui->immed_amsg_lock);
 }
 
-/* Helper function, gets the next routine KMSG (RKM).  Returns 0 if the list was
- * empty. */
-static kernel_message_t *get_next_rkmsg(struct per_cpu_info *pcpui)
+/* Returns whether or not coreid has immediate messages waiting.  Racy, unless
+ * you're coreid with IRQs disabled, in which case you may get a false
+ * positive. */
+bool has_immed_kmsgs(uint32_t coreid)
 {
-	struct kernel_message *kmsg;
-	/* Avoid locking if the list appears empty (lockless peak is okay) */
-	if (STAILQ_EMPTY(&pcpui->routine_amsgs))
-		return 0;
-	/* The lock serves as a cmb to force a re-read of the head of the list */
-	spin_lock(&pcpui->routine_amsg_lock);
-	kmsg = STAILQ_FIRST(&pcpui->routine_amsgs);
-	if (kmsg)
-		STAILQ_REMOVE_HEAD(&pcpui->routine_amsgs, link);
-	spin_unlock(&pcpui->routine_amsg_lock);
-	return kmsg;
+	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
+	if (pcpui->immed_amsg_ring && !bcq_empty(pcpui->immed_amsg_ring))
+		return TRUE;
+	return !STAILQ_EMPTY(&pcpui->immed_amsgs);
+}
+
+/* Helper function, copies the next routine KMSG (RKM) into msg.  Returns FALSE
+ * if there were none. */
+static bool get_next_rkmsg(struct per_cpu_info *pcpui,
+                           struct kernel_message *msg)
+{
+	return __kmsg_dequeue(pcpui->routine_amsg_ring, &pcpui->routine_amsg_lock,
+	                      &pcpui->routine_amsgs, msg);
 }
 
 /* Runs routine kernel messages.  This might not return.  In the past, this
@@ -114,16 +212,15 @@ void process_routine_kmsg(void)
 {
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
-	struct kernel_message msg_cp, *kmsg;
+	struct kernel_message msg_cp;
 
 	/* Important that callers have IRQs disabled.  When sending cross-core RKMs,
 	 * the IPI is used to keep the core from going to sleep - even though RKMs
 	 * aren't handled in the kmsg handler.  Check smp_idle() for more info. */
 	assert(!irq_is_enabled());
-	while ((kmsg = get_next_rkmsg(pcpui))) {
-		/* Copy in, and then free, in case we don't return */
-		msg_cp = *kmsg;
-		kmem_cache_free(kernel_msg_cache, (void*)kmsg);
+	/* The message is copied out (and freed, if it was on the list), in case we
+	 * don't return */
+	while (get_next_rkmsg(pcpui, &msg_cp)) {
 		assert(msg_cp.dstid == pcoreid);	/* caught a brutal bug with this */
 		set_rkmsg(pcpui);					/* we're now in early RKM ctx */
 		pcpui_trace_kmsg(pcpui, (uintptr_t)msg_cp.pc);
@@ -150,27 +247,44 @@ void process_routine_kmsg(void)
 void print_kmsgs(uint32_t coreid)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
-	void __print_kmsgs(struct kernel_msg_list *list, char *type)
+	void __print_kmsg(struct kernel_message *kmsg, char *type)
+	{
+		char *fn_name = get_fn_name((long)kmsg->pc);
+		printk("%s KMSG on %d from %d to run %p(%s)\n", type,
+		       kmsg->dstid, kmsg->srcid, kmsg->pc, fn_name); 
+		kfree(fn_name);
+	}
+	void __print_kmsgs(struct kmsg_bcq *ring, struct kernel_msg_list *list,
+	                   char *type)
 	{
-		char *fn_name;
 		struct kernel_message *kmsg_i;
-		STAILQ_FOREACH(kmsg_i, list, link) {
-			fn_name = get_fn_name((long)kmsg_i->pc);
-			printk("%s KMSG on %d from %d to run %p(%s)\n", type,
-			       kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc, fn_name); 
-			kfree(fn_name);
+		if (ring) {
+			for (uint32_t i = ring->hdr.cons_pvt_idx; i != ring->hdr.prod_idx;
+			     i++)
+				__print_kmsg(&ring->wraps[i & (KMSG_RING_SZ - 1)].elem, type);
 		}
+		STAILQ_FOREACH(kmsg_i, list, link)
+			__print_kmsg(kmsg_i, type);
 	}
-	__print_kmsgs(&pcpui->immed_amsgs, "Immedte");
-	__print_kmsgs(&pcpui->routine_amsgs, "Routine");
+	__print_kmsgs(pcpui->immed_amsg_ring, &pcpui->immed_amsgs, "Immedte");
+	__print_kmsgs(pcpui->routine_amsg_ring, &pcpui->routine_amsgs, "Routine");
 }
 
 /* Debugging stuff */
 void kmsg_queue_stat(void)
 {
+	struct per_cpu_info *pcpui;
 	struct kernel_message *kmsg;
 	bool immed_emp, routine_emp;
 	for (int i = 0; i < num_cpus; i++) {
+		pcpui = &per_cpu_info[i];
+		printk("Core %d's ring msgs: immed %d, routine %d\n", i,
+		       pcpui->immed_amsg_ring ?
+		       pcpui->immed_amsg_ring->hdr.prod_idx -
+		       pcpui->immed_amsg_ring->hdr.cons_pvt_idx : 0,
+		       pcpui->routine_amsg_ring ?
+		       pcpui->routine_amsg_ring->hdr.prod_idx -
+		       pcpui->routine_amsg_ring->hdr.cons_pvt_idx : 0);
 		spin_lock_irqsave(&per_cpu_info[i].immed_amsg_lock);
 		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs);
 		spin_unlock_irqsave(&per_cpu_info[i].immed_amsg_lock);
@@ -72,6 +72,14 @@ void *user_mem_check(struct proc *p, const void *DANGEROUS va, size_t len,
 		warn("Blimey!  Wrap around in VM range calculation!");	
 		return NULL;
 	}
+	/* The caller is going to write the area directly, so copy CoW pages now,
+	 * while we can take the mm_lock.  Syscalls check their sysc here on entry,
+	 * so set_errno() and friends don't fault. */
+	if (((perm & PTE_USER_RW) == PTE_USER_RW) &&
+	    user_mem_break_cow(p, va, len)) {
+		user_mem_check_addr = (void*DANGEROUS)va;
+		return NULL;
+	}
 	num_pages = LA2PPN(end - start);
 	for (i = 0; i < num_pages; i++, start += PGSIZE) {
 		page_perms = get_va_perms(p->env_pgdir, start);
@@ -92,6 +100,30 @@ void *user_mem_check(struct proc *p, const void *DANGEROUS va, size_t len,
 	return (void *COUNT(len))TC(va);
 }
 
+/* Gives p its own copy of any CoW page (shared after a fork) in [va, va + len),
+ * so the kernel can write to it without faulting.  kernel_cow_fault() can
+ * handle those faults, but this is cheaper for something we're about to write,
+ * like a syscall struct.  Call it from process context, without p's mm_lock.
+ * Pages that aren't present or aren't CoW are left alone.  Returns 0 or
+ * -EFAULT. */
+int user_mem_break_cow(struct proc *p, const void *DANGEROUS va, size_t len)
+{
+	uintptr_t start = ROUNDDOWN((uintptr_t)va, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t)va + len, PGSIZE);
+	pte_t *pte;
+
+	if ((start >= ULIM) || (end > ULIM) || (start >= end))
+		return -EFAULT;
+	for (uintptr_t i = start; i < end; i += PGSIZE) {
+		pte = pgdir_walk(p->env_pgdir, (void*)i, 0);
+		if (!pte || !(*pte & PTE_P) || !(*pte & PTE_COW))
+			continue;
+		if (handle_page_fault(p, i, PROT_WRITE))
+			return -EFAULT;
+	}
+	return 0;
+}
+
 /**
  * @brief Checks that process 'p' is allowed to access the range
  * of memory [va, va+len) with permissions 'perm | PTE_U'. Destroy 
@@ -168,7 +200,7 @@ int memcpy_from_user(struct proc *p, void *dest, const void *DANGEROUS va,
 			if (handle_page_fault(p, (uintptr_t)start + i * PGSIZE, PROT_READ))
 				return -EFAULT;
 
-		void *kpage = KADDR(PTE_ADDR(*pte));
+		void *kpage = pte2kva(*pte, start + i * PGSIZE);
 		const void *src_start = i > 0 ? kpage : kpage + (va - start);
 		void *dst_start = dest + bytes_copied;
 		size_t copy_len = PGSIZE;
@@ -228,12 +260,16 @@ int memcpy_to_user(struct proc *p, void *va, const void *src, size_t len)
 		pte = pgdir_walk(p->env_pgdir, start + i * PGSIZE, 0);
 		if (!pte)
 			return -EFAULT;
-		if ((*pte & PTE_P) && (*pte & PTE_USER_RW) != PTE_USER_RW)
+		if ((*pte & PTE_P) && !(*pte & PTE_COW) &&
+		    (*pte & PTE_USER_RW) != PTE_USER_RW)
 			return -EFAULT;
-		if (!(*pte & PTE_P))
+		/* CoW pages need to be copied before we write them */
+		if (!(*pte & PTE_P) || (*pte & PTE_COW)) {
 			if (handle_page_fault(p, (uintptr_t)start + i * PGSIZE, PROT_WRITE))
 				return -EFAULT;
-		void *kpage = KADDR(PTE_ADDR(*pte));
+			pte = pgdir_walk(p->env_pgdir, start + i * PGSIZE, 0);
+		}
+		void *kpage = pte2kva(*pte, start + i * PGSIZE);
 		void *dst_start = i > 0 ? kpage : kpage + (va - start);
 		const void *src_start = src + bytes_copied;
 		size_t copy_len = PGSIZE;
@@ -16,6 +16,7 @@
 #include <pmap.h>
 #include <umem.h>
 #include <smp.h>
+#include <writeback.h>
 
 struct sb_tailq super_blocks = TAILQ_HEAD_INITIALIZER(super_blocks);
 spinlock_t super_blocks_lock = SPINLOCK_INITIALIZER;
@@ -551,11 +552,10 @@ struct super_block *get_sb(void)
 	TAILQ_INIT(&sb->s_io_wb);
 	TAILQ_INIT(&sb->s_lru_d);
 	TAILQ_INIT(&sb->s_files);
-	sb->s_dcache = create_hashtable(100, __dcache_hash, __dcache_eq);
-	sb->s_icache = create_hashtable(100, __generic_hash, __generic_eq);
+	sb->s_dcache = create_chashtable(100, __dcache_hash, __dcache_eq);
+	sb->s_icache = create_chashtable(100, __generic_hash, __generic_eq);
 	spinlock_init(&sb->s_lru_lock);
-	spinlock_init(&sb->s_dcache_lock);
-	spinlock_init(&sb->s_icache_lock);
+	spinlock_init(&sb->s_prune_lock);
 	sb->s_fs_info = 0; // can override somewhere else
 	return sb;
 }
@@ -772,20 +772,17 @@ struct dentry *lookup_dentry(char *path, int flags)
  * This is where we do the "kref resurrection" - we are returning a kref'd
  * object, even if it wasn't kref'd before.  This means the dcache does NOT hold
  * krefs (it is a weak/internal ref), but it is a source of kref generation.  We
- * sync up with the possible freeing of the dentry by locking the table.  See
- * Doc/kref for more info. */
+ * sync up with the possible freeing of the dentry by doing the kref while the
+ * dcache bucket is locked.  See Doc/kref for more info. */
 struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
 {
-	struct dentry *found;
-	/* This lock protects the hash, as well as ensures the returned object
-	 * doesn't get deleted/freed out from under us */
-	spin_lock(&sb->s_dcache_lock);
-	found = hashtable_search(sb->s_dcache, what_i_want);
-	if (found) {
+	/* Runs with the bucket locked, so found can't be removed and freed */
+	bool __dcache_get_ref(void *v)
+	{
+		struct dentry *found = (struct dentry*)v;
 		if (found->d_flags & DENTRY_NEGATIVE) {
 			what_i_want->d_flags |= DENTRY_NEGATIVE;
-			spin_unlock(&sb->s_dcache_lock);
-			return 0;
+			return FALSE;
 		}
 		spin_lock(&found->d_lock);
 		__kref_get(&found->d_kref, 1);	/* prob could be done outside the lock*/
@@ -798,9 +795,9 @@ struct dentry *dcache_get(struct super_block *sb, struct dentry *what_i_want)
 			spin_unlock(&sb->s_lru_lock);
 		}
 		spin_unlock(&found->d_lock);
+		return TRUE;
 	}
-	spin_unlock(&sb->s_dcache_lock);
-	return found;
+	return chashtable_search_get(sb->s_dcache, what_i_want, __dcache_get_ref);
 }
 
 /* Adds a dentry to the dcache.  Note the *dentry is both the key and the value.
@@ -810,22 +807,23 @@ void dcache_put(struct super_block *sb, struct dentry *key_val)
 {
 	struct dentry *old;
 	int retval;
-	spin_lock(&sb->s_dcache_lock);
-	old = hashtable_remove(sb->s_dcache, key_val);
+	old = chashtable_remove(sb->s_dcache, key_val);
 	if (old) {
 		assert(old->d_flags & DENTRY_NEGATIVE);
 		/* This is possible, but rare for now (about to be put on the LRU) */
 		assert(!(old->d_flags & DENTRY_USED));
 		assert(!kref_refcnt(&old->d_kref));
+		/* dcache_prune() could be looking at old.  It won't free it, since
+		 * it's not in the dcache anymore, but we need to wait til it's done. */
+		spin_lock(&sb->s_prune_lock);
 		spin_lock(&sb->s_lru_lock);
 		TAILQ_REMOVE(&sb->s_lru_d, old, d_lru);
 		spin_unlock(&sb->s_lru_lock);
+		spin_unlock(&sb->s_prune_lock);
 		__dentry_free(old);
 	}
-	/* this returns 0 on failure (TODO: Fix this ghetto shit) */
- 	retval = hashtable_insert(sb->s_dcache, key_val, key_val);
-	assert(retval);
-	spin_unlock(&sb->s_dcache_lock);
+	retval = chashtable_insert(sb->s_dcache, key_val, key_val);
+	assert(!retval);
 }
 
 /* Will remove and return the dentry.  Caller deallocs the key, but the retval
@@ -835,38 +833,61 @@ void dcache_put(struct super_block *sb, struct dentry *key_val)
  * there. */
 struct dentry *dcache_remove(struct super_block *sb, struct dentry *key)
 {
-	struct dentry *retval;
-	spin_lock(&sb->s_dcache_lock);
-	retval = hashtable_remove(sb->s_dcache, key);
-	spin_unlock(&sb->s_dcache_lock);
-	return retval;
+	return chashtable_remove(sb->s_dcache, key);
 }
 
 /* This will clean out the LRU list, which are the unused dentries of the dentry
- * cache.  This will optionally only free the negative ones.  Note that we grab
- * the hash lock for the time we traverse the LRU list - this prevents someone
- * from getting a kref from the dcache, which could cause us trouble (we rip
- * someone off the list, who isn't unused, and they try to rip them off the
- * list). */
+ * cache.  This will optionally only free the negative ones.
+ *
+ * We can't hold the LRU lock while we lock a dcache bucket (dcache_get() locks
+ * them the other way around), so we look at each LRU dentry in turn, rotating
+ * it to the back, and remove it from the dcache only if it is still unused
+ * with its bucket locked.  Someone could be resurrecting it right now.  The
+ * prune lock keeps dcache_put() from freeing a dentry we're looking at. */
 void dcache_prune(struct super_block *sb, bool negative_only)
 {
 	struct dentry *d_i, *temp;
 	struct dentry_tailq victims = TAILQ_HEAD_INITIALIZER(victims);
-
-	spin_lock(&sb->s_dcache_lock);
+	size_t nr_lru = 0;
+
+	/* Runs with the bucket locked, so no one can resurrect it */
+	bool __dentry_unused(void *v)
+	{
+		bool unused;
+		if (v != d_i)
+			return FALSE;
+		spin_lock(&d_i->d_lock);
+		unused = !(d_i->d_flags & DENTRY_USED);
+		spin_unlock(&d_i->d_lock);
+		return unused;
+	}
+	spin_lock(&sb->s_prune_lock);
 	spin_lock(&sb->s_lru_lock);
-	TAILQ_FOREACH_SAFE(d_i, &sb->s_lru_d, d_lru, temp) {
-		if (!(d_i->d_flags & DENTRY_USED)) {
-			if (negative_only && !(d_i->d_flags & DENTRY_NEGATIVE))
-				continue;
-			/* another place where we'd be better off with tools, not sol'ns */
-			hashtable_remove(sb->s_dcache, d_i);
-			TAILQ_REMOVE(&sb->s_lru_d, d_i, d_lru);
-			TAILQ_INSERT_HEAD(&victims, d_i, d_lru);
+	TAILQ_FOREACH(d_i, &sb->s_lru_d, d_lru)
+		nr_lru++;
+	spin_unlock(&sb->s_lru_lock);
+	for (size_t i = 0; i < nr_lru; i++) {
+		spin_lock(&sb->s_lru_lock);
+		d_i = TAILQ_FIRST(&sb->s_lru_d);
+		if (!d_i) {
+			spin_unlock(&sb->s_lru_lock);
+			break;
 		}
+		TAILQ_REMOVE(&sb->s_lru_d, d_i, d_lru);
+		TAILQ_INSERT_TAIL(&sb->s_lru_d, d_i, d_lru);
+		spin_unlock(&sb->s_lru_lock);
+		if ((d_i->d_flags & DENTRY_USED) ||
+		    (negative_only && !(d_i->d_flags & DENTRY_NEGATIVE)))
+			continue;
+		if (!chashtable_remove_if(sb->s_dcache, d_i, __dentry_unused))
+			continue;
+		/* Unused and out of the dcache, so it's still on the LRU and is ours */
+		spin_lock(&sb->s_lru_lock);
+		TAILQ_REMOVE(&sb->s_lru_d, d_i, d_lru);
+		spin_unlock(&sb->s_lru_lock);
+		TAILQ_INSERT_HEAD(&victims, d_i, d_lru);
 	}
-	spin_unlock(&sb->s_lru_lock);
-	spin_unlock(&sb->s_dcache_lock);
+	spin_unlock(&sb->s_prune_lock);
 	/* Now do the actual freeing, outside of the hash/LRU list locks.  This is
 	 * necessary since __dentry_free() will decref its parent, which may get
 	 * released and try to add itself to the LRU. */
@@ -920,6 +941,7 @@ struct inode *get_inode(struct dentry *dentry)
 	 * what pm_op they want via i_pm.pm_op, which we set again in pm_init() */
 	inode->i_mapping = &inode->i_pm;
 	pm_init(inode->i_mapping, inode->i_pm.pm_op, inode);
+	inode->i_mapping->pm_host_kref = &inode->i_kref;
 	return inode;
 }
 
@@ -1045,6 +1067,9 @@ void inode_release(struct kref *kref)
 	struct inode *inode = container_of(kref, struct inode, i_kref);
 	TAILQ_REMOVE(&inode->i_sb->s_inodes, inode, i_sb_list);
 	icache_remove(inode->i_sb, inode->i_ino);
+	/* Dirty pages keep us alive, but the flushers could still be writing some.
+	 * They need the pm, which goes away with us. */
+	pm_wait_writeback(inode->i_mapping);
 	/* Might need to write back or delete the file/inode */
 	if (inode->i_nlink) {
 		if (inode->i_state & I_STATE_DIRTY)
@@ -1058,6 +1083,8 @@ void inode_release(struct kref *kref)
 	}
 	/* TODO: (BDEV) */
 	// kref_put(inode->i_bdev->kref); /* assuming it's a bdev, could be a pipe*/
+	/* The page cache goes with the inode, including pages reclaim can see */
+	pm_destroy(inode->i_mapping);
 	/* Either way, we dealloc the in-memory version */
 	inode->i_sb->s_op->dealloc_inode(inode);	/* FS-specific clean-up */
 	kref_put(&inode->i_sb->s_kref);
@@ -1089,34 +1116,31 @@ void stat_inode(struct inode *inode, struct kstat *kstat)
  * in inode_release(). */
 struct inode *icache_get(struct super_block *sb, unsigned long ino)
 {
-	/* This is the same style as in pid2proc, it's the "safely create a strong
-	 * reference from a weak one, so long as other strong ones exist" pattern */
-	spin_lock(&sb->s_icache_lock);
-	struct inode *inode = hashtable_search(sb->s_icache, (void*)ino);
-	if (inode)
-		if (!kref_get_not_zero(&inode->i_kref, 1))
-			inode = 0;
-	spin_unlock(&sb->s_icache_lock);
-	return inode;
+	/* This is the "safely create a strong reference from a weak one, so long as
+	 * other strong ones exist" pattern.  The bucket is locked while we get the
+	 * ref, so the inode can't be removed and freed. */
+	bool __icache_get_ref(void *v)
+	{
+		return kref_get_not_zero(&((struct inode*)v)->i_kref, 1) != 0;
+	}
+	return chashtable_search_get(sb->s_icache, (void*)ino, __icache_get_ref);
 }
 
 void icache_put(struct super_block *sb, struct inode *inode)
 {
-	spin_lock(&sb->s_icache_lock);
+	int retval;
 	/* there's a race in load_ino() that could trigger this */
-	assert(!hashtable_search(sb->s_icache, (void*)inode->i_ino));
-	hashtable_insert(sb->s_icache, (void*)inode->i_ino, inode);
-	spin_unlock(&sb->s_icache_lock);
+	assert(!chashtable_search(sb->s_icache, (void*)inode->i_ino));
+	retval = chashtable_insert(sb->s_icache, (void*)inode->i_ino, inode);
+	assert(!retval);
 }
 
 struct inode *icache_remove(struct super_block *sb, unsigned long ino)
 {
 	struct inode *inode;
 	/* Presumably these hashtable removals could be easier since callers
-	 * actually know who they are (same with the pid2proc hash) */
-	spin_lock(&sb->s_icache_lock);
-	inode = hashtable_remove(sb->s_icache, (void*)ino);
-	spin_unlock(&sb->s_icache_lock);
+	 * actually know who they are */
+	inode = chashtable_remove(sb->s_icache, (void*)ino);
 	assert(inode && !kref_refcnt(&inode->i_kref));
 	return inode;
 }
@@ -1153,6 +1177,8 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
 	/* For each file page, make sure it's in the page cache, then copy it out.
 	 * TODO: will probably need to consider concurrently truncated files here.*/
 	for (int i = first_idx; i <= last_idx; i++) {
+		pm_readahead(file->f_mapping, &file->f_ra, i,
+		             nr_pages(file->f_dentry->d_inode->i_size));
 		error = pm_load_page(file->f_mapping, i, &page);
 		assert(!error);	/* TODO: handle ENOMEM and friends */
 		copy_amt = MIN(PGSIZE - page_off, buf_end - buf);
@@ -1218,10 +1244,13 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 		}
 		buf += copy_amt;
 		page_off = 0;
+		pm_dirty_page(file->f_mapping, page);
 		page_decref(page);	/* it's still in the cache, we just don't need it */
 	}
 	assert(buf == buf_end);
 	*offset += count;
+	/* Wait for the flushers if we're dirtying memory too fast */
+	writeback_throttle();
 	return count;
 }
 
@@ -1966,6 +1995,7 @@ struct file *dentry_open(struct dentry *dentry, int flags)
 	spinlock_init(&file->f_ep_lock);
 	file->f_privdata = 0;						/* prob overriden by the fs */
 	file->f_mapping = inode->i_mapping;
+	file_ra_state_init(&file->f_ra);
 	file->f_op->open(inode, file);
 	return file;
 error_access:
@@ -0,0 +1,398 @@
+/* Copyright (c) 2013 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Writeback of dirty page cache pages, see writeback.h.
+ *
+ * A page is tagged PM_TAG_DIRTY until someone locks it and starts writing it,
+ * at which point it is tagged PM_TAG_WRITEBACK instead, until the write is
+ * done and the page is unlocked.  So a page that gets dirtied again during its
+ * write is tagged both ways, and will be written again.  We count dirty pages
+ * from when they are tagged until their write finishes.
+ *
+ * Lock ordering: a pm's pm_tree_lock and the dirty list lock are never held at
+ * the same time.  The dirty list only says which pms to look at, and the tags
+ * say which pages to write, so a pm can be on the list with nothing to write.
+ * That's fine, the flusher just takes it off. */
+
+#include <ros/errno.h>
+#include <writeback.h>
+#include <pagemap.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <blockdev.h>
+#include <kthread.h>
+#include <alarm.h>
+#include <smp.h>
+#include <trap.h>
+#include <time.h>
+#include <atomic.h>
+#include <kref.h>
+#include <assert.h>
+#include <stdio.h>
+
+struct wb_flusher {
+	struct semaphore			sem;
+	struct alarm_waiter			alarm;
+	bool						alarm_set;		/* cleared by the handler */
+	atomic_t					kicked;			/* a wakeup is on its way */
+	/* Stats */
+	uint64_t					nr_wakeups;
+	uint64_t					nr_pms;
+};
+
+static struct wb_flusher flushers[WB_NR_FLUSHERS];
+
+static struct page_map_tailq dirty_pms = TAILQ_HEAD_INITIALIZER(dirty_pms);
+static spinlock_t dirty_pms_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+
+static atomic_t nr_dirty_pages;
+static long wb_background_pages;
+static long wb_dirty_limit;
+static struct cond_var wb_throttle_cv;
+
+/* Stats */
+static atomic_t wb_nr_clusters;
+static atomic_t wb_nr_pages_written;
+static atomic_t wb_nr_throttles;
+
+/* Tags page dirty, and puts pm on the dirty list if it wasn't already there.
+ * The page doesn't need to be locked, but it must be in pm. */
+void pm_dirty_page(struct page_map *pm, struct page *page)
+{
+	bool newly_dirty = FALSE;
+
+	spin_lock_irqsave(&pm->pm_tree_lock);
+	if ((page->pg_mapping == pm) &&
+	    !radix_tag_get(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY)) {
+		radix_tag_set(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+		newly_dirty = TRUE;
+	}
+	spin_unlock_irqsave(&pm->pm_tree_lock);
+	/* pms we can't write back (like KFS's) just stay tagged */
+	if (!newly_dirty || !pm->pm_op->writepages)
+		return;
+	atomic_inc(&nr_dirty_pages);
+	spin_lock_irqsave(&dirty_pms_lock);
+	if (!(pm->pm_flags & PM_DIRTY_LISTED)) {
+		pm->pm_flags |= PM_DIRTY_LISTED;
+		pm->pm_dirtied_at = read_tsc();
+		if (pm->pm_host_kref)
+			kref_get(pm->pm_host_kref, 1);
+		TAILQ_INSERT_TAIL(&dirty_pms, pm, pm_dirty_link);
+	}
+	spin_unlock_irqsave(&dirty_pms_lock);
+}
+
+/* Dirties page, which a user PTE of pte_val mapped, if the PTE says it was
+ * written.  Writes through shared file mappings go straight to the page cache's
+ * page, so this is how we hear about them.  Call it when the PTE goes away. */
+void pm_dirty_mapped_page(struct page *page, pte_t pte_val)
+{
+	struct page_map *pm = ACCESS_ONCE(page->pg_mapping);
+
+	if (pm && (pte_val & PTE_D))
+		pm_dirty_page(pm, page);
+}
+
+/* Called by writepages() when page's write is done, usually from IRQ context.
+ * This unlocks the page and drops the ref writepages() got for it.  Errors are
+ * reported by the next pm_wait_writeback(). */
+void pm_end_page_writeback(struct page *page, bool error)
+{
+	struct page_map *pm = page->pg_mapping;
+
+	spin_lock_irqsave(&pm->pm_tree_lock);
+	radix_tag_clear(&pm->pm_tree, page->pg_index, PM_TAG_WRITEBACK);
+	if (error)
+		pm->pm_wb_error = -EIO;
+	spin_unlock_irqsave(&pm->pm_tree_lock);
+	atomic_dec(&nr_dirty_pages);
+	unlock_page(page);
+	page_decref(page);
+}
+
+/* Finds up to nr pages of pm, starting from index, that are tagged tag, and
+ * takes a ref on each. */
+static unsigned int pm_tagged_pages(struct page_map *pm, struct page **pages,
+                                    unsigned long index, unsigned int nr,
+                                    int tag)
+{
+	spin_lock_irqsave(&pm->pm_tree_lock);
+	nr = radix_tag_gang_lookup(&pm->pm_tree, (void**)pages, index, nr, tag);
+	for (int i = 0; i < nr; i++)
+		page_incref(pages[i]);
+	spin_unlock_irqsave(&pm->pm_tree_lock);
+	return nr;
+}
+
+static void pm_write_cluster(struct page_map *pm, struct page **pages,
+                             unsigned int nr)
+{
+	if (pm->pm_op->writepages(pm, pages, nr)) {
+		for (int i = 0; i < nr; i++)
+			pm_end_page_writeback(pages[i], TRUE);
+		writeback_wake_throttled();
+		return;
+	}
+	atomic_inc(&wb_nr_clusters);
+	atomic_add(&wb_nr_pages_written, nr);
+}
+
+/* Starts writing every dirty page of pm, a run of contiguous pages at a time.
+ * We hold the locks of a run's pages until it goes out, and we lock pages in
+ * index order, so two of us working on the same pm won't deadlock.  The device
+ * is plugged while we go, so runs that are next to each other on disk can be
+ * merged. */
+static void __pm_writeback(struct page_map *pm)
+{
+	struct block_device *bdev = pm_backing_bdev(pm);
+	struct page *pages[WB_MAX_CLUSTER];
+	struct page *cluster[WB_MAX_CLUSTER];
+	struct page *page;
+	unsigned int nr, nr_cluster = 0;
+	unsigned long index = 0;
+	bool dirty;
+
+	if (bdev)
+		bdev_plug(bdev);
+	while ((nr = pm_tagged_pages(pm, pages, index, WB_MAX_CLUSTER,
+	                             PM_TAG_DIRTY))) {
+		index = pages[nr - 1]->pg_index + 1;
+		for (int i = 0; i < nr; i++) {
+			page = pages[i];
+			if (nr_cluster && ((nr_cluster == WB_MAX_CLUSTER) ||
+			    (cluster[nr_cluster - 1]->pg_index + 1 != page->pg_index))) {
+				pm_write_cluster(pm, cluster, nr_cluster);
+				nr_cluster = 0;
+			}
+			lock_page(page);
+			/* Someone could have written it while we waited */
+			spin_lock_irqsave(&pm->pm_tree_lock);
+			dirty = (page->pg_mapping == pm) &&
+			        radix_tag_get(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+			if (dirty) {
+				radix_tag_clear(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+				radix_tag_set(&pm->pm_tree, page->pg_index, PM_TAG_WRITEBACK);
+			}
+			spin_unlock_irqsave(&pm->pm_tree_lock);
+			if (!dirty) {
+				unlock_page(page);
+				page_decref(page);
+				continue;
+			}
+			cluster[nr_cluster++] = page;	/* our ref goes to writepages() */
+		}
+	}
+	if (nr_cluster)
+		pm_write_cluster(pm, cluster, nr_cluster);
+	if (bdev)
+		bdev_unplug(bdev);
+}
+
+/* Waits for all of pm's writes in flight, returning 0 or the first error any of
+ * them had since the last time someone asked. */
+int pm_wait_writeback(struct page_map *pm)
+{
+	struct page *pages[WB_MAX_CLUSTER];
+	unsigned long index = 0;
+	unsigned int nr;
+	int error;
+
+	while ((nr = pm_tagged_pages(pm, pages, index, WB_MAX_CLUSTER,
+	                             PM_TAG_WRITEBACK))) {
+		index = pages[nr - 1]->pg_index + 1;
+		for (int i = 0; i < nr; i++) {
+			/* writes hold the page lock until they are done */
+			lock_page(pages[i]);
+			unlock_page(pages[i]);
+			page_decref(pages[i]);
+		}
+	}
+	spin_lock_irqsave(&pm->pm_tree_lock);
+	error = pm->pm_wb_error;
+	pm->pm_wb_error = 0;
+	spin_unlock_irqsave(&pm->pm_tree_lock);
+	return error;
+}
+
+/* Writes back pm's dirty pages, and if wait is set, waits for them (and any
+ * other writes in flight) and returns the error, if any.  Used by fsync, so it
+ * only touches pm. */
+int pm_writeback(struct page_map *pm, bool wait)
+{
+	bool listed;
+	int error = 0;
+
+	if (!pm->pm_op->writepages)
+		return 0;
+	spin_lock_irqsave(&dirty_pms_lock);
+	listed = pm->pm_flags & PM_DIRTY_LISTED;
+	if (listed) {
+		TAILQ_REMOVE(&dirty_pms, pm, pm_dirty_link);
+		pm->pm_flags &= ~PM_DIRTY_LISTED;
+	}
+	spin_unlock_irqsave(&dirty_pms_lock);
+	__pm_writeback(pm);
+	if (wait)
+		error = pm_wait_writeback(pm);
+	/* Could be the last ref on the host, and pm goes with it */
+	if (listed && pm->pm_host_kref)
+		kref_put(pm->pm_host_kref);
+	return error;
+}
+
+/* Wakes up anyone waiting in writeback_throttle(), if there's room.  Call this
+ * after writes finish; it's OK from IRQ context. */
+void writeback_wake_throttled(void)
+{
+	int8_t irq_state = 0;
+
+	if (atomic_read(&nr_dirty_pages) > wb_dirty_limit)
+		return;
+	/* Throttled writers check the count and sleep with the lock held */
+	cv_lock_irqsave(&wb_throttle_cv, &irq_state);
+	if (wb_throttle_cv.nr_waiters)
+		__cv_broadcast(&wb_throttle_cv);
+	cv_unlock_irqsave(&wb_throttle_cv, &irq_state);
+}
+
+static void wb_kick(struct wb_flusher *fl)
+{
+	int8_t irq_state = 0;
+
+	if (atomic_cas(&fl->kicked, 0, 1))
+		sem_up_irqsave(&fl->sem, &irq_state);
+}
+
+static void wb_kick_all(void)
+{
+	for (int i = 0; i < WB_NR_FLUSHERS; i++)
+		wb_kick(&flushers[i]);
+}
+
+/* Gets the flushers going now, for when someone needs clean pages */
+void writeback_wakeup(void)
+{
+	wb_kick_all();
+}
+
+/* Writers call this after dirtying pages.  Past the background limit, we get
+ * the flushers going, and past the dirty limit, we wait for them. */
+void writeback_throttle(void)
+{
+	int8_t irq_state = 0;
+
+	if (atomic_read(&nr_dirty_pages) <= wb_background_pages)
+		return;
+	wb_kick_all();
+	if (atomic_read(&nr_dirty_pages) <= wb_dirty_limit)
+		return;
+	atomic_inc(&wb_nr_throttles);
+	cv_lock_irqsave(&wb_throttle_cv, &irq_state);
+	while (atomic_read(&nr_dirty_pages) > wb_dirty_limit)
+		cv_wait(&wb_throttle_cv);
+	cv_unlock_irqsave(&wb_throttle_cv, &irq_state);
+}
+
+/* Writes back pms from the head of the dirty list, as long as they have been
+ * dirty for too long, or there's too much dirty memory.  Flushers race for pms,
+ * but each one only gets taken off the list once. */
+static void wb_flusher_pass(struct wb_flusher *fl)
+{
+	uint64_t expire_tsc = usec2tsc(WB_EXPIRE_USEC);
+	struct page_map *pm;
+	bool background;
+
+	while (1) {
+		background = atomic_read(&nr_dirty_pages) > wb_background_pages;
+		spin_lock_irqsave(&dirty_pms_lock);
+		pm = TAILQ_FIRST(&dirty_pms);
+		if (!pm || (!background &&
+		            (read_tsc() - pm->pm_dirtied_at < expire_tsc))) {
+			spin_unlock_irqsave(&dirty_pms_lock);
+			break;
+		}
+		TAILQ_REMOVE(&dirty_pms, pm, pm_dirty_link);
+		pm->pm_flags &= ~PM_DIRTY_LISTED;
+		spin_unlock_irqsave(&dirty_pms_lock);
+		/* The list's ref on the host keeps pm around while we work */
+		__pm_writeback(pm);
+		if (pm->pm_host_kref)
+			kref_put(pm->pm_host_kref);
+		fl->nr_pms++;
+	}
+}
+
+static void wb_alarm_handler(struct alarm_waiter *waiter)
+{
+	struct wb_flusher *fl = (struct wb_flusher*)waiter->data;
+
+	/* Once this is clear, the flusher can set the alarm again, maybe on
+	 * another core, so this is the last we touch the waiter. */
+	wmb();
+	fl->alarm_set = FALSE;
+	wb_kick(fl);
+}
+
+/* Flusher kthread, started as a routine kernel message that never returns.
+ * Sleeps until its alarm goes off or a writer kicks it.
+ *
+ * A kick doesn't unset the alarm.  The kthread can wake up on another core,
+ * and a tchain can only be changed by its own core.  The alarm goes off when
+ * it was going to anyway, and we set it again once it has. */
+static void wb_flusher(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct wb_flusher *fl = &flushers[a0];
+	int8_t irq_state = 0;
+
+	while (1) {
+		wb_flusher_pass(fl);
+		if (!ACCESS_ONCE(fl->alarm_set)) {
+			fl->alarm_set = TRUE;
+			set_awaiter_rel(&fl->alarm, WB_PERIOD_USEC);
+			set_alarm(&per_cpu_info[core_id()].tchain, &fl->alarm);
+		}
+		sem_down_irqsave(&fl->sem, &irq_state);
+		atomic_set(&fl->kicked, 0);
+		fl->nr_wakeups++;
+	}
+}
+
+/* Sets the dirty limits from the amount of RAM and starts the flushers on the
+ * calling core. */
+void writeback_init(void)
+{
+	struct wb_flusher *fl;
+
+	atomic_init(&nr_dirty_pages, 0);
+	atomic_init(&wb_nr_clusters, 0);
+	atomic_init(&wb_nr_pages_written, 0);
+	atomic_init(&wb_nr_throttles, 0);
+	wb_background_pages = max_nr_pages * WB_BACKGROUND_RATIO / 100;
+	wb_dirty_limit = max_nr_pages * WB_DIRTY_RATIO / 100;
+	cv_init_irqsave(&wb_throttle_cv);
+	for (int i = 0; i < WB_NR_FLUSHERS; i++) {
+		fl = &flushers[i];
+		sem_init_irqsave(&fl->sem, 0);
+		init_awaiter(&fl->alarm, wb_alarm_handler);
+		fl->alarm.data = fl;
+		fl->alarm_set = FALSE;
+		atomic_init(&fl->kicked, 0);
+		fl->nr_wakeups = 0;
+		fl->nr_pms = 0;
+		send_kernel_message(core_id(), wb_flusher, i, 0, 0, KMSG_ROUTINE);
+	}
+}
+
+void print_writeback_stats(void)
+{
+	printk("Dirty pages: %ld, background at %ld, writers wait at %ld\n",
+	       atomic_read(&nr_dirty_pages), wb_background_pages, wb_dirty_limit);
+	printk("Clusters written: %ld, pages written: %ld, throttles: %ld\n",
+	       atomic_read(&wb_nr_clusters), atomic_read(&wb_nr_pages_written),
+	       atomic_read(&wb_nr_throttles));
+	printk("Flusher      Wakeups          PMs\n");
+	for (int i = 0; i < WB_NR_FLUSHERS; i++)
+		printk("%7d %12llu %12llu\n", i, flushers[i].nr_wakeups,
+		       flushers[i].nr_pms);
+}
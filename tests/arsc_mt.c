@@ -1,3 +1,12 @@
+/* ARSC throughput benchmark.  Each thread pushes nr_calls SYS_null calls
+ * through the global syscall ring, keeping up to 'window' of them in flight,
+ * and we report syscalls per second across all threads.
+ *
+ * With 'e', completions come back as EV_SYSCALL messages on a per-thread UCQ,
+ * instead of the thread spinning on each syscall's flags.
+ *
+ * Usage: arsc_mt [nr_threads] [nr_calls] [window] [e] */
+
 #ifdef CONFIG_ARSC_SERVER
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,47 +14,102 @@
 #include <unistd.h>
 #include <vcore.h>
 #include <parlib.h>
+#include <event.h>
+#include <ucq.h>
 #include <ros/syscall.h>
+#include <ros/event.h>
 #include <arc.h>
-#include <stdio.h>
+#include <sys/time.h>
 
-#define NUM_THREADS 4
+static int nr_threads = 4;
+static int nr_calls = 10000;
+static int window = 16;
+static bool use_events = FALSE;
 
-pthread_t t1;
+static long usec_since(struct timeval *start_tv)
+{
+	struct timeval end_tv = {0};
+	if (gettimeofday(&end_tv, 0))
+		perror("End time error...");
+	return (end_tv.tv_sec - start_tv->tv_sec) * 1000000 +
+	       (end_tv.tv_usec - start_tv->tv_usec);
+}
 
-async_desc_t desc1;
+/* Waits for nr_descs EV_SYSCALLs on ev_q.  The syscalls are done once we have
+ * them, so waiton_syscall() won't spin. */
+static void wait_for_events(struct event_queue *ev_q, int nr_descs)
+{
+	struct event_msg msg;
 
-syscall_desc_t* sys_cputs_async(const char *s, size_t len,                                             
-                     void (*cleanup_handler)(void*), void* cleanup_data)
-{                                                                                                                     
-	return arc_call(SYS_cputs, s, len);
+	while (nr_descs) {
+		if (get_ucq_msg(&ev_q->ev_mbox->ev_msgs, &msg)) {
+			cpu_relax();
+			continue;
+		}
+		assert(msg.ev_type == EV_SYSCALL);
+		nr_descs--;
+	}
 }
 
 void *syscall_thread(void* arg)
 {
-	char testme ='a';
-	char buf[20] = {0};
-	sprintf(buf, "%d", (pthread_self()->id % 10) );
-	char tid = buf[0];
-	syscall_desc_t* sysdesc;
-	sysdesc = sys_cputs_async(&tid, 1, NULL, NULL);
-	assert (-1 != waiton_syscall(sysdesc));
+	syscall_desc_t **descs = malloc(sizeof(syscall_desc_t*) * window);
+	struct event_queue *ev_q = 0;
+	int nr_descs;
+
+	assert(descs);
+	if (use_events)
+		ev_q = get_big_event_q();
+	for (int done = 0; done < nr_calls; done += nr_descs) {
+		for (nr_descs = 0; nr_descs < MIN(window, nr_calls - done); nr_descs++) {
+			descs[nr_descs] = use_events ? arc_call_ev(ev_q, SYS_null)
+			                             : arc_call(SYS_null);
+			/* Ring is full, wait on what we have */
+			if (!descs[nr_descs])
+				break;
+		}
+		if (use_events)
+			wait_for_events(ev_q, nr_descs);
+		for (int i = 0; i < nr_descs; i++)
+			assert(-1 != waiton_syscall(descs[i]));
+	}
+	if (ev_q)
+		put_big_event_q(ev_q);
+	free(descs);
+	return 0;
 }
 
-int main(int argc, char** argv){
-	int pid = sys_getpid();
-	pthread_t *my_threads = malloc(sizeof(pthread_t) * NUM_THREADS);
-	char testme = 't';
-	printf ("multi thread - init arsc \n");
+int main(int argc, char** argv)
+{
+	struct timeval start_tv = {0};
+	long usec_diff;
+	pthread_t *my_threads;
+
+	if (argc > 1)
+		nr_threads = strtol(argv[1], 0, 10);
+	if (argc > 2)
+		nr_calls = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		window = MAX(strtol(argv[3], 0, 10), 1);
+	if (argc > 4)
+		use_events = argv[4][0] == 'e';
+	my_threads = malloc(sizeof(pthread_t) * nr_threads);
+	printf("multi thread - init arsc \n");
 	init_arc(&SYS_CHANNEL);
-	for (int i = 0; i < NUM_THREADS ; i++)
+	if (gettimeofday(&start_tv, 0))
+		perror("Start time error...");
+	for (int i = 0; i < nr_threads ; i++)
 		pthread_create(&my_threads[i], NULL, &syscall_thread, NULL);
-	
-	for (int i = 0; i < NUM_THREADS; i++){
+	for (int i = 0; i < nr_threads; i++)
 		pthread_join(my_threads[i], NULL);
-	}
-
+	usec_diff = usec_since(&start_tv);
+	printf("%d threads, %d calls each, window %d, %s: %f usec per call, "
+	       "%f calls/sec\n", nr_threads, nr_calls, window,
+	       use_events ? "ucq events" : "spinning",
+	       (float)usec_diff / (nr_threads * nr_calls),
+	       (float)nr_threads * nr_calls * 1000000 / usec_diff);
 	printf("multi thread - end\n");
+	return 0;
 }
 #else
 int main(){};
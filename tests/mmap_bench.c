@@ -0,0 +1,84 @@
+/* Microbenchmark for VMR lookups and placement.  Creates a lot of separate
+ * regions, punches holes in them, and refills the holes, timing each phase.
+ *
+ * Usage: mmap_bench [nr_regions] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <parlib.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+static long usec_since(struct timeval *start_tv)
+{
+	struct timeval end_tv = {0};
+	if (gettimeofday(&end_tv, 0))
+		perror("End time error...");
+	return (end_tv.tv_sec - start_tv->tv_sec) * 1000000 +
+	       (end_tv.tv_usec - start_tv->tv_usec);
+}
+
+int main(int argc, char** argv)
+{
+	struct timeval start_tv = {0};
+	long usec_diff;
+	int nr_regions = 10000;
+	void **regions;
+
+	if (argc > 1)
+		nr_regions = strtol(argv[1], 0, 10);
+	regions = malloc(sizeof(void*) * nr_regions);
+	if (!regions) {
+		perror("Init regions/malloc");
+		exit(-1);
+	}
+	/* Alternate the protections, so neighboring regions can't be merged */
+	if (gettimeofday(&start_tv, 0))
+		perror("Start time error...");
+	for (int i = 0; i < nr_regions; i++) {
+		regions[i] = mmap(0, PGSIZE, i % 2 ? PROT_READ :
+		                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		                  -1, 0);
+		if (regions[i] == MAP_FAILED) {
+			perror("mmap");
+			exit(-1);
+		}
+	}
+	usec_diff = usec_since(&start_tv);
+	printf("mmap: %d regions, %f usec per mmap\n", nr_regions,
+	       (float)usec_diff / nr_regions);
+	/* Punch a hole at every other region */
+	if (gettimeofday(&start_tv, 0))
+		perror("Start time error...");
+	for (int i = 0; i < nr_regions; i += 2)
+		munmap(regions[i], PGSIZE);
+	usec_diff = usec_since(&start_tv);
+	printf("munmap: %d holes, %f usec per munmap\n", (nr_regions + 1) / 2,
+	       (float)usec_diff / ((nr_regions + 1) / 2));
+	/* Refill the holes, which requires finding each gap */
+	if (gettimeofday(&start_tv, 0))
+		perror("Start time error...");
+	for (int i = 0; i < nr_regions; i += 2) {
+		regions[i] = mmap(0, PGSIZE, PROT_READ | PROT_WRITE,
+		                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (regions[i] == MAP_FAILED) {
+			perror("mmap");
+			exit(-1);
+		}
+	}
+	usec_diff = usec_since(&start_tv);
+	printf("refill: %d holes, %f usec per mmap\n", (nr_regions + 1) / 2,
+	       (float)usec_diff / ((nr_regions + 1) / 2));
+	/* Touch every region, to exercise the fault-time lookups */
+	if (gettimeofday(&start_tv, 0))
+		perror("Start time error...");
+	for (int i = 0; i < nr_regions; i++)
+		(void)*(volatile int*)regions[i];
+	usec_diff = usec_since(&start_tv);
+	printf("fault: %d regions, %f usec per fault\n", nr_regions,
+	       (float)usec_diff / nr_regions);
+	for (int i = 0; i < nr_regions; i++)
+		munmap(regions[i], PGSIZE);
+	free(regions);
+	return 0;
+}
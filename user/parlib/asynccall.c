@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 
 #include <ros/common.h>
 #include <ros/syscall.h>
@@ -129,6 +131,8 @@ int async_syscall(arsc_channel_t* chan, syscall_req_t* req, syscall_desc_t** des
 	struct mcs_lock_qnode local_qn = {0};
 	mcs_lock_lock(&(chan->aclock), &local_qn);
 	if (RING_FULL(fr)) {
+		mcs_lock_unlock(&chan->aclock, &local_qn);
+		free(desc);
 		errno = EBUSY;
 		return -1;
 	}
@@ -151,29 +155,57 @@ int async_syscall(arsc_channel_t* chan, syscall_req_t* req, syscall_desc_t** des
 	*desc_ptr2 = desc;
 	return 0;
 }
-// Default convinence wrapper before other method of posting calls are available
-
-syscall_desc_t* arc_call(long int num, ...)
+static syscall_desc_t *__arc_call(struct event_queue *ev_q, long int num,
+                                   va_list vl)
 {
-  	va_list vl;
-  	va_start(vl,num);
 	struct syscall *p_sysc = malloc(sizeof (struct syscall));
 	syscall_desc_t* desc;
 	if (p_sysc == NULL) {
 		errno = ENOMEM;
 		return 0;
 	}
+	memset(p_sysc, 0, sizeof(struct syscall));
 	p_sysc->num = num;
-  	p_sysc->arg0 = va_arg(vl,long int);
-  	p_sysc->arg1 = va_arg(vl,long int);
-  	p_sysc->arg2 = va_arg(vl,long int);
-  	p_sysc->arg3 = va_arg(vl,long int);
-  	p_sysc->arg4 = va_arg(vl,long int);
-  	p_sysc->arg5 = va_arg(vl,long int);
-  	va_end(vl);
+	p_sysc->arg0 = va_arg(vl,long int);
+	p_sysc->arg1 = va_arg(vl,long int);
+	p_sysc->arg2 = va_arg(vl,long int);
+	p_sysc->arg3 = va_arg(vl,long int);
+	p_sysc->arg4 = va_arg(vl,long int);
+	p_sysc->arg5 = va_arg(vl,long int);
+	/* The kernel will send an EV_SYSCALL to ev_q when it is done */
+	if (ev_q) {
+		p_sysc->ev_q = ev_q;
+		atomic_set(&p_sysc->flags, SC_UEVENT);
+	}
 	syscall_req_t arc = {REQ_alloc,NULL, NULL, p_sysc};
-	async_syscall(&SYS_CHANNEL, &arc, &desc);
-	printf ( "%d pushed at %p \n", desc);
+	if (async_syscall(&SYS_CHANNEL, &arc, &desc)) {
+		free(p_sysc);
+		return 0;
+	}
+	return desc;
+}
+
+// Default convinence wrapper before other method of posting calls are available
+syscall_desc_t* arc_call(long int num, ...)
+{
+	syscall_desc_t* desc;
+	va_list vl;
+	va_start(vl,num);
+	desc = __arc_call(0, num, vl);
+	va_end(vl);
+	return desc;
+}
+
+/* Like arc_call(), but completion is also announced with an EV_SYSCALL message
+ * on ev_q (ev_arg3 is the struct syscall), so the caller can wait on a UCQ
+ * instead of spinning on each syscall. */
+syscall_desc_t* arc_call_ev(struct event_queue *ev_q, long int num, ...)
+{
+	syscall_desc_t* desc;
+	va_list vl;
+	va_start(vl,num);
+	desc = __arc_call(ev_q, num, vl);
+	va_end(vl);
 	return desc;
 }
 
@@ -197,11 +229,10 @@ int waiton_syscall(syscall_desc_t* desc)
 		errno = EFAIL;
 		return -1;
 	}
-	printf("waiting %d\n", vcore_id());
 	syscall_rsp_t* rsp = RING_GET_RESPONSE(fr, desc->idx);
 
 	// ignoring the ring push response from the kernel side now
-	while (atomic_read(&rsp->sc->flags) != SC_DONE)
+	while (!(atomic_read(&rsp->sc->flags) & SC_DONE))
 		cpu_relax();
 	// memcpy(rsp, rsp_inring, sizeof(*rsp));
 	
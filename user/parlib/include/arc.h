@@ -94,6 +94,7 @@ int get_all_desc(async_desc_t** a_desc, syscall_desc_t** s_desc);
 // helper function to make arc calls
 
 syscall_desc_t* arc_call(long int num, ...);
+syscall_desc_t* arc_call_ev(struct event_queue *ev_q, long int num, ...);
 
 #ifdef __cplusplus
   }